@@ -37,6 +37,12 @@ public:
   std::string getBuildOptions(){
       return " -fno-bin-llvmir -fno-bin-amdil -fno-bin-source ";
   }
+  size_t getNumComputeQueues(){
+      return 4;
+  }
+  size_t getNumTransferQueues(){
+      return 2;
+  }
 };
 
 }
@@ -37,6 +37,12 @@ public:
   std::string getBuildOptions(){
       return "";
   }
+  size_t getNumComputeQueues(){
+      return 4;
+  }
+  size_t getNumTransferQueues(){
+      return 2;
+  }
 };
 
 }
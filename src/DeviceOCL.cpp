@@ -46,6 +46,8 @@
 #include <string.h>
 #include <math.h>
 #include "UtilOCL.h"
+#include "QueueOCL.h"
+#include "QueuePoolOCL.h"
 namespace ltk {
 
 DeviceOCL::DeviceOCL(cl_context my_context, bool ownsCtxt,
@@ -55,7 +57,10 @@ DeviceOCL::DeviceOCL(cl_context my_context, bool ownsCtxt,
 		device(my_device),
 		queue(NULL),
 		deviceInfo(deviceInfo),
-		arch(architecture) {
+		arch(architecture),
+		queueProperties(queue_props),
+		computeQueues(nullptr),
+		transferQueues(nullptr) {
     cl_int errorCode;
 
   #ifdef CL_VERSION_2_0
@@ -78,9 +83,17 @@ DeviceOCL::DeviceOCL(cl_context my_context, bool ownsCtxt,
     }
     if (!queue)
       throw std::runtime_error("Failed to create command queue");
+    try {
+    	configureQueuePools(arch->getNumComputeQueues(),
+    			arch->getNumTransferQueues(), QUEUE_DISPATCH_ROUND_ROBIN);
+    } catch (std::runtime_error &re) {
+    	clReleaseCommandQueue(queue);
+    	throw;
+    }
 }
 
 DeviceOCL::~DeviceOCL() {
+	releaseQueuePools();
 	delete arch;
 	delete deviceInfo;
 	cl_int errorCode = CL_SUCCESS;
@@ -109,6 +122,43 @@ std::string DeviceOCL::getBuildOptions(){
 	return arch->getBuildOptions();
 }
 
+void DeviceOCL::configureQueuePools(size_t numComputeQueues,
+		size_t numTransferQueues, eQueueDispatch dispatch) {
+	releaseQueuePools();
+	computeQueues = new QueuePoolOCL(this, numComputeQueues, queueProperties,
+			dispatch);
+	try {
+		transferQueues = new QueuePoolOCL(this, numTransferQueues,
+				queueProperties, dispatch);
+	} catch (std::runtime_error &re) {
+		releaseQueuePools();
+		throw;
+	}
+}
+
+QueueOCL* DeviceOCL::getComputeQueue() {
+	return computeQueues->getQueue();
+}
+
+QueueOCL* DeviceOCL::getTransferQueue() {
+	return transferQueues->getQueue();
+}
+
+QueuePoolOCL* DeviceOCL::getComputeQueuePool() {
+	return computeQueues;
+}
+
+QueuePoolOCL* DeviceOCL::getTransferQueuePool() {
+	return transferQueues;
+}
+
+void DeviceOCL::releaseQueuePools() {
+	delete computeQueues;
+	computeQueues = nullptr;
+	delete transferQueues;
+	transferQueues = nullptr;
+}
+
 
 }
 #endif
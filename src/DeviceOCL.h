@@ -46,6 +46,14 @@
 
 namespace ltk {
 
+class QueueOCL;
+class QueuePoolOCL;
+
+enum eQueueDispatch {
+	QUEUE_DISPATCH_ROUND_ROBIN,
+	QUEUE_DISPATCH_LEAST_LOADED
+};
+
 struct DeviceOCL {
 	DeviceOCL(cl_context my_context, bool ownsCtxt, cl_device_id my_device,
 			DeviceInfo *deviceInfo, IArch *architecture,cl_command_queue_properties queue_props);
@@ -53,12 +61,28 @@ struct DeviceOCL {
 
 	std::string getBuildOptions();
 
+	// replace compute and transfer queue pools. Must not be called
+	// while queues borrowed from the current pools are still in use.
+	void configureQueuePools(size_t numComputeQueues, size_t numTransferQueues,
+			eQueueDispatch dispatch);
+	// borrow queue for kernel execution
+	QueueOCL* getComputeQueue();
+	// borrow queue for map/unmap and other host <=> device transfers
+	QueueOCL* getTransferQueue();
+	QueuePoolOCL* getComputeQueuePool();
+	QueuePoolOCL* getTransferQueuePool();
+
 	bool ownsContext;
 	cl_context context;           // hold the context handler
 	cl_device_id device;            // hold the selected device handler
 	cl_command_queue queue;      // hold the commands-queue handler
 	DeviceInfo *deviceInfo;
 	IArch *arch;
+	cl_command_queue_properties queueProperties;
+private:
+	void releaseQueuePools();
+	QueuePoolOCL *computeQueues;
+	QueuePoolOCL *transferQueues;
 };
 
 }
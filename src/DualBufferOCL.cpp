@@ -21,11 +21,27 @@
 #ifdef OPENCL_FOUND
 #include "DualBufferOCL.h"
 #include "UtilOCL.h"
+#include "QueuePoolOCL.h"
 #include <cassert>
 
 
 namespace ltk {
 
+DualBufferOCL::DualBufferOCL(DeviceOCL *device, size_t len,DualBufferType type) :
+		DualBufferOCL(device, len,type,0,nullptr)
+{
+}
+
+DualBufferOCL::DualBufferOCL(DeviceOCL *device,
+							size_t len,
+							DualBufferType type,
+							cl_mem_flags client_flags,
+							void* buffer) :
+		DualBufferOCL(device, len, type, client_flags, buffer,
+						device->getTransferQueue(), false)
+{
+}
+
 DualBufferOCL::DualBufferOCL(DeviceOCL *device, size_t len,DualBufferType type, cl_command_queue_properties queue_props) :
 		DualBufferOCL(device, len,type,0,nullptr,queue_props)
 {
@@ -37,13 +53,28 @@ DualBufferOCL::DualBufferOCL(DeviceOCL *device,
 							cl_mem_flags client_flags,
 							void* buffer,
 							cl_command_queue_properties queue_props) :
+		DualBufferOCL(device, len, type, client_flags, buffer,
+						new QueueOCL(device, queue_props), true)
+{
+}
+
+DualBufferOCL::DualBufferOCL(DeviceOCL *device,
+							size_t len,
+							DualBufferType type,
+							cl_mem_flags client_flags,
+							void* buffer,
+							QueueOCL *queue,
+							bool ownsQueue) :
 		m_type(type),
-		queue(new QueueOCL(device, queue_props)),
+		queue(queue),
+		ownsQueue(ownsQueue),
 		hostBuffer(nullptr),
 		deviceBuffer(0),
 		numBytes(len){
-	if (numBytes == 0)
+	if (numBytes == 0) {
+		cleanup();
 		throw std::exception();
+	}
   cl_mem_flags flags = buffer ? CL_MEM_ALLOC_HOST_PTR : 0;
   if (type == HostToDeviceBuffer){
 	  flags |= CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY;
@@ -81,7 +112,9 @@ size_t DualBufferOCL::getSize() const {
 	return numBytes;
 }
 void DualBufferOCL::cleanup() {
-	delete queue;
+	if (ownsQueue)
+		delete queue;
+	queue = nullptr;
 	Util::ReleaseMemory(deviceBuffer);
 }
 
@@ -111,6 +144,8 @@ bool DualBufferOCL::map(QueueOCL *mapQueue, cl_uint num_events_in_wait_list,
 				Util::TranslateOpenCLError(error_code));
 		return false;
 	}
+	if (completionEvent)
+		mapQueue->trackCompletion(*completionEvent);
 	return true;
 }
 
@@ -131,6 +166,8 @@ bool DualBufferOCL::unmap(QueueOCL *mapQueue, cl_uint num_events_in_wait_list,
 	if (CL_SUCCESS != error_code) {
 		Util::LogError("Error: unmap (CL_QUEUE_CONTEXT) returned %s.\n",
 				Util::TranslateOpenCLError(error_code));
+	} else if (completionEvent) {
+		mapQueue->trackCompletion(*completionEvent);
 	}
 	return error_code == CL_SUCCESS;
 }
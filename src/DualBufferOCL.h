@@ -24,9 +24,20 @@
 #include "IDualMemOCL.h"
 namespace ltk {
 
+// Thread safety: map() stores the mapped host pointer in the buffer, and
+// unmap() releases it, so map/unmap calls on a single DualBufferOCL must be
+// serialized by the caller, and getHostBuffer() is only valid between a
+// completed map and the matching unmap. Different DualBufferOCL instances
+// may be mapped, unmapped and used as kernel arguments from different
+// threads concurrently, including when they share a pooled queue.
 class DualBufferOCL: public IDualMemOCL {
 
 public:
+	// borrow map/unmap queue from device transfer queue pool
+	DualBufferOCL(DeviceOCL *device, size_t len, DualBufferType type);
+	DualBufferOCL(DeviceOCL *device, size_t len, DualBufferType type,
+					cl_mem_flags client_flags,	void* buffer);
+	// create private map/unmap queue
 	DualBufferOCL(DeviceOCL *device, size_t len, DualBufferType type, cl_command_queue_properties queue_props);
 	DualBufferOCL(DeviceOCL *device, size_t len, DualBufferType type,
 					cl_mem_flags client_flags,	void* buffer,
@@ -52,9 +63,13 @@ public:
 	size_t getSize() const;
 	QueueOCL* getQueue() const;
 private:
+	DualBufferOCL(DeviceOCL *device, size_t len, DualBufferType type,
+					cl_mem_flags client_flags,	void* buffer,
+						QueueOCL *queue, bool ownsQueue);
 	void cleanup();
 	DualBufferType m_type;
 	QueueOCL *queue;
+	bool ownsQueue;
 	unsigned char *hostBuffer;
 	cl_mem deviceBuffer;
 	size_t numBytes;
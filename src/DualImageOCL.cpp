@@ -21,19 +21,33 @@
 #ifdef OPENCL_FOUND
 #include "DualImageOCL.h"
 #include "UtilOCL.h"
+#include "QueuePoolOCL.h"
 
 namespace ltk {
+DualImageOCL::DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
+		uint32_t channelOrder, uint32_t dataType, bool doHostToDevice) :
+		DualImageOCL(device, dimX, dimY, channelOrder, dataType, doHostToDevice,
+				device->getTransferQueue(), false) {
+}
 DualImageOCL::DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
 		uint32_t channelOrder, uint32_t dataType, bool doHostToDevice, cl_command_queue_properties queue_props) :
-		    hostToDevice(doHostToDevice), queue(new QueueOCL(device, queue_props)),
+		DualImageOCL(device, dimX, dimY, channelOrder, dataType, doHostToDevice,
+				new QueueOCL(device, queue_props), true) {
+}
+DualImageOCL::DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
+		uint32_t channelOrder, uint32_t dataType, bool doHostToDevice,
+		QueueOCL *queue, bool ownsQueue) :
+		    hostToDevice(doHostToDevice), queue(queue), ownsQueue(ownsQueue),
 		    hostBuffer(nullptr),
 		    image(0),
 		    dimX(dimX),
 		    dimY(dimY),
 		    channelOrder(channelOrder),
 		    dataType(dataType) {
-	if (dimX == 0 && dimY == 0)
+	if (dimX == 0 && dimY == 0) {
+		cleanup();
 		throw std::exception();
+	}
 
 	cl_mem_flags flags = CL_MEM_ALLOC_HOST_PTR;
 	flags |=
@@ -88,7 +102,9 @@ size_t DualImageOCL::getDimY() const {
 	return dimY;
 }
 void DualImageOCL::cleanup() {
-	delete queue;
+	if (ownsQueue)
+		delete queue;
+	queue = nullptr;
 	Util::ReleaseMemory(image);
 }
 size_t DualImageOCL::getNumBytes() const {
@@ -154,6 +170,8 @@ bool DualImageOCL::map(QueueOCL *mapQueue, cl_uint num_events_in_wait_list,
 				Util::TranslateOpenCLError(error_code));
 		return false;
 	}
+	if (completionEvent)
+		mapQueue->trackCompletion(*completionEvent);
 	return true;
 }
 bool DualImageOCL::unmap(QueueOCL *mapQueue, cl_uint num_events_in_wait_list,
@@ -164,6 +182,8 @@ bool DualImageOCL::unmap(QueueOCL *mapQueue, cl_uint num_events_in_wait_list,
 	if (CL_SUCCESS != error_code) {
 		Util::LogError("Error: unmap (CL_QUEUE_CONTEXT) returned %s.\n",
 				Util::TranslateOpenCLError(error_code));
+	} else if (completionEvent) {
+		mapQueue->trackCompletion(*completionEvent);
 	}
 	return error_code == CL_SUCCESS;
 }
@@ -26,9 +26,14 @@
 
 namespace ltk {
 
+// Thread safety: same contract as DualBufferOCL
 class DualImageOCL: public IDualMemOCL {
 
 public:
+	// borrow map/unmap queue from device transfer queue pool
+	DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
+			uint32_t channelOrder, uint32_t dataType, bool hostToDevice);
+	// create private map/unmap queue
 	DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
 			uint32_t channelOrder, uint32_t dataType, bool hostToDevice, cl_command_queue_properties queue_props);
 	~DualImageOCL();
@@ -53,9 +58,13 @@ public:
 	size_t getDimY() const;
 	QueueOCL* getQueue() const;
 private:
+	DualImageOCL(DeviceOCL *device, size_t dimX, size_t dimY,
+			uint32_t channelOrder, uint32_t dataType, bool hostToDevice,
+			QueueOCL *queue, bool ownsQueue);
 	void cleanup();
 	bool hostToDevice;
 	QueueOCL *queue;
+	bool ownsQueue;
 	unsigned char *hostBuffer;
 	cl_mem image;
 	size_t dimX;
@@ -32,6 +32,9 @@ public:
 	virtual size_t getWaveFrontSize()=0;
 	virtual cl_uint getVendorId() = 0;
 	virtual std::string getBuildOptions() = 0;
+	// suggested queue pool sizes, matching hardware queues/engines
+	virtual size_t getNumComputeQueues() = 0;
+	virtual size_t getNumTransferQueues() = 0;
 };
 
 }
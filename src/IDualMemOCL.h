@@ -56,7 +56,7 @@ public:
 template<typename M> struct MemMapEvents {
 	MemMapEvents(DeviceOCL *dev, std::shared_ptr<M> image) :
 			mem(image), triggerMemUnmap(Util::CreateUserEvent(dev->context)), memUnmapped(
-					0) {
+					0), hostBuffer(nullptr) {
 	}
 	~MemMapEvents() {
 		Util::ReleaseEvent(triggerMemUnmap);
@@ -66,6 +66,8 @@ template<typename M> struct MemMapEvents {
 	std::shared_ptr<M> mem;
 	cl_event triggerMemUnmap;
 	cl_event memUnmapped;
+	// host pointer returned by the map that triggerMemUnmap/memUnmapped belong to
+	unsigned char *hostBuffer;
 };
 
 
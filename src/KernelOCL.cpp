@@ -24,9 +24,55 @@
 #include "UtilOCL.h"
 #include <sstream>
 #include <algorithm>
+#include <cstring>
 
 namespace ltk {
 
+void ThreadKernelsOCL::release(std::thread::id id) {
+	KernelOCL *kernel = nullptr;
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		auto iter = kernels.find(id);
+		if (iter == kernels.end())
+			return;
+		kernel = iter->second;
+		kernels.erase(iter);
+	}
+	delete kernel;
+}
+
+void ThreadKernelsOCL::releaseAll() {
+	std::map<std::thread::id, KernelOCL*> released;
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		released.swap(kernels);
+	}
+	for (auto &k : released)
+		delete k.second;
+}
+
+// releases the calling thread's kernel clones when the thread exits,
+// for kernels that still exist
+struct ThreadKernelReleaser {
+	~ThreadKernelReleaser() {
+		auto id = std::this_thread::get_id();
+		for (auto &weak : owners) {
+			auto owner = weak.lock();
+			if (owner)
+				owner->release(id);
+		}
+	}
+	void add(const std::shared_ptr<ThreadKernelsOCL> &owner) {
+		// forget kernels that have since been destroyed
+		owners.erase(std::remove_if(owners.begin(), owners.end(),
+				[](const std::weak_ptr<ThreadKernelsOCL> &w) { return w.expired(); }),
+				owners.end());
+		owners.push_back(owner);
+	}
+	std::vector<std::weak_ptr<ThreadKernelsOCL>> owners;
+};
+static thread_local ThreadKernelReleaser threadKernelReleaser;
+
 
 KernelOCL::KernelOCL(KernelInitInfo init) : KernelOCL(init, 0)
 {}
@@ -36,7 +82,8 @@ KernelOCL::KernelOCL(KernelInitInfo init, cl_program prog) : initInfo(init),
 											device(init.device->device),
 											context(init.device->context),
 											argCount(0),
-											program(prog) {
+											program(prog),
+											threadKernels(std::make_shared<ThreadKernelsOCL>()) {
 	bool verbose = true;
 	if (!prog)
 		program = generateProgram(init);
@@ -59,7 +106,19 @@ KernelOCL::KernelOCL(KernelInitInfo init, cl_program prog) : initInfo(init),
 		clReleaseProgram(program);
 }
 
+KernelOCL::KernelOCL(KernelInitInfo init, cl_kernel kernel,
+		std::vector<KernelArgOCL> args) : initInfo(init),
+											myKernel(kernel),
+											device(init.device->device),
+											context(init.device->context),
+											argCount(0),
+											program(0),
+											argCache(args),
+											threadKernels(std::make_shared<ThreadKernelsOCL>()) {
+}
+
 KernelOCL::~KernelOCL(void) {
+	threadKernels->releaseAll();
 	if (myKernel)
 		clReleaseKernel(myKernel);
 }
@@ -129,6 +188,89 @@ std::string KernelOCL::getBuildOptions(KernelInitInfo init) {
 	return bldOptions.str();
 }
 
+KernelOCL* KernelOCL::clone() {
+	cl_kernel kernel = 0;
+	cl_int error_code = CL_SUCCESS;
+	std::vector<KernelArgOCL> args;
+#ifdef CL_VERSION_2_1
+	if (initInfo.device->deviceInfo->checkOpenCLVersion(2, 1)) {
+		kernel = clCloneKernel(myKernel, &error_code);
+		if (CL_SUCCESS != error_code) {
+			Util::LogError("Error: clCloneKernel returned %s for kernel %s.\n",
+					Util::TranslateOpenCLError(error_code),
+					initInfo.kernelName.c_str());
+			kernel = 0;
+		} else {
+			// cloned kernel inherits argument values
+			args = argCache;
+		}
+	}
+#endif
+	if (!kernel) {
+		// kernel retains its program, so we can re-create from it
+		cl_program prog = 0;
+		error_code = clGetKernelInfo(myKernel, CL_KERNEL_PROGRAM,
+				sizeof(cl_program), &prog, NULL);
+		if (CL_SUCCESS == error_code)
+			kernel = clCreateKernel(prog, initInfo.kernelName.c_str(),
+					&error_code);
+		if (CL_SUCCESS != error_code) {
+			Util::LogError("Error: clCreateKernel returned %s for kernel %s.\n",
+					Util::TranslateOpenCLError(error_code),
+					initInfo.kernelName.c_str());
+			throw std::runtime_error(
+					("Failed to clone kernel " + initInfo.kernelName + "\n").c_str());
+		}
+	}
+
+	return new KernelOCL(initInfo, kernel, args);
+}
+
+KernelOCL* KernelOCL::getThreadKernel() {
+	auto id = std::this_thread::get_id();
+	KernelOCL *kernel = nullptr;
+	{
+		std::lock_guard<std::mutex> lk(threadKernels->mutex);
+		auto iter = threadKernels->kernels.find(id);
+		if (iter != threadKernels->kernels.end())
+			return iter->second;
+		kernel = clone();
+		threadKernels->kernels[id] = kernel;
+	}
+	threadKernelReleaser.add(threadKernels);
+	return kernel;
+}
+
+void KernelOCL::setArg(uint32_t index, size_t size, const void *val) {
+	if (index >= argCache.size())
+		argCache.resize(index + 1);
+	auto &arg = argCache[index];
+	if (arg.valid && arg.size == size) {
+		if (!val && arg.value.empty())
+			return;
+		if (val && !arg.value.empty() && !memcmp(arg.value.data(), val, size))
+			return;
+	}
+	auto error_code = clSetKernelArg(myKernel, index, size, val);
+	if (DeviceSuccess != error_code) {
+		arg.valid = false;
+		Util::LogError("Error: setKernelArgs returned %s.\n",
+				Util::TranslateOpenCLError(error_code));
+		throw std::exception();
+	}
+	arg.valid = true;
+	arg.size = size;
+	if (val)
+		arg.value.assign((const uint8_t*) val, (const uint8_t*) val + size);
+	else
+		arg.value.clear();
+}
+
+void KernelOCL::invalidateArgs() {
+	for (auto &arg : argCache)
+		arg.valid = false;
+}
+
 // Enqueue the command to asynchronously execute the kernel on the device
 void KernelOCL::enqueue(EnqueueInfoOCL &info) {
 	cl_int error_code = clEnqueueNDRangeKernel(info.queue->getQueueImpl(), myKernel,
@@ -141,6 +283,8 @@ void KernelOCL::enqueue(EnqueueInfoOCL &info) {
 				Util::TranslateOpenCLError(error_code));
 		throw std::exception();
 	}
+	if (info.needsCompletionEvent)
+		info.queue->trackCompletion(info.completionEvent);
 	argCount = 0;
 }
 }
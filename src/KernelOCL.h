@@ -22,6 +22,12 @@
 #ifdef OPENCL_FOUND
 #include "platform.h"
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "QueueOCL.h"
 #include "UtilOCL.h"
 #include "EnqueueInfoOCL.h"
@@ -72,6 +78,35 @@ struct KernelInitInfo: KernelInitInfoBase {
 	std::string kernelName;
 };
 
+// cached state of a single kernel argument
+struct KernelArgOCL {
+	KernelArgOCL() : valid(false), size(0) {
+	}
+	bool valid;
+	size_t size;
+	// argument value; empty for __local arguments
+	std::vector<uint8_t> value;
+};
+
+class KernelOCL;
+
+// Kernel instances private to host threads, cloned from one kernel.
+// Shared by the kernel and by each thread holding a clone, so that
+// a thread's clone is released when the thread exits, or when the kernel
+// is destroyed, whichever comes first.
+struct ThreadKernelsOCL {
+	// release clone of thread id, if any
+	void release(std::thread::id id);
+	void releaseAll();
+	std::mutex mutex;
+	std::map<std::thread::id, KernelOCL*> kernels;
+};
+
+// Thread safety: a KernelOCL instance holds mutable argument state, so
+// setArg/setArgs/pushArg/enqueue on one instance must be serialized.
+// To enqueue from several host threads, each thread should call
+// getThreadKernel() and set arguments/enqueue on the returned instance,
+// which is private to the calling thread.
 class KernelOCL {
 public:
 	KernelOCL(KernelInitInfo initInfo, cl_program program);
@@ -89,15 +124,52 @@ public:
 	void enqueue(EnqueueInfoOCL &info);
 	static void generateBinary(KernelInitInfo init);
 
+	// Create an independent kernel object for the same kernel function,
+	// so that arguments can be set and the kernel enqueued from another
+	// host thread. Uses clCloneKernel on OpenCL 2.1+ devices (argument
+	// values are copied), otherwise the kernel is re-created from its program
+	// and all arguments must be set again. Caller owns the returned kernel.
+	KernelOCL* clone();
+
+	// Kernel instance private to the calling thread, cloned from this kernel
+	// on the thread's first call and cached until the thread exits or this
+	// kernel is destroyed.
+	// This kernel's arguments must not be changed while other threads
+	// may be calling getThreadKernel().
+	KernelOCL* getThreadKernel();
+
 	template<typename T> void pushArg(T *val) {
-		auto error_code = clSetKernelArg(myKernel, argCount++, sizeof(T), val);
-		if (DeviceSuccess != error_code) {
-			Util::LogError("Error: setKernelArgs returned %s.\n",
-					Util::TranslateOpenCLError(error_code));
-			throw std::exception();
-		}
+		setArg<T>(argCount++, *val);
 	}
+
+	// Set kernel arguments 0 .. N-1. Arguments are cached, and only those
+	// whose value differs from the last value sent to the runtime are
+	// passed to clSetKernelArg.
+	template<typename ... Args> void setArgs(const Args &... args) {
+		setArgsFrom(0, args...);
+	}
+	template<typename T> void setArg(uint32_t index, const T &val) {
+		setArg(index, sizeof(T), &val);
+	}
+	// set __local memory argument of specified size
+	void setLocalArg(uint32_t index, size_t size) {
+		setArg(index, size, nullptr);
+	}
+	void setArg(uint32_t index, size_t size, const void *val);
+
+	// mark all cached arguments as dirty, forcing them to be re-sent
+	void invalidateArgs();
 protected:
+	KernelOCL(KernelInitInfo initInfo, cl_kernel kernel,
+			std::vector<KernelArgOCL> args);
+	void setArgsFrom(uint32_t index) {
+		(void) index;
+	}
+	template<typename T, typename ... Args> void setArgsFrom(uint32_t index,
+			const T &val, const Args &... args) {
+		setArg<T>(index, val);
+		setArgsFrom(index + 1, args...);
+	}
 	static void generateBinaryName(buildProgramData &data);
 	static buildProgramData getProgramData(KernelInitInfo init);
 	static std::string getBuildOptions(KernelInitInfo init);
@@ -108,6 +180,8 @@ protected:
 	cl_context context;
 	uint32_t argCount;
 	cl_program program;
+	std::vector<KernelArgOCL> argCache;
+	std::shared_ptr<ThreadKernelsOCL> threadKernels;
 };
 }
 #endif
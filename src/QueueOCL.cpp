@@ -32,14 +32,17 @@
 namespace ltk {
 
 QueueOCL::QueueOCL(QueueOCL &rhs) :
-		queue(rhs.queue), ownsQueue(rhs.ownsQueue) {
+		queue(rhs.queue), ownsQueue(rhs.ownsQueue), trackWork(false),
+		outstanding(std::make_shared<std::atomic<uint32_t>>(0)) {
 }
 QueueOCL::QueueOCL(cl_command_queue cmdQueue) :
-		queue(cmdQueue), ownsQueue(false) {
+		queue(cmdQueue), ownsQueue(false), trackWork(false),
+		outstanding(std::make_shared<std::atomic<uint32_t>>(0)) {
 }
 
 QueueOCL::QueueOCL(DeviceOCL *device, cl_command_queue_properties queue_props) :
-		queue(0), ownsQueue(true) {
+		queue(0), ownsQueue(true), trackWork(false),
+		outstanding(std::make_shared<std::atomic<uint32_t>>(0)) {
 	cl_int errorCode;
 
 #ifdef CL_VERSION_2_0
@@ -109,5 +112,39 @@ tDeviceRC QueueOCL::flush(cl_command_queue commandQueue) {
 tDeviceRC QueueOCL::flush(void) {
 	return QueueOCL::flush(queue);
 }
+
+void QueueOCL::setTrackWork(bool track) {
+	trackWork = track;
+}
+
+void QueueOCL::trackCompletion(cl_event evt) {
+	if (!trackWork || !evt)
+		return;
+	// callback holds its own reference to the count, which outlives
+	// the queue if need be
+	auto count = new std::shared_ptr<std::atomic<uint32_t>>(outstanding);
+	(*outstanding)++;
+	cl_int error_code = clSetEventCallback(evt, CL_COMPLETE,
+			CompletionCallback, count);
+	if (CL_SUCCESS != error_code) {
+		Util::LogError("Error: clSetEventCallback returned %s.\n",
+				Util::TranslateOpenCLError(error_code));
+		(*outstanding)--;
+		delete count;
+	}
+}
+
+uint32_t QueueOCL::getOutstanding() const {
+	return *outstanding;
+}
+
+void CL_CALLBACK QueueOCL::CompletionCallback(cl_event event,
+		cl_int cmd_exec_status, void *user_data) {
+	(void) event;
+	(void) cmd_exec_status;
+	auto count = (std::shared_ptr<std::atomic<uint32_t>>*) user_data;
+	(**count)--;
+	delete count;
+}
 }
 #endif
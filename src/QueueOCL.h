@@ -20,13 +20,22 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <memory>
 
 #ifdef OPENCL_FOUND
 #include "platform.h"
 
 namespace ltk {
 
-
+// Thread safety: OpenCL command queues are thread-safe, so commands may be
+// enqueued on the same QueueOCL from several host threads without locking,
+// as may finish() and flush(). Commands enqueued concurrently from different
+// threads have no defined relative order; use events to order them.
+// Outstanding work tracking is atomic, and its count is shared with pending
+// completion callbacks, so the queue may be destroyed while tracked commands
+// are outstanding. Construction, destruction and setTrackWork() must not race
+// with other use of the queue.
 class QueueOCL
 {
 public:
@@ -45,9 +54,22 @@ public:
     cl_command_queue getQueueImpl() {
         return queue;
     }
+
+    // enable/disable tracking of outstanding work on this queue
+    void setTrackWork(bool track);
+    // register completion callback on command event, so that the
+    // number of outstanding commands on this queue can be tracked
+    void trackCompletion(cl_event evt);
+    // number of tracked commands that have not yet completed
+    uint32_t getOutstanding() const;
 private:
+    static void CL_CALLBACK CompletionCallback(cl_event event,
+    		cl_int cmd_exec_status, void *user_data);
     cl_command_queue queue;
     bool ownsQueue;
+    bool trackWork;
+    // outstanding command count, also referenced by each pending callback
+    std::shared_ptr<std::atomic<uint32_t>> outstanding;
 };
 
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "latke_config.h"
+#ifdef OPENCL_FOUND
+#include "QueuePoolOCL.h"
+#include "DeviceOCL.h"
+#include "UtilOCL.h"
+
+namespace ltk {
+
+QueuePoolOCL::QueuePoolOCL(DeviceOCL *device, size_t numQueues,
+		cl_command_queue_properties queue_props, eQueueDispatch dispatch) :
+		next(0), dispatch(dispatch) {
+	if (numQueues == 0)
+		numQueues = 1;
+	try {
+		for (size_t i = 0; i < numQueues; ++i) {
+			auto q = new QueueOCL(device, queue_props);
+			q->setTrackWork(dispatch == QUEUE_DISPATCH_LEAST_LOADED);
+			queues.push_back(q);
+		}
+	} catch (std::runtime_error &re) {
+		for (auto &q : queues)
+			delete q;
+		throw;
+	}
+}
+
+QueuePoolOCL::~QueuePoolOCL(void) {
+	for (auto &q : queues)
+		delete q;
+}
+
+QueueOCL* QueuePoolOCL::getQueue() {
+	size_t start = next++ % queues.size();
+	if (dispatch == QUEUE_DISPATCH_ROUND_ROBIN)
+		return queues[start];
+
+	// least loaded: scan from round robin start position, so that
+	// ties are spread evenly across the pool
+	size_t best = start;
+	uint32_t bestLoad = queues[start]->getOutstanding();
+	for (size_t i = 1; i < queues.size() && bestLoad; ++i) {
+		size_t index = (start + i) % queues.size();
+		uint32_t load = queues[index]->getOutstanding();
+		if (load < bestLoad) {
+			best = index;
+			bestLoad = load;
+		}
+	}
+	return queues[best];
+}
+
+QueueOCL* QueuePoolOCL::getQueue(size_t index) {
+	if (index >= queues.size())
+		return nullptr;
+	return queues[index];
+}
+
+size_t QueuePoolOCL::size() const {
+	return queues.size();
+}
+
+eQueueDispatch QueuePoolOCL::getDispatch() const {
+	return dispatch;
+}
+
+tDeviceRC QueuePoolOCL::finish() {
+	for (auto &q : queues) {
+		auto rc = q->finish();
+		if (rc != CL_SUCCESS)
+			return rc;
+	}
+	return CL_SUCCESS;
+}
+
+tDeviceRC QueuePoolOCL::flush() {
+	for (auto &q : queues) {
+		auto rc = q->flush();
+		if (rc != CL_SUCCESS)
+			return rc;
+	}
+	return CL_SUCCESS;
+}
+
+}
+#endif
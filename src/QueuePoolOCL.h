@@ -0,0 +1,58 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+#include "latke_config.h"
+#ifdef OPENCL_FOUND
+#include "platform.h"
+#include "QueueOCL.h"
+
+namespace ltk {
+
+// Fixed set of command queues owned by a device. Clients borrow
+// queues from the pool rather than creating their own, so that the total
+// number of queues can be matched to the number of hardware queues/engines.
+class QueuePoolOCL
+{
+public:
+    QueuePoolOCL(DeviceOCL* device, size_t numQueues,
+    		cl_command_queue_properties queue_props, eQueueDispatch dispatch);
+    ~QueuePoolOCL(void);
+
+    // borrow next queue, according to dispatch policy.
+    // Pool retains ownership of the queue.
+    QueueOCL* getQueue();
+    QueueOCL* getQueue(size_t index);
+    size_t size() const;
+    eQueueDispatch getDispatch() const;
+
+    tDeviceRC finish();
+    tDeviceRC flush();
+private:
+    std::vector<QueueOCL*> queues;
+    std::atomic<size_t> next;
+    eQueueDispatch dispatch;
+};
+
+}
+#endif
@@ -1260,6 +1260,20 @@ bool DeviceInfo::checkOpenCL2_XCompatibility() {
     return isOpenCL2_XSupported;
 }
 
+/**
+ * checkOpenCLVersion
+ * Check if the device supports at least OpenCL major.minor
+ * @return @bool
+ */
+bool DeviceInfo::checkOpenCLVersion(int major, int minor) {
+    int majorRev, minorRev;
+    if (sscanf(this->deviceVersion, "OpenCL %d.%d", &majorRev, &minorRev)
+            != 2)
+        return false;
+
+    return majorRev > major || (majorRev == major && minorRev >= minor);
+}
+
 void Util::LogInfo(const char *str, ...) {
     if (str) {
         va_list args;
@@ -521,6 +521,13 @@ public:
 	 */
 	bool checkOpenCL2_XCompatibility();
 
+	/**
+	 * checkOpenCLVersion
+	 * Check if the device supports at least OpenCL major.minor
+	 * @return @bool
+	 */
+	bool checkOpenCLVersion(int major, int minor);
+
 private:
 
 	/**
@@ -22,6 +22,7 @@
 #include "DeviceOCL.h"
 #include "DeviceManagerOCL.h"
 #include "QueueOCL.h"
+#include "QueuePoolOCL.h"
 #include "EnqueueInfoOCL.h"
 #include "DualBufferOCL.h"
 #include "DualImageOCL.h"
@@ -1 +1,2 @@
 #define OPENCL_FOUND
+#define ZLIB_FOUND
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+// Edge preserving denoise of a Bayer frame, ahead of demosaic (buffers only).
+//
+// A bilateral filter over each sample's 5 x 5 neighbourhood of same-colour
+// samples, which lie two samples apart, so that each CFA channel is filtered
+// on its own, whatever the pattern. Range weights fall off with the
+// difference from the centre sample, over twice the noise sigma, so that
+// edges are kept; spatial weights fall off over 1.5 same-colour steps.
+//
+// As in demosaic, each work group of TILE_COLS x TILE_ROWS samples first
+// fills an LDS apron of its tile and a border of the filter's reach, then
+// filters from LDS, so the frame is read once and written once.
+
+#include "platform.cl"
+#include "image.cl"
+
+#define dn_half 4
+#define dn_apron_rows (TILE_ROWS + 2 * dn_half)
+#define dn_apron_cols (TILE_COLS + 2 * dn_half)
+#define dn_tile_pixels (TILE_ROWS * TILE_COLS)
+
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void bayer_denoise(const uint im_rows, const uint im_cols,
+    __global const uchar *input_image_p, const uint input_image_pitch,
+    __global uchar *output_image_p, const uint output_image_pitch, const float sigma){
+    const uint tile_col = get_local_id(0);
+    const uint tile_row = get_local_id(1);
+    const uint g_c = get_global_id(0);
+    const uint g_r = get_global_id(1);
+    const uint tile_flat_id = tile_row * TILE_COLS + tile_col;
+    const int tile_c0 = (int)(get_group_id(0) * TILE_COLS);
+    const int tile_r0 = (int)(get_group_id(1) * TILE_ROWS);
+
+    __local int apron[dn_apron_rows][dn_apron_cols];
+    for(uint task = tile_flat_id; task < dn_apron_rows * dn_apron_cols; task += dn_tile_pixels){
+        const uint a_r = task / dn_apron_cols;
+        const uint a_c = task % dn_apron_cols;
+        apron[a_r][a_c] = image_tex2D(uchar, input_image_p, im_rows, im_cols, input_image_pitch,
+            tile_r0 + (int)a_r - dn_half, tile_c0 + (int)a_c - dn_half, ADDRESS_REFLECT_BORDER_EXCLUSIVE);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if((g_r >= im_rows) | (g_c >= im_cols))
+        return;
+
+    const uint i = tile_col + dn_half;
+    const uint j = tile_row + dn_half;
+    const int x = apron[j][i];
+    const float range_scale = -1.0f / (8.0f * sigma * sigma);
+    float sum = 0.0f;
+    float weight = 0.0f;
+    for(int dy = -2; dy <= 2; ++dy){
+        for(int dx = -2; dx <= 2; ++dx){
+            const int n = apron[(int)j + 2 * dy][(int)i + 2 * dx];
+            const float d = (float)(n - x);
+            const float w = native_exp(-(float)(dx * dx + dy * dy) / 4.5f + d * d * range_scale);
+            sum += w * n;
+            weight += w;
+        }
+    }
+    output_image_p[g_r * output_image_pitch + g_c] = convert_uchar_sat_rte(sum / weight);
+}
+
+// Temporal denoise of a Bayer frame against a ring of previous raw frames.
+//
+// Each sample is averaged with the same sample of up to history_frames
+// previous frames, held in the ring entries before history_index. Each
+// previous frame is weighted by how well it agrees with the current frame
+// around the sample: the mean absolute difference over the 3 x 3 same-colour
+// samples around it, less what noise alone accounts for, falls off over the
+// noise sigma, so that moving content is taken from the current frame alone.
+// The frame's own samples are stored in ring entry history_index, for the
+// frames that follow; no other entry is written, so neighbours are read
+// straight from global memory.
+
+#define tn_taps 9
+
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void temporal_denoise(const uint im_rows, const uint im_cols,
+    __global const uchar *input_image_p, const uint input_image_pitch,
+    __global uchar *output_image_p, const uint output_image_pitch,
+    __global uchar *history_p, const uint history_entries, const uint history_frames,
+    const uint history_index, const float sigma){
+    const int g_c = get_global_id(0);
+    const int g_r = get_global_id(1);
+    if((g_r >= (int)im_rows) | (g_c >= (int)im_cols))
+        return;
+
+    const size_t frame_size = (size_t)im_rows * im_cols;
+    int taps[tn_taps];
+    for(int t = 0; t < tn_taps; ++t)
+        taps[t] = image_tex2D(uchar, input_image_p, im_rows, im_cols, input_image_pitch,
+            g_r + 2 * (t / 3 - 1), g_c + 2 * (t % 3 - 1), ADDRESS_REFLECT_BORDER_EXCLUSIVE);
+    const int x = taps[tn_taps / 2];
+
+    // mean absolute difference of two noisy samples is about 1.13 sigma
+    const float noise_diff = 1.13f * sigma;
+    const float motion_scale = -1.0f / (2.0f * sigma * sigma);
+    float sum = (float)x;
+    float weight = 1.0f;
+    for(uint h = 1; h <= history_frames; ++h){
+        __global const uchar *frame_p = history_p
+            + ((history_index + history_entries - h) % history_entries) * frame_size;
+        int diff = 0;
+        int centre = 0;
+        for(int t = 0; t < tn_taps; ++t){
+            const int n = image_tex2D(uchar, frame_p, im_rows, im_cols, im_cols,
+                g_r + 2 * (t / 3 - 1), g_c + 2 * (t % 3 - 1), ADDRESS_REFLECT_BORDER_EXCLUSIVE);
+            diff += abs(n - taps[t]);
+            centre = t == tn_taps / 2 ? n : centre;
+        }
+        const float excess = max(diff * (1.0f / tn_taps) - noise_diff, 0.0f);
+        const float w = native_exp(excess * excess * motion_scale);
+        sum += w * centre;
+        weight += w;
+    }
+    history_p[history_index * frame_size + g_r * im_cols + g_c] = (uchar)x;
+    output_image_p[g_r * output_image_pitch + g_c] = convert_uchar_sat_rte(sum / weight);
+}
@@ -18,39 +18,946 @@
  */
 #pragma once
 #include "common.h"
+#include "DepthController.h"
+#include "DecodeStage.h"
+#include "PngEncoder.h"
+#include "JpegWriter.h"
+#include "TileCodec.h"
+#include "FrameStats.h"
+#include "ShadingMap.h"
+#include "FrameStore.h"
+#include "FrameRing.h"
+#include "FrameStream.h"
+#include "ShardCoordinator.h"
+#include "SyntheticFrames.h"
+#include "IoEngine.h"
+#include "FrameSink.h"
 #include <cmath>
-
-// template struct to handle debayer to either image or buffer
-template<typename M, typename A> struct Debayer {
-	int debayer(int argc, char *argv[],
-			pfn_event_notify HostToDeviceMappedCallback,
-			pfn_event_notify DeviceToHostMappedCallback,
-			std::string kernelFile);
-	BlockingQueue<JobInfo<M>*> mappedHostToDeviceQueue;
-	BlockingQueue<JobInfo<M>*> mappedDeviceToHostQueue;
-};
+#include <algorithm>
+#include <deque>
+#include <vector>
 
 enum pattern_t {
 	RGGB = 0, GRBG = 1, GBRG = 2, BGGR = 3
 };
 
 const int numCLBuffers = 4;
+const int maxCLBuffers = 32;
 const int numPostProcBuffers = 16;
 const int tile_rows = 5;
 const int tile_columns = 32;
+const int png_filter_wg = 64;
+const int jpeg_pack_wg = 64;
+const int tile_scan_wg = 256;
+const int tile_pack_wg = 64;
 const int platformId = 0;
 const eDeviceType deviceType = GPU;
 const int deviceNum = 0;
 
-inline char separator()
-{
+// Device buffer size class for a frame dimension: dimensions are rounded
+// up to one of eight steps per power of two, so buffers are at most 12.5%
+// larger than the frames they hold, and frames of similar size share buffers
+inline uint32_t sizeClass(uint32_t dim) {
+	if (dim <= 8)
+		return 8;
+	uint32_t shift = 0;
+	while (((dim - 1) >> shift) >= 16)
+		shift++;
+	return (((dim - 1) >> shift) + 1) << shift;
+}
+
+// device buffers for frames of one size class
+template<typename M> struct SlotBuffers {
+	SlotBuffers() : temporal(0), denoised(0), demosaiced(0), coefficients(0), segments(0),
+			width(0), height(0) {
+	}
+	// release intermediate buffers
+	void releaseIntermediate() {
+		for (auto mem : { temporal, denoised, demosaiced, coefficients, segments }) {
+			if (mem)
+				clReleaseMemObject(mem);
+		}
+		temporal = denoised = demosaiced = coefficients = segments = 0;
+	}
+	std::shared_ptr<M> hostToDevice;
+	std::shared_ptr<M> deviceToHost;
+	// temporally and spatially denoised Bayer frames, each read by the
+	// next stage in place of hostToDevice
+	cl_mem temporal;
+	cl_mem denoised;
+	// demosaic output, when rows are PNG filtered or frames are
+	// JPEG encoded or compressed on the device
+	cl_mem demosaiced;
+	// quantized coefficients and entropy coded segments of JPEG encoding;
+	// segments also holds the coded tiles of compression
+	cl_mem coefficients;
+	cl_mem segments;
+	// size class
+	uint32_t width;
+	uint32_t height;
+};
+
+// device buffers, kernel queue and jobs for one in-flight frame
+template<typename M> struct DebayerSlot : SlotBuffers<M> {
+	DebayerSlot() : kernelQueue(nullptr), currentJobInfo(nullptr),
+					prevJobInfo(nullptr), retired(false), failed(false), stats(0) {
+	}
+	~DebayerSlot() {
+		this->releaseIntermediate();
+		if (stats)
+			clReleaseMemObject(stats);
+	}
+	// compute queue of the current job
+	QueueOCL *kernelQueue;
+	JobInfo<M> *currentJobInfo;
+	JobInfo<M> *prevJobInfo;
+	// no further jobs are queued on a retired slot, until it is reused
+	bool retired;
+	// a job failed to queue; slot is not reused
+	bool failed;
+	// frame statistics accumulated by demosaic, of any size class
+	cl_mem stats;
+};
+
+// Device buffers of size classes not currently bound to a slot, kept so that
+// frames of a returning size class do not reallocate device memory.
+// Each entry holds the events that complete once the buffers are released by
+// their last job. The least recently cached entry is evicted first.
+template<typename M> class SlotBufferCache {
+public:
+	explicit SlotBufferCache(size_t capacity) : capacity(capacity) {
+	}
+	~SlotBufferCache() {
+		clear();
+	}
+	// take ownership of buffers and their release events
+	void put(SlotBuffers<M> &buffers, std::vector<cl_event> &released) {
+		entries.push_back(Entry { buffers, released });
+		buffers = SlotBuffers<M>();
+		released.clear();
+		while (entries.size() > capacity)
+			evictOldest();
+	}
+	// take buffers of a size class, with their release events
+	bool take(uint32_t width, uint32_t height, SlotBuffers<M> &buffers,
+			std::vector<cl_event> &released) {
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+			if (it->buffers.width == width && it->buffers.height == height) {
+				buffers = it->buffers;
+				released = it->released;
+				entries.erase(std::next(it).base());
+				return true;
+			}
+		}
+		return false;
+	}
+	void clear() {
+		while (!entries.empty())
+			evictOldest();
+	}
+private:
+	struct Entry {
+		SlotBuffers<M> buffers;
+		std::vector<cl_event> released;
+	};
+	void evictOldest() {
+		auto &entry = entries.front();
+		entry.buffers.releaseIntermediate();
+		for (auto evt : entry.released)
+			Util::ReleaseEvent(evt);
+		entries.pop_front();
+	}
+	std::deque<Entry> entries;
+	size_t capacity;
+};
+
+// Device-only ring of the last raw Bayer frames, for temporal denoise.
+// Frames are denoised in sequence order, whichever slot carries them: each
+// frame's temporal kernel reads up to depth previous frames from the ring,
+// stores its own samples in the next entry, and waits on the previous
+// frame's temporal kernel. As that kernel has read every entry but its own,
+// the wait also orders reuse of the oldest entry. History restarts when
+// frame geometry or Bayer pattern changes.
+struct FrameHistory {
+	FrameHistory() : ring(0), capacity(0), depth(0), width(0), height(0), pattern(-1),
+			frames(0), index(0), written(0) {
+	}
+	~FrameHistory() {
+		release();
+	}
+	void release() {
+		if (ring)
+			clReleaseMemObject(ring);
+		Util::ReleaseEvent(written);
+		ring = 0;
+		written = 0;
+		capacity = 0;
+		frames = 0;
+	}
+	// ring entries: history, and the current frame's samples
+	uint32_t entries() const {
+		return depth + 1;
+	}
+	// prepare ring for a frame; returns false if the ring cannot be allocated
+	bool bind(cl_context context, uint32_t frameWidth, uint32_t frameHeight,
+			int32_t framePattern) {
+		if (frameWidth != width || frameHeight != height || framePattern != pattern) {
+			width = frameWidth;
+			height = frameHeight;
+			pattern = framePattern;
+			frames = 0;
+			index = 0;
+		}
+		size_t size = (size_t) width * height * entries();
+		if (size <= capacity)
+			return true;
+		// kernels still reading the old ring keep it alive until they complete
+		if (ring)
+			clReleaseMemObject(ring);
+		cl_int error_code = CL_SUCCESS;
+		ring = clCreateBuffer(context, CL_MEM_READ_WRITE, size, nullptr, &error_code);
+		if (CL_SUCCESS != error_code) {
+			Util::LogError("Error: clCreateBuffer returned %s.\n",
+					Util::TranslateOpenCLError(error_code));
+			ring = 0;
+			capacity = 0;
+			return false;
+		}
+		capacity = size;
+		frames = 0;
+		index = 0;
+		return true;
+	}
+	// current frame's temporal kernel is queued; take ownership of its
+	// completion event, and advance to the next entry
+	void advance(cl_event completed) {
+		Util::ReleaseEvent(written);
+		written = completed;
+		frames = std::min(frames + 1, depth);
+		index = (index + 1) % entries();
+	}
+	cl_mem ring;
+	size_t capacity;
+	// previous frames blended with each frame
+	uint32_t depth;
+	uint32_t width;
+	uint32_t height;
+	int32_t pattern;
+	// previous frames held, and entry of the current frame
+	uint32_t frames;
+	uint32_t index;
+	// completion of the last queued temporal kernel
+	cl_event written;
+};
+
+// per-frame latency, from arrival of frame request until output is written
+class LatencyStats {
+public:
+	void record(double ms) {
+		std::lock_guard<std::mutex> lk(mutex);
+		latencies.push_back(ms);
+	}
+	size_t count() {
+		std::lock_guard<std::mutex> lk(mutex);
+		return latencies.size();
+	}
+	struct Summary {
+		double mean, p50, p95, p99, max;
+	};
+	bool summarize(Summary &summary) {
+		std::lock_guard<std::mutex> lk(mutex);
+		if (latencies.empty())
+			return false;
+		std::sort(latencies.begin(), latencies.end());
+		double sum = 0;
+		for (auto &l : latencies)
+			sum += l;
+		summary.mean = sum / latencies.size();
+		summary.p50 = percentile(0.5);
+		summary.p95 = percentile(0.95);
+		summary.p99 = percentile(0.99);
+		summary.max = latencies.back();
+		return true;
+	}
+	void print() {
+		Summary summary;
+		if (!summarize(summary))
+			return;
+		fprintf(stdout,
+				"frame latency (ms): mean = %f, p50 = %f, p95 = %f, p99 = %f, max = %f\n",
+				summary.mean, summary.p50, summary.p95, summary.p99, summary.max);
+	}
+private:
+	double percentile(double p) {
+		size_t index = (size_t) std::ceil(p * latencies.size());
+		return latencies[index ? index - 1 : 0];
+	}
+	std::mutex mutex;
+	std::vector<double> latencies;
+};
+
+// one benchmark result, appended to a report file: CSV for a .csv file
+// (with a header if the file is new), JSON lines otherwise
+struct BenchReport {
+	std::vector<std::pair<std::string, std::string>> fields;
+	template<typename T> void add(const std::string &name, T value) {
+		std::stringstream ss;
+		ss << value;
+		fields.emplace_back(name, ss.str());
+	}
+	void add(const std::string &name, const std::string &value) {
+		fields.emplace_back(name, "\"" + value + "\"");
+	}
+	bool append(const std::string &path) const {
+		bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+		FILE *fp = fopen(path.c_str(), "a");
+		if (!fp)
+			return false;
+		std::string line;
+		if (csv) {
+			fseek(fp, 0, SEEK_END);
+			if (ftell(fp) == 0) {
+				for (auto &f : fields)
+					line += (line.empty() ? "" : ",") + f.first;
+				line += "\n";
+			}
+			std::string values;
+			for (auto &f : fields)
+				values += (values.empty() ? "" : ",") + f.second;
+			line += values;
+		} else {
+			for (auto &f : fields)
+				line += (line.empty() ? "{" : ", ") + ("\"" + f.first + "\": ") + f.second;
+			line += "}";
+		}
+		line += "\n";
+		bool rc = fwrite(line.data(), 1, line.size(), fp) == line.size();
+		return fclose(fp) == 0 && rc;
+	}
+};
+
+// source currently feeding the pipeline, so that it can be stopped on signal
+static IFrameSource *activeFrameSource = nullptr;
+
+#ifndef _WIN32
+static void stopFrameSource(int sig) {
+	(void) sig;
+	if (activeFrameSource)
+		activeFrameSource->stop();
+}
+#endif
+
+// where frames come from, as chosen on the command line
+struct FrameSourceParams {
+	FrameSourceParams() : synthetic(false), syntheticWidth(0), syntheticHeight(0),
+			syntheticFrames(0), recursive(false), service(false), fileOutput(false) {
+	}
+	// worker taking shards from coordinator on this socket, if set
+	std::string coordinatorSocket;
+	bool synthetic;
+	uint32_t syntheticWidth;
+	uint32_t syntheticHeight;
+	uint64_t syntheticFrames;
+	// manifest file listing inputs, if set
+	std::string manifest;
+	std::string inputDir;
+	bool recursive;
+	FileSelector selector;
+	// service mode: paths from socket if set, else new files in inputDir
+	// if set, else paths from stdin
+	bool service;
+	std::string serviceSocket;
+	// frames are written as files to outputDir
+	bool fileOutput;
+	std::string outputDir;
+};
+
+// Service mode reads paths from local socket, or watches input directory,
+// or reads paths from stdin. Otherwise, single pass over manifest
+// or input directory, or generated frames.
+// Returns nullptr if the source cannot be used
+static std::unique_ptr<IFrameSource> createFrameSource(const FrameSourceParams &params) {
+#ifndef _WIN32
+	if (!params.coordinatorSocket.empty())
+		return std::make_unique<CoordinatedFrameSource>(params.coordinatorSocket);
+#endif
+	if (params.synthetic)
+		return std::make_unique<SyntheticFrameSource>(params.syntheticWidth,
+				params.syntheticHeight, params.syntheticFrames);
+	if (!params.manifest.empty())
+		return std::make_unique<ManifestFrameSource>(params.manifest, params.selector);
+	if (!params.service) {
+		// outputs written into the listed tree are not to be listed as inputs
+		bool snapshot = params.fileOutput && (params.recursive ?
+				directoryWithin(params.outputDir, params.inputDir) :
+				sameDirectory(params.outputDir, params.inputDir));
+		return std::make_unique<DirectoryFrameSource>(params.inputDir, params.recursive,
+				params.selector, snapshot);
+	}
 #ifdef _WIN32
-    return '\\';
+	std::cerr << "Service mode is not supported on this platform";
+	return nullptr;
 #else
-    return '/';
+	if (!params.serviceSocket.empty())
+		return std::make_unique<SocketFrameSource>(params.serviceSocket);
+#ifdef __linux__
+	if (!params.inputDir.empty()) {
+		// outputs written to the watched directory would be taken as inputs
+		if (params.fileOutput && sameDirectory(params.outputDir, params.inputDir)) {
+			std::cerr << "Watched directory " << params.inputDir
+					<< " cannot also be the output directory";
+			return nullptr;
+		}
+		return std::make_unique<WatchFrameSource>(params.inputDir, params.selector);
+	}
+#endif
+	return std::make_unique<StreamFrameSource>(STDIN_FILENO);
 #endif
 }
 
+// per-thread kernels of the device encode stage, run in order after
+// demosaic: JPEG DCT, Huffman coding and packing, or tile encode, scan
+// and packing of compression
+struct EncodeKernels {
+	KernelOCL *stages[3];
+};
+
+// per-thread kernels run on the Bayer frame ahead of demosaic, in order,
+// or null: temporal denoise against the frame history, then spatial denoise
+struct BayerKernels {
+	KernelOCL *temporal;
+	KernelOCL *denoise;
+};
+
+// template struct to handle debayer to either image or buffer
+template<typename M, typename A> struct Debayer {
+	int debayer(int argc, char *argv[],
+			pfn_event_notify HostToDeviceMappedCallback,
+			pfn_event_notify DeviceToHostMappedCallback,
+			std::string kernelFile);
+	BlockingQueue<JobInfo<M>*> mappedHostToDeviceQueue;
+	BlockingQueue<JobInfo<M>*> mappedDeviceToHostQueue;
+private:
+	bool mapJob(DebayerSlot<M> &slot, uint32_t slotIndex);
+	bool launchJob(DebayerSlot<M> &slot, const BayerKernels &bayerKernels,
+			KernelOCL *kernel, KernelOCL *filterKernel,
+			const EncodeKernels *encodeKernels);
+	bool bindSlot(DebayerSlot<M> &slot, uint32_t width, uint32_t height,
+			SlotBufferCache<M> &cache);
+	void allocateBuffers(uint32_t classWidth, uint32_t classHeight,
+			SlotBuffers<M> &buffers);
+	uint32_t classOf(uint32_t dim) const {
+		// image kernel samples the whole image, so images are sized exactly
+		return std::is_same<M, DualBufferOCL>::value ? sizeClass(dim) : dim;
+	}
+	// output dimension of frame dimension; preview bins previewBin
+	// Bayer samples into one pixel
+	uint32_t outputDim(uint32_t dim) const {
+		return previewBin ? std::max<uint32_t>(1, dim / previewBin) : dim;
+	}
+
+	DeviceOCL *dev;
+	pfn_event_notify hostToDeviceMappedCallback;
+	pfn_event_notify deviceToHostMappedCallback;
+	// dimensions of first frame
+	uint32_t bufferWidth;
+	uint32_t bufferHeight;
+	uint32_t channelsOut;
+	int bayer_pattern;
+	// pattern given on command line overrides pattern of raw frames
+	bool forcePattern;
+	int pngFilter;
+	// demosaic to intermediate buffer, for PNG filter kernel
+	bool filterRows;
+	// demosaic to intermediate buffer, for JPEG encode kernels, which
+	// read quantization tables and Huffman codes from jpegTables
+	bool jpegEncode;
+	cl_mem jpegTables;
+	// demosaic to intermediate buffer, for tile compression kernels, which
+	// pack frames into deviceToHost buffers of compressBudget percent
+	// of the uncompressed frame's size
+	bool compressTiles;
+	uint32_t compressBudget;
+	// binned preview in place of demosaic: 2 or 4, or 0 for full resolution
+	uint32_t previewBin;
+	// demosaic accumulates frame statistics into the slot's stats buffer,
+	// read back with the frame, or in place of it
+	bool frameStats;
+	bool statsOnly;
+	// Bayer samples are corrected for defects and lens shading as
+	// kernels load them
+	bool bayerCorrect;
+	cl_mem shadingMap;
+	cl_int defectThreshold;
+	// noise sigma of Bayer denoise ahead of demosaic, or 0 for none
+	cl_float denoiseSigma;
+	// temporal denoise blends each frame with up to history.depth previous
+	// frames held on the device, for noise of temporalSigma; depth 0 for none
+	FrameHistory history;
+	cl_float temporalSigma;
+};
+
+// Each frame on a slot is queued in two steps: mapJob queues the map of the
+// hostToDevice buffer, waiting on the previous frame's kernel, and once the
+// host has filled the mapped buffer and knows the frame's geometry,
+// launchJob queues unmap => kernel => map => unmap for the frame.
+// Each unmap waits on the host triggering it once it is done with the
+// mapped memory. Map callbacks are only set once their commands have been
+// queued, so a job that fails to queue never reaches the host side of the
+// pipeline through them.
+template<typename M, typename A> bool Debayer<M, A>::mapJob(
+		DebayerSlot<M> &slot, uint32_t slotIndex) {
+	auto prev = slot.currentJobInfo;
+	auto job = new JobInfo<M>(dev, slot.hostToDevice, slot.deviceToHost,
+			slot.prevJobInfo, slotIndex);
+	slot.currentJobInfo = job;
+	slot.prevJobInfo = prev;
+
+	// map
+	// (wait for previous kernel to complete)
+	bool waitPrev = prev && prev->kernelCompleted;
+	cl_event hostToDeviceMapped = 0;
+	if (!slot.hostToDevice->map(waitPrev ? 1 : 0,
+								waitPrev ? &prev->kernelCompleted : nullptr,
+								&hostToDeviceMapped, false))
+		return false;
+	job->hostToDevice->hostBuffer = slot.hostToDevice->getHostBuffer();
+
+	// set callback, which will add this job to host-side queue
+	// of mapped hostToDevice buffers
+	auto error_code = clSetEventCallback(hostToDeviceMapped, CL_COMPLETE,
+			hostToDeviceMappedCallback, job);
+	Util::ReleaseEvent(hostToDeviceMapped);
+	if (DeviceSuccess != error_code) {
+		Util::LogError("Error: clSetEventCallback returned %s.\n",
+				Util::TranslateOpenCLError(error_code));
+		return false;
+	}
+
+	return true;
+}
+
+// Queue unmap => kernel => map => unmap chain for the slot's current job,
+// sized to the job's frame. Bayer kernels run first: the temporal kernel
+// blends the raw frame with the frame history into the slot's temporal
+// buffer, and the denoise kernel filters the frame into the slot's denoised
+// buffer. Each stage, and then demosaic, reads the last stage's output in
+// place of the hostToDevice buffer. In preview mode, the kernel is the
+// binned preview kernel, and everything after it is sized to the binned frame.
+// With a filter kernel, demosaic writes to the slot's intermediate buffer,
+// and the deviceToHost buffer receives PNG filtered scanlines. With encode
+// kernels, demosaic likewise writes to the intermediate buffer, and the
+// deviceToHost buffer receives the packed entropy coded JPEG frame, or the
+// packed compressed tiles.
+// Frame statistics are zeroed before demosaic, and read back once it
+// completes; with statistics only, the frame is not mapped, and the job
+// reaches the host once its statistics are read.
+template<typename M, typename A> bool Debayer<M, A>::launchJob(
+		DebayerSlot<M> &slot, const BayerKernels &bayerKernels, KernelOCL *kernel,
+		KernelOCL *filterKernel, const EncodeKernels *encodeKernels) {
+	auto job = slot.currentJobInfo;
+	auto prev = slot.prevJobInfo;
+	// borrow a compute queue per job, following the pool's dispatch policy;
+	// commands are ordered by events, so a slot's jobs may use different queues
+	slot.kernelQueue = dev->getComputeQueue();
+	uint32_t width = outputDim(job->width);
+	uint32_t height = outputDim(job->height);
+	uint32_t pitchOut = width * channelsOut;
+	job->outputWidth = width;
+	job->outputHeight = height;
+	// black level and gain from levels, 12 fractional bits
+	cl_int blackLevel = (cl_int) job->blackLevel;
+	cl_int levelGain = (cl_int) ((255u << 12)
+			/ std::max<uint32_t>(1, job->whiteLevel - std::min(job->whiteLevel, job->blackLevel)));
+
+	bool success = false;
+	cl_event deviceToHostMapped = 0;
+	cl_event demosaicCompleted = 0;
+	cl_event statsCleared = 0;
+	cl_event bayerCompleted = 0;
+	cl_mem demosaicIn = *slot.hostToDevice->getDeviceMem();
+	// frames without history, such as empty jobs, skip temporal denoise
+	bool temporal = bayerKernels.temporal && job->valid
+			&& history.bind(dev->context, job->width, job->height, job->pattern);
+	// queue a Bayer stage from demosaicIn to stageOut, once the previous
+	// stage and any further wait event complete; the stage's arguments past
+	// the frame's are already set
+	auto enqueueBayerStage = [&](KernelOCL *stage, cl_mem stageOut, cl_event wait) {
+		EnqueueInfoOCL stageInfo(slot.kernelQueue);
+		stageInfo.dimension = 2;
+		stageInfo.local_work_size[0] = tile_columns;
+		stageInfo.local_work_size[1] = tile_rows;
+		stageInfo.global_work_size[0] = (size_t) std::ceil(
+				job->width / (double) tile_columns) * stageInfo.local_work_size[0];
+		stageInfo.global_work_size[1] = (size_t) std::ceil(
+				job->height / (double) tile_rows) * stageInfo.local_work_size[1];
+		stageInfo.needsCompletionEvent = true;
+		stageInfo.pushWaitEvent(bayerCompleted ? bayerCompleted : job->hostToDevice->memUnmapped);
+		if (wait)
+			stageInfo.pushWaitEvent(wait);
+		try {
+			stage->setArgs<cl_uint, cl_uint, cl_mem, cl_uint, cl_mem, cl_uint>(job->height,
+					job->width, demosaicIn, job->width, stageOut, job->width);
+			stage->enqueue(stageInfo);
+		} catch (std::exception &ex) {
+			return false;
+		}
+		Util::ReleaseEvent(bayerCompleted);
+		bayerCompleted = stageInfo.completionEvent;
+		demosaicIn = stageOut;
+		return true;
+	};
+	cl_mem demosaicOut = (filterKernel || encodeKernels) ?
+			slot.demosaiced : *slot.deviceToHost->getDeviceMem();
+	do {
+		// unmap
+		if (!slot.hostToDevice->unmap(1, &job->hostToDevice->triggerMemUnmap,
+									&job->hostToDevice->memUnmapped))
+			break;
+
+		// temporal denoise, after the previous frame's, which has read
+		// the ring entry this frame's samples replace
+		if (temporal) {
+			try {
+				bayerKernels.temporal->setArg<cl_mem>(6, history.ring);
+				bayerKernels.temporal->setArg<cl_uint>(7, history.entries());
+				bayerKernels.temporal->setArg<cl_uint>(8, history.frames);
+				bayerKernels.temporal->setArg<cl_uint>(9, history.index);
+				bayerKernels.temporal->setArg<cl_float>(10, temporalSigma);
+			} catch (std::exception &ex) {
+				break;
+			}
+			if (!enqueueBayerStage(bayerKernels.temporal, slot.temporal, history.written))
+				break;
+			clRetainEvent(bayerCompleted);
+			history.advance(bayerCompleted);
+		}
+
+		// spatial denoise
+		if (bayerKernels.denoise) {
+			try {
+				bayerKernels.denoise->setArg<cl_float>(6, denoiseSigma);
+			} catch (std::exception &ex) {
+				break;
+			}
+			if (!enqueueBayerStage(bayerKernels.denoise, slot.denoised, 0))
+				break;
+		}
+
+		// zero statistics, once previous frame's have been read
+		if (frameStats) {
+			const cl_uint zero = 0;
+			bool waitRead = prev && prev->statsRead;
+			auto error_code = clEnqueueFillBuffer(slot.kernelQueue->getQueueImpl(),
+					slot.stats, &zero, sizeof(zero), 0, FrameStats::bufferSize(),
+					waitRead ? 1 : 0, waitRead ? &prev->statsRead : nullptr, &statsCleared);
+			if (DeviceSuccess != error_code) {
+				Util::LogError("Error: clEnqueueFillBuffer returned %s.\n",
+						Util::TranslateOpenCLError(error_code));
+				break;
+			}
+		}
+
+		// frame geometry, pattern, levels and the two memory arguments
+		// change from frame to frame; optional arguments follow in the
+		// order preview bin, statistics, Bayer correction
+		try {
+			kernel->setArgs<cl_uint, cl_uint, cl_mem, cl_uint, cl_mem, cl_uint, cl_int,
+					cl_int, cl_int>(job->height, job->width, demosaicIn,
+					job->width, demosaicOut, pitchOut, job->pattern, blackLevel, levelGain);
+			uint32_t arg = 9;
+			if (previewBin)
+				kernel->setArg<cl_uint>(arg++, previewBin);
+			else if (frameStats)
+				kernel->setArg<cl_mem>(arg++, slot.stats);
+			if (bayerCorrect) {
+				kernel->setArg<cl_mem>(arg++, shadingMap);
+				kernel->setArg<cl_int>(arg++, defectThreshold);
+			}
+		} catch (std::exception &ex) {
+			break;
+		}
+
+		EnqueueInfoOCL info(slot.kernelQueue);
+		info.dimension = 2;
+		info.local_work_size[0] = tile_columns;
+		info.local_work_size[1] = tile_rows;
+		info.global_work_size[0] = (size_t) std::ceil(
+				width / (double) tile_columns) * info.local_work_size[0];
+		info.global_work_size[1] = (size_t) std::ceil(
+				height / (double) tile_rows) * info.local_work_size[1];
+		info.needsCompletionEvent = true;
+		info.pushWaitEvent(bayerCompleted ? bayerCompleted : job->hostToDevice->memUnmapped);
+		if (statsCleared)
+			info.pushWaitEvent(statsCleared);
+		// wait for unmapping of previous deviceToHost
+		if (prev && prev->deviceToHost->memUnmapped)
+			info.pushWaitEvent(prev->deviceToHost->memUnmapped);
+		try {
+			kernel->enqueue(info);
+		} catch (std::exception &ex) {
+			break;
+		}
+		demosaicCompleted = info.completionEvent;
+
+		// read statistics back while later stages run
+		if (frameStats) {
+			job->stats.resize(FrameStats::words);
+			auto error_code = clEnqueueReadBuffer(slot.kernelQueue->getQueueImpl(),
+					slot.stats, CL_FALSE, 0, FrameStats::bufferSize(), job->stats.data(),
+					1, &demosaicCompleted, &job->statsRead);
+			if (DeviceSuccess != error_code) {
+				Util::LogError("Error: clEnqueueReadBuffer returned %s.\n",
+						Util::TranslateOpenCLError(error_code));
+				break;
+			}
+		}
+
+		// PNG filter rows of demosaiced frame
+		if (filterKernel) {
+			try {
+				filterKernel->setArgs<cl_uint, cl_uint, cl_uint, cl_mem, cl_uint, cl_mem, cl_int>(
+						height, pitchOut, channelsOut, slot.demosaiced, pitchOut,
+						*slot.deviceToHost->getDeviceMem(), pngFilter);
+			} catch (std::exception &ex) {
+				break;
+			}
+			EnqueueInfoOCL filterInfo(slot.kernelQueue);
+			filterInfo.dimension = 1;
+			filterInfo.local_work_size[0] = png_filter_wg;
+			filterInfo.global_work_size[0] = (size_t) height * png_filter_wg;
+			filterInfo.needsCompletionEvent = true;
+			filterInfo.pushWaitEvent(demosaicCompleted);
+			try {
+				filterKernel->enqueue(filterInfo);
+			} catch (std::exception &ex) {
+				break;
+			}
+			job->kernelCompleted = filterInfo.completionEvent;
+		} else if (encodeKernels) {
+			// JPEG: transform blocks, entropy code restart intervals,
+			// then pack intervals into the deviceToHost buffer.
+			// Compression: code tiles, turn tile sizes into offsets,
+			// then pack tiles into the deviceToHost buffer
+			KernelOCL *const *stages = encodeKernels->stages;
+			size_t items[3];
+			size_t localSizes[3];
+			try {
+				if (jpegEncode) {
+					cl_uint numSegments = JpegWriter::segmentCount(width, height);
+					cl_uint segmentCapacity = JpegWriter::segmentCapacity();
+					cl_uint packedCapacity = (cl_uint) JpegWriter::packedCapacity(width, height);
+					stages[0]->setArgs<cl_uint, cl_uint, cl_mem, cl_uint, cl_mem, cl_mem>(
+							height, width, slot.demosaiced, pitchOut, slot.coefficients, jpegTables);
+					stages[1]->setArgs<cl_uint, cl_uint, cl_mem, cl_mem, cl_uint, cl_mem>(
+							height, width, slot.coefficients, slot.segments, segmentCapacity,
+							jpegTables);
+					stages[2]->setArgs<cl_uint, cl_uint, cl_mem, cl_uint, cl_mem, cl_uint>(
+							height, width, slot.segments, segmentCapacity,
+							*slot.deviceToHost->getDeviceMem(), packedCapacity);
+					items[0] = (size_t) JpegWriter::mcuCount(width, height) * 6;
+					items[1] = numSegments;
+					items[2] = (size_t) numSegments * jpeg_pack_wg;
+					localSizes[0] = localSizes[1] = localSizes[2] = jpeg_pack_wg;
+				} else {
+					cl_uint numTiles = TileDecoder::tileCount(width, height);
+					cl_uint packedCapacity = (cl_uint) TileDecoder::packedCapacity(width, height,
+							channelsOut, compressBudget);
+					stages[0]->setArgs<cl_uint, cl_uint, cl_mem, cl_uint, cl_mem>(
+							height, width, slot.demosaiced, pitchOut, slot.segments);
+					stages[1]->setArgs<cl_uint, cl_uint, cl_mem, cl_mem, cl_uint>(
+							height, width, slot.segments, *slot.deviceToHost->getDeviceMem(),
+							packedCapacity);
+					stages[2]->setArgs<cl_uint, cl_uint, cl_mem, cl_mem, cl_uint>(
+							height, width, slot.segments, *slot.deviceToHost->getDeviceMem(),
+							packedCapacity);
+					items[0] = numTiles;
+					items[1] = tile_scan_wg;
+					items[2] = (size_t) numTiles * tile_pack_wg;
+					localSizes[0] = tile_pack_wg;
+					localSizes[1] = tile_scan_wg;
+					localSizes[2] = tile_pack_wg;
+				}
+			} catch (std::exception &ex) {
+				break;
+			}
+			cl_event stageCompleted = demosaicCompleted;
+			demosaicCompleted = 0;
+			bool queued = true;
+			for (int i = 0; i < 3 && queued; ++i) {
+				EnqueueInfoOCL stageInfo(slot.kernelQueue);
+				stageInfo.dimension = 1;
+				stageInfo.local_work_size[0] = localSizes[i];
+				stageInfo.global_work_size[0] = (items[i] + localSizes[i] - 1)
+						/ localSizes[i] * localSizes[i];
+				stageInfo.needsCompletionEvent = true;
+				stageInfo.pushWaitEvent(stageCompleted);
+				try {
+					stages[i]->enqueue(stageInfo);
+				} catch (std::exception &ex) {
+					queued = false;
+				}
+				Util::ReleaseEvent(stageCompleted);
+				stageCompleted = queued ? stageInfo.completionEvent : 0;
+			}
+			if (!queued)
+				break;
+			job->kernelCompleted = stageCompleted;
+			// frames that do not compress into deviceToHost
+			// are read back from the intermediate buffer
+			if (compressTiles && clRetainMemObject(slot.demosaiced) == CL_SUCCESS)
+				job->demosaiced = slot.demosaiced;
+		} else {
+			job->kernelCompleted = demosaicCompleted;
+			demosaicCompleted = 0;
+		}
+
+		if (!statsOnly) {
+			// map, once statistics are also read
+			cl_event mapWait[2] = { job->kernelCompleted, job->statsRead };
+			if (!slot.deviceToHost->map(job->statsRead ? 2 : 1, mapWait,
+					&deviceToHostMapped, false))
+				break;
+			job->deviceToHost->hostBuffer = slot.deviceToHost->getHostBuffer();
+
+			// unmap
+			if (!slot.deviceToHost->unmap(1, &job->deviceToHost->triggerMemUnmap,
+											&job->deviceToHost->memUnmapped))
+				break;
+		}
+
+		// set callback, which will add this job
+		// to host-side queue of mapped deviceToHost buffers
+		auto error_code = clSetEventCallback(statsOnly ? job->statsRead : deviceToHostMapped,
+				CL_COMPLETE, deviceToHostMappedCallback, job);
+		if (DeviceSuccess != error_code) {
+			Util::LogError("Error: clSetEventCallback returned %s.\n",
+					Util::TranslateOpenCLError(error_code));
+			break;
+		}
+		success = true;
+	} while (false);
+	Util::ReleaseEvent(deviceToHostMapped);
+	Util::ReleaseEvent(demosaicCompleted);
+	Util::ReleaseEvent(statsCleared);
+	Util::ReleaseEvent(bayerCompleted);
+
+	// release any commands queued so far
+	if (!success) {
+		Util::SetEventComplete(job->hostToDevice->triggerMemUnmap);
+		Util::SetEventComplete(job->deviceToHost->triggerMemUnmap);
+	}
+
+	return success;
+}
+
+template<typename M, typename A> void Debayer<M, A>::allocateBuffers(
+		uint32_t classWidth, uint32_t classHeight, SlotBuffers<M> &buffers) {
+	// buffers downstream of demosaic hold the (binned) output frame
+	uint32_t outWidth = outputDim(classWidth);
+	uint32_t outHeight = outputDim(classHeight);
+	uint32_t pitchOut = outWidth * channelsOut;
+	// filtered scanlines are prefixed by filter type; JPEG and
+	// compressed frames are read back packed
+	size_t sizeOut = jpegEncode ? JpegWriter::packedCapacity(outWidth, outHeight) :
+			compressTiles ? TileDecoder::packedCapacity(outWidth, outHeight,
+					channelsOut, compressBudget) :
+			(size_t) (pitchOut + (filterRows ? 1 : 0)) * outHeight;
+	bool linearOut = filterRows || jpegEncode || compressTiles;
+	A allocator(dev, classWidth, classHeight, 1, CL_UNSIGNED_INT8);
+	A allocatorOut(dev, linearOut ? sizeOut : outWidth,
+			linearOut ? 1 : outHeight, linearOut ? 1 : channelsOut, CL_UNSIGNED_INT8);
+	SlotBuffers<M> allocated;
+	allocated.hostToDevice = allocator.allocate(true);
+	allocated.deviceToHost = allocatorOut.allocate(false);
+	auto createBuffer = [this, &allocated](size_t size) {
+		cl_int error_code = CL_SUCCESS;
+		cl_mem mem = clCreateBuffer(dev->context, CL_MEM_READ_WRITE, size, nullptr,
+				&error_code);
+		if (CL_SUCCESS != error_code) {
+			Util::LogError("Error: clCreateBuffer returned %s.\n",
+					Util::TranslateOpenCLError(error_code));
+			allocated.releaseIntermediate();
+			throw std::exception();
+		}
+		return mem;
+	};
+	if (history.depth)
+		allocated.temporal = createBuffer((size_t) classWidth * classHeight);
+	if (denoiseSigma > 0)
+		allocated.denoised = createBuffer((size_t) classWidth * classHeight);
+	if (linearOut)
+		allocated.demosaiced = createBuffer((size_t) pitchOut * outHeight);
+	if (jpegEncode) {
+		allocated.coefficients = createBuffer(
+				JpegWriter::coefficientSize(outWidth, outHeight));
+		allocated.segments = createBuffer(
+				JpegWriter::segmentBufferSize(outWidth, outHeight));
+	}
+	if (compressTiles)
+		allocated.segments = createBuffer(
+				TileDecoder::tileBufferSize(outWidth, outHeight, channelsOut));
+	allocated.width = classWidth;
+	allocated.height = classHeight;
+	buffers = allocated;
+}
+
+// Bind slot to buffers of a frame's size class, if it is not bound to them
+// already. Buffers of the slot's previous size class are cached, and are
+// released once the current job's hostToDevice buffer is unmapped and the
+// previous job's output has been handled. On return, the current job's
+// hostToDevice buffer is mapped. If buffers for the size class cannot be
+// allocated, false is returned and the slot is unchanged.
+template<typename M, typename A> bool Debayer<M, A>::bindSlot(
+		DebayerSlot<M> &slot, uint32_t width, uint32_t height,
+		SlotBufferCache<M> &cache) {
+	uint32_t classWidth = classOf(width);
+	uint32_t classHeight = classOf(height);
+	if (classWidth == slot.width && classHeight == slot.height)
+		return true;
+
+	SlotBuffers<M> buffers;
+	std::vector<cl_event> released;
+	if (!cache.take(classWidth, classHeight, buffers, released)) {
+		try {
+			allocateBuffers(classWidth, classHeight, buffers);
+		} catch (std::exception &ex) {
+			// make room by freeing cached buffers
+			cache.clear();
+			try {
+				allocateBuffers(classWidth, classHeight, buffers);
+			} catch (std::exception &ex2) {
+				return false;
+			}
+		}
+	}
+
+	// cache current buffers
+	auto job = slot.currentJobInfo;
+	auto prev = slot.prevJobInfo;
+	std::vector<cl_event> slotReleased;
+	cl_event unmapped = 0;
+	if (slot.hostToDevice->unmap(0, nullptr, &unmapped))
+		slotReleased.push_back(unmapped);
+	if (prev && prev->deviceToHost->memUnmapped) {
+		clRetainEvent(prev->deviceToHost->memUnmapped);
+		slotReleased.push_back(prev->deviceToHost->memUnmapped);
+	}
+	cache.put(slot, slotReleased);
+
+	// map new buffers once their last job has released them
+	static_cast<SlotBuffers<M>&>(slot) = buffers;
+	bool success = slot.hostToDevice->map((cl_uint) released.size(),
+			released.empty() ? nullptr : released.data(), nullptr, true);
+	for (auto evt : released)
+		Util::ReleaseEvent(evt);
+	job->hostToDevice->mem = slot.hostToDevice;
+	job->deviceToHost->mem = slot.deviceToHost;
+	job->hostToDevice->hostBuffer = success ? slot.hostToDevice->getHostBuffer() : nullptr;
+
+	return success;
+}
+
 template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
 		char *argv[], pfn_event_notify HostToDeviceMappedCallback,
 		pfn_event_notify DeviceToHostMappedCallback, std::string kernelFile) {
@@ -67,55 +974,399 @@ template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
 	ValueArg<std::string> patternArg("p", "pattern", "Bayer Pattern", false,
 			"", "string", cmd);
 
-	cmd.parse(argc, argv);
+	ValueArg<uint32_t> computeQueuesArg("c", "compute-queues", "Number of Compute Queues", false,
+			0, "unsigned integer", cmd);
+
+	ValueArg<uint32_t> transferQueuesArg("t", "transfer-queues", "Number of Transfer Queues", false,
+			0, "unsigned integer", cmd);
+
+	ValueArg<std::string> dispatchArg("d", "queue-dispatch", "Queue Dispatch {round-robin,least-loaded}", false,
+			"", "string", cmd);
+
+	ValueArg<uint32_t> inFlightArg("n", "in-flight", "Number of In-Flight Frames", false,
+			numCLBuffers, "unsigned integer", cmd);
+
+	SwitchArg adaptiveArg("a", "adaptive", "Adapt number of in-flight frames to stage occupancy", cmd);
+
+	ValueArg<uint32_t> memoryBudgetArg("m", "memory-budget", "Memory Budget For In-Flight Frames (MB)", false,
+			0, "unsigned integer", cmd);
+
+	ValueArg<uint32_t> decodeWorkersArg("w", "decode-workers", "Number of Decode Workers (0 for automatic)", false,
+			0, "unsigned integer", cmd);
+
+	SwitchArg unorderedArg("", "unordered", "Hand decoded frames to device in completion order", cmd);
+
+	SwitchArg recursiveArg("r", "recursive", "Include Images In Subdirectories Of Input Directory", cmd);
+
+	MultiArg<std::string> globArg("", "glob", "Input File Name Pattern (may be repeated)", false,
+			"string", cmd);
+
+	ValueArg<std::string> shardArg("", "shard", "Process Shard Of Input Files (index/count)", false,
+			"", "string", cmd);
+
+	ValueArg<std::string> manifestArg("", "manifest", "File Listing Input Images, One Per Line", false,
+			"", "string", cmd);
+
+#ifdef ZLIB_FOUND
+	ValueArg<int> pngLevelArg("l", "png-level", "PNG Compression Level (0-9)", false,
+			PngEncodeParams().level, "integer", cmd);
+
+	ValueArg<std::string> pngFilterArg("f", "png-filter", "PNG Row Filter {none,sub,up,average,paeth,adaptive}", false,
+			"adaptive", "string", cmd);
+
+	SwitchArg deviceFilterArg("g", "device-png-filter", "PNG Filter Rows On Device (buffers only)", cmd);
+#endif
+
+	SwitchArg jpegArg("j", "jpeg", "Encode JPEG Frames On Device (buffers only)", cmd);
+
+	ValueArg<int> jpegQualityArg("q", "jpeg-quality", "JPEG Quality (1-100)", false,
+			90, "integer", cmd);
+
+	SwitchArg compressArg("z", "compress", "Compress Frames Losslessly On Device Before Readback (buffers only)", cmd);
 
+	ValueArg<uint32_t> compressBudgetArg("", "compress-budget", "Readback Buffer Size, In Percent Of Uncompressed Frame (compress)", false,
+			50, "unsigned integer", cmd);
 
-	if (!inputDirArg.isSet()) {
+#ifndef _WIN32
+	ValueArg<std::string> storeArg("", "store", "Output Frame Store File", false,
+			"", "string", cmd);
+
+	ValueArg<std::string> storeFormatArg("", "store-format", "Frame Store Format {raw,png}", false,
+			"raw", "string", cmd);
+
+	ValueArg<std::string> ioArg("", "io", "File I/O {auto,uring,threads,sync}", false,
+			"auto", "string", cmd);
+
+	ValueArg<uint32_t> readaheadArg("", "readahead", "Number of Input Files Read Ahead", false,
+			8, "unsigned integer", cmd);
+
+	SwitchArg directArg("", "direct", "Write Output Files With O_DIRECT", cmd);
+
+	ValueArg<std::string> streamArg("", "stream", "Stream Frames In Order To File, FIFO Or - (stdout)", false,
+			"", "string", cmd);
+
+	ValueArg<std::string> streamFormatArg("", "stream-format", "Stream Format {y4m,rgb,rgba,nv12}", false,
+			"y4m", "string", cmd);
+
+	ValueArg<uint32_t> streamFpsArg("", "stream-fps", "Stream Frame Rate (y4m)", false,
+			30, "unsigned integer", cmd);
+#endif
+
+#ifdef __linux__
+	ValueArg<std::string> ringArg("", "ring", "Publish Frames To Shared Memory Ring, Served On Local Socket", false,
+			"", "string", cmd);
+
+	ValueArg<uint32_t> ringSlotsArg("", "ring-slots", "Number of Frame Ring Slots", false,
+			8, "unsigned integer", cmd);
+
+	ValueArg<uint64_t> ringSlotSizeArg("", "ring-slot-size", "Frame Ring Slot Size In Bytes (default: first frame's size)", false,
+			0, "unsigned integer", cmd);
+
+	SwitchArg ringBlockArg("", "ring-block", "Wait For Ring Consumer Instead Of Overwriting Frames", cmd);
+#endif
+
+	ValueArg<int> deviceArg("", "device", "OpenCL Device Index", false,
+			deviceNum, "integer", cmd);
+
+#ifndef _WIN32
+	ValueArg<std::string> coordinateArg("", "coordinate", "Hand Out Input Shards To Workers On Local Socket", false,
+			"", "string", cmd);
+
+	ValueArg<uint32_t> spawnArg("", "spawn", "Number of Workers To Spawn, One Per Device (coordinator)", false,
+			0, "unsigned integer", cmd);
+
+	SwitchArg numaArg("", "numa", "Bind Each Spawned Worker To A NUMA Node (coordinator)", cmd);
+
+	ValueArg<uint32_t> shardSizeArg("", "shard-size", "Number of Files Per Shard (coordinator)", false,
+			64, "unsigned integer", cmd);
+
+	ValueArg<std::string> workerArg("", "worker", "Take Input Shards From Coordinator On Local Socket", false,
+			"", "string", cmd);
+#endif
+
+	ValueArg<std::string> demosaicArg("", "demosaic", "Demosaic Algorithm {bilinear,mhc,edge}", false,
+			"mhc", "string", cmd);
+
+	ValueArg<uint32_t> previewArg("", "preview", "Binned Preview At 1/N Resolution {2,4} In Place Of Demosaic", false,
+			0, "uint32_t", cmd);
+
+	ValueArg<std::string> statsArg("", "stats", "Append Per-Frame Histogram, White Balance, Exposure And Sharpness Statistics, Computed During Demosaic, To CSV File", false,
+			"", "string", cmd);
+
+	SwitchArg statsOnlyArg("", "stats-only", "Read Back Only Frame Statistics, Not Frames (stats)", cmd);
+
+	ValueArg<std::string> shadingArg("", "shading", "Lens Shading Gain Map File, Or radial:K For Gain 1 + K * d^2", false,
+			"", "string", cmd);
+
+	ValueArg<uint32_t> temporalArg("", "temporal", "Temporal Denoise Against Up To N Previous Frames Held On Device (0 for off, buffers only)", false,
+			0, "unsigned int", cmd);
+
+	ValueArg<float> temporalSigmaArg("", "temporal-sigma", "Noise Sigma Of Temporal Denoise", false,
+			8, "float", cmd);
+
+	ValueArg<float> denoiseArg("", "denoise", "Denoise Bayer Frames Before Demosaic, Given Noise Sigma (0 for off, buffers only)", false,
+			0, "float", cmd);
+
+	ValueArg<uint32_t> defectThresholdArg("", "defect-threshold", "Replace Samples Beyond Their Same-Colour Neighbours By More Than N (0 for off)", false,
+			0, "uint32_t", cmd);
+
+	ValueArg<std::string> syntheticArg("", "synthetic", "Process Generated Frames Of Given Size (WxH) Instead Of Input Files", false,
+			"", "string", cmd);
+
+	ValueArg<uint64_t> framesArg("", "frames", "Number of Generated Frames (synthetic)", false,
+			100, "uint64_t", cmd);
+
+	SwitchArg qualityArg("", "quality", "Measure PSNR Of First Frame Against Generated Scene (synthetic)", cmd);
+
+	SwitchArg nullOutputArg("", "null-output", "Discard Frames After Readback Instead Of Writing Them", cmd);
+
+	ValueArg<uint32_t> encodeThreadsArg("", "encode-threads", "Number of Encode Threads (0 for one per hardware thread)", false,
+			0, "uint32_t", cmd);
+
+	ValueArg<std::string> reportArg("", "report", "Append Throughput And Latency To Report File (.csv, else JSON lines)", false,
+			"", "string", cmd);
+
+	SwitchArg serviceArg("s", "service", "Run as a service, processing frames as they arrive", cmd);
+
+	ValueArg<std::string> socketArg("u", "socket", "Local Socket For Frame Paths (service mode)", false,
+			"", "string", cmd);
+
+	cmd.parse(argc, argv);
+
+	bool service = serviceArg.isSet();
+	bool worker = false;
+#ifndef _WIN32
+	worker = workerArg.isSet();
+#endif
+	// synthetic frames are generated in memory, and need no input directory
+	bool synthetic = syntheticArg.isSet() && !worker;
+	uint32_t syntheticWidth = 0, syntheticHeight = 0;
+	if (synthetic && !parseDimensions(syntheticArg.getValue(), syntheticWidth, syntheticHeight)) {
+		std::cerr << "Invalid synthetic frame size " << syntheticArg.getValue() << ": expected WxH";
+		return -1;
+	}
+	bool useManifest = manifestArg.isSet() && !service && !worker && !synthetic;
+	if (!inputDirArg.isSet() && !useManifest && !service && !worker && !synthetic) {
 		std::cerr << "Required image directory missing";
 		return -1;
 	}
+	FileSelector selector;
+	selector.patterns = globArg.getValue();
+	if (shardArg.isSet() && !selector.setShard(shardArg.getValue())) {
+		std::cerr << "Invalid shard " << shardArg.getValue() << ": expected index/count";
+		return -1;
+	}
 
 	std::string inputDir = inputDirArg.getValue();
 	std::string outputDir = inputDir;
 	if (outputDirArg.isSet())
 		outputDir = outputDirArg.getValue();
+	bool useStore = false;
+	bool storeRaw = false;
+#ifndef _WIN32
+	useStore = storeArg.isSet();
+	storeRaw = useStore && storeFormatArg.getValue() != "png";
+	if (useStore && storeRaw && storeFormatArg.getValue() != "raw")
+		std::cout << "Unrecognized store format " << storeFormatArg.getValue() << ". Using raw." << std::endl;
+#endif
+	// raw frames published to a ring replace PNG output
+	bool useRing = false;
+#ifdef __linux__
+	useRing = ringArg.isSet();
+#endif
+	// statistics are accumulated by the demosaic kernels, which binned
+	// preview replaces
+	frameStats = statsArg.isSet() && !previewArg.getValue();
+	if (statsArg.isSet() && !frameStats)
+		std::cout << "Frame statistics are not computed for binned previews." << std::endl;
+	statsOnly = frameStats && statsOnlyArg.isSet();
+	// null sink discards frames once they are read back, replacing all outputs;
+	// frames whose statistics are read back in their place are discarded
+	bool nullOutput = nullOutputArg.isSet() || statsOnly;
+	if (nullOutput)
+		useStore = storeRaw = useRing = false;
+	// a stream replaces all other outputs. It is opened first, so that
+	// streaming to stdout can move log output out of the way
+	bool useStream = false;
+#ifndef _WIN32
+	int streamFd = -1;
+	eStreamFormat streamFormat = STREAM_FORMAT_Y4M;
+	if (streamArg.isSet() && !nullOutput) {
+		streamFd = FrameStream::openOutput(streamArg.getValue());
+		if (streamFd < 0)
+			return -1;
+		useStream = true;
+		if (!FrameStream::parseFormat(streamFormatArg.getValue(), streamFormat))
+			std::cout << "Unrecognized stream format " << streamFormatArg.getValue() << ". Using y4m." << std::endl;
+		if (useStore || useRing)
+			std::cout << "Streaming frames: frame store and ring are not written." << std::endl;
+		useStore = storeRaw = useRing = false;
+	}
+#endif
+	// frames are written as files to the output directory
+	bool fileOutput = !useStore && !useRing && !useStream && !nullOutput;
+	if (outputDir.empty() && fileOutput) {
+		std::cerr << "Required output directory missing";
+		return -1;
+	}
+	// JPEG frames are encoded on the device, and written to files
+	// or to the frame store
+	bool jpeg = jpegArg.isSet() && std::is_same<M, DualBufferOCL>::value
+			&& !useRing && !useStream && !statsOnly;
+	if (jpegArg.isSet() && !jpeg)
+		std::cout << "Device JPEG encoding requires buffers, and file or frame store output. Writing PNG." << std::endl;
+	if (jpeg)
+		storeRaw = false;
+	JpegWriter jpegWriter(jpegQualityArg.getValue());
+	// frames are compressed on the device, and decoded on the host
+	// before output
+	bool compress = compressArg.isSet() && std::is_same<M, DualBufferOCL>::value && !jpeg
+			&& !statsOnly;
+	if (compressArg.isSet() && !compress)
+		std::cout << "Device compression requires buffers, and is not used with JPEG output or statistics only. Reading back uncompressed frames." << std::endl;
+
+#ifdef ZLIB_FOUND
+	PngEncodeParams pngParams;
+	pngParams.level = pngLevelArg.getValue();
+	if (!PngEncoder::parseFilter(pngFilterArg.getValue(), pngParams.filter))
+		std::cout << "Unrecognized PNG filter " << pngFilterArg.getValue() << ". Using adaptive." << std::endl;
+	// filter kernel reads demosaiced rows from a buffer
+	bool deviceFilter = deviceFilterArg.isSet() && std::is_same<M, DualBufferOCL>::value
+			&& !storeRaw && !useRing && !useStream && !nullOutput && !jpeg && !compress;
+	if (deviceFilterArg.isSet() && !deviceFilter)
+		std::cout << "Device PNG filtering requires buffers and PNG output. Filtering on host." << std::endl;
+	pngFilter = pngParams.filter;
+#else
+	bool deviceFilter = false;
+#endif
 
-	// set up directory iterator
-	auto dir = opendir(inputDir.c_str());
-	if (!dir) {
-		std::cerr << "Unable to open image directory " << inputDir;
+	FrameSourceParams sourceParams;
+#ifndef _WIN32
+	if (worker)
+		sourceParams.coordinatorSocket = workerArg.getValue();
+#endif
+	sourceParams.synthetic = synthetic;
+	sourceParams.syntheticWidth = syntheticWidth;
+	sourceParams.syntheticHeight = syntheticHeight;
+	sourceParams.syntheticFrames = framesArg.getValue();
+	if (useManifest)
+		sourceParams.manifest = manifestArg.getValue();
+	sourceParams.inputDir = inputDir;
+	sourceParams.recursive = recursiveArg.isSet();
+	sourceParams.selector = selector;
+	sourceParams.service = service;
+	sourceParams.serviceSocket = socketArg.getValue();
+	sourceParams.fileOutput = fileOutput;
+	sourceParams.outputDir = outputDir;
+	std::unique_ptr<IFrameSource> source = createFrameSource(sourceParams);
+	if (!source)
 		return -1;
+#ifndef _WIN32
+	if (service && !worker && !synthetic) {
+		activeFrameSource = source.get();
+		signal(SIGINT, stopFrameSource);
+		signal(SIGTERM, stopFrameSource);
+	}
+#endif
+	BlockingQueue<FrameRequest> requestQueue;
+	std::thread sourceThread([&source, &requestQueue]() {
+		source->run(requestQueue);
+	});
+	auto stopSource = [&source, &sourceThread]() {
+		source->stop();
+		sourceThread.join();
+		activeFrameSource = nullptr;
+	};
+	// frames report their completion to the source
+	IFrameSource *frameSource = source.get();
+
+#ifndef _WIN32
+	// coordinator hands shards of the input to worker processes,
+	// which run with the same arguments
+	if (coordinateArg.isSet()) {
+		std::vector<std::string> workerArgs;
+		for (int i = 0; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--coordinate" || arg == "--spawn" || arg == "--shard-size"
+					|| arg == "--device") {
+				i++;
+				continue;
+			}
+			if (arg != "--numa")
+				workerArgs.push_back(arg);
+		}
+		workerArgs.push_back("--worker");
+		workerArgs.push_back(coordinateArg.getValue());
+		ShardCoordinator coordinator(coordinateArg.getValue(), shardSizeArg.getValue());
+		bool rc = coordinator.run(requestQueue, workerArgs, spawnArg.getValue(),
+				numaArg.isSet());
+		stopSource();
+		return rc ? 0 : -1;
+	}
+#endif
+
+	// read header of first image to get image dimensions
+	FrameRequest first;
+	requestQueue.waitAndPop(first);
+	if (first.endOfStream()) {
+		stopSource();
+		std::cout << "No images to process" << std::endl;
+		return 0;
 	}
-	struct dirent *content = nullptr;
-	std::string inputFile;
-	BlockingQueue<std::string> imageQueue;
-	while ((content = readdir(dir)) != nullptr) {
-		if (strcmp(".", content->d_name) == 0
-				|| strcmp("..", content->d_name) == 0)
-			continue;
-		inputFile = content->d_name;
-		imageQueue.push(content->d_name);
-	}
-	closedir(dir);
-	uint32_t numImages = (imageQueue.size()/numCLBuffers) * numCLBuffers;
-	int numBatches = numImages / numCLBuffers;
-
-	// read first image in to get image dimensions
 	int width = 0, height = 0, channels = 0;
-	std::string inputFileFull = inputDir + separator() + inputFile.c_str();
-	auto image = stbi_load(inputFileFull.c_str(), &width, &height, &channels,
-			STBI_default);
-	if (!image) {
-		std::cerr << "Failed to read image file " << inputFile;
+	TiffRawReader firstRaw;
+	uint32_t firstWidth = 0, firstHeight = 0;
+	if (parseSyntheticPath(first.path, firstWidth, firstHeight)) {
+		width = (int) firstWidth;
+		height = (int) firstHeight;
+	} else if (TiffRawReader::hasRawExtension(first.path) && firstRaw.open(first.path)) {
+		width = (int) firstRaw.getWidth();
+		height = (int) firstRaw.getHeight();
+		firstRaw.close();
+	} else if (!stbi_info(first.path.c_str(), &width, &height, &channels)) {
+		std::cerr << "Failed to read image file " << first.path;
+		stopSource();
 		return -1;
 	}
-	stbi_image_free(image);
 
-	uint32_t bufferWidth = width;
-	uint32_t bufferHeight = height;
+	bufferWidth = width;
+	bufferHeight = height;
 
-	int bayer_pattern = RGGB;
+	// demosaic algorithm of frames whose request does not set one
+	eDemosaic defaultDemosaic = DEMOSAIC_MHC;
+	if (!parseDemosaic(demosaicArg.getValue(), defaultDemosaic))
+		std::cout << "Unrecognized demosaic algorithm " << demosaicArg.getValue() << ". Using mhc." << std::endl;
+	// binned preview replaces demosaic for all frames
+	previewBin = previewArg.getValue();
+	if (previewBin && previewBin != 2 && previewBin != 4) {
+		std::cout << "Unsupported preview binning " << previewBin << ". Using 2." << std::endl;
+		previewBin = 2;
+	}
+	uint32_t outputWidth = outputDim(bufferWidth);
+	uint32_t outputHeight = outputDim(bufferHeight);
+	// Bayer correction: lens shading map, uploaded to the device below,
+	// and defect threshold
+	ShadingMap shading;
+	if (shadingArg.isSet() && !shading.load(shadingArg.getValue()))
+		std::cout << "Failed to read shading map " << shadingArg.getValue() << ". Using unity gains." << std::endl;
+	defectThreshold = (cl_int) std::min<uint32_t>(defectThresholdArg.getValue(), 255);
+	bayerCorrect = shadingArg.isSet() || defectThreshold > 0;
+	shadingMap = 0;
+	// denoised frames are read by demosaic from a buffer
+	denoiseSigma = std::is_same<M, DualBufferOCL>::value ? std::max(0.0f, denoiseArg.getValue()) : 0;
+	if (denoiseArg.getValue() > 0 && denoiseSigma <= 0)
+		std::cout << "Bayer denoise requires buffers. Frames are not denoised." << std::endl;
+	history.depth = std::is_same<M, DualBufferOCL>::value ?
+			std::min<uint32_t>(temporalArg.getValue(), 8) : 0;
+	temporalSigma = std::max(1.0f, temporalSigmaArg.getValue());
+	if (temporalArg.getValue() > 0 && !history.depth)
+		std::cout << "Temporal denoise requires buffers. Frames are not denoised." << std::endl;
+	else if (temporalArg.getValue() > history.depth)
+		std::cout << "Unrecognized temporal depth " << temporalArg.getValue()
+				<< ". Using " << history.depth << std::endl;
 
+	bayer_pattern = RGGB;
+	forcePattern = patternArg.isSet();
 	if (patternArg.isSet()) {
 		std::string patt = patternArg.getValue();
 		if (patt == "GRBG")
@@ -129,40 +1380,79 @@ template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
 	}
 
 	uint32_t bps_out = 4;
-	uint32_t bufferPitch = bufferWidth;
-	uint32_t frameSize = bufferPitch * bufferHeight;
-	uint32_t bufferPitchOut = bufferWidth * bps_out;
-	uint32_t frameSizeOut = bufferPitchOut * bufferHeight;
+	channelsOut = bps_out;
+	filterRows = deviceFilter;
+	jpegEncode = jpeg;
+	jpegTables = 0;
+	compressTiles = compress;
+	compressBudget = std::max<uint32_t>(1, compressBudgetArg.getValue());
+	uint32_t budget = compressBudget;
+	// size of first frame's output
+	// (filtered scanlines are prefixed by filter type, and JPEG and
+	// compressed frames are read back into a buffer of fixed capacity)
+	auto outputSize = [bps_out, deviceFilter, jpeg, compress, budget](uint32_t width,
+			uint32_t height) {
+		if (jpeg)
+			return JpegWriter::packedCapacity(width, height);
+		if (compress)
+			return TileDecoder::packedCapacity(width, height, bps_out, budget);
+		return (size_t) (width * bps_out + (deviceFilter ? 1 : 0)) * height;
+	};
+	size_t frameSizeOut = outputSize(outputWidth, outputHeight);
 
-	uint8_t *postProcBuffers[numPostProcBuffers];
-	BlockingQueue<uint8_t*> availableBuffers;
+	// output frames are copied to post processing buffers,
+	// which grow to the largest frame seen
+	std::vector<uint8_t> postProcBuffers[numPostProcBuffers];
+	BlockingQueue<std::vector<uint8_t>*> availableBuffers;
 	for (int i = 0; i < numPostProcBuffers; ++i) {
-		postProcBuffers[i] = new uint8_t[frameSizeOut];
-		availableBuffers.push(postProcBuffers[i]);
+		postProcBuffers[i].reserve(frameSizeOut);
+		availableBuffers.push(postProcBuffers + i);
 	}
   cl_command_queue_properties queue_props = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
 
 	// 1. create device manager
 	auto deviceManager = std::make_shared<DeviceManagerOCL>(true);
-	auto success = deviceManager->init(platformId, deviceType, deviceNum, true, queue_props);
-	if (success != DeviceSuccess) {
+	auto success = deviceManager->init(platformId, deviceType, deviceArg.getValue(), true, queue_props);
+	// with several devices, manager only keeps the selected device
+	dev = success == DeviceSuccess ? deviceManager->getDevice(0) : nullptr;
+	if (!dev) {
 		std::cerr << "Failed to initialize OpenCL device";
+		stopSource();
 		return -1;
 	}
 
-	auto dev = deviceManager->getDevice(deviceNum);
+	hostToDeviceMappedCallback = HostToDeviceMappedCallback;
+	deviceToHostMappedCallback = DeviceToHostMappedCallback;
 
 	auto arch = ArchFactory::getArchitecture(dev->deviceInfo->venderId);
 	if (!arch){
 	    std::cerr << "Unsupported OpenCL vendor ID " << dev->deviceInfo->venderId;
+	    stopSource();
 	    return -1;
 	}
 
-	std::shared_ptr<M> hostToDevice[numCLBuffers];
-	std::shared_ptr<M> deviceToHost[numCLBuffers];
-	std::shared_ptr<QueueOCL> kernelQueue[numCLBuffers];
-	JobInfo<M> *currentJobInfo[numCLBuffers];
-	JobInfo<M> *prevJobInfo[numCLBuffers];
+	if (computeQueuesArg.isSet() || transferQueuesArg.isSet() || dispatchArg.isSet()) {
+		size_t numComputeQueues = computeQueuesArg.isSet() ?
+				computeQueuesArg.getValue() : arch->getNumComputeQueues();
+		size_t numTransferQueues = transferQueuesArg.isSet() ?
+				transferQueuesArg.getValue() : arch->getNumTransferQueues();
+		auto dispatch = QUEUE_DISPATCH_ROUND_ROBIN;
+		if (dispatchArg.isSet()) {
+			std::string disp = dispatchArg.getValue();
+			if (disp == "least-loaded")
+				dispatch = QUEUE_DISPATCH_LEAST_LOADED;
+			else if (disp != "round-robin")
+				std::cout << "Unrecognized queue dispatch " << disp << ". Using round-robin." << std::endl;
+		}
+		try {
+			dev->configureQueuePools(numComputeQueues, numTransferQueues, dispatch);
+		} catch (std::runtime_error &re) {
+			std::cerr << "Failed to create queue pools";
+			delete arch;
+			stopSource();
+			return -1;
+		}
+	}
 
 	std::stringstream buildOptions;
 	buildOptions << " -I ./ ";
@@ -182,147 +1472,406 @@ template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
       buildOptions << "";
       break;
 		default:
+			delete arch;
+			stopSource();
 			return -1;
 
 	}
 	buildOptions << " -D OUTPUT_CHANNELS=" << bps_out;
+	buildOptions << " -D PNG_FILTER_WG=" << png_filter_wg;
+	buildOptions << " -D JPEG_PACK_WG=" << jpeg_pack_wg;
+	buildOptions << " -D JPEG_RESTART_MCUS=" << JpegWriter::restartMcus;
+	buildOptions << " -D TILE_SIZE=" << TileDecoder::tileSize;
+	buildOptions << " -D TILE_SCAN_WG=" << tile_scan_wg;
+	buildOptions << " -D TILE_PACK_WG=" << tile_pack_wg;
+	if (frameStats)
+		buildOptions << " -D FRAME_STATS";
+	if (bayerCorrect)
+		buildOptions << " -D BAYER_CORRECT";
 	buildOptions << arch->getBuildOptions();
 	//buildOptions << " -D DEBUG";
+	delete arch;
 
 	KernelInitInfoBase initInfoBase(dev, buildOptions.str(), "",
 	BUILD_BINARY_IN_MEMORY);
+	// demosaic algorithms share one program, and are chosen per frame,
+	// unless the preview kernel from the same program replaces them
 	KernelInitInfo initInfo(initInfoBase, kernelFile, "debayer",
-			"malvar_he_cutler_demosaic");
-	std::shared_ptr<KernelOCL> kernel;
+			"bilinear_demosaic");
+	std::shared_ptr<KernelOCL> demosaicKernels[DEMOSAIC_COUNT];
+	std::shared_ptr<KernelOCL> previewKernel;
+	{
+		const char *kernelNames[DEMOSAIC_COUNT] = { "bilinear_demosaic",
+				"malvar_he_cutler_demosaic", "edge_directed_demosaic" };
+		cl_program program = 0;
+		bool built = true;
+		try {
+			program = KernelOCL::generateProgram(initInfo);
+			for (int i = 0; i < DEMOSAIC_COUNT; ++i) {
+				initInfo.kernelName = kernelNames[i];
+				demosaicKernels[i] = std::make_unique<KernelOCL>(initInfo, program);
+			}
+			if (previewBin) {
+				initInfo.kernelName = "binned_preview";
+				previewKernel = std::make_unique<KernelOCL>(initInfo, program);
+			}
+		} catch (std::runtime_error &re) {
+			built = false;
+		}
+		if (program)
+			clReleaseProgram(program);
+		if (!built) {
+			std::cerr << "Unable to build kernel. Exiting" << std::endl;
+			stopSource();
+			return -1;
+		}
+	}
+	// temporal and spatial Bayer denoise share one program
+	std::shared_ptr<KernelOCL> temporalKernel;
+	std::shared_ptr<KernelOCL> denoiseKernel;
+	if (history.depth || denoiseSigma > 0) {
+		KernelInitInfo denoiseInitInfo(initInfoBase, "bayerDenoise.cl", "bayerDenoise",
+				"bayer_denoise");
+		cl_program denoiseProgram = 0;
+		bool built = true;
+		try {
+			denoiseProgram = KernelOCL::generateProgram(denoiseInitInfo);
+			if (history.depth) {
+				denoiseInitInfo.kernelName = "temporal_denoise";
+				temporalKernel = std::make_unique<KernelOCL>(denoiseInitInfo, denoiseProgram);
+			}
+			if (denoiseSigma > 0) {
+				denoiseInitInfo.kernelName = "bayer_denoise";
+				denoiseKernel = std::make_unique<KernelOCL>(denoiseInitInfo, denoiseProgram);
+			}
+		} catch (std::runtime_error &re) {
+			built = false;
+		}
+		if (denoiseProgram)
+			clReleaseProgram(denoiseProgram);
+		if (!built) {
+			std::cerr << "Unable to build denoise kernels. Exiting" << std::endl;
+			stopSource();
+			return -1;
+		}
+	}
+	std::shared_ptr<KernelOCL> filterKernel;
+	if (deviceFilter) {
+		KernelInitInfo filterInitInfo(initInfoBase, "pngFilter.cl", "pngFilter",
+				"png_filter");
+		try {
+			filterKernel = std::make_unique<KernelOCL>(filterInitInfo);
+		} catch (std::runtime_error &re) {
+			std::cerr << "Unable to build PNG filter kernel. Exiting" << std::endl;
+			stopSource();
+			return -1;
+		}
+	}
+	// encode stages share one program; JPEG stages also share one table buffer
+	std::shared_ptr<KernelOCL> encodeKernels[3];
+	if (jpeg || compress) {
+		const char *stageNames[2][3] = { { "jpeg_dct", "jpeg_huffman", "jpeg_pack" },
+				{ "tile_encode", "tile_scan", "tile_pack" } };
+		auto names = stageNames[jpeg ? 0 : 1];
+		KernelInitInfo encodeInitInfo(initInfoBase, jpeg ? "jpegEncode.cl" : "tileCodec.cl",
+				jpeg ? "jpegEncode" : "tileCodec", names[0]);
+		cl_program encodeProgram = 0;
+		bool built = true;
+		try {
+			encodeProgram = KernelOCL::generateProgram(encodeInitInfo);
+			for (int i = 0; i < 3; ++i) {
+				encodeInitInfo.kernelName = names[i];
+				encodeKernels[i] = std::make_unique<KernelOCL>(encodeInitInfo, encodeProgram);
+			}
+		} catch (std::runtime_error &re) {
+			built = false;
+		}
+		if (encodeProgram)
+			clReleaseProgram(encodeProgram);
+		if (built && jpeg) {
+			auto &tables = jpegWriter.getDeviceTables();
+			cl_int error_code = CL_SUCCESS;
+			jpegTables = clCreateBuffer(dev->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+					tables.size() * sizeof(uint32_t), (void*) tables.data(), &error_code);
+			built = jpegTables != 0;
+		}
+		if (!built) {
+			std::cerr << "Unable to build " << (jpeg ? "JPEG encode" : "compression")
+					<< " kernels. Exiting" << std::endl;
+			stopSource();
+			return -1;
+		}
+	}
+
+	if (bayerCorrect) {
+		cl_image_format format;
+		format.image_channel_order = CL_RGBA;
+		format.image_channel_data_type = CL_FLOAT;
+		cl_image_desc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+		desc.image_width = shading.width;
+		desc.image_height = shading.height;
+		cl_int error_code = CL_SUCCESS;
+		shadingMap = clCreateImage(dev->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				&format, &desc, shading.gains.data(), &error_code);
+		if (!shadingMap) {
+			std::cerr << "Failed to create shading map: "
+					<< Util::TranslateOpenCLError(error_code) << std::endl;
+			stopSource();
+			return -1;
+		}
+	}
+
+	// in-flight frames are limited by memory budget, which defaults
+	// to a quarter of device global memory, and is applied to
+	// the size class of the first frame
+	uint32_t classWidth = classOf(bufferWidth);
+	uint32_t classHeight = classOf(bufferHeight);
+	uint64_t classSize = (uint64_t) classWidth * classHeight;
+	uint32_t classOutWidth = outputDim(classWidth);
+	uint32_t classOutHeight = outputDim(classHeight);
+	uint64_t classOutSize = (uint64_t) classOutWidth * classOutHeight;
+	uint64_t slotSize = classSize + outputSize(classOutWidth, classOutHeight)
+			+ (history.depth ? classSize : 0)
+			+ (denoiseSigma > 0 ? classSize : 0)
+			+ (deviceFilter ? classOutSize * bps_out : 0)
+			+ (jpeg ? classOutSize * bps_out + JpegWriter::coefficientSize(classOutWidth, classOutHeight)
+					+ JpegWriter::segmentBufferSize(classOutWidth, classOutHeight) : 0)
+			+ (compress ? classOutSize * bps_out
+					+ TileDecoder::tileBufferSize(classOutWidth, classOutHeight, bps_out) : 0);
+	uint64_t memoryBudget = memoryBudgetArg.isSet() ?
+			(uint64_t) memoryBudgetArg.getValue() << 20 :
+			dev->deviceInfo->globalMemSize / 4;
+	// frame history is shared by all slots
+	uint64_t historySize = history.depth ? classSize * history.entries() : 0;
+	memoryBudget -= std::min(memoryBudget, historySize);
+	size_t maxSlots = std::max<size_t>(1,
+			std::min<uint64_t>(maxCLBuffers, memoryBudget / slotSize));
+	size_t numSlots = std::max<size_t>(1, inFlightArg.getValue());
+	if (numSlots > maxSlots) {
+		std::cout << "Number of in-flight frames limited to " << maxSlots
+				<< " by memory budget" << std::endl;
+		numSlots = maxSlots;
+	}
+	bool adaptive = adaptiveArg.isSet();
+	DepthController depthController(numSlots, 1, adaptive ? maxSlots : numSlots);
+
+	// slots start with buffers of the first frame's size class, and are
+	// rebound to other size classes as frames of those sizes arrive.
+	// Buffers of unbound size classes are cached for reuse
+	SlotBufferCache<M> bufferCache(maxSlots);
+	std::vector<std::unique_ptr<DebayerSlot<M>>> slots;
+	auto addSlot = [this, &slots, classWidth, classHeight]() {
+		auto slot = std::make_unique<DebayerSlot<M>>();
+		allocateBuffers(classWidth, classHeight, *slot);
+		if (frameStats) {
+			cl_int error_code = CL_SUCCESS;
+			slot->stats = clCreateBuffer(dev->context, CL_MEM_READ_WRITE,
+					FrameStats::bufferSize(), nullptr, &error_code);
+			if (!slot->stats)
+				throw std::exception();
+		}
+		slots.push_back(std::move(slot));
+	};
 	try {
-		kernel = std::make_unique<KernelOCL>(initInfo);
-	} catch (std::runtime_error &re) {
-		std::cerr << "Unable to build kernel. Exiting" << std::endl;
+		for (size_t i = 0; i < numSlots; ++i)
+			addSlot();
+	} catch (std::exception &ex) {
+		std::cerr << "Failed to allocate in-flight frame buffers";
+		stopSource();
 		return -1;
 	}
 
-	A allocator(dev, bufferWidth, bufferHeight, 1, CL_UNSIGNED_INT8, queue_props);
-	A allocatorOut(dev, bufferWidth, bufferHeight, 4, CL_UNSIGNED_INT8, queue_props);
-	for (int i = 0; i < numCLBuffers; ++i) {
-		hostToDevice[i] = allocator.allocate(true);
-		deviceToHost[i] = allocatorOut.allocate(false);
-		kernelQueue[i] = std::make_unique<QueueOCL>(dev,queue_props);
-		currentJobInfo[i] = nullptr;
-		prevJobInfo[i] = nullptr;
-	}
-
-	// queue all kernel runs
-	for (int j = 0; j < numBatches; j++) {
-		for (int i = 0; i < numCLBuffers; ++i) {
-			bool lastBatch = j == numBatches - 1;
-			auto prev = currentJobInfo[i];
-			currentJobInfo[i] = new JobInfo<M>(dev, hostToDevice[i],
-												deviceToHost[i], prevJobInfo[i]);
-			prevJobInfo[i] = prev;
-
-			// map
-			// (wait for previous kernel to complete)
-			cl_event hostToDeviceMapped;
-			if (!hostToDevice[i]->map(prev ? 1 : 0,
-										prev ? &prev->kernelCompleted : nullptr,
-										&hostToDeviceMapped, false)) {
-				return -1;
-			}
-			// set callback, which will add this image
-			// info to host-side queue of mapped buffers
-			auto error_code = clSetEventCallback(hostToDeviceMapped,
-			CL_COMPLETE, HostToDeviceMappedCallback, currentJobInfo[i]);
-			if (DeviceSuccess != error_code) {
-				Util::LogError("Error: clSetEventCallback returned %s.\n",
-						Util::TranslateOpenCLError(error_code));
-				return -1;
-			}
-			Util::ReleaseEvent(hostToDeviceMapped);
+	// slots whose last job has not yet been handled by the output stage
+	std::atomic<size_t> liveSlots(slots.size());
 
-			// unmap
-			if (!hostToDevice[i]->unmap(1,
-										&currentJobInfo[i]->hostToDevice->triggerMemUnmap,
-										&currentJobInfo[i]->hostToDevice->memUnmapped)) {
-				return -1;
-			}
+	// map first job on each slot. Each job is launched as its frame
+	// is handed to the device, and the next job on the slot is then mapped
+	for (uint32_t i = 0; i < slots.size(); ++i) {
+		if (!mapJob(*slots[i], i)) {
+			stopSource();
+			return -1;
+		}
+	}
 
-			kernel->pushArg<cl_uint>(&bufferHeight);
-			kernel->pushArg<cl_uint>(&bufferWidth);
-			kernel->pushArg<cl_mem>(hostToDevice[i]->getDeviceMem());
-			kernel->pushArg<cl_uint>(&bufferPitch);
-			kernel->pushArg<cl_mem>(deviceToHost[i]->getDeviceMem());
-			kernel->pushArg<cl_uint>(&bufferPitchOut);
-			kernel->pushArg<cl_int>(&bayer_pattern);
-
-			EnqueueInfoOCL info(kernelQueue[i].get());
-			info.dimension = 2;
-			info.local_work_size[0] = tile_columns;
-			info.local_work_size[1] = tile_rows;
-			info.global_work_size[0] = (size_t) std::ceil(
-					bufferWidth / (double) tile_columns)
-					* info.local_work_size[0];
-			info.global_work_size[1] = (size_t) std::ceil(
-					bufferHeight / (double) tile_rows)
-					* info.local_work_size[1];
-			info.needsCompletionEvent = true;
-			info.pushWaitEvent(currentJobInfo[i]->hostToDevice->memUnmapped);
-			// wait for unmapping of previous deviceToHost
-			if (prev)
-				info.pushWaitEvent(prev->hostToDevice->memUnmapped);
-			try {
-				kernel->enqueue(info);
-			} catch (std::exception &ex) {
-				// todo: handle exception
+	// decode frames ahead of the device. Automatic sizing caps workers
+	// at the number of hardware threads
+	size_t decodeWorkers = decodeWorkersArg.getValue();
+	bool autoDecodeWorkers = decodeWorkers == 0;
+	if (autoDecodeWorkers)
+		decodeWorkers = std::max<size_t>(1, std::thread::hardware_concurrency());
+#ifndef _WIN32
+	// input files are read ahead, and output files written, through the I/O
+	// engine, unless I/O is synchronous
+	std::unique_ptr<IoEngine> io;
+	std::string ioMode = ioArg.getValue();
+	if (ioMode != "sync") {
+		eIoBackend backend = IO_BACKEND_AUTO;
+		if (ioMode == "uring")
+			backend = IO_BACKEND_URING;
+		else if (ioMode == "threads")
+			backend = IO_BACKEND_THREADS;
+		else if (ioMode != "auto")
+			std::cout << "Unrecognized I/O mode " << ioMode << ". Using auto." << std::endl;
+		io = std::make_unique<IoEngine>(backend);
+	}
+#endif
+	DecodeStage decoder(requestQueue, decodeWorkers, autoDecodeWorkers,
+			2 * decodeWorkers, !unorderedArg.isSet());
+#ifndef _WIN32
+	if (io)
+		decoder.setReadahead(io.get(), readaheadArg.getValue());
+#endif
+	decoder.start(first);
+
+	// wait for cl memory objects from queue, fill them, launch their jobs,
+	// and trigger unmap event.
+	// Each mapped job receives the next decoded frame, first rebinding its slot
+	// to buffers of the frame's size class if need be; once the frame stream
+	// ends, remaining jobs are passed through empty, draining their slots.
+	// In adaptive mode, slots are added or retired here, following the depth
+	// controller. A retired slot drains after its current job.
+	auto start = std::chrono::high_resolution_clock::now();
+	// frames handed to the device are numbered in input order,
+	// so that a stream can restore their order
+	uint64_t framesSequenced = 0;
+	std::thread pushImages([this, &decoder, &slots, &demosaicKernels, defaultDemosaic,
+							&previewKernel, &temporalKernel, &denoiseKernel, &filterKernel,
+							&encodeKernels,
+							&depthController, adaptive, &addSlot, &liveSlots,
+							&bufferCache, &framesSequenced, frameSource]() {
+		typedef DepthController::clock clock;
+		KernelOCL *pushKernels[DEMOSAIC_COUNT];
+		for (int i = 0; i < DEMOSAIC_COUNT; ++i)
+			pushKernels[i] = demosaicKernels[i]->getThreadKernel();
+		auto pushPreviewKernel = previewKernel ? previewKernel->getThreadKernel() : nullptr;
+		BayerKernels pushBayerKernels = {
+				temporalKernel ? temporalKernel->getThreadKernel() : nullptr,
+				denoiseKernel ? denoiseKernel->getThreadKernel() : nullptr };
+		auto pushFilterKernel = filterKernel ? filterKernel->getThreadKernel() : nullptr;
+		EncodeKernels pushEncodeKernels = { { nullptr, nullptr, nullptr } };
+		if (encodeKernels[0]) {
+			for (int i = 0; i < 3; ++i)
+				pushEncodeKernels.stages[i] = encodeKernels[i]->getThreadKernel();
+		}
+		bool endOfStream = false;
+		size_t activeSlots = slots.size();
+		JobInfo<M> *info = nullptr;
+		while (activeSlots) {
+			auto waitStart = clock::now();
+			if (!mappedHostToDeviceQueue.waitAndPop(info))
+				break;
+			depthController.addInputWait(clock::now() - waitStart);
+			if (!endOfStream) {
+				// skip frames that failed to decode
+				DecodedFrame frame;
+				bool haveFrame = false;
+				waitStart = clock::now();
+				while (decoder.waitAndPop(frame)) {
+					if (frame.valid()) {
+						haveFrame = true;
+						break;
+					}
+					frameSource->completed(frame.request.tag, false, 0);
+				}
+				depthController.addSourceWait(clock::now() - waitStart);
+				endOfStream = !haveFrame;
+				if (haveFrame) {
+					info->sequence = framesSequenced++;
+					info->tag = frame.request.tag;
+					if (bindSlot(*slots[info->slot], frame.width, frame.height,
+							bufferCache) && info->hostToDevice->hostBuffer) {
+						info->fileName = frame.request.outputName();
+						info->arrival = frame.request.arrival;
+						info->width = frame.width;
+						info->height = frame.height;
+						info->pattern = bayer_pattern;
+						info->demosaic = frame.request.demosaic == DEMOSAIC_DEFAULT ?
+								defaultDemosaic : frame.request.demosaic;
+						info->blackLevel = 0;
+						info->whiteLevel = 255;
+						if (frame.raw) {
+							// unpack strips straight into mapped buffer
+							info->valid = frame.raw->read(info->hostToDevice->hostBuffer,
+									frame.width);
+							if (!forcePattern && frame.raw->getPattern() != CFA_UNKNOWN)
+								info->pattern = frame.raw->getPattern();
+							info->blackLevel = frame.raw->getBlackLevel();
+							info->whiteLevel = frame.raw->getWhiteLevel();
+							if (!info->valid)
+								std::cerr << "Skipping image file " << frame.request.path
+										<< ": truncated raw data" << std::endl;
+						} else {
+							memcpy(info->hostToDevice->hostBuffer, frame.data,
+									(size_t) frame.width * frame.height);
+							info->valid = true;
+						}
+					} else {
+						std::cerr << "Skipping image file " << frame.request.path
+								<< ": unable to allocate device buffers" << std::endl;
+					}
+					decoder.release(frame);
+				}
 			}
-			currentJobInfo[i]->kernelCompleted = info.completionEvent;
+			size_t targetSlots = adaptive && !endOfStream ?
+					depthController.update() : activeSlots;
 
-			// map
-			cl_event deviceToHostMapped;
-			if (!deviceToHost[i]->map(1, &currentJobInfo[i]->kernelCompleted,
-					&deviceToHostMapped, false)) {
-				return -1;
+			// launch this job, and map next job on this slot,
+			// unless slot is to be retired. An empty job runs the cheapest
+			// demosaic over the slot's whole buffers, and its output is discarded
+			auto &slot = *slots[info->slot];
+			if (!info->valid) {
+				info->width = slot.width;
+				info->height = slot.height;
+				info->demosaic = DEMOSAIC_BILINEAR;
 			}
-			// set callback on mapping
-			error_code = clSetEventCallback(deviceToHostMapped,
-											CL_COMPLETE,
-											DeviceToHostMappedCallback,
-											currentJobInfo[i]);
-			if (DeviceSuccess != error_code) {
-				Util::LogError("Error: clSetEventCallback returned %s.\n",
-						Util::TranslateOpenCLError(error_code));
-				return -1;
+			if (targetSlots < activeSlots)
+				slot.retired = true;
+			bool launched = launchJob(slot, pushBayerKernels,
+					pushPreviewKernel ? pushPreviewKernel : pushKernels[info->demosaic],
+					pushFilterKernel, pushEncodeKernels.stages[0] ? &pushEncodeKernels : nullptr);
+			info->last = !launched || endOfStream || slot.retired
+					|| !mapJob(slot, info->slot);
+			if (info->last) {
+				slot.retired = true;
+				activeSlots--;
+			}
+			if (!launched) {
+				// job will not be mapped back to host, so hand it
+				// straight to output stage, to account for the slot
+				slot.failed = true;
+				info->valid = false;
+				mappedDeviceToHostQueue.push(info);
 			}
-			Util::ReleaseEvent(deviceToHostMapped);
-
-			// unmap (except last batch)
-			if (!lastBatch) {
-				if (!deviceToHost[i]->unmap(1,
-											&currentJobInfo[i]->deviceToHost->triggerMemUnmap,
-											&currentJobInfo[i]->deviceToHost->memUnmapped)) {
-					return -1;
+
+			// add slots, reusing retired slots first
+			while (activeSlots && activeSlots < targetSlots) {
+				uint32_t index = 0;
+				while (index < slots.size()
+						&& (!slots[index]->retired || slots[index]->failed))
+					index++;
+				if (index == slots.size()) {
+					try {
+						addSlot();
+					} catch (std::exception &ex) {
+						depthController.setMaxDepth(activeSlots);
+						break;
+					}
+				}
+				slots[index]->retired = false;
+				liveSlots++;
+				if (!mapJob(*slots[index], index)) {
+					slots[index]->retired = true;
+					liveSlots--;
+					depthController.setMaxDepth(activeSlots);
+					break;
 				}
+				activeSlots++;
 			}
-		}
-	}
 
-	// wait for cl memory objects from queue, fill them, and trigger unmap event
-	auto start = std::chrono::high_resolution_clock::now();
-	std::thread pushImages([this, frameSize, numImages, &imageQueue, inputDir]() {
-		JobInfo<M> *info = nullptr;
-		int count = 0;
-		while (mappedHostToDeviceQueue.waitAndPop(info)) {
-			std::string fname;
-			imageQueue.waitAndPop(fname);
-			info->fileName = fname;
-			int width = 0, height = 0, channels = 0;
-			fname = inputDir + separator() + fname;
-			auto image = stbi_load(fname.c_str(), &width, &height, &channels,	STBI_default);
-			memcpy(info->hostToDevice->mem->getHostBuffer(), image, frameSize);
-			stbi_image_free(image);
 			// trigger unmap, allowing current kernel to proceed
 			Util::SetEventComplete(info->hostToDevice->triggerMemUnmap);
-			if (++count == numImages)
-				break;
 		}
 	});
 
@@ -330,32 +1879,295 @@ template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
 	// and trigger unmap event
 	std::mutex postMutex;
 	std::condition_variable postCondition;
-	auto postProcPool = new ThreadPool(std::thread::hardware_concurrency());
-	std::thread pullImages([this, frameSizeOut, &postProcPool, bufferWidth, bufferHeight,
-							bps_out, &availableBuffers, outputDir, numImages,
-							&postCondition, &postMutex]() {
+	size_t postPending = 0;
+	LatencyStats latency;
+	size_t encodeThreads = encodeThreadsArg.getValue();
+	if (!encodeThreads)
+		encodeThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	auto postProcPool = new ThreadPool(encodeThreads);
+#ifdef ZLIB_FOUND
+	// each frame's PNG stripes are compressed in parallel
+	PngEncoder pngEncoder(encodeThreads);
+#endif
+	// each compressed frame's tile rows are decoded in parallel.
+	// Compression ratio is tracked over frames that fit their readback buffer;
+	// the others are read back uncompressed
+	std::unique_ptr<TileDecoder> tileDecoder;
+	if (compress)
+		tileDecoder = std::make_unique<TileDecoder>(encodeThreads);
+	std::atomic<uint64_t> compressedFrames(0), compressedBytes(0), uncompressedBytes(0),
+			compressFallbacks(0);
+	// quality of the first frame is measured against the generated scene,
+	// when frames are read back as pixels
+	bool measureQuality = qualityArg.isSet() && synthetic && !jpeg && !deviceFilter
+			&& !previewBin && !statsOnly;
+	if (qualityArg.isSet() && !measureQuality)
+		std::cout << "Quality is measured on full resolution synthetic frames, without JPEG or device PNG filtering." << std::endl;
+	double psnr = -1;
+	// frame statistics are appended to a CSV file, and averaged over the run
+	FILE *statsFile = nullptr;
+	if (frameStats) {
+		statsFile = fopen(statsArg.getValue().c_str(), "a");
+		if (statsFile) {
+			fseek(statsFile, 0, SEEK_END);
+			if (ftell(statsFile) == 0)
+				fputs(FrameStats::csvHeader(), statsFile);
+		} else {
+			std::cerr << "Failed to open statistics file " << statsArg.getValue() << std::endl;
+		}
+	}
+	uint64_t statsFrames = 0;
+	double statsLuma = 0, statsSharpness = 0, statsGain[2] = { 0, 0 };
+	// frames are written to a frame store, or to one PNG file per frame
+#ifndef _WIN32
+	FrameStoreWriter store;
+	if (useStore && !store.create(storeArg.getValue())) {
+		std::cerr << "Failed to create frame store " << storeArg.getValue() << std::endl;
+		useStore = false;
+		storeRaw = false;
+	}
+#ifdef __linux__
+	FrameRingWriter ring;
+	if (useRing && !ring.create(ringArg.getValue(), ringSlotsArg.getValue(),
+			ringSlotSizeArg.getValue() ? ringSlotSizeArg.getValue() : frameSizeOut,
+			ringBlockArg.isSet())) {
+		std::cerr << "Failed to create frame ring " << ringArg.getValue() << std::endl;
+		useRing = false;
+	}
+#endif
+#ifndef _WIN32
+	// a slow stream reader holds back frames beyond those that can be in
+	// flight ahead of the next one to be written: on the device, each slot
+	// holding its current and previous frame, and in post processing
+	std::unique_ptr<FrameStream> stream;
+	if (useStream)
+		stream.reset(new FrameStream(streamFd, streamFormat, outputWidth, outputHeight,
+				streamFpsArg.getValue(), 2 * maxSlots + numPostProcBuffers));
+#endif
+	// I/O buffers for encoded files are sized for the first frame,
+	// and bound the number of writes in flight
+	size_t maxIoBuffers = std::max<size_t>(2, std::min<size_t>(numPostProcBuffers,
+			2 * std::thread::hardware_concurrency()));
+#ifdef ZLIB_FOUND
+	size_t ioBufferSize = pngEncoder.maxEncodedSize(outputWidth, outputHeight,
+			bps_out, pngParams);
+#else
+	size_t ioBufferSize = frameSizeOut + frameSizeOut / 8 + 65536;
+#endif
+#endif
+	// raw frames go straight to the store and ring, or the null sink;
+	// other frames are encoded on the post processing pool
+	RawFrameSink rawSink(bps_out, tileDecoder.get(), nullOutput);
+	EncodedFrameSink encodedSink(outputDir, bps_out, jpeg ? &jpegWriter : nullptr);
+#ifdef ZLIB_FOUND
+	encodedSink.setPngEncoder(&pngEncoder, pngParams, deviceFilter);
+#endif
+#ifndef _WIN32
+	if (storeRaw)
+		rawSink.setStore(&store);
+	else if (useStore)
+		encodedSink.setStore(&store);
+	if (io)
+		encodedSink.setIoEngine(io.get(), ioBufferSize, maxIoBuffers, directArg.isSet());
+#endif
+#ifdef __linux__
+	if (useRing)
+		rawSink.setRing(&ring);
+#endif
+	// frame that will not be written: keep stream moving past it, so
+	// that frames after it are not held up waiting for it
+	auto skipStream = [
+#ifndef _WIN32
+						&stream
+#endif
+						](uint64_t sequence) {
+#ifndef _WIN32
+		if (stream && sequence != UINT64_MAX)
+			stream->skip(sequence);
+#else
+		(void) sequence;
+#endif
+	};
+	auto frameDone = [service, &latency, frameSource](const std::string &fileName,
+			std::chrono::high_resolution_clock::time_point arrival, uint64_t tag,
+			bool success) {
+		std::chrono::duration<double, std::milli> elapsed =
+				std::chrono::high_resolution_clock::now() - arrival;
+		latency.record(elapsed.count());
+		frameSource->completed(tag, success, elapsed.count());
+		if (service)
+			fprintf(stdout, "%s: latency = %f ms\n", fileName.c_str(), elapsed.count());
+	};
+
+	std::thread pullImages([this, &outputSize, &postProcPool, bps_out, &availableBuffers,
+							&liveSlots, &postCondition, &postMutex, &encodedSink, &rawSink, &frameDone,
+							&skipStream,
+							&tileDecoder, &compressedFrames, &compressedBytes,
+							&uncompressedBytes, &compressFallbacks, measureQuality, &psnr,
+							statsFile, &statsFrames, &statsLuma, &statsSharpness, &statsGain,
+#ifndef _WIN32
+							storeRaw, &stream,
+#endif
+							useRing, nullOutput, jpeg, frameSource, &postPending, &depthController]() {
+		typedef DepthController::clock clock;
 		JobInfo<M> *info = nullptr;
-		int pullCount;
-		std::atomic<int> postCount(0);
-		while (mappedDeviceToHostQueue.waitAndPop(info)) {
-			uint8_t *buf;
-			if (availableBuffers.waitAndPop(buf)) {
-				memcpy(buf, info->deviceToHost->mem->getHostBuffer(),frameSizeOut);
-				auto evt = [buf, bufferWidth, bufferHeight,
-							bps_out, &availableBuffers, info, outputDir, numImages,
-							&postCondition, &postMutex, &postCount] {
-					std::stringstream f;
-					f << outputDir << separator() << info->fileName << ".png";
-					stbi_write_png(f.str().c_str(), bufferWidth, bufferHeight, bps_out,buf, bufferWidth*bps_out);
+		// frames that did not compress, read back uncompressed,
+		// and compressed frames decoded for the null sink
+		std::vector<uint8_t> readBack;
+		while (liveSlots) {
+			auto waitStart = clock::now();
+			if (!mappedDeviceToHostQueue.waitAndPop(info))
+				break;
+			depthController.addOutputWait(clock::now() - waitStart);
+			size_t sizeOut = outputSize(info->outputWidth, info->outputHeight);
+#ifndef _WIN32
+			bool rawOut = storeRaw || useRing || nullOutput;
+#else
+			bool rawOut = nullOutput;
+#endif
+			const uint8_t *frameData = info->deviceToHost->hostBuffer;
+			// a compressed frame is decoded as it is output. A frame that
+			// overflowed its readback buffer is read from the intermediate buffer
+			bool compressed = false;
+			if (info->valid && tileDecoder) {
+				size_t rawSize = (size_t) info->outputWidth * info->outputHeight * bps_out;
+				size_t packedSize = TileDecoder::packedSize(frameData, sizeOut);
+				if (packedSize) {
+					compressed = true;
+					sizeOut = packedSize;
+					compressedFrames++;
+					compressedBytes += packedSize;
+					uncompressedBytes += rawSize;
+				} else {
+					readBack.resize(rawSize);
+					compressFallbacks++;
+					// read on a compute queue, out of order, waiting on the frame's
+					// own kernels only, and not behind other slots' map and unmap work
+					// on the transfer queue
+					bool read = false;
+					if (info->demosaiced) {
+						auto queue = dev->getComputeQueue();
+						cl_event readCompleted = 0;
+						read = clEnqueueReadBuffer(queue->getQueueImpl(), info->demosaiced,
+								CL_FALSE, 0, rawSize, readBack.data(),
+								info->kernelCompleted ? 1 : 0,
+								info->kernelCompleted ? &info->kernelCompleted : nullptr,
+								&readCompleted) == CL_SUCCESS && queue->flush() == CL_SUCCESS
+								&& clWaitForEvents(1, &readCompleted) == CL_SUCCESS;
+						Util::ReleaseEvent(readCompleted);
+					}
+					if (!read) {
+						std::cerr << "Failed to read back " << info->fileName << std::endl;
+						info->valid = false;
+					}
+					frameData = readBack.data();
+					sizeOut = rawSize;
+				}
+			}
+			if (measureQuality && info->valid && psnr < 0) {
+				const uint8_t *pixels = frameData;
+				if (compressed) {
+					readBack.resize((size_t) info->outputWidth * info->outputHeight * bps_out);
+					if (tileDecoder->decode(frameData, sizeOut, info->outputWidth, info->outputHeight,
+							bps_out, readBack.data(), (size_t) info->outputWidth * bps_out))
+						pixels = readBack.data();
+					else
+						pixels = nullptr;
+				}
+				if (pixels)
+					psnr = syntheticPsnr(pixels, info->outputWidth, info->outputHeight, bps_out);
+			}
+			FrameStats statsOut;
+			if (info->valid && frameStats && statsOut.parse(info->stats.data())) {
+				statsFrames++;
+				statsLuma += statsOut.meanLuma;
+				statsSharpness += statsOut.sharpness;
+				statsGain[0] += statsOut.gain[0];
+				statsGain[1] += statsOut.gain[2];
+				if (statsFile && !statsOut.writeCsv(statsFile, info->fileName))
+					std::cerr << "Failed to write statistics of " << info->fileName << std::endl;
+			}
+			// raw frames are copied straight into the mapped store and ring,
+			// or discarded by the null sink. Compressed frames are decoded
+			// straight into the store and ring
+			if (info->valid && rawOut) {
+				bool written = rawSink.write(info->fileName, frameData, sizeOut,
+						info->outputWidth, info->outputHeight, compressed);
+				depthController.frameCompleted();
+				frameDone(info->fileName, info->arrival, info->tag, written);
+			}
+			bool encode = info->valid && !rawOut;
+			// only the packed bitstream of a JPEG frame is copied
+			if (encode && jpeg) {
+				sizeOut = JpegWriter::packedSize(info->deviceToHost->hostBuffer, sizeOut);
+				if (!sizeOut) {
+					std::cerr << "Failed to encode " << info->fileName
+							<< ": JPEG bitstream exceeds device buffers" << std::endl;
+					encode = false;
+				}
+			}
+			std::vector<uint8_t> *buf = nullptr;
+			bool haveBuffer = false;
+			if (encode) {
+				waitStart = clock::now();
+				haveBuffer = availableBuffers.waitAndPop(buf);
+				depthController.addEncodeWait(clock::now() - waitStart);
+			}
+			if (haveBuffer) {
+				buf->resize(sizeOut);
+				memcpy(buf->data(), frameData, sizeOut);
+				depthController.frameCompleted();
+				{
+					std::lock_guard<std::mutex> lk(postMutex);
+					postPending++;
+				}
+				auto fileName = info->fileName;
+				auto arrival = info->arrival;
+				uint32_t width = info->outputWidth;
+				uint32_t height = info->outputHeight;
+				uint64_t sequence = info->sequence;
+				uint64_t tag = info->tag;
+				auto evt = [buf, &availableBuffers, fileName, arrival, width, height, tag,
+#ifndef _WIN32
+							&stream,
+#endif
+							sequence, &skipStream, &encodedSink, &frameDone, &postCondition, &postMutex,
+							&postPending, &tileDecoder, compressed, bps_out] {
+					bool written = false;
+					const uint8_t *frame = buf->data();
+					size_t frameLen = buf->size();
+					static thread_local std::vector<uint8_t> decoded;
+					bool valid = true;
+					if (compressed) {
+						decoded.resize((size_t) width * height * bps_out);
+						valid = tileDecoder->decode(frame, frameLen, width, height, bps_out,
+								decoded.data(), (size_t) width * bps_out);
+						frame = decoded.data();
+						frameLen = decoded.size();
+					}
+					// a frame the stream cannot take is skipped by push()
+					if (!valid)
+						skipStream(sequence);
+#ifndef _WIN32
+					else if (stream)
+						written = stream->push(sequence, frame, width, height);
+#endif
+					else
+						written = encodedSink.write(fileName, frame, frameLen, width, height);
+					if (!written)
+						std::cerr << "Failed to write " << fileName << std::endl;
 					availableBuffers.push(buf);
-					if (++postCount == numImages){
-						std::lock_guard<std::mutex> lk(postMutex);
+					frameDone(fileName, arrival, tag, written);
+					std::lock_guard<std::mutex> lk(postMutex);
+					if (--postPending == 0)
 						postCondition.notify_one();
-					}
 				};
 				postProcPool->enqueue(evt);
-			} else {
-				std::cout << "mappedDeviceToHostQueue failed" << std::endl;
+			}
+			// frame that will not be written: report it to its source
+			if (!haveBuffer && !(info->valid && rawOut) && info->sequence != UINT64_MAX) {
+				skipStream(info->sequence);
+				frameSource->completed(info->tag, false, 0);
 			}
 			// trigger unmap, allowing next kernel to proceed
 			Util::SetEventComplete(info->deviceToHost->triggerMemUnmap);
@@ -363,30 +2175,111 @@ template<typename M, typename A> int Debayer<M, A>::debayer(int argc,
 			// cleanup
 			delete info->prev;
 			info->prev = nullptr;
-			if (++pullCount == numImages){
-				break;
-			}
+			if (info->last)
+				liveSlots--;
 		}
 	});
-	std::unique_lock<std::mutex> lk(postMutex);
-	postCondition.wait(lk);
+	pushImages.join();
+	pullImages.join();
+	if (statsFile)
+		fclose(statsFile);
+	{
+		std::unique_lock<std::mutex> lk(postMutex);
+		postCondition.wait(lk, [&postPending] {return postPending == 0;});
+	}
+#ifndef _WIN32
+	if (io)
+		io->drain();
+#endif
+#ifdef __linux__
+	ring.close();
+#endif
+#ifndef _WIN32
+	if (stream)
+		stream->close(framesSequenced);
+#endif
 	auto finish = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> elapsed = finish - start;
 
 	// cleanup
-	pushImages.join();
-	pullImages.join();
+	stopSource();
+	decoder.stop();
 	delete postProcPool;
-	for (int i = 0; i < numPostProcBuffers; ++i)
-		delete[] postProcBuffers[i];
-	for (int i = 0; i < numCLBuffers; ++i) {
-		deviceToHost[i]->unmap(0, nullptr, nullptr);
-		delete currentJobInfo[i]->prev;
-		delete currentJobInfo[i];
+	if (jpegTables)
+		clReleaseMemObject(jpegTables);
+	if (shadingMap)
+		clReleaseMemObject(shadingMap);
+	history.release();
+	dev->getTransferQueuePool()->finish();
+	dev->getComputeQueuePool()->finish();
+	for (auto &slot : slots) {
+		if (slot->currentJobInfo)
+			delete slot->currentJobInfo->prev;
+		delete slot->currentJobInfo;
+		delete slot->prevJobInfo;
 	}
-	delete arch;
-	fprintf(stdout, "opencl processing time per image = %f ms\n",
-			(elapsed.count() * 1000) / (double) numImages);
+	auto numImages = latency.count();
+	if (numImages)
+		fprintf(stdout, "opencl processing time per image = %f ms\n",
+				(elapsed.count() * 1000) / (double) numImages);
+	latency.print();
+	// readback saved by compression, over frames that fit their buffer
+	double compressionRatio = compressedBytes ?
+			uncompressedBytes / (double) compressedBytes : 1.0;
+	if (compress)
+		fprintf(stdout, "device compression: ratio = %f, frames = %llu, uncompressed fallbacks = %llu, "
+				"readback buffer = %zu of %zu bytes\n", compressionRatio,
+				(unsigned long long) compressedFrames.load(),
+				(unsigned long long) compressFallbacks.load(), frameSizeOut,
+				(size_t) outputWidth * outputHeight * bps_out);
+	if (psnr >= 0)
+		fprintf(stdout, "demosaic quality: %s, psnr = %f dB\n",
+				demosaicName(defaultDemosaic), psnr);
+	double meanSharpness = statsFrames ? statsSharpness / statsFrames : -1;
+	if (statsFrames)
+		fprintf(stdout, "frame statistics: frames = %llu, mean luma = %f, "
+				"white balance gains r = %f, b = %f, sharpness = %f\n",
+				(unsigned long long) statsFrames, statsLuma / statsFrames,
+				statsGain[0] / statsFrames, statsGain[1] / statsFrames, meanSharpness);
+	LatencyStats::Summary summary;
+	if (reportArg.isSet() && latency.summarize(summary)) {
+		BenchReport report;
+		report.add("memory", std::string(std::is_same<M, DualBufferOCL>::value ? "buffer" : "image"));
+		report.add("source", std::string(synthetic ? "synthetic" : "files"));
+		report.add("sink", std::string(nullOutput ? "null" : useStream ? "stream" :
+				useRing ? "ring" : useStore ? "store" : "png"));
+		report.add("width", bufferWidth);
+		report.add("height", bufferHeight);
+		report.add("frames", numImages);
+		report.add("in_flight", numSlots);
+		report.add("compute_queues", dev->getComputeQueuePool()->size());
+		report.add("decode_workers", decodeWorkers);
+		report.add("encode_threads", encodeThreads);
+		report.add("demosaic", std::string(demosaicName(defaultDemosaic)));
+		report.add("preview", previewBin);
+		report.add("stats", std::string(statsOnly ? "only" : frameStats ? "on" : "off"));
+		report.add("sharpness", meanSharpness);
+		report.add("bayer_correct", std::string(bayerCorrect ? "on" : "off"));
+		report.add("denoise_sigma", denoiseSigma);
+		report.add("temporal_depth", history.depth);
+		report.add("psnr_db", psnr);
+		report.add("compress", std::string(compress ? "tile" : "off"));
+		report.add("compression_ratio", compressionRatio);
+		report.add("fps", numImages / elapsed.count());
+		report.add("ms_per_frame", (elapsed.count() * 1000) / (double) numImages);
+		report.add("latency_mean_ms", summary.mean);
+		report.add("latency_p50_ms", summary.p50);
+		report.add("latency_p95_ms", summary.p95);
+		report.add("latency_p99_ms", summary.p99);
+		report.add("latency_max_ms", summary.max);
+		if (!report.append(reportArg.getValue()))
+			std::cerr << "Failed to write report " << reportArg.getValue() << std::endl;
+	}
+	if (autoDecodeWorkers)
+		fprintf(stdout, "decode workers: final = %zu\n", decoder.getActiveWorkers());
+	if (adaptive)
+		fprintf(stdout, "in-flight frames: final = %zu, allocated = %zu\n",
+				depthController.getDepth(), slots.size());
 
 	return 0;
 }
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#define TCLAP_NAMESTARTSTRING "-"
+#include "tclap/CmdLine.h"
+using namespace TCLAP;
+
+// split comma separated list
+static std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+#ifndef _WIN32
+// run debayer binary with arguments, and wait for it to exit
+static bool runDebayer(const std::vector<std::string> &args) {
+	std::vector<char*> argv;
+	for (auto &a : args)
+		argv.push_back((char*) a.c_str());
+	argv.push_back(nullptr);
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		execv(argv[0], argv.data());
+		perror(argv[0]);
+		_exit(127);
+	}
+	int status = 0;
+	if (waitpid(pid, &status, 0) < 0)
+		return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#endif
+
+// Sweep the debayer pipeline over frame size, in-flight frames, compute
+// queues, decode workers, encode threads, memory type, device compression
+// (buffers only) and demosaic algorithm, or binned preview. Each configuration
+// runs the debayer_buffer or debayer_image binary, found next to this one,
+// on synthetic frames with a null sink, and appends its throughput, latency
+// percentiles and demosaic PSNR against the generated scene to the report
+// file (CSV for .csv, else JSON lines)
+int main(int argc, char *argv[]) {
+	CmdLine cmd("debayer pipeline benchmark", ' ', "v1.0");
+
+	ValueArg<std::string> sizesArg("s", "sizes", "Frame Sizes (WxH,...)", false,
+			"1920x1080,3840x2160", "string", cmd);
+
+	ValueArg<std::string> inFlightArg("n", "in-flight", "Numbers of In-Flight Frames (...)", false,
+			"2,4,8", "string", cmd);
+
+	ValueArg<std::string> computeQueuesArg("c", "compute-queues", "Numbers of Compute Queues (0 for device default)", false,
+			"0", "string", cmd);
+
+	ValueArg<std::string> decodeWorkersArg("w", "decode-workers", "Numbers of Decode Workers (0 for automatic)", false,
+			"0", "string", cmd);
+
+	ValueArg<std::string> encodeThreadsArg("e", "encode-threads", "Numbers of Encode Threads (0 for hardware threads)", false,
+			"0", "string", cmd);
+
+	ValueArg<std::string> memoryArg("m", "memory", "Memory Types {buffer,image}", false,
+			"buffer,image", "string", cmd);
+
+	ValueArg<std::string> demosaicArg("a", "demosaic", "Demosaic Algorithms {bilinear,mhc,edge}, Or Binned Previews {preview2,preview4}", false,
+			"mhc", "string", cmd);
+
+	ValueArg<std::string> compressArg("z", "compress", "Device Compression Before Readback {off,on} (buffers only)", false,
+			"off", "string", cmd);
+
+	ValueArg<uint64_t> framesArg("f", "frames", "Frames Per Run", false,
+			200, "uint64_t", cmd);
+
+	ValueArg<int> deviceArg("d", "device", "OpenCL Device Index", false,
+			0, "integer", cmd);
+
+	SwitchArg pngArg("p", "png", "Encode PNG Frames To Output Directory Instead Of Discarding Them", cmd);
+
+	ValueArg<std::string> outputDirArg("o", "output-dir", "Output Image Directory (with --png)", false,
+			".", "string", cmd);
+
+	ValueArg<std::string> reportArg("r", "report", "Report File (.csv, else JSON lines)", false,
+			"debayer_bench.csv", "string", cmd);
+
+	cmd.parse(argc, argv);
+
+#ifdef _WIN32
+	std::cerr << "Benchmark is not supported on this platform" << std::endl;
+	return -1;
+#else
+	std::string binDir = argv[0];
+	size_t slash = binDir.find_last_of('/');
+	binDir = slash == std::string::npos ? "." : binDir.substr(0, slash);
+
+	auto sizes = splitList(sizesArg.getValue());
+	auto inFlight = splitList(inFlightArg.getValue());
+	auto computeQueues = splitList(computeQueuesArg.getValue());
+	auto decodeWorkers = splitList(decodeWorkersArg.getValue());
+	auto encodeThreads = splitList(encodeThreadsArg.getValue());
+	auto memory = splitList(memoryArg.getValue());
+	for (auto &m : memory) {
+		if (m != "buffer" && m != "image") {
+			std::cerr << "Unrecognized memory type " << m << std::endl;
+			return -1;
+		}
+	}
+	auto demosaic = splitList(demosaicArg.getValue());
+	for (auto &a : demosaic) {
+		if (a != "bilinear" && a != "mhc" && a != "edge" && a != "preview2"
+				&& a != "preview4") {
+			std::cerr << "Unrecognized demosaic algorithm " << a << std::endl;
+			return -1;
+		}
+	}
+	auto compress = splitList(compressArg.getValue());
+	for (auto &z : compress) {
+		if (z != "off" && z != "on") {
+			std::cerr << "Unrecognized compression setting " << z << std::endl;
+			return -1;
+		}
+	}
+	// images are never compressed
+	size_t compressOff = 0;
+	for (auto &z : compress)
+		compressOff += z == "off" ? 1 : 0;
+	size_t memoryRuns = 0;
+	for (auto &m : memory)
+		memoryRuns += m == "buffer" ? compress.size() : compressOff;
+	size_t runs = sizes.size() * inFlight.size() * computeQueues.size()
+			* decodeWorkers.size() * encodeThreads.size() * memoryRuns * demosaic.size();
+	if (!runs) {
+		std::cerr << "Nothing to run" << std::endl;
+		return -1;
+	}
+
+	size_t run = 0, failed = 0;
+	for (auto &a : demosaic) {
+		for (auto &m : memory) {
+			for (auto &size : sizes) {
+				for (auto &n : inFlight) {
+					for (auto &c : computeQueues) {
+						for (auto &w : decodeWorkers) {
+							for (auto &e : encodeThreads) {
+								for (auto &z : compress) {
+									if (z == "on" && m != "buffer")
+										continue;
+									std::vector<std::string> args = { binDir + "/debayer_" + m,
+											"--synthetic", size,
+											"--frames", std::to_string(framesArg.getValue()),
+											"--device", std::to_string(deviceArg.getValue()),
+											"-n", n, "-w", w, "--encode-threads", e,
+											"--report", reportArg.getValue() };
+									// preview replaces demosaic, and has no quality measure
+									if (a.compare(0, 7, "preview") == 0) {
+										args.push_back("--preview");
+										args.push_back(a.substr(7));
+									} else {
+										args.push_back("--demosaic");
+										args.push_back(a);
+										args.push_back("--quality");
+									}
+									if (c != "0") {
+										args.push_back("-c");
+										args.push_back(c);
+									}
+									if (z == "on")
+										args.push_back("--compress");
+									if (pngArg.isSet()) {
+										args.push_back("-o");
+										args.push_back(outputDirArg.getValue());
+									} else {
+										args.push_back("--null-output");
+									}
+									fprintf(stdout, "run %zu/%zu: memory = %s, size = %s, in-flight = %s, "
+											"compute queues = %s, decode workers = %s, encode threads = %s, "
+											"compress = %s, demosaic = %s\n",
+											++run, runs, m.c_str(), size.c_str(), n.c_str(),
+											c.c_str(), w.c_str(), e.c_str(), z.c_str(), a.c_str());
+									fflush(stdout);
+									if (!runDebayer(args)) {
+										std::cerr << "Run " << run << " failed" << std::endl;
+										failed++;
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	fprintf(stdout, "%zu runs, %zu failed, results appended to %s\n", runs, failed,
+			reportArg.getValue().c_str());
+
+	return failed ? -1 : 0;
+#endif
+}
@@ -0,0 +1,554 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+/*
+ * Based on:
+ *  "HIGH-QUALITY LINEAR INTERPOLATION FOR DEMOSAICING OF BAYER-PATTERNED COLOR IMAGES"
+ *  Henrique S. Malvar, Li-wei He, and Ross Cutler, 2004
+ * And http://www.ipol.im/pub/art/2011/g_mhcd/
+ *
+ * Copyright 2015 Jason Newton <nevion@gmail.com>
+ *
+ *Permission is hereby granted, free of charge, to any person obtaining a copy
+ *of this software and associated documentation files (the "Software"), to deal
+ *in the Software without restriction, including without limitation the rights
+ *to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *copies of the Software, and to permit persons to whom the Software is
+ *furnished to do so, subject to the following conditions:
+ *
+ *The above copyright notice and this permission notice shall be included in all
+ *copies or substantial portions of the Software.
+ *
+ *THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *SOFTWARE.
+*/
+
+// Demosaic kernels, shared by buffer and image variants, from fastest to
+// highest quality:
+//
+// bilinear_demosaic: averages of nearest samples of each channel
+// malvar_he_cutler_demosaic: linear 5x5 filters with gradient correction
+// edge_directed_demosaic: Hamilton-Adams green, interpolated along the
+// direction of smaller gradient, then red and blue from colour differences,
+// along the smaller diagonal gradient at red and blue sites
+//
+// binned_preview skips demosaic altogether, and emits one pixel per bin x bin
+// block of Bayer samples, averaging the block's 2x2 quads.
+//
+// Each work group handles a tile of TILE_COLS x TILE_ROWS pixels. It first
+// fills an apron of levelled Bayer samples, covering the tile and a border
+// as wide as the kernel's reach, into LDS; every pixel is then interpolated
+// from LDS. All kernels take the same arguments.
+//
+// The including file defines the memory access of its variant:
+// INPUT_IMAGE_ARG and OUTPUT_IMAGE_ARG kernel arguments, input_pixel(r, c)
+// reading a Bayer sample with reflection at image borders, and
+// store_output_pixel(r, c, R, G, B) writing an output pixel.
+//
+// Built with BAYER_CORRECT, all kernels take a lens shading map and a defect
+// threshold after their other arguments, and correct Bayer samples as they
+// are loaded: defective samples are replaced, then black level, shading gain
+// and white level are applied in one step.
+//
+// Built with FRAME_STATS, the demosaic kernels take a frame_stats buffer,
+// zeroed before launch, as their last argument, and accumulate per-frame
+// statistics into it, laid out as in FrameStats.h. Each work group
+// accumulates into LDS with atomics, then adds its non-zero words to the
+// frame's buffer.
+
+#ifndef OUTPUT_CHANNELS
+#define OUTPUT_CHANNELS 3
+#endif
+
+#ifndef ALPHA_VALUE
+#define ALPHA_VALUE UCHAR_MAX
+#endif
+
+#ifndef PIXELT
+#define PIXELT uchar
+#endif
+
+#ifndef RGBPIXELBASET
+#define RGBPIXELBASET PIXELT
+#endif
+
+#ifndef RGBPIXELT
+#define RGBPIXELT PASTE(RGBPIXELBASET, OUTPUT_CHANNELS)
+#endif
+#ifndef LDSPIXELT
+#define LDSPIXELT int
+#endif
+
+typedef PIXELT PixelT;
+typedef RGBPIXELBASET RGBPixelBaseT;
+typedef RGBPIXELT RGBPixelT;
+typedef LDSPIXELT LDSPixelT;// for LDS's, having this large enough to prevent bank conflicts make's a large difference
+#define kernel_size 5
+
+#define tile_rows TILE_ROWS
+#define tile_cols TILE_COLS
+#define apron_rows (tile_rows + kernel_size - 1)
+#define apron_cols (tile_cols + kernel_size - 1)
+
+#define half_ksize  (kernel_size/2)
+#define shalf_ksize ((int) half_ksize)
+#define half_ksize_rem (kernel_size - half_ksize)
+#define n_apron_fill_tasks (apron_rows * apron_cols)
+#define n_tile_pixels  (tile_rows * tile_cols)
+
+#define apron_pixel(_t_r, _t_c) apron[(_t_r)][(_t_c)]
+
+#define output_pixel_cast(x) PASTE3(convert_,RGBPIXELBASET,_sat)((x))
+
+// subtract black level and stretch to white level;
+// level_gain is fixed point with 12 fractional bits
+#define level_pixel(x) min((max((int)(x) - black_level, 0) * level_gain + 2048) >> 12, 255)
+
+enum pattern_t{
+    RGGB = 0,
+    GRBG = 1,
+    GBRG = 2,
+    BGGR = 3
+};
+
+// work group's tile, and work item's position in tile and image
+#define declare_tile_ids() \
+    const uint tile_col_blocksize = get_local_size(0); \
+    const uint tile_row_blocksize = get_local_size(1); \
+    const uint tile_col_block = get_group_id(0) + get_global_offset(0) / tile_col_blocksize; \
+    const uint tile_row_block = get_group_id(1) + get_global_offset(1) / tile_row_blocksize; \
+    const uint tile_col = get_local_id(0); \
+    const uint tile_row = get_local_id(1); \
+    const uint g_c = get_global_id(0); \
+    const uint g_r = get_global_id(1); \
+    const bool valid_pixel_task = (g_r < im_rows) & (g_c < im_cols); \
+    const uint tile_flat_id = tile_row * tile_cols + tile_col
+
+// fill _apron, of _rows x _cols samples, with the tile and a border
+// of _half samples around it
+#define fill_apron(_apron, _rows, _cols, _half) \
+    for(uint apron_fill_task_id = tile_flat_id; apron_fill_task_id < (_rows) * (_cols); apron_fill_task_id += n_tile_pixels){ \
+        const uint apron_read_row = apron_fill_task_id / (_cols); \
+        const uint apron_read_col = apron_fill_task_id % (_cols); \
+        const int ag_c = ((int)(apron_read_col + tile_col_block * tile_col_blocksize)) - (int)(_half); \
+        const int ag_r = ((int)(apron_read_row + tile_row_block * tile_row_blocksize)) - (int)(_half); \
+        _apron[apron_read_row][apron_read_col] = load_pixel(ag_r, ag_c); \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE)
+
+//RGGB -> RedXY = (0, 0), GreenXY1 = (1, 0), GreenXY2 = (0, 1), BlueXY = (1, 1)
+//GRBG -> RedXY = (1, 0), GreenXY1 = (0, 0), GreenXY2 = (1, 1), BlueXY = (0, 1)
+//GBRG -> RedXY = (0, 1), GreenXY1 = (0, 0), GreenXY2 = (1, 1), BlueXY = (1, 0)
+//BGGR -> RedXY = (1, 1), GreenXY1 = (1, 0), GreenXY2 = (0, 1), BlueXY = (0, 0)
+#define is_rggb (bayer_pattern == RGGB)
+#define is_grbg (bayer_pattern == GRBG)
+#define is_gbrg (bayer_pattern == GBRG)
+#define is_bggr (bayer_pattern == BGGR)
+
+// colour of the Bayer site at image row _r, column _c
+#define declare_bayer_site(_r, _c) \
+    const int r_mod_2 = (_r) & 1; \
+    const int c_mod_2 = (_c) & 1; \
+    const int red_col = is_grbg | is_bggr; \
+    const int red_row = is_gbrg | is_bggr; \
+    const int blue_col = 1 - red_col; \
+    const int blue_row = 1 - red_row; \
+    const int in_red_row = r_mod_2 == red_row; \
+    const int in_blue_row = r_mod_2 == blue_row; \
+    const int is_red_pixel = (r_mod_2 == red_row) & (c_mod_2 == red_col); \
+    const int is_blue_pixel = (r_mod_2 == blue_row) & (c_mod_2 == blue_col); \
+    const int is_green_pixel = !(is_red_pixel | is_blue_pixel); \
+    assert(is_green_pixel + is_blue_pixel + is_red_pixel == 1); \
+    assert(in_red_row + in_blue_row == 1)
+
+#ifdef FRAME_STATS
+// 256 bin histograms of output R, G and B, then 64 bit sums, as (lo, hi)
+// words, of R, G, B, of the squared Laplacian of levelled Bayer samples
+// of the pixel's colour, and of pixels
+#define stats_bins 256
+#define stats_sums 5
+#define stats_group_words (3 * stats_bins + stats_sums)
+#define FRAME_STATS_ARG , __global uint *frame_stats
+
+// 64 bit atomic add, carrying into the high word
+INLINE void stats_add64(__global uint *p, const uint v){
+    const uint old = atomic_add(p, v);
+    if(old + v < old)
+        atomic_inc(p + 1);
+}
+
+// declare and zero the work group's statistics; the apron fill's barrier
+// orders zeroing before accumulation
+#define declare_frame_stats() \
+    __local uint group_stats[stats_group_words]; \
+    for(uint stats_task_id = tile_flat_id; stats_task_id < stats_group_words; stats_task_id += n_tile_pixels) \
+        group_stats[stats_task_id] = 0
+
+// accumulate pixel R, G, B and the Laplacian at _apron[_a_r][_a_c], which
+// needs an apron of at least two samples, then add the work group's
+// statistics to the frame's
+#define accumulate_frame_stats(_apron, _a_r, _a_c, R, G, B) \
+    if(valid_pixel_task){ \
+        const int lap = 4*_apron[(_a_r)][(_a_c)] - _apron[(_a_r)-2][(_a_c)] - _apron[(_a_r)+2][(_a_c)] \
+                      - _apron[(_a_r)][(_a_c)-2] - _apron[(_a_r)][(_a_c)+2]; \
+        atomic_inc(&group_stats[(uint)(R)]); \
+        atomic_inc(&group_stats[stats_bins + (uint)(G)]); \
+        atomic_inc(&group_stats[2 * stats_bins + (uint)(B)]); \
+        atomic_add(&group_stats[3 * stats_bins], (uint)(R)); \
+        atomic_add(&group_stats[3 * stats_bins + 1], (uint)(G)); \
+        atomic_add(&group_stats[3 * stats_bins + 2], (uint)(B)); \
+        atomic_add(&group_stats[3 * stats_bins + 3], (uint)(lap * lap)); \
+        atomic_inc(&group_stats[3 * stats_bins + 4]); \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for(uint stats_task_id = tile_flat_id; stats_task_id < 3 * stats_bins; stats_task_id += n_tile_pixels){ \
+        if(group_stats[stats_task_id]) \
+            atomic_add(&frame_stats[stats_task_id], group_stats[stats_task_id]); \
+    } \
+    if(tile_flat_id < stats_sums) \
+        stats_add64(frame_stats + 3 * stats_bins + 2 * tile_flat_id, group_stats[3 * stats_bins + tile_flat_id])
+#else
+#define FRAME_STATS_ARG
+#define declare_frame_stats()
+#define accumulate_frame_stats(_apron, _a_r, _a_c, R, G, B)
+#endif
+
+// Bayer site at image row _r, column _c is green
+INLINE int bayer_is_green(const int bayer_pattern, const int r, const int c){
+    const int red_col = is_grbg | is_bggr;
+    const int red_row = is_gbrg | is_bggr;
+    return ((r & 1) == red_row) != ((c & 1) == red_col);
+}
+
+#ifdef BAYER_CORRECT
+#define BAYER_CORRECT_ARG , READ_ONLY_IMAGE2D shading_map, const int defect_threshold
+
+// shading map holds gains of red, green in red rows, green in blue rows and
+// blue sites in x, y, z and w, bilinearly interpolated across the frame
+CONSTANT sampler_t shading_sampler = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+INLINE float shading_gain(READ_ONLY_IMAGE2D shading_map, const int bayer_pattern,
+    const uint im_rows, const uint im_cols, const int r, const int c){
+    const int red_col = is_grbg | is_bggr;
+    const int red_row = is_gbrg | is_bggr;
+    const int site = (((r & 1) != red_row) << 1) | ((c & 1) != red_col);
+    const float4 gains = read_imagef(shading_map, shading_sampler,
+        (float2)((c + 0.5f) / im_cols, (r + 0.5f) / im_rows));
+    return site == 0 ? gains.x : (site == 1 ? gains.y : (site == 2 ? gains.z : gains.w));
+}
+
+// a sample beyond the range of its four same-colour neighbours by more
+// than threshold is replaced by their median
+INLINE int defect_corrected(const int x, const int n0, const int n1, const int n2, const int n3,
+    const int threshold){
+    const int lo = min(min(n0, n1), min(n2, n3));
+    const int hi = max(max(n0, n1), max(n2, n3));
+    const int median = (n0 + n1 + n2 + n3 - lo - hi + 1) / 2;
+    return ((x > hi + threshold) | (x < lo - threshold)) ? median : x;
+}
+
+// same-colour neighbours are two samples away, and mostly already cached
+// by the work group's neighbouring reads
+#define defect_pixel(r, c) (defect_threshold > 0 ? \
+    defect_corrected(input_pixel((r), (c)), input_pixel((r) - 2, (c)), input_pixel((r) + 2, (c)), \
+        input_pixel((r), (c) - 2), input_pixel((r), (c) + 2), defect_threshold) : \
+    (int)input_pixel((r), (c)))
+#define shade_pixel(x, gain) min(((int)((float)(max((int)(x) - black_level, 0) * level_gain) * (gain)) + 2048) >> 12, 255)
+#define load_pixel(r, c) shade_pixel(defect_pixel((r), (c)), \
+    shading_gain(shading_map, bayer_pattern, im_rows, im_cols, (r), (c)))
+#else
+#define BAYER_CORRECT_ARG
+#define load_pixel(r, c) level_pixel(input_pixel((r), (c)))
+#endif
+
+//fast tier: each missing channel is the average of its nearest samples.
+//Statistics widen the apron to the Laplacian's reach
+#ifdef FRAME_STATS
+#define bl_half 2
+#else
+#define bl_half 1
+#endif
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void bilinear_demosaic(const uint im_rows, const uint im_cols,
+    INPUT_IMAGE_ARG, const uint input_image_pitch, OUTPUT_IMAGE_ARG, const uint output_image_pitch, const int bayer_pattern,
+    const int black_level, const int level_gain FRAME_STATS_ARG BAYER_CORRECT_ARG){
+    declare_tile_ids();
+
+    #define bl_apron_rows (tile_rows + 2 * bl_half)
+    #define bl_apron_cols (tile_cols + 2 * bl_half)
+    __local LDSPixelT apron[bl_apron_rows][bl_apron_cols];
+    declare_frame_stats();
+    fill_apron(apron, bl_apron_rows, bl_apron_cols, bl_half);
+
+    const uint i = tile_col + bl_half;
+    const uint j = tile_row + bl_half;
+    #define F(_i, _j) apron_pixel((_j), (_i))
+
+    const int Fij = F(i,j);
+    const int cross = (F(i-1,j) + F(i+1,j) + F(i,j-1) + F(i,j+1) + 2) / 4;
+    const int diagonal = (F(i-1,j-1) + F(i+1,j-1) + F(i-1,j+1) + F(i+1,j+1) + 2) / 4;
+    const int horizontal = (F(i-1,j) + F(i+1,j) + 1) / 2;
+    const int vertical = (F(i,j-1) + F(i,j+1) + 1) / 2;
+    #undef F
+
+    declare_bayer_site(g_r, g_c);
+
+    //at G in red rows, red neighbours are left and right, blue neighbours above and below
+    const RGBPixelBaseT R = output_pixel_cast(
+        Fij * is_red_pixel +
+        diagonal * is_blue_pixel +
+        horizontal * (is_green_pixel & in_red_row) +
+        vertical * (is_green_pixel & in_blue_row)
+    );
+    const RGBPixelBaseT B = output_pixel_cast(
+        Fij * is_blue_pixel +
+        diagonal * is_red_pixel +
+        vertical * (is_green_pixel & in_red_row) +
+        horizontal * (is_green_pixel & in_blue_row)
+    );
+    const RGBPixelBaseT G = output_pixel_cast(Fij * is_green_pixel + cross * (!is_green_pixel));
+
+    accumulate_frame_stats(apron, j, i, R, G, B);
+    if(valid_pixel_task){
+        store_output_pixel(g_r, g_c, R, G, B);
+    }
+}
+
+//this version takes a tile (z=1) and each tile job does 4 line median sorts
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void malvar_he_cutler_demosaic(const uint im_rows, const uint im_cols,
+    INPUT_IMAGE_ARG, const uint input_image_pitch, OUTPUT_IMAGE_ARG, const uint output_image_pitch, const int bayer_pattern,
+    const int black_level, const int level_gain FRAME_STATS_ARG BAYER_CORRECT_ARG){
+    declare_tile_ids();
+
+    __local LDSPixelT apron[apron_rows][apron_cols];
+    declare_frame_stats();
+    fill_apron(apron, apron_rows, apron_cols, half_ksize);
+    
+    //valid tasks read from [half_ksize, (tile_rows|tile_cols) + kernel_size - 1)
+    const uint a_c = tile_col + half_ksize;
+    const uint a_r = tile_row + half_ksize;
+    assert_val(a_c >= half_ksize && a_c < apron_cols - half_ksize, a_c);
+    assert_val(a_r >= half_ksize && a_r < apron_rows - half_ksize, a_r);
+
+    //note the following formulas are col, row convention and uses i,j - this is done to preserve readability with the originating paper
+    const uint i = a_c;
+    const uint j = a_r;
+    #define F(_i, _j) apron_pixel((_j), (_i))
+
+    const int Fij = F(i,j);
+    //symmetric 4,2,-1 response - cross
+    const int R1 = (4*F(i, j) + 2*(F(i-1,j) + F(i,j-1) + F(i+1,j) + F(i,j+1)) - F(i-2,j) - F(i+2,j) - F(i,j-2) - F(i,j+2)) / 8;
+
+    //left-right symmetric response - with .5,1,4,5 - theta
+    const int R2 = (
+       8*(F(i-1,j) + F(i+1,j))
+      +10*F(i,j)
+      + F(i,j-2) + F(i,j+2)
+      - 2*((F(i-1,j-1) + F(i+1,j-1) + F(i-1,j+1) + F(i+1,j+1)) + F(i-2,j) + F(i+2,j))
+    ) / 16;
+
+    //top-bottom symmetric response - with .5,1,4,5 - phi
+    const int R3 = (
+        8*(F(i,j-1) + F(i,j+1))
+       +10*F(i,j)
+       + F(i-2,j) + F(i+2,j)
+       - 2*((F(i-1,j-1) + F(i+1,j-1) + F(i-1,j+1) + F(i+1,j+1)) + F(i,j-2) + F(i,j+2))
+    ) / 16;
+    //symmetric 3/2s response - checker
+    const int R4 = (
+         12*F(i,j)
+        - 3*(F(i-2,j) + F(i+2,j) + F(i,j-2) + F(i,j+2))
+        + 4*(F(i-1,j-1) + F(i+1,j-1) + F(i-1,j+1) + F(i+1,j+1))
+    ) / 16;
+
+    const int G_at_red_or_blue = R1;
+    const int R_at_G_in_red = R2;
+    const int B_at_G_in_blue = R2;
+    const int R_at_G_in_blue = R3;
+    const int B_at_G_in_red = R3;
+    const int R_at_B = R4;
+    const int B_at_R = R4;
+
+    #undef F
+    #undef j
+    #undef i
+    declare_bayer_site(g_r, g_c);
+
+    //at R locations: R is original
+    //at B locations it is the 3/2s symmetric response
+    //at G in red rows it is the left-right symmmetric with 4s
+    //at G in blue rows it is the top-bottom symmetric with 4s
+    const RGBPixelBaseT R = output_pixel_cast(
+        Fij * is_red_pixel +
+        R_at_B * is_blue_pixel +
+        R_at_G_in_red * (is_green_pixel & in_red_row) +
+        R_at_G_in_blue * (is_green_pixel & in_blue_row)
+    );
+    //at B locations: B is original
+    //at R locations it is the 3/2s symmetric response
+    //at G in red rows it is the top-bottom symmmetric with 4s
+    //at G in blue rows it is the left-right symmetric with 4s
+    const RGBPixelBaseT B = output_pixel_cast(
+        Fij * is_blue_pixel +
+        B_at_R * is_red_pixel +
+        B_at_G_in_red * (is_green_pixel & in_red_row) +
+        B_at_G_in_blue * (is_green_pixel & in_blue_row)
+    );
+    //at G locations: G is original
+    //at R locations: symmetric 4,2,-1
+    //at B locations: symmetric 4,2,-1
+    const RGBPixelBaseT G = output_pixel_cast(Fij * is_green_pixel + G_at_red_or_blue * (!is_green_pixel));
+    
+    accumulate_frame_stats(apron, a_r, a_c, R, G, B);
+    if(valid_pixel_task){
+        store_output_pixel(g_r, g_c, R, G, B);
+    }
+}
+
+//high quality tier: green is interpolated first, for the tile and a one pixel
+//border, into a second LDS plane, from a raw apron of three pixels around the tile
+#define ed_half 3
+#define ed_apron_rows (tile_rows + 2 * ed_half)
+#define ed_apron_cols (tile_cols + 2 * ed_half)
+#define ed_green_rows (tile_rows + 2)
+#define ed_green_cols (tile_cols + 2)
+
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void edge_directed_demosaic(const uint im_rows, const uint im_cols,
+    INPUT_IMAGE_ARG, const uint input_image_pitch, OUTPUT_IMAGE_ARG, const uint output_image_pitch, const int bayer_pattern,
+    const int black_level, const int level_gain FRAME_STATS_ARG BAYER_CORRECT_ARG){
+    declare_tile_ids();
+
+    __local LDSPixelT apron[ed_apron_rows][ed_apron_cols];
+    __local LDSPixelT green[ed_green_rows][ed_green_cols];
+    declare_frame_stats();
+    fill_apron(apron, ed_apron_rows, ed_apron_cols, ed_half);
+
+    #define F(_i, _j) apron_pixel((_j), (_i))
+    #define Gr(_i, _j) green[(_j)][(_i)]
+
+    //green at red and blue sites: average of green neighbours, corrected by the
+    //second derivative of the site's colour, along the direction of smaller gradient
+    for(uint green_task_id = tile_flat_id; green_task_id < ed_green_rows * ed_green_cols; green_task_id += n_tile_pixels){
+        const uint green_row = green_task_id / ed_green_cols;
+        const uint green_col = green_task_id % ed_green_cols;
+        const uint i = green_col + ed_half - 1;
+        const uint j = green_row + ed_half - 1;
+        const int gi_r = (int)(tile_row_block * tile_row_blocksize + green_row) - 1;
+        const int gi_c = (int)(tile_col_block * tile_col_blocksize + green_col) - 1;
+        const int X = F(i,j);
+        int G = X;
+        if(!bayer_is_green(bayer_pattern, gi_r, gi_c)){
+            const int lap_h = 2*X - F(i-2,j) - F(i+2,j);
+            const int lap_v = 2*X - F(i,j-2) - F(i,j+2);
+            const int grad_h = abs(F(i-1,j) - F(i+1,j)) + abs(lap_h);
+            const int grad_v = abs(F(i,j-1) - F(i,j+1)) + abs(lap_v);
+            const int G_h = (2*(F(i-1,j) + F(i+1,j)) + lap_h) / 4;
+            const int G_v = (2*(F(i,j-1) + F(i,j+1)) + lap_v) / 4;
+            G = grad_h < grad_v ? G_h : (grad_v < grad_h ? G_v : (G_h + G_v) / 2);
+            G = clamp(G, 0, 255);
+        }
+        green[green_row][green_col] = G;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const uint i = tile_col + ed_half;
+    const uint j = tile_row + ed_half;
+    const uint gi = tile_col + 1;
+    const uint gj = tile_row + 1;
+    const int Fij = F(i,j);
+    const int Gij = Gr(gi,gj);
+
+    //colour differences of left and right, upper and lower, and diagonal neighbours
+    const int diff_h = (F(i-1,j) - Gr(gi-1,gj) + F(i+1,j) - Gr(gi+1,gj)) / 2;
+    const int diff_v = (F(i,j-1) - Gr(gi,gj-1) + F(i,j+1) - Gr(gi,gj+1)) / 2;
+    const int grad_d1 = abs(F(i-1,j-1) - F(i+1,j+1)) + abs(2*Gij - Gr(gi-1,gj-1) - Gr(gi+1,gj+1));
+    const int grad_d2 = abs(F(i+1,j-1) - F(i-1,j+1)) + abs(2*Gij - Gr(gi+1,gj-1) - Gr(gi-1,gj+1));
+    const int diff_d1 = (F(i-1,j-1) - Gr(gi-1,gj-1) + F(i+1,j+1) - Gr(gi+1,gj+1)) / 2;
+    const int diff_d2 = (F(i+1,j-1) - Gr(gi+1,gj-1) + F(i-1,j+1) - Gr(gi-1,gj+1)) / 2;
+    const int diff_d = grad_d1 < grad_d2 ? diff_d1 : (grad_d2 < grad_d1 ? diff_d2 : (diff_d1 + diff_d2) / 2);
+    #undef Gr
+    #undef F
+
+    declare_bayer_site(g_r, g_c);
+
+    const RGBPixelBaseT R = output_pixel_cast(
+        Fij * is_red_pixel +
+        (Gij + diff_d) * is_blue_pixel +
+        (Gij + diff_h) * (is_green_pixel & in_red_row) +
+        (Gij + diff_v) * (is_green_pixel & in_blue_row)
+    );
+    const RGBPixelBaseT B = output_pixel_cast(
+        Fij * is_blue_pixel +
+        (Gij + diff_d) * is_red_pixel +
+        (Gij + diff_v) * (is_green_pixel & in_red_row) +
+        (Gij + diff_h) * (is_green_pixel & in_blue_row)
+    );
+    const RGBPixelBaseT G = output_pixel_cast(Gij);
+
+    accumulate_frame_stats(apron, j, i, R, G, B);
+    if(valid_pixel_task){
+        store_output_pixel(g_r, g_c, R, G, B);
+    }
+}
+
+//preview: each work item bins (bin / 2) x (bin / 2) quads of the input into
+//one output pixel; output is (im_rows / bin) x (im_cols / bin) pixels.
+//No sample is read twice, so the input is read straight from global memory
+__kernel __attribute__((reqd_work_group_size(TILE_COLS, TILE_ROWS, 1)))
+void binned_preview(const uint im_rows, const uint im_cols,
+    INPUT_IMAGE_ARG, const uint input_image_pitch, OUTPUT_IMAGE_ARG, const uint output_image_pitch, const int bayer_pattern,
+    const int black_level, const int level_gain, const uint bin BAYER_CORRECT_ARG){
+    const uint g_c = get_global_id(0);
+    const uint g_r = get_global_id(1);
+    const uint out_rows = max(im_rows / bin, 1u);
+    const uint out_cols = max(im_cols / bin, 1u);
+    if((g_r >= out_rows) | (g_c >= out_cols))
+        return;
+
+    const int red_col = is_grbg | is_bggr;
+    const int red_row = is_gbrg | is_bggr;
+    const int blue_col = 1 - red_col;
+    const int blue_row = 1 - red_row;
+    const uint quads = max(bin / 2, 1u);
+    int sum_r = 0;
+    int sum_g = 0;
+    int sum_b = 0;
+    for(uint qy = 0; qy < quads; ++qy){
+        for(uint qx = 0; qx < quads; ++qx){
+            //samples beyond the image reflect back into it, keeping their colour
+            const int r0 = (int)(g_r * bin + 2 * qy);
+            const int c0 = (int)(g_c * bin + 2 * qx);
+            sum_r += load_pixel(r0 + red_row, c0 + red_col);
+            sum_b += load_pixel(r0 + blue_row, c0 + blue_col);
+            sum_g += load_pixel(r0 + red_row, c0 + blue_col)
+                   + load_pixel(r0 + blue_row, c0 + red_col);
+        }
+    }
+    const int n = (int)(quads * quads);
+    const RGBPixelBaseT R = output_pixel_cast((sum_r + n / 2) / n);
+    const RGBPixelBaseT G = output_pixel_cast((sum_g + n) / (2 * n));
+    const RGBPixelBaseT B = output_pixel_cast((sum_b + n / 2) / n);
+    store_output_pixel(g_r, g_c, R, G, B);
+}
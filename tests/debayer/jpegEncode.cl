@@ -0,0 +1,306 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+// Baseline JPEG encoding of an RGBA image, 4:2:0, in three passes:
+//
+// jpeg_dct: one work item per 8x8 block converts its pixels to YCbCr
+// (averaging 2x2 pixels for chroma), transforms and quantizes them, and
+// stores the coefficients in zig-zag order. Blocks are numbered in MCU
+// order: four luma blocks, then Cb and Cr, for each 16x16 MCU.
+//
+// jpeg_huffman: one work item per restart interval of JPEG_RESTART_MCUS MCUs
+// entropy codes the interval's blocks into its own segment, with DC
+// prediction reset at the start of the interval as restart markers require.
+//
+// jpeg_pack: one work group per segment finds the segment's offset from the
+// sizes of earlier segments, and copies it to the output, followed by its
+// restart marker. The output holds a JPEG_PACK_HEADER byte header (entropy
+// coded size, and an overflow flag) followed by the entropy coded data, so
+// only the compact bitstream is read back; the host adds the JPEG headers.
+//
+// Quantization tables (natural order) and Huffman codes (length << 16 | code)
+// are built on the host, in one table buffer:
+// quant[2][64], dc[2][16], ac[2][256].
+
+#ifndef JPEG_RESTART_MCUS
+#define JPEG_RESTART_MCUS 8
+#endif
+#ifndef JPEG_PACK_WG
+#define JPEG_PACK_WG 64
+#endif
+#define JPEG_PACK_HEADER 16
+#define JPEG_BLOCKS_PER_MCU 6
+#define JPEG_TABLE_DC 128
+#define JPEG_TABLE_AC 160
+#define JPEG_SEGMENT_INVALID 0xFFFFFFFF
+
+__constant float jpeg_dct_basis[64] = {
+    0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f, 0.35355339f,
+    0.49039264f, 0.41573481f, 0.27778512f, 0.09754516f, -0.09754516f, -0.27778512f, -0.41573481f, -0.49039264f,
+    0.46193977f, 0.19134172f, -0.19134172f, -0.46193977f, -0.46193977f, -0.19134172f, 0.19134172f, 0.46193977f,
+    0.41573481f, -0.09754516f, -0.49039264f, -0.27778512f, 0.27778512f, 0.49039264f, 0.09754516f, -0.41573481f,
+    0.35355339f, -0.35355339f, -0.35355339f, 0.35355339f, 0.35355339f, -0.35355339f, -0.35355339f, 0.35355339f,
+    0.27778512f, -0.49039264f, 0.09754516f, 0.41573481f, -0.41573481f, -0.09754516f, 0.49039264f, -0.27778512f,
+    0.19134172f, -0.46193977f, 0.46193977f, -0.19134172f, -0.19134172f, 0.46193977f, -0.46193977f, 0.19134172f,
+    0.09754516f, -0.27778512f, 0.41573481f, -0.49039264f, 0.49039264f, -0.41573481f, 0.27778512f, -0.09754516f
+};
+
+// natural index of each zig-zag position
+__constant uchar jpeg_natural_order[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+inline uint jpeg_mcus(const uint im_rows, const uint im_cols){
+    return ((im_cols + 15) >> 4) * ((im_rows + 15) >> 4);
+}
+
+inline uint jpeg_segments(const uint im_rows, const uint im_cols){
+    return (jpeg_mcus(im_rows, im_cols) + JPEG_RESTART_MCUS - 1) / JPEG_RESTART_MCUS;
+}
+
+// segment sizes are followed by segment data, 64 byte aligned
+inline uint jpeg_segment_data_offset(const uint num_segments){
+    return ((num_segments * 4 + 63) >> 6) << 6;
+}
+
+inline float3 jpeg_rgb(__global const uchar *input_image_p, const uint input_image_pitch,
+                       const uint im_rows, const uint im_cols, const uint x, const uint y){
+    __global const uchar *p = input_image_p + min(y, im_rows - 1) * input_image_pitch
+        + min(x, im_cols - 1) * OUTPUT_CHANNELS;
+    return (float3)((float)p[0], (float)p[1], (float)p[2]);
+}
+
+__kernel void jpeg_dct(const uint im_rows, const uint im_cols,
+    __global const uchar *input_image_p, const uint input_image_pitch,
+    __global short *coefficients, __global const uint *tables){
+    const uint gid = get_global_id(0);
+    if (gid >= jpeg_mcus(im_rows, im_cols) * JPEG_BLOCKS_PER_MCU)
+        return;
+    const uint mcu = gid / JPEG_BLOCKS_PER_MCU;
+    const uint block = gid % JPEG_BLOCKS_PER_MCU;
+    const uint mcus_x = (im_cols + 15) >> 4;
+    const uint mcu_x = (mcu % mcus_x) << 4;
+    const uint mcu_y = (mcu / mcus_x) << 4;
+
+    // level shifted samples
+    float s[64];
+    for (uint y = 0; y < 8; ++y){
+        for (uint x = 0; x < 8; ++x){
+            float v;
+            if (block < 4){
+                const float3 c = jpeg_rgb(input_image_p, input_image_pitch, im_rows, im_cols,
+                    mcu_x + ((block & 1) << 3) + x, mcu_y + ((block >> 1) << 3) + y);
+                v = 0.299f * c.x + 0.587f * c.y + 0.114f * c.z - 128.0f;
+            } else {
+                const uint px = mcu_x + (x << 1);
+                const uint py = mcu_y + (y << 1);
+                const float3 c = 0.25f * (
+                    jpeg_rgb(input_image_p, input_image_pitch, im_rows, im_cols, px, py) +
+                    jpeg_rgb(input_image_p, input_image_pitch, im_rows, im_cols, px + 1, py) +
+                    jpeg_rgb(input_image_p, input_image_pitch, im_rows, im_cols, px, py + 1) +
+                    jpeg_rgb(input_image_p, input_image_pitch, im_rows, im_cols, px + 1, py + 1));
+                v = block == 4 ?
+                    -0.168736f * c.x - 0.331264f * c.y + 0.5f * c.z :
+                    0.5f * c.x - 0.418688f * c.y - 0.081312f * c.z;
+            }
+            s[(y << 3) + x] = v;
+        }
+    }
+
+    // separable DCT: rows, then columns
+    float t[64];
+    for (uint y = 0; y < 8; ++y){
+        for (uint u = 0; u < 8; ++u){
+            float sum = 0.0f;
+            for (uint x = 0; x < 8; ++x)
+                sum += jpeg_dct_basis[(u << 3) + x] * s[(y << 3) + x];
+            t[(y << 3) + u] = sum;
+        }
+    }
+    __global const uint *quant = tables + (block < 4 ? 0 : 64);
+    __global short *out = coefficients + gid * 64;
+    for (uint k = 0; k < 64; ++k){
+        const uint n = jpeg_natural_order[k];
+        const uint u = n & 7;
+        const uint v = n >> 3;
+        float sum = 0.0f;
+        for (uint y = 0; y < 8; ++y)
+            sum += jpeg_dct_basis[(v << 3) + y] * t[(y << 3) + u];
+        const int limit = k ? 1023 : 2047;
+        const int q = (int)floor(sum / (float)quant[n] + 0.5f);
+        out[k] = (short)clamp(q, -limit, limit);
+    }
+}
+
+typedef struct {
+    __global uchar *out;
+    uint capacity;
+    uint pos;
+    uint bits;
+    uint count;
+} jpeg_bit_writer;
+
+inline void jpeg_emit_byte(jpeg_bit_writer *w, const uchar b){
+    if (w->pos < w->capacity)
+        w->out[w->pos] = b;
+    w->pos++;
+}
+
+inline void jpeg_put_bits(jpeg_bit_writer *w, const uint code, const uint len){
+    w->bits = (w->bits << len) | (code & ((1u << len) - 1));
+    w->count += len;
+    while (w->count >= 8){
+        w->count -= 8;
+        const uchar b = (uchar)(w->bits >> w->count);
+        jpeg_emit_byte(w, b);
+        // byte stuffing
+        if (b == 0xFF)
+            jpeg_emit_byte(w, 0);
+    }
+    w->bits &= (1u << w->count) - 1;
+}
+
+inline uint jpeg_category(const int v){
+    return v ? 32 - clz((uint)abs(v)) : 0;
+}
+
+// Huffman code of symbol, then value's bits
+inline void jpeg_put_value(jpeg_bit_writer *w, const uint code, const int v, const uint cat){
+    jpeg_put_bits(w, code & 0xFFFF, code >> 16);
+    if (cat)
+        jpeg_put_bits(w, (uint)(v < 0 ? v - 1 : v), cat);
+}
+
+__kernel void jpeg_huffman(const uint im_rows, const uint im_cols,
+    __global const short *coefficients, __global uchar *segments,
+    const uint segment_capacity, __global const uint *tables){
+    const uint seg = get_global_id(0);
+    const uint num_segments = jpeg_segments(im_rows, im_cols);
+    if (seg >= num_segments)
+        return;
+    const uint first_mcu = seg * JPEG_RESTART_MCUS;
+    const uint end_mcu = min(first_mcu + JPEG_RESTART_MCUS, jpeg_mcus(im_rows, im_cols));
+
+    jpeg_bit_writer w;
+    w.out = segments + jpeg_segment_data_offset(num_segments) + seg * segment_capacity;
+    w.capacity = segment_capacity;
+    w.pos = 0;
+    w.bits = 0;
+    w.count = 0;
+    int pred[3] = {0, 0, 0};
+    for (uint mcu = first_mcu; mcu < end_mcu; ++mcu){
+        for (uint block = 0; block < JPEG_BLOCKS_PER_MCU; ++block){
+            const uint comp = block < 4 ? 0 : block - 3;
+            const uint table = comp ? 1 : 0;
+            __global const short *coef = coefficients + (mcu * JPEG_BLOCKS_PER_MCU + block) * 64;
+            __global const uint *dc = tables + JPEG_TABLE_DC + table * 16;
+            __global const uint *ac = tables + JPEG_TABLE_AC + table * 256;
+
+            const int diff = coef[0] - pred[comp];
+            pred[comp] = coef[0];
+            uint cat = jpeg_category(diff);
+            jpeg_put_value(&w, dc[cat], diff, cat);
+
+            uint run = 0;
+            for (uint k = 1; k < 64; ++k){
+                const int v = coef[k];
+                if (!v){
+                    run++;
+                    continue;
+                }
+                // runs of 16 zeros
+                while (run > 15){
+                    jpeg_put_bits(&w, ac[0xF0] & 0xFFFF, ac[0xF0] >> 16);
+                    run -= 16;
+                }
+                cat = jpeg_category(v);
+                jpeg_put_value(&w, ac[(run << 4) | cat], v, cat);
+                run = 0;
+            }
+            // end of block
+            if (run)
+                jpeg_put_bits(&w, ac[0] & 0xFFFF, ac[0] >> 16);
+        }
+    }
+    // pad final byte with ones
+    if (w.count)
+        jpeg_put_bits(&w, 0x7F, 8 - w.count);
+    ((__global uint *)segments)[seg] = w.pos <= segment_capacity ? w.pos : JPEG_SEGMENT_INVALID;
+}
+
+__kernel __attribute__((reqd_work_group_size(JPEG_PACK_WG, 1, 1)))
+void jpeg_pack(const uint im_rows, const uint im_cols,
+    __global const uchar *segments, const uint segment_capacity,
+    __global uchar *output_p, const uint output_capacity){
+    const uint seg = get_group_id(0);
+    const uint lid = get_local_id(0);
+    const uint num_segments = jpeg_segments(im_rows, im_cols);
+    if (seg >= num_segments)
+        return;
+    __global const uint *sizes = (__global const uint *)segments;
+
+    // offset of segment: sizes of earlier segments and their restart markers
+    __local uint partial[JPEG_PACK_WG];
+    __local uint invalid[JPEG_PACK_WG];
+    uint sum = 0;
+    uint bad = 0;
+    for (uint i = lid; i < seg; i += JPEG_PACK_WG){
+        const uint size = sizes[i];
+        if (size == JPEG_SEGMENT_INVALID)
+            bad = 1;
+        else
+            sum += size + 2;
+    }
+    partial[lid] = sum;
+    invalid[lid] = bad;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = JPEG_PACK_WG / 2; stride > 0; stride >>= 1){
+        if (lid < stride){
+            partial[lid] += partial[lid + stride];
+            invalid[lid] |= invalid[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    const uint offset = partial[0];
+    const uint size = sizes[seg];
+    const bool last = seg == num_segments - 1;
+    const uint marker = last ? 0 : 2;
+    const bool fits = size != JPEG_SEGMENT_INVALID && !invalid[0]
+        && offset + size + marker <= output_capacity - JPEG_PACK_HEADER;
+
+    __global uchar *out = output_p + JPEG_PACK_HEADER + offset;
+    if (fits){
+        __global const uchar *in = segments + jpeg_segment_data_offset(num_segments)
+            + seg * segment_capacity;
+        for (uint i = lid; i < size; i += JPEG_PACK_WG)
+            out[i] = in[i];
+        if (lid == 0 && !last){
+            out[size] = 0xFF;
+            out[size + 1] = (uchar)(0xD0 | (seg & 7));
+        }
+    }
+    // last segment knows the size of the whole bitstream
+    if (last && lid == 0){
+        __global uint *header = (__global uint *)output_p;
+        header[0] = fits ? offset + size : 0;
+        header[1] = fits ? 0 : 1;
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+// PNG row filtering of an 8 bit image, producing scanlines ready to deflate:
+// each output row is one filter type byte followed by the filtered row.
+//
+// One work group filters one row. For the adaptive filter, each work item
+// sums the absolute (signed) filtered values of all five filters over its
+// bytes; sums are reduced in local memory and the filter with the smallest
+// sum is chosen, lowest filter type winning ties, matching the host encoder.
+
+#ifndef PNG_FILTER_WG
+#define PNG_FILTER_WG 64
+#endif
+
+#define PNG_FILTER_NONE 0
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP 2
+#define PNG_FILTER_AVERAGE 3
+#define PNG_FILTER_PAETH 4
+#define PNG_FILTER_ADAPTIVE 5
+#define PNG_NUM_FILTERS 5
+
+inline int paeth_predictor(int a, int b, int c){
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+inline uchar png_filter_byte(const int filter, __global const uchar *row, __global const uchar *prev, const uint i, const uint bpp){
+    const int x = row[i];
+    const int a = i >= bpp ? row[i - bpp] : 0;
+    const int b = prev ? prev[i] : 0;
+    const int c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+    switch (filter){
+    case PNG_FILTER_SUB:
+        return (uchar)(x - a);
+    case PNG_FILTER_UP:
+        return (uchar)(x - b);
+    case PNG_FILTER_AVERAGE:
+        return (uchar)(x - ((a + b) >> 1));
+    case PNG_FILTER_PAETH:
+        return (uchar)(x - paeth_predictor(a, b, c));
+    default:
+        return (uchar)x;
+    }
+}
+
+__kernel __attribute__((reqd_work_group_size(PNG_FILTER_WG, 1, 1)))
+void png_filter(const uint im_rows, const uint row_bytes, const uint bpp,
+    __global const uchar *input_image_p, const uint input_image_pitch, __global uchar *output_image_p, const int filter){
+    const uint row = get_group_id(0);
+    const uint lid = get_local_id(0);
+    if (row >= im_rows)
+        return;
+
+    __global const uchar *cur = input_image_p + row * input_image_pitch;
+    __global const uchar *prev = row ? cur - input_image_pitch : 0;
+    __global uchar *out = output_image_p + row * (row_bytes + 1);
+
+    __local uint costs[PNG_NUM_FILTERS][PNG_FILTER_WG];
+    __local int best;
+
+    int chosen = filter;
+    if (filter == PNG_FILTER_ADAPTIVE){
+        uint sums[PNG_NUM_FILTERS] = {0, 0, 0, 0, 0};
+        for (uint i = lid; i < row_bytes; i += PNG_FILTER_WG){
+            for (int f = 0; f < PNG_NUM_FILTERS; ++f)
+                sums[f] += abs((int)(char)png_filter_byte(f, cur, prev, i, bpp));
+        }
+        for (int f = 0; f < PNG_NUM_FILTERS; ++f)
+            costs[f][lid] = sums[f];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (uint stride = PNG_FILTER_WG / 2; stride > 0; stride >>= 1){
+            if (lid < stride){
+                for (int f = 0; f < PNG_NUM_FILTERS; ++f)
+                    costs[f][lid] += costs[f][lid + stride];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        if (lid == 0){
+            int b = 0;
+            for (int f = 1; f < PNG_NUM_FILTERS; ++f){
+                if (costs[f][0] < costs[b][0])
+                    b = f;
+            }
+            best = b;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        chosen = best;
+    }
+
+    if (lid == 0)
+        out[0] = (uchar)chosen;
+    for (uint i = lid; i < row_bytes; i += PNG_FILTER_WG)
+        out[i + 1] = png_filter_byte(chosen, cur, prev, i, bpp);
+}
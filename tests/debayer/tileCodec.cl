@@ -0,0 +1,205 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+// Lossless compression of an 8 bit image with OUTPUT_CHANNELS channels,
+// in independently decodable tiles of TILE_SIZE x TILE_SIZE pixels.
+//
+// tile_encode: one work item per tile predicts each channel's samples from
+// their neighbours in the tile (MED predictor: left on the first row, up on
+// the first column), maps residuals to unsigned values, and bit-packs each
+// tile row of residuals with the smallest bit width that holds them. A
+// channel's tile is stored as TILE_SIZE 4 bit widths, then each row's
+// residuals, packed LSB first into 2 x width bytes.
+//
+// tile_scan: one work group turns tile sizes into offsets.
+//
+// tile_pack: one work group per tile copies the tile to its offset in the
+// output, which holds a TILE_HEADER byte header (data size, tile count and
+// an overflow flag), tile offsets (tile count + 1), and then the tile data.
+//
+// The intermediate tile buffer holds tile sizes, then tile offsets,
+// then one TILE_CAPACITY byte slot per tile.
+
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+#ifndef TILE_SCAN_WG
+#define TILE_SCAN_WG 256
+#endif
+#ifndef TILE_PACK_WG
+#define TILE_PACK_WG 64
+#endif
+#define TILE_HEADER 16
+#define TILE_CAPACITY (OUTPUT_CHANNELS * (TILE_SIZE / 2 + TILE_SIZE * TILE_SIZE))
+
+inline uint tile_count(const uint im_rows, const uint im_cols){
+    return ((im_cols + TILE_SIZE - 1) / TILE_SIZE) * ((im_rows + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+inline uint tile_align(const uint len, const uint alignment){
+    return (len + alignment - 1) / alignment * alignment;
+}
+
+// offset of tile offsets, and of tile slots, in the intermediate buffer
+inline uint tile_offsets_offset(const uint num_tiles){
+    return tile_align((num_tiles + 1) * 4, 64);
+}
+
+inline uint tile_slots_offset(const uint num_tiles){
+    return 2 * tile_offsets_offset(num_tiles);
+}
+
+// offset of tile data in the output
+inline uint tile_data_offset(const uint num_tiles){
+    return tile_align(TILE_HEADER + (num_tiles + 1) * 4, 16);
+}
+
+inline int med_predict(const int a, const int b, const int c){
+    if (c >= max(a, b))
+        return min(a, b);
+    if (c <= min(a, b))
+        return max(a, b);
+    return a + b - c;
+}
+
+__kernel void tile_encode(const uint im_rows, const uint im_cols,
+    __global const uchar *input_image_p, const uint input_image_pitch,
+    __global uchar *tiles){
+    const uint tile = get_global_id(0);
+    const uint num_tiles = tile_count(im_rows, im_cols);
+    if (tile >= num_tiles)
+        return;
+    const uint tiles_x = (im_cols + TILE_SIZE - 1) / TILE_SIZE;
+    const uint x0 = (tile % tiles_x) * TILE_SIZE;
+    const uint y0 = (tile / tiles_x) * TILE_SIZE;
+    const uint tw = min((uint)TILE_SIZE, im_cols - x0);
+    const uint th = min((uint)TILE_SIZE, im_rows - y0);
+    __global const uchar *src = input_image_p + y0 * input_image_pitch + x0 * OUTPUT_CHANNELS;
+    __global uchar *out = tiles + tile_slots_offset(num_tiles) + tile * TILE_CAPACITY;
+
+    uint pos = 0;
+    for (uint ch = 0; ch < OUTPUT_CHANNELS; ++ch){
+        __global uchar *widths = out + pos;
+        pos += TILE_SIZE / 2;
+        for (uint y = 0; y < TILE_SIZE; y += 2)
+            widths[y >> 1] = 0;
+        for (uint y = 0; y < th; ++y){
+            __global const uchar *row = src + y * input_image_pitch + ch;
+            __global const uchar *up = row - input_image_pitch;
+            uchar residuals[TILE_SIZE];
+            uint all = 0;
+            for (uint x = 0; x < TILE_SIZE; ++x){
+                uchar z = 0;
+                if (x < tw){
+                    const int p = row[x * OUTPUT_CHANNELS];
+                    int pred = 0;
+                    if (x && y)
+                        pred = med_predict(row[(x - 1) * OUTPUT_CHANNELS], up[x * OUTPUT_CHANNELS],
+                            up[(x - 1) * OUTPUT_CHANNELS]);
+                    else if (x)
+                        pred = row[(x - 1) * OUTPUT_CHANNELS];
+                    else if (y)
+                        pred = up[0];
+                    // signed 8 bit residual, zig-zag mapped
+                    const int r = (char)(p - pred);
+                    z = (uchar)((r << 1) ^ (r >> 7));
+                }
+                residuals[x] = z;
+                all |= z;
+            }
+            const uint width = 32 - clz(all);
+            widths[y >> 1] |= (uchar)(width << ((y & 1) << 2));
+            uint bits = 0;
+            uint count = 0;
+            for (uint x = 0; x < TILE_SIZE; ++x){
+                bits |= (uint)residuals[x] << count;
+                count += width;
+                while (count >= 8){
+                    out[pos++] = (uchar)bits;
+                    bits >>= 8;
+                    count -= 8;
+                }
+            }
+        }
+    }
+    ((__global uint *)tiles)[tile] = pos;
+}
+
+__kernel __attribute__((reqd_work_group_size(TILE_SCAN_WG, 1, 1)))
+void tile_scan(const uint im_rows, const uint im_cols, __global uchar *tiles,
+    __global uchar *output_p, const uint output_capacity){
+    const uint lid = get_local_id(0);
+    const uint num_tiles = tile_count(im_rows, im_cols);
+    __global const uint *sizes = (__global const uint *)tiles;
+    __global uint *offsets = (__global uint *)(tiles + tile_offsets_offset(num_tiles));
+    __global uint *out_offsets = (__global uint *)(output_p + TILE_HEADER);
+
+    // each work item scans a run of tiles
+    const uint run = (num_tiles + TILE_SCAN_WG - 1) / TILE_SCAN_WG;
+    const uint begin = min(lid * run, num_tiles);
+    const uint end = min(begin + run, num_tiles);
+    uint sum = 0;
+    for (uint i = begin; i < end; ++i)
+        sum += sizes[i];
+
+    // inclusive scan of run sums
+    __local uint partial[TILE_SCAN_WG];
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = 1; stride < TILE_SCAN_WG; stride <<= 1){
+        const uint v = lid >= stride ? partial[lid - stride] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        partial[lid] += v;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    uint offset = partial[lid] - sum;
+    for (uint i = begin; i < end; ++i){
+        offsets[i] = offset;
+        out_offsets[i] = offset;
+        offset += sizes[i];
+    }
+    if (lid == TILE_SCAN_WG - 1){
+        const uint total = partial[lid];
+        offsets[num_tiles] = total;
+        out_offsets[num_tiles] = total;
+        __global uint *header = (__global uint *)output_p;
+        const bool fits = tile_data_offset(num_tiles) + total <= output_capacity;
+        header[0] = total;
+        header[1] = num_tiles;
+        header[2] = fits ? 0 : 1;
+    }
+}
+
+__kernel __attribute__((reqd_work_group_size(TILE_PACK_WG, 1, 1)))
+void tile_pack(const uint im_rows, const uint im_cols, __global const uchar *tiles,
+    __global uchar *output_p, const uint output_capacity){
+    const uint tile = get_group_id(0);
+    const uint lid = get_local_id(0);
+    const uint num_tiles = tile_count(im_rows, im_cols);
+    if (tile >= num_tiles)
+        return;
+    __global const uint *offsets = (__global const uint *)(tiles + tile_offsets_offset(num_tiles));
+    const uint data_offset = tile_data_offset(num_tiles);
+    if (data_offset + offsets[num_tiles] > output_capacity)
+        return;
+    const uint size = offsets[tile + 1] - offsets[tile];
+    __global const uchar *in = tiles + tile_slots_offset(num_tiles) + tile * TILE_CAPACITY;
+    __global uchar *out = output_p + data_offset + offsets[tile];
+    for (uint i = lid; i < size; i += TILE_PACK_WG)
+        out[i] = in[i];
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ReorderBuffer.h"
+#include "SyntheticFrames.h"
+#include "TiffRawReader.h"
+#include "common.h"
+#ifndef _WIN32
+#include "IoEngine.h"
+#else
+struct IoRequest;
+#endif
+
+// Frame decoded by the decode stage, as width x height grey pixels, or
+// as a raw DNG/TIFF frame whose samples are unpacked by the consumer.
+// A frame that could not be decoded has neither.
+struct DecodedFrame {
+	DecodedFrame() : data(nullptr), width(0), height(0), sequence(0) {
+	}
+	bool valid() const {
+		return data || raw;
+	}
+	FrameRequest request;
+	uint8_t *data;
+	std::shared_ptr<TiffRawReader> raw;
+	uint32_t width;
+	uint32_t height;
+	uint64_t sequence;
+};
+
+// Decodes frame requests to 8 bit grey with a set of worker threads,
+// which decode ahead into a bounded number of staging buffers.
+// Decoded frames are handed to a single consumer in request order, or in
+// completion order if unordered. With auto sizing, the number of active
+// workers follows the ratio of measured decode time per frame to the
+// time the consumer spends on each frame.
+// With an I/O engine, files of upcoming requests are read ahead
+// asynchronously, and workers decode from memory.
+// DNG and TIFF files are only parsed, and mapped until released.
+class DecodeStage {
+public:
+	typedef std::chrono::high_resolution_clock clock;
+
+	DecodeStage(BlockingQueue<FrameRequest> &requestQueue, size_t maxWorkers,
+			bool autoSize, size_t numStaging, bool ordered) :
+			requests(requestQueue), frames(ordered), maxWorkers(
+					maxWorkers ? maxWorkers : 1), autoSize(autoSize), activeWorkers(
+					autoSize ? std::min<size_t>(2, this->maxWorkers) : this->maxWorkers), freeStaging(
+					numStaging ? numStaging : 1), stopping(false), endOfStream(false), haveFirst(
+					false), nextSequence(0), decodeNanos(0), decodeCount(0), consumerWaitNanos(
+					0), windowFrames(0), windowStart(clock::now()) {
+	}
+	~DecodeStage() {
+		stop();
+	}
+#ifndef _WIN32
+	// read up to depth files ahead of the workers through engine.
+	// Must be called before start
+	void setReadahead(IoEngine *engine, size_t depth) {
+		io = engine;
+		readahead = depth ? depth : 1;
+	}
+#endif
+	// launch workers. The first request is decoded before any queued request
+	void start(const FrameRequest &firstRequest) {
+		first = firstRequest;
+		haveFirst = !first.endOfStream();
+		windowStart = clock::now();
+		for (size_t i = 0; i < maxWorkers; ++i)
+			workers.emplace_back([this, i] {
+				work(i);
+			});
+	}
+	// Wait for next decoded frame. Returns false at end of stream.
+	// Called from a single consumer thread.
+	bool waitAndPop(DecodedFrame &frame) {
+		auto waitStart = clock::now();
+		bool rc = frames.waitAndPop(frame);
+		auto now = clock::now();
+		if (rc && autoSize)
+			resize(now - waitStart, now);
+		return rc;
+	}
+	// return frame's staging buffer
+	void release(DecodedFrame &frame) {
+		if (!frame.valid())
+			return;
+		if (frame.data)
+			stbi_image_free(frame.data);
+		frame.data = nullptr;
+		frame.raw = nullptr;
+		returnStaging();
+	}
+	// Stop workers and free undelivered frames. Workers waiting on the request
+	// queue only return once it yields end of stream, so the frame source
+	// should be stopped first.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			stopping = true;
+			condition.notify_all();
+		}
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+		DecodedFrame frame;
+		while (frames.tryPop(frame))
+			release(frame);
+		frames.deactivate();
+#ifndef _WIN32
+		std::lock_guard<std::mutex> lk(requestMutex);
+		ahead.clear();
+#endif
+	}
+	size_t getActiveWorkers() {
+		std::lock_guard<std::mutex> lk(mutex);
+		return activeWorkers;
+	}
+private:
+	void returnStaging() {
+		std::lock_guard<std::mutex> lk(mutex);
+		freeStaging++;
+		condition.notify_all();
+	}
+	void work(size_t index) {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lk(mutex);
+				condition.wait(lk, [this, index] {
+					return stopping || endOfStream ||
+							(index < activeWorkers && freeStaging > 0);
+				});
+				if (stopping || endOfStream)
+					return;
+				freeStaging--;
+			}
+			// staging buffer is reserved before taking a sequence number, so a
+			// frame waiting to be delivered in order never waits for a buffer
+			DecodedFrame frame;
+			std::shared_ptr<IoRequest> read;
+			if (!nextRequest(frame.request, frame.sequence, read)) {
+				returnStaging();
+				return;
+			}
+			auto decodeStart = clock::now();
+			int w = 0, h = 0, channels = 0;
+			std::string reason = "unable to read";
+			auto raw = std::make_shared<TiffRawReader>();
+			uint32_t syntheticWidth = 0, syntheticHeight = 0;
+#ifndef _WIN32
+			if (read) {
+				if (read->wait() && !read->data.empty()) {
+					if (TiffRawReader::isTiff(read->data.data(), read->data.size())) {
+						if (raw->open(std::move(read->data)))
+							frame.raw = raw;
+					} else {
+						frame.data = stbi_load_from_memory(read->data.data(),
+								(int) read->data.size(), &w, &h, &channels, STBI_grey);
+					}
+				}
+				read = nullptr;
+			} else
+#endif
+			if (parseSyntheticPath(frame.request.path, syntheticWidth, syntheticHeight)) {
+				// copy of generated mosaic, released with stbi_image_free
+				auto mosaic = syntheticMosaic(syntheticWidth, syntheticHeight);
+				frame.data = (uint8_t*) malloc(mosaic->size());
+				if (frame.data) {
+					memcpy(frame.data, mosaic->data(), mosaic->size());
+					w = (int) syntheticWidth;
+					h = (int) syntheticHeight;
+				}
+			} else if (TiffRawReader::hasRawExtension(frame.request.path)) {
+				if (raw->open(frame.request.path))
+					frame.raw = raw;
+			} else {
+				frame.data = stbi_load(frame.request.path.c_str(), &w, &h, &channels,
+						STBI_grey);
+			}
+			if (frame.raw) {
+				w = (int) raw->getWidth();
+				h = (int) raw->getHeight();
+			} else if (!raw->getError().empty()) {
+				reason = raw->getError();
+			}
+			decodeNanos += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+					clock::now() - decodeStart).count();
+			decodeCount++;
+			if (frame.valid()) {
+				frame.width = (uint32_t) w;
+				frame.height = (uint32_t) h;
+			} else {
+				std::cerr << "Skipping image file " << frame.request.path
+						<< ": " << reason << std::endl;
+				returnStaging();
+			}
+			frames.push(frame.sequence, frame);
+		}
+	}
+	// take next request from request queue, waiting if block is set.
+	// Returns false if no request is available without waiting
+	bool takeRequest(FrameRequest &request, bool block) {
+		if (haveFirst) {
+			request = first;
+			haveFirst = false;
+		} else if (block) {
+			if (!requests.waitAndPop(request))
+				request = FrameRequest();
+		} else if (!requests.tryPop(request)) {
+			return false;
+		}
+		return true;
+	}
+	// take next request and its sequence number, along with its read ahead,
+	// if any. At end of stream, the reorder buffer is closed and false is returned
+	bool nextRequest(FrameRequest &request, uint64_t &sequence,
+			std::shared_ptr<IoRequest> &read) {
+		std::lock_guard<std::mutex> lk(requestMutex);
+		if (endOfStream)
+			return false;
+#ifndef _WIN32
+		if (io) {
+			// top up read ahead window, waiting only when it is empty
+			while (ahead.size() < readahead
+					&& (ahead.empty() || !ahead.back().request.endOfStream())) {
+				ReadAhead next;
+				if (!takeRequest(next.request, ahead.empty()))
+					break;
+				uint32_t sw = 0, sh = 0;
+				if (!next.request.endOfStream()
+						&& !parseSyntheticPath(next.request.path, sw, sh))
+					next.read = io->read(next.request.path);
+				ahead.push_back(next);
+			}
+			request = ahead.front().request;
+			read = ahead.front().read;
+			ahead.pop_front();
+		} else
+#endif
+		takeRequest(request, true);
+		if (request.endOfStream()) {
+			frames.close(nextSequence);
+			std::lock_guard<std::mutex> lk2(mutex);
+			endOfStream = true;
+			condition.notify_all();
+			return false;
+		}
+		sequence = nextSequence++;
+		return true;
+	}
+	// size active workers from decode time and consumer time per frame,
+	// once per window of frames
+	void resize(clock::duration consumerWait, clock::time_point now) {
+		consumerWaitNanos += (uint64_t) std::chrono::duration_cast<
+				std::chrono::nanoseconds>(consumerWait).count();
+		if (++windowFrames < resizeWindow)
+			return;
+		uint64_t count = decodeCount.exchange(0);
+		uint64_t nanos = decodeNanos.exchange(0);
+		double elapsed = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(
+				now - windowStart).count();
+		double consumerBusy = (elapsed - (double) consumerWaitNanos) / windowFrames;
+		windowStart = now;
+		windowFrames = 0;
+		consumerWaitNanos = 0;
+		if (!count || consumerBusy <= 0)
+			return;
+		double decodeTime = (double) nanos / count;
+		size_t needed = (size_t) std::ceil(decodeTime / consumerBusy);
+		needed = std::max<size_t>(1, std::min(needed, maxWorkers));
+		std::lock_guard<std::mutex> lk(mutex);
+		activeWorkers = needed;
+		condition.notify_all();
+	}
+	static const uint32_t resizeWindow = 16;
+
+	BlockingQueue<FrameRequest> &requests;
+	ReorderBuffer<DecodedFrame> frames;
+	size_t maxWorkers;
+	bool autoSize;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	size_t activeWorkers;
+	size_t freeStaging;
+	bool stopping;
+	bool endOfStream;
+
+	std::mutex requestMutex;
+	FrameRequest first;
+	bool haveFirst;
+	uint64_t nextSequence;
+#ifndef _WIN32
+	struct ReadAhead {
+		FrameRequest request;
+		std::shared_ptr<IoRequest> read;
+	};
+	IoEngine *io = nullptr;
+	size_t readahead = 1;
+	std::deque<ReadAhead> ahead;
+#endif
+
+	std::atomic<uint64_t> decodeNanos;
+	std::atomic<uint64_t> decodeCount;
+	// consumer side
+	uint64_t consumerWaitNanos;
+	uint32_t windowFrames;
+	clock::time_point windowStart;
+};
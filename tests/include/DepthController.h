@@ -0,0 +1,180 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Adjusts the number of in-flight frames (pipeline depth), searching for the
+// minimum depth that keeps the slowest pipeline stage saturated.
+//
+// Pipeline threads report the time they spend waiting:
+// input  - input stage waiting for a mapped hostToDevice slot
+// output - output stage waiting for a mapped deviceToHost slot
+// encode - output stage waiting for a free post-processing buffer
+// source - input stage waiting for frame requests
+//
+// When both the input and output stages are starved, frames are not in flight
+// long enough to cover device latency, so depth grows. Otherwise, depth is
+// probed downwards. A change that does not pay for itself in throughput
+// is reverted, and the depth it was reverted from becomes a ceiling/floor
+// until the next re-probe.
+class DepthController {
+public:
+	DepthController(size_t initialDepth, size_t minDepth, size_t maxDepth) :
+			depth(initialDepth), minDepth(minDepth ? minDepth : 1), maxDepth(
+					maxDepth), floorDepth(this->minDepth), ceilingDepth(maxDepth), lastChange(
+					NONE), prevThroughput(0), windows(0), windowStartFrames(0), windowStart(
+					clock::now()), completed(0), inputWait(0), outputWait(0), encodeWait(
+					0), sourceWait(0) {
+		if (this->maxDepth < this->minDepth)
+			this->maxDepth = this->minDepth;
+		if (ceilingDepth < this->minDepth)
+			ceilingDepth = this->minDepth;
+		if (depth < this->minDepth)
+			depth = this->minDepth;
+		if (depth > this->maxDepth)
+			depth = this->maxDepth;
+	}
+	typedef std::chrono::high_resolution_clock clock;
+
+	// stage accounting, called from any pipeline thread
+	void addInputWait(clock::duration d) {
+		inputWait += toNanos(d);
+	}
+	void addOutputWait(clock::duration d) {
+		outputWait += toNanos(d);
+	}
+	void addEncodeWait(clock::duration d) {
+		encodeWait += toNanos(d);
+	}
+	void addSourceWait(clock::duration d) {
+		sourceWait += toNanos(d);
+	}
+	void frameCompleted() {
+		completed++;
+	}
+
+	// Re-evaluate depth at end of each measurement window.
+	// Called from a single thread. Returns target depth.
+	size_t update() {
+		uint64_t frames = completed;
+		if (frames - windowStartFrames < windowFrames())
+			return depth;
+		auto now = clock::now();
+		double windowNs = (double) toNanos(now - windowStart);
+		if (windowNs <= 0)
+			return depth;
+		double throughput = (frames - windowStartFrames) * 1e9 / windowNs;
+		double inputFrac = inputWait.exchange(0) / windowNs;
+		double outputFrac = outputWait.exchange(0) / windowNs;
+		double encodeFrac = encodeWait.exchange(0) / windowNs;
+		double sourceFrac = sourceWait.exchange(0) / windowNs;
+		windowStart = now;
+		windowStartFrames = frames;
+
+		// periodically forget floor and ceiling, in case load has changed
+		if (++windows % reprobeWindows == 0) {
+			floorDepth = minDepth;
+			ceilingDepth = maxDepth;
+		}
+
+		// limited by frame arrival rate: nothing to tune
+		if (sourceFrac > sourceBoundFraction) {
+			lastChange = NONE;
+			prevThroughput = throughput;
+			return depth;
+		}
+
+		// revert previous change if it did not pay off
+		if (lastChange == GROW && throughput < prevThroughput * (1 + gainFraction)) {
+			ceilingDepth = depth - 1;
+			depth--;
+			lastChange = NONE;
+			return depth;
+		}
+		if (lastChange == SHRINK && throughput < prevThroughput * (1 - gainFraction)) {
+			floorDepth = depth + 1;
+			depth++;
+			lastChange = NONE;
+			return depth;
+		}
+		lastChange = NONE;
+		prevThroughput = throughput;
+
+		bool starved = inputFrac > starveFraction && outputFrac > starveFraction
+				&& encodeFrac < starveFraction;
+		if (starved && depth < ceilingDepth) {
+			depth++;
+			lastChange = GROW;
+		} else if (!starved && depth > floorDepth) {
+			depth--;
+			lastChange = SHRINK;
+		}
+		return depth;
+	}
+	size_t getDepth() const {
+		return depth;
+	}
+	// cap depth, for example when memory for a new slot cannot be allocated
+	void setMaxDepth(size_t max) {
+		maxDepth = max < minDepth ? minDepth : max;
+		if (ceilingDepth > maxDepth)
+			ceilingDepth = maxDepth;
+		if (depth > maxDepth)
+			depth = maxDepth;
+	}
+
+	// stage is starved if it waits for longer than this fraction of a window
+	static constexpr double starveFraction = 0.1;
+	// pipeline is limited by frame arrivals if input waits for longer than
+	// this fraction of a window
+	static constexpr double sourceBoundFraction = 0.5;
+	// minimum relative throughput change that justifies a depth change
+	static constexpr double gainFraction = 0.05;
+	static const uint32_t reprobeWindows = 32;
+private:
+	enum eChange {
+		NONE, GROW, SHRINK
+	};
+	static uint64_t toNanos(clock::duration d) {
+		return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	}
+	uint64_t windowFrames() const {
+		return 8 + 2 * depth;
+	}
+	size_t depth;
+	size_t minDepth;
+	size_t maxDepth;
+	size_t floorDepth;
+	size_t ceilingDepth;
+	eChange lastChange;
+	double prevThroughput;
+	uint32_t windows;
+	uint64_t windowStartFrames;
+	clock::time_point windowStart;
+
+	std::atomic<uint64_t> completed;
+	std::atomic<uint64_t> inputWait;
+	std::atomic<uint64_t> outputWait;
+	std::atomic<uint64_t> encodeWait;
+	std::atomic<uint64_t> sourceWait;
+};
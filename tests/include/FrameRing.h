@@ -0,0 +1,521 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameStore.h"
+
+// Ring of output frames in shared memory, for handing frames to a consumer
+// process without copies or files.
+//
+// The ring lives in a sealed memfd: a header, one descriptor per slot,
+// then page aligned slot data. A single writer publishes frames in
+// sequence, frame n going to slot n % slotCount; consumers connect to
+// the writer's local socket, receive the memfd, and read frames in place.
+//
+// Synchronization is lock free: a slot's descriptor holds the sequence of
+// its frame plus one once the frame is complete, and zero while it is
+// being written, and the header's write sequence is advanced after each
+// frame. By default the writer overwrites the oldest slot, so a consumer
+// that falls behind skips frames, and must check that a frame is still
+// valid after reading it. In blocking mode, the writer waits for slots
+// released by the consumer while a consumer is connected.
+// Waits use futexes on header words, shared between the processes.
+
+struct FrameRingHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t slotCount;
+	uint64_t slotSize;
+	uint64_t dataOffset;
+	// sequence of next frame to be published
+	uint64_t writeSequence;
+	// sequence of next frame to be released by consumer (blocking mode)
+	uint64_t readSequence;
+	// futex words: bumped on publish, and on release
+	uint32_t published;
+	uint32_t released;
+	uint32_t blocking;
+	// writer has finished
+	uint32_t closed;
+};
+static_assert(sizeof(FrameRingHeader) == 64, "frame ring header must be 64 bytes");
+
+struct FrameRingSlot {
+	// frame sequence + 1 once published, zero while being written
+	uint64_t sequence;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+	uint16_t channels;
+	uint16_t format;
+	uint32_t nameLength;
+	char name[224];
+};
+static_assert(sizeof(FrameRingSlot) == 256, "frame ring slot must be 256 bytes");
+
+const char frameRingMagic[8] = { 'L', 'T', 'K', 'R', 'I', 'N', 'G', '1' };
+const uint32_t frameRingVersion = 1;
+
+inline bool frameRingFutexWait(uint32_t *word, uint32_t expected, int timeoutMs) {
+	struct timespec ts;
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	return syscall(SYS_futex, word, FUTEX_WAIT, expected, timeoutMs < 0 ? nullptr : &ts,
+			nullptr, 0) == 0 || errno == EAGAIN;
+}
+inline void frameRingFutexWake(uint32_t *word) {
+	__atomic_fetch_add(word, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Publishes frames from a single thread. Consumers connect to the local
+// socket given to create(), which hands them the ring's memfd.
+class FrameRingWriter {
+public:
+	FrameRingWriter() : fd(-1), listenFd(-1), base(nullptr), mappedSize(0), header(
+			nullptr), slots(nullptr), consumers(0) {
+		wakeFds[0] = wakeFds[1] = -1;
+	}
+	~FrameRingWriter() {
+		close();
+	}
+	bool create(const std::string &socketPath, uint32_t slotCount, uint64_t slotSize,
+			bool blocking) {
+		uint64_t pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+		slotCount = std::max<uint32_t>(slotCount, 2);
+		slotSize = (std::max<uint64_t>(slotSize, 1) + pageSize - 1) / pageSize * pageSize;
+		uint64_t dataOffset = (sizeof(FrameRingHeader) + slotCount * sizeof(FrameRingSlot)
+				+ pageSize - 1) / pageSize * pageSize;
+		mappedSize = dataOffset + slotCount * slotSize;
+		fd = memfd_create("latke-frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (fd < 0) {
+			std::cerr << "Unable to create frame ring: " << strerror(errno) << std::endl;
+			return false;
+		}
+		// size is fixed, so consumers can map the whole ring safely
+		if (ftruncate(fd, (off_t) mappedSize) != 0
+				|| fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+			std::cerr << "Unable to size frame ring: " << strerror(errno) << std::endl;
+			close();
+			return false;
+		}
+		void *addr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			std::cerr << "Unable to map frame ring: " << strerror(errno) << std::endl;
+			mappedSize = 0;
+			close();
+			return false;
+		}
+		base = (uint8_t*) addr;
+		header = (FrameRingHeader*) base;
+		slots = (FrameRingSlot*) (base + sizeof(FrameRingHeader));
+		memcpy(header->magic, frameRingMagic, sizeof(frameRingMagic));
+		header->version = frameRingVersion;
+		header->slotCount = slotCount;
+		header->slotSize = slotSize;
+		header->dataOffset = dataOffset;
+		header->blocking = blocking ? 1 : 0;
+		if (!listen(socketPath)) {
+			close();
+			return false;
+		}
+		return true;
+	}
+	uint64_t getSlotSize() const {
+		return header ? header->slotSize : 0;
+	}
+	// Reserve next slot for a frame, returning pointer to its data in the ring,
+	// or nullptr if frame does not fit in a slot. Frame becomes visible to
+	// consumers on commit(). In blocking mode, waits for a free slot
+	uint8_t* reserve(const std::string &name, uint32_t width, uint32_t height,
+			uint16_t channels, eFrameFormat format, uint64_t size, uint64_t &sequence) {
+		if (!header || size > header->slotSize)
+			return nullptr;
+		sequence = header->writeSequence;
+		while (header->blocking && consumers.load() > 0) {
+			uint32_t released = __atomic_load_n(&header->released, __ATOMIC_ACQUIRE);
+			if (sequence - __atomic_load_n(&header->readSequence, __ATOMIC_ACQUIRE)
+					< header->slotCount)
+				break;
+			// time out to notice consumers that have gone
+			frameRingFutexWait(&header->released, released, 100);
+		}
+		auto slot = slots + sequence % header->slotCount;
+		__atomic_store_n(&slot->sequence, 0, __ATOMIC_RELEASE);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot->size = size;
+		slot->width = width;
+		slot->height = height;
+		slot->channels = channels;
+		slot->format = (uint16_t) format;
+		slot->nameLength = (uint32_t) std::min(name.size(), sizeof(slot->name));
+		memcpy(slot->name, name.c_str(), slot->nameLength);
+		return base + header->dataOffset + (sequence % header->slotCount) * header->slotSize;
+	}
+	// frame data has been written
+	void commit(uint64_t sequence) {
+		auto slot = slots + sequence % header->slotCount;
+		__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&header->writeSequence, sequence + 1, __ATOMIC_RELEASE);
+		frameRingFutexWake(&header->published);
+	}
+	// copy frame into ring
+	bool publish(const std::string &name, uint32_t width, uint32_t height,
+			uint16_t channels, eFrameFormat format, const uint8_t *data, uint64_t size) {
+		uint64_t sequence = 0;
+		auto dest = reserve(name, width, height, channels, format, size, sequence);
+		if (!dest)
+			return false;
+		memcpy(dest, data, size);
+		commit(sequence);
+		return true;
+	}
+	// mark ring closed, waking consumers, and stop accepting consumers.
+	// The memfd lives on until the last consumer unmaps it
+	void close() {
+		if (header) {
+			__atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+			frameRingFutexWake(&header->published);
+		}
+		if (wakeFds[1] >= 0) {
+			char c = 0;
+			if (write(wakeFds[1], &c, 1) < 0)
+				std::cerr << "Unable to stop frame ring listener" << std::endl;
+		}
+		if (listener.joinable())
+			listener.join();
+		for (int i = 0; i < 2; ++i) {
+			if (wakeFds[i] >= 0)
+				::close(wakeFds[i]);
+			wakeFds[i] = -1;
+		}
+		if (listenFd >= 0) {
+			::close(listenFd);
+			unlink(socketPath.c_str());
+		}
+		listenFd = -1;
+		if (base)
+			munmap(base, mappedSize);
+		base = nullptr;
+		header = nullptr;
+		slots = nullptr;
+		mappedSize = 0;
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+private:
+	bool listen(const std::string &path) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+			std::cerr << "Invalid frame ring socket path " << path << std::endl;
+			return false;
+		}
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenFd < 0)
+			return false;
+		unlink(path.c_str());
+		if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) != 0
+				|| ::listen(listenFd, 8) != 0 || pipe2(wakeFds, O_CLOEXEC) != 0) {
+			std::cerr << "Unable to listen on " << path << ": " << strerror(errno) << std::endl;
+			::close(listenFd);
+			listenFd = -1;
+			return false;
+		}
+		socketPath = path;
+		listener = std::thread([this] {
+			serve();
+		});
+		return true;
+	}
+	// accept consumers, handing each the memfd, and track their
+	// connections, which close when a consumer goes away
+	void serve() {
+		std::vector<int> clients;
+		while (true) {
+			std::vector<pollfd> fds(2 + clients.size());
+			fds[0] = {wakeFds[0], POLLIN, 0};
+			fds[1] = {listenFd, POLLIN, 0};
+			for (size_t i = 0; i < clients.size(); ++i)
+				fds[2 + i] = {clients[i], POLLIN, 0};
+			if (poll(fds.data(), fds.size(), -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (fds[0].revents)
+				break;
+			for (size_t i = clients.size(); i > 0; --i) {
+				if (!fds[1 + i].revents)
+					continue;
+				char buf[64];
+				if (read(clients[i - 1], buf, sizeof(buf)) > 0)
+					continue;
+				::close(clients[i - 1]);
+				clients.erase(clients.begin() + (ptrdiff_t) (i - 1));
+				consumers--;
+				// wake writer waiting on departed consumer
+				frameRingFutexWake(&header->released);
+			}
+			if (fds[1].revents & POLLIN) {
+				int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+				if (client >= 0) {
+					if (sendFd(client)) {
+						clients.push_back(client);
+						consumers++;
+					} else {
+						::close(client);
+					}
+				}
+			}
+		}
+		for (auto client : clients)
+			::close(client);
+		consumers = 0;
+	}
+	bool sendFd(int client) {
+		char data = 'R';
+		iovec iov = { &data, 1 };
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof(control));
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		return sendmsg(client, &msg, MSG_NOSIGNAL) == 1;
+	}
+
+	int fd;
+	int listenFd;
+	int wakeFds[2];
+	std::string socketPath;
+	uint8_t *base;
+	uint64_t mappedSize;
+	FrameRingHeader *header;
+	FrameRingSlot *slots;
+	std::atomic<int> consumers;
+	std::thread listener;
+};
+
+// frame returned by FrameRingReader, pointing into the ring
+struct FrameRingFrame {
+	FrameRingFrame() : data(nullptr), size(0), width(0), height(0), channels(0),
+					   format(FRAME_FORMAT_RAW), sequence(0) {
+	}
+	const uint8_t *data;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+	uint16_t channels;
+	eFrameFormat format;
+	uint64_t sequence;
+	std::string name;
+};
+
+// Reads frames from a ring in order, in place. Used by consumer processes
+class FrameRingReader {
+public:
+	FrameRingReader() : sock(-1), base(nullptr), mappedSize(0), header(nullptr), slots(
+			nullptr), cursor(0), dropped(0) {
+	}
+	~FrameRingReader() {
+		close();
+	}
+	// connect to writer's socket, and map the ring it hands over.
+	// Reading starts at the oldest frame still in the ring
+	bool connect(const std::string &socketPath) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+		sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock < 0 || ::connect(sock, (sockaddr*) &addr, sizeof(addr)) != 0) {
+			std::cerr << "Unable to connect to frame ring " << socketPath << ": "
+					<< strerror(errno) << std::endl;
+			close();
+			return false;
+		}
+		int ringFd = receiveFd();
+		if (ringFd < 0 || !map(ringFd)) {
+			if (ringFd >= 0)
+				::close(ringFd);
+			std::cerr << "Not a frame ring: " << socketPath << std::endl;
+			close();
+			return false;
+		}
+		::close(ringFd);
+		uint64_t written = __atomic_load_n(&header->writeSequence, __ATOMIC_ACQUIRE);
+		cursor = header->blocking ? __atomic_load_n(&header->readSequence, __ATOMIC_ACQUIRE) :
+				written - std::min<uint64_t>(written, header->slotCount);
+		return true;
+	}
+	// Wait up to timeoutMs (forever if negative) for next frame.
+	// Returns false on timeout, or once ring is closed and drained
+	bool next(FrameRingFrame &frame, int timeoutMs = -1) {
+		if (!header)
+			return false;
+		while (true) {
+			uint32_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+			uint64_t written = __atomic_load_n(&header->writeSequence, __ATOMIC_ACQUIRE);
+			if (cursor < written) {
+				// overwritten frames are skipped
+				if (written - cursor > header->slotCount) {
+					dropped += written - header->slotCount - cursor;
+					cursor = written - header->slotCount;
+				}
+				auto slot = slots + cursor % header->slotCount;
+				if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != cursor + 1) {
+					dropped++;
+					cursor++;
+					continue;
+				}
+				frame.sequence = cursor;
+				frame.size = slot->size;
+				frame.width = slot->width;
+				frame.height = slot->height;
+				frame.channels = slot->channels;
+				frame.format = (eFrameFormat) slot->format;
+				frame.name.assign(slot->name, std::min<size_t>(slot->nameLength, sizeof(slot->name)));
+				frame.data = base + header->dataOffset
+						+ (cursor % header->slotCount) * header->slotSize;
+				cursor++;
+				if (!valid(frame)) {
+					dropped++;
+					continue;
+				}
+				return true;
+			}
+			if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+				return false;
+			if (!frameRingFutexWait(&header->published, published, timeoutMs)
+					&& errno == ETIMEDOUT)
+				return false;
+		}
+	}
+	// frame has not been overwritten since it was returned by next().
+	// Without blocking mode, check after reading frame data
+	bool valid(const FrameRingFrame &frame) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		auto slot = slots + frame.sequence % header->slotCount;
+		return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == frame.sequence + 1;
+	}
+	// done with frame and all frames before it: in blocking mode,
+	// their slots may be reused
+	void release(const FrameRingFrame &frame) {
+		if (!header)
+			return;
+		__atomic_store_n(&header->readSequence, frame.sequence + 1, __ATOMIC_RELEASE);
+		frameRingFutexWake(&header->released);
+	}
+	// frames skipped because they were overwritten before being read
+	uint64_t getDropped() const {
+		return dropped;
+	}
+	void close() {
+		if (base)
+			munmap(base, mappedSize);
+		base = nullptr;
+		header = nullptr;
+		slots = nullptr;
+		mappedSize = 0;
+		if (sock >= 0)
+			::close(sock);
+		sock = -1;
+	}
+private:
+	int receiveFd() {
+		char data = 0;
+		iovec iov = { &data, 1 };
+		char control[CMSG_SPACE(sizeof(int))];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+			return -1;
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			return -1;
+		int received = -1;
+		memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+		return received;
+	}
+	bool map(int ringFd) {
+		off_t size = lseek(ringFd, 0, SEEK_END);
+		if (size < (off_t) sizeof(FrameRingHeader))
+			return false;
+		// consumer writes release sequence to header
+		void *addr = mmap(nullptr, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+		if (addr == MAP_FAILED)
+			return false;
+		base = (uint8_t*) addr;
+		mappedSize = (uint64_t) size;
+		header = (FrameRingHeader*) base;
+		slots = (FrameRingSlot*) (base + sizeof(FrameRingHeader));
+		if (memcmp(header->magic, frameRingMagic, sizeof(frameRingMagic)) != 0
+				|| header->version != frameRingVersion || !header->slotCount
+				|| header->dataOffset + header->slotCount * header->slotSize > mappedSize)
+			return false;
+		return true;
+	}
+
+	int sock;
+	uint8_t *base;
+	uint64_t mappedSize;
+	FrameRingHeader *header;
+	FrameRingSlot *slots;
+	uint64_t cursor;
+	uint64_t dropped;
+};
+
+#endif
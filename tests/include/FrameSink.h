@@ -0,0 +1,360 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#pragma once
+
+#include "latke_config.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "BlockingQueue.h"
+#include "FrameRing.h"
+#include "FrameSource.h"
+#include "FrameStore.h"
+#include "IoEngine.h"
+#include "JpegWriter.h"
+#include "PngEncoder.h"
+#include "TileCodec.h"
+
+// Sinks for frames read back from the device.
+//
+// Without zlib, PNG files are written with stb_image_write, whose
+// implementation is provided by the including file (see common.h).
+
+// Writes encoded frames: a JPEG frame, packed on the device, is given its
+// headers, and other frames are PNG encoded, from pixels or from rows
+// filtered on the device. Frames go to a frame store, or to one file per
+// frame in the output directory, written asynchronously through the I/O
+// engine when there is one.
+//
+// Files written through the I/O engine are staged in page aligned buffers.
+// Buffers are allocated on demand, up to a limit which bounds the number
+// of writes in flight. Pooled buffers are sized for the first frame;
+// larger frames get buffers of their own.
+//
+// write() may be called concurrently from multiple threads.
+class EncodedFrameSink {
+public:
+	// frames of channels 8 bit samples are written to outputDir; packed JPEG
+	// frames, if jpegWriter is set
+	EncodedFrameSink(const std::string &outputDir, uint32_t channels,
+			const JpegWriter *jpegWriter) :
+			outputDir(outputDir), channels(channels), jpegWriter(jpegWriter)
+#ifdef ZLIB_FOUND
+			, pngEncoder(nullptr), prefiltered(false)
+#endif
+#ifndef _WIN32
+			, store(nullptr), io(nullptr), ioBufferSize(0), maxIoBuffers(0), ioBuffersAllocated(0),
+			directWrite(false)
+#endif
+	{
+	}
+	~EncodedFrameSink() {
+#ifndef _WIN32
+		// writes in flight return their buffers to the pool
+		if (io)
+			io->drain();
+		IoBuffer *buffer = nullptr;
+		while (ioBuffers.tryPop(buffer))
+			delete buffer;
+#endif
+	}
+#ifdef ZLIB_FOUND
+	// encode PNG frames with encoder, from rows already filtered if prefiltered
+	void setPngEncoder(PngEncoder *encoder, const PngEncodeParams &params, bool prefiltered) {
+		pngEncoder = encoder;
+		pngParams = params;
+		this->prefiltered = prefiltered;
+	}
+#endif
+#ifndef _WIN32
+	// append frames to store rather than writing files
+	void setStore(FrameStoreWriter *frameStore) {
+		store = frameStore;
+	}
+	// write files through engine, staged in up to maxBuffers buffers of bufferSize
+	void setIoEngine(IoEngine *engine, size_t bufferSize, size_t maxBuffers, bool direct) {
+		io = engine;
+		ioBufferSize = IoBuffer::roundUp(bufferSize);
+		maxIoBuffers = maxBuffers;
+		directWrite = direct;
+	}
+#endif
+	// Write frame, as pixels, filtered rows, or packed JPEG bitstream of len bytes.
+	// Returns false on failure
+	bool write(const std::string &fileName, const uint8_t *buf, size_t len, uint32_t width,
+			uint32_t height) {
+		std::string path = outputDir + separator() + fileName + (jpegWriter ? ".jpg" : ".png");
+		if (jpegWriter)
+			return writeJpeg(fileName, path, buf, len, width, height);
+#ifndef _WIN32
+		if (io && !store)
+			return writePngAsync(path, buf, width, height);
+#endif
+#ifdef ZLIB_FOUND
+		static thread_local std::vector<uint8_t> encoded;
+#ifndef _WIN32
+		if (store) {
+			encoded.resize(pngEncoder->maxEncodedSize(width, height, channels, pngParams));
+			size_t pngLen = encodePng(buf, width, height, encoded.data(), encoded.size());
+			return pngLen && store->append(fileName, width, height, (uint16_t) channels,
+					FRAME_FORMAT_PNG, encoded.data(), pngLen);
+		}
+#endif
+		return prefiltered ?
+				pngEncoder->writeFiltered(path, buf, width, height, channels, pngParams,
+						encoded) :
+				pngEncoder->write(path, buf, width, height, channels, width * channels,
+						pngParams, encoded);
+#else
+#ifndef _WIN32
+		if (store) {
+			int pngLen = 0;
+			auto png = stbi_write_png_to_mem(buf, width * channels, width, height,
+					channels, &pngLen);
+			bool rc = png && store->append(fileName, width, height, (uint16_t) channels,
+					FRAME_FORMAT_PNG, png, pngLen);
+			STBIW_FREE(png);
+			return rc;
+		}
+#endif
+		return stbi_write_png(path.c_str(), width, height, channels, buf,
+				width * channels) != 0;
+#endif
+	}
+private:
+	bool writeJpeg(const std::string &fileName, const std::string &path, const uint8_t *buf,
+			size_t len, uint32_t width, uint32_t height) {
+#ifndef _WIN32
+		if (io && !store) {
+			auto out = acquireIoBuffer(JpegWriter::maxHeaderSize() + len);
+			if (!out)
+				return false;
+			size_t jpegLen = jpegWriter->write(buf, len, width, height, out->data(),
+					out->getCapacity());
+			if (!jpegLen) {
+				releaseIoBuffer(out);
+				return false;
+			}
+			writeAsync(path, out, jpegLen);
+			return true;
+		}
+#endif
+		static thread_local std::vector<uint8_t> jpegScratch;
+#ifndef _WIN32
+		if (store) {
+			jpegScratch.resize(JpegWriter::maxHeaderSize() + len);
+			size_t jpegLen = jpegWriter->write(buf, len, width, height, jpegScratch.data(),
+					jpegScratch.size());
+			return jpegLen && store->append(fileName, width, height, 3, FRAME_FORMAT_JPEG,
+					jpegScratch.data(), jpegLen);
+		}
+#endif
+		return jpegWriter->write(path, buf, len, width, height, jpegScratch);
+	}
+#ifdef ZLIB_FOUND
+	size_t encodePng(const uint8_t *buf, uint32_t width, uint32_t height, uint8_t *out,
+			size_t outSize) {
+		return prefiltered ?
+				pngEncoder->encodeFiltered(buf, width, height, channels, pngParams, out,
+						outSize) :
+				pngEncoder->encode(buf, width, height, channels, width * channels,
+						pngParams, out, outSize);
+	}
+#endif
+#ifndef _WIN32
+	// file is encoded into an I/O buffer and written asynchronously
+	bool writePngAsync(const std::string &path, const uint8_t *buf, uint32_t width,
+			uint32_t height) {
+#ifdef ZLIB_FOUND
+		auto out = acquireIoBuffer(pngEncoder->maxEncodedSize(width, height, channels,
+				pngParams));
+		if (!out)
+			return false;
+		size_t pngLen = encodePng(buf, width, height, out->data(), out->getCapacity());
+#else
+		auto out = acquireIoBuffer(0);
+		if (!out)
+			return false;
+		int stbLen = 0;
+		auto png = stbi_write_png_to_mem(buf, width * channels, width, height, channels,
+				&stbLen);
+		size_t pngLen = png ? (size_t) stbLen : 0;
+		if (pngLen > out->getCapacity()) {
+			releaseIoBuffer(out);
+			out = new IoBuffer(pngLen);
+		}
+		if (pngLen)
+			memcpy(out->data(), png, pngLen);
+		STBIW_FREE(png);
+#endif
+		if (!pngLen) {
+			releaseIoBuffer(out);
+			return false;
+		}
+		writeAsync(path, out, pngLen);
+		return true;
+	}
+	// buffer of at least len bytes: pooled, unless len is larger than pooled
+	// buffers. Waits for a pooled buffer once the limit is reached
+	IoBuffer* acquireIoBuffer(size_t len) {
+		if (len > ioBufferSize)
+			return new IoBuffer(len);
+		IoBuffer *out = nullptr;
+		if (ioBuffers.tryPop(out))
+			return out;
+		if (ioBuffersAllocated++ < maxIoBuffers)
+			return new IoBuffer(ioBufferSize);
+		ioBuffersAllocated--;
+		return ioBuffers.waitAndPop(out) ? out : nullptr;
+	}
+	// oversized buffers are not pooled
+	void releaseIoBuffer(IoBuffer *buffer) {
+		if (buffer->getCapacity() == ioBufferSize)
+			ioBuffers.push(buffer);
+		else
+			delete buffer;
+	}
+	void writeAsync(const std::string &path, IoBuffer *out, size_t len) {
+		io->write(path, std::unique_ptr<IoBuffer>(out), len, directWrite,
+				[this](IoRequest &req) {
+			if (req.error)
+				std::cerr << "Failed to write " << req.path << ": "
+						<< strerror(req.error) << std::endl;
+			releaseIoBuffer(req.buffer.release());
+		});
+	}
+#endif
+
+	std::string outputDir;
+	uint32_t channels;
+	const JpegWriter *jpegWriter;
+#ifdef ZLIB_FOUND
+	PngEncoder *pngEncoder;
+	PngEncodeParams pngParams;
+	bool prefiltered;
+#endif
+#ifndef _WIN32
+	FrameStoreWriter *store;
+	IoEngine *io;
+	size_t ioBufferSize;
+	size_t maxIoBuffers;
+	BlockingQueue<IoBuffer*> ioBuffers;
+	std::atomic<size_t> ioBuffersAllocated;
+	bool directWrite;
+#endif
+};
+
+// Writes raw frames: copies them straight into a frame store and ring,
+// decoding frames compressed on the device straight into them, or, as the
+// null sink, discards them, still decoding compressed frames.
+//
+// write() is called from a single thread.
+class RawFrameSink {
+public:
+	// frames of channels 8 bit samples, compressed ones decoded with tileDecoder
+	RawFrameSink(uint32_t channels, TileDecoder *tileDecoder, bool nullOutput) :
+			channels(channels), tileDecoder(tileDecoder), nullOutput(nullOutput)
+#ifndef _WIN32
+			, store(nullptr)
+#endif
+#ifdef __linux__
+			, ring(nullptr)
+#endif
+	{
+	}
+#ifndef _WIN32
+	void setStore(FrameStoreWriter *frameStore) {
+		store = frameStore;
+	}
+#endif
+#ifdef __linux__
+	void setRing(FrameRingWriter *frameRing) {
+		ring = frameRing;
+	}
+#endif
+	// write frame of len bytes, packed if compressed. Returns false if
+	// any of its outputs failed
+	bool write(const std::string &fileName, const uint8_t *data, size_t len, uint32_t width,
+			uint32_t height, bool compressed) {
+		bool written = true;
+#ifndef _WIN32
+		if (store && !(compressed ? put(*store, fileName, data, len, width, height) :
+				store->append(fileName, width, height, (uint16_t) channels, FRAME_FORMAT_RAW,
+						data, len))) {
+			std::cerr << "Failed to store " << fileName << std::endl;
+			written = false;
+		}
+#endif
+#ifdef __linux__
+		if (ring) {
+			uint64_t rawSize = compressed ? (uint64_t) width * height * channels : len;
+			if (rawSize > ring->getSlotSize()) {
+				std::cerr << "Failed to publish " << fileName
+						<< ": frame is larger than ring slot" << std::endl;
+				written = false;
+			} else if (!(compressed ? put(*ring, fileName, data, len, width, height) :
+					ring->publish(fileName, width, height, (uint16_t) channels,
+							FRAME_FORMAT_RAW, data, len))) {
+				std::cerr << "Failed to publish " << fileName << std::endl;
+				written = false;
+			}
+		}
+#endif
+		// null sink still pays for decoding
+		if (nullOutput && compressed) {
+			decoded.resize((size_t) width * height * channels);
+			written = tileDecoder->decode(data, len, width, height, channels, decoded.data(),
+					(size_t) width * channels);
+		}
+		return written;
+	}
+private:
+	// Decode compressed frame into target's reserved space. A frame that
+	// fails to decode is not committed: the store's readers skip its entry,
+	// and the ring reuses its slot for the next frame
+	template<typename T> bool put(T &target, const std::string &fileName, const uint8_t *data,
+			size_t len, uint32_t width, uint32_t height) {
+		uint64_t index = 0;
+		auto dest = target.reserve(fileName, width, height, (uint16_t) channels,
+				FRAME_FORMAT_RAW, (uint64_t) width * height * channels, index);
+		if (!dest)
+			return false;
+		if (!tileDecoder->decode(data, len, width, height, channels, dest,
+				(size_t) width * channels)) {
+			std::cerr << "Failed to decode " << fileName << std::endl;
+			return false;
+		}
+		target.commit(index);
+		return true;
+	}
+
+	uint32_t channels;
+	TileDecoder *tileDecoder;
+	bool nullOutput;
+	std::vector<uint8_t> decoded;
+#ifndef _WIN32
+	FrameStoreWriter *store;
+#endif
+#ifdef __linux__
+	FrameRingWriter *ring;
+#endif
+};
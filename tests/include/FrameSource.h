@@ -0,0 +1,572 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include "windirent.h"
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "BlockingQueue.h"
+
+inline char separator()
+{
+#ifdef _WIN32
+    return '\\';
+#else
+    return '/';
+#endif
+}
+
+// file name component of a path
+inline std::string baseName(const std::string &path) {
+	auto pos = path.find_last_of("/\\");
+	return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// directory dir is root, or lies below it; paths are compared once resolved,
+// so that different spellings of one directory match
+inline bool directoryWithin(const std::string &dir, const std::string &root) {
+#ifdef _WIN32
+	char dirPath[_MAX_PATH], rootPath[_MAX_PATH];
+	if (!_fullpath(dirPath, dir.c_str(), _MAX_PATH)
+			|| !_fullpath(rootPath, root.c_str(), _MAX_PATH))
+		return dir == root;
+#else
+	char dirPath[PATH_MAX], rootPath[PATH_MAX];
+	if (!realpath(dir.c_str(), dirPath) || !realpath(root.c_str(), rootPath))
+		return dir == root;
+#endif
+	std::string d(dirPath), r(rootPath);
+	return d.compare(0, r.size(), r) == 0 && (d.size() == r.size()
+			|| r.back() == separator() || d[r.size()] == separator());
+}
+
+inline bool sameDirectory(const std::string &a, const std::string &b) {
+	return directoryWithin(a, b) && directoryWithin(b, a);
+}
+
+// demosaic algorithms, from fastest to highest quality
+enum eDemosaic {
+	DEMOSAIC_DEFAULT = -1,
+	DEMOSAIC_BILINEAR,
+	DEMOSAIC_MHC,
+	DEMOSAIC_EDGE,
+	DEMOSAIC_COUNT
+};
+
+inline const char* demosaicName(eDemosaic demosaic) {
+	const char *names[] = { "bilinear", "mhc", "edge" };
+	return demosaic >= 0 && demosaic < DEMOSAIC_COUNT ? names[demosaic] : "default";
+}
+
+inline bool parseDemosaic(const std::string &name, eDemosaic &demosaic) {
+	for (int i = 0; i < DEMOSAIC_COUNT; ++i) {
+		if (name == demosaicName((eDemosaic) i)) {
+			demosaic = (eDemosaic) i;
+			return true;
+		}
+	}
+	demosaic = DEMOSAIC_MHC;
+	return false;
+}
+
+// Request to process one frame. A request with an empty path
+// signals the end of the frame stream.
+struct FrameRequest {
+	FrameRequest() : arrival(std::chrono::high_resolution_clock::now()), tag(0),
+			demosaic(DEMOSAIC_DEFAULT) {
+	}
+	explicit FrameRequest(const std::string &filePath) :
+			path(filePath), arrival(std::chrono::high_resolution_clock::now()), tag(0),
+			demosaic(DEMOSAIC_DEFAULT) {
+	}
+	FrameRequest(const std::string &filePath, const std::string &frameName) :
+			path(filePath), name(frameName), arrival(
+					std::chrono::high_resolution_clock::now()), tag(0),
+			demosaic(DEMOSAIC_DEFAULT) {
+	}
+	bool endOfStream() const {
+		return path.empty();
+	}
+	// name of frame's outputs: file name, unless set by the source
+	std::string outputName() const {
+		return name.empty() ? baseName(path) : name;
+	}
+	std::string path;
+	std::string name;
+	std::chrono::high_resolution_clock::time_point arrival;
+	// set by source, and handed back to it on completion
+	uint64_t tag;
+	// demosaic algorithm of frame, or default of the run
+	eDemosaic demosaic;
+};
+
+// match file name against glob pattern with '*' and '?' wildcards
+inline bool globMatch(const char *pattern, const char *name) {
+	const char *star = nullptr;
+	const char *resume = nullptr;
+	while (*name) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (star) {
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return false;
+		}
+	}
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == 0;
+}
+
+// Selects files from an enumeration: by glob patterns on file name,
+// and by shard, so that several processes can split one job.
+// A file's shard is determined by a hash of its path relative to
+// the enumeration root, so every process assigns it to the same shard
+// whatever order it enumerates files in.
+struct FileSelector {
+	FileSelector() : shardIndex(0), shardCount(1) {
+	}
+	// parse shard as "index/count"
+	bool setShard(const std::string &shard) {
+		unsigned index = 0, count = 0;
+		if (sscanf(shard.c_str(), "%u/%u", &index, &count) != 2 || !count
+				|| index >= count)
+			return false;
+		shardIndex = index;
+		shardCount = count;
+		return true;
+	}
+	bool matches(const char *fileName) const {
+		if (patterns.empty())
+			return true;
+		for (auto &p : patterns) {
+			if (globMatch(p.c_str(), fileName))
+				return true;
+		}
+		return false;
+	}
+	bool inShard(uint64_t key) const {
+		return shardCount <= 1 || key % shardCount == shardIndex;
+	}
+	// FNV-1a
+	static uint64_t hash(const std::string &str) {
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (unsigned char c : str) {
+			h ^= c;
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+	std::vector<std::string> patterns;
+	uint32_t shardIndex;
+	uint32_t shardCount;
+};
+
+// Produces frame requests. run() pushes requests into the queue
+// and finishes by pushing an end of stream request.
+class IFrameSource {
+public:
+	IFrameSource() : stopRequested(false) {
+	}
+	virtual ~IFrameSource() {
+	}
+	virtual void run(BlockingQueue<FrameRequest> &queue) = 0;
+	// ask run() to push end of stream and return
+	void stop() {
+		stopRequested = true;
+	}
+	// request with tag has been written, or has failed, latencyMs after
+	// its arrival. Called from pipeline threads
+	virtual void completed(uint64_t tag, bool success, double latencyMs) {
+		(void) tag;
+		(void) success;
+		(void) latencyMs;
+	}
+protected:
+	std::atomic<bool> stopRequested;
+};
+
+// Single pass over all selected files in a directory, and, if recursive,
+// in its subdirectories. Files are queued as they are enumerated, so the
+// pipeline starts on the first file while the rest of a large tree is read.
+// Frames in subdirectories are named by their relative path, with
+// separators replaced by '_', so outputs from different subdirectories
+// do not collide.
+// When outputs are written into the listed tree, the source is told to
+// snapshot it: the tree is listed in full before any file is queued, so
+// that no output is taken as an input.
+class DirectoryFrameSource: public IFrameSource {
+public:
+	explicit DirectoryFrameSource(const std::string &directory,
+			bool recursive = false, const FileSelector &selector = FileSelector(),
+			bool snapshot = false) :
+			dir(directory), recursive(recursive), selector(selector), snapshot(snapshot) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		if (snapshot) {
+			BlockingQueue<FrameRequest> listing;
+			listDirectory(dir, listing, stopRequested, recursive, selector);
+			FrameRequest request;
+			while (listing.tryPop(request))
+				queue.push(request);
+		} else {
+			listDirectory(dir, queue, stopRequested, recursive, selector);
+		}
+		queue.push(FrameRequest());
+	}
+	// queue selected files; relative paths of queued files are added
+	// to listed, if given
+	static void listDirectory(const std::string &dir,
+			BlockingQueue<FrameRequest> &queue, std::atomic<bool> &stop,
+			bool recursive = false, const FileSelector &selector = FileSelector(),
+			std::unordered_set<std::string> *listed = nullptr) {
+		// relative paths of directories still to be listed
+		std::vector<std::string> pending(1);
+		bool isRoot = true;
+		while (!pending.empty() && !stop) {
+			std::string rel = pending.back();
+			pending.pop_back();
+			std::string path = rel.empty() ? dir : dir + separator() + rel;
+			auto entry = [&](const char *name, bool isDir) {
+				if (strcmp(".", name) == 0 || strcmp("..", name) == 0)
+					return;
+				std::string relName = rel.empty() ? name : rel + separator() + name;
+				if (isDir) {
+					if (recursive)
+						pending.push_back(relName);
+					return;
+				}
+				if (!selector.matches(name)
+						|| !selector.inShard(FileSelector::hash(relName)))
+					return;
+				std::string frameName;
+				if (!rel.empty()) {
+					frameName = relName;
+					for (auto &c : frameName) {
+						if (c == '/' || c == '\\')
+							c = '_';
+					}
+				}
+				if (listed)
+					listed->insert(relName);
+				queue.push(FrameRequest(path + separator() + name, frameName));
+			};
+			if (!enumerate(path, entry, stop) && isRoot)
+				std::cerr << "Unable to open image directory " << dir << std::endl;
+			isRoot = false;
+		}
+	}
+private:
+	// Call entry(name, isDirectory) for each entry of a directory.
+	// On Linux, entries are read in large getdents64 batches.
+	template<typename F> static bool enumerate(const std::string &path, F &entry,
+			std::atomic<bool> &stop) {
+#ifdef __linux__
+		int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		std::vector<char> buf(direntBatchBytes);
+		while (!stop) {
+			long len = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+			if (len <= 0)
+				break;
+			for (long pos = 0; pos < len;) {
+				auto d = (struct linux_dirent64*) (buf.data() + pos);
+				bool isDir = d->d_type == DT_DIR;
+				if (d->d_type == DT_UNKNOWN) {
+					struct stat st;
+					isDir = fstatat(fd, d->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+				}
+				entry(d->d_name, isDir);
+				pos += d->d_reclen;
+			}
+		}
+		close(fd);
+#else
+		auto d = opendir(path.c_str());
+		if (!d)
+			return false;
+		struct dirent *content = nullptr;
+		while (!stop && (content = readdir(d)) != nullptr)
+			entry(content->d_name, content->d_type == DT_DIR);
+		closedir(d);
+#endif
+		return true;
+	}
+#ifdef __linux__
+	struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+	static const size_t direntBatchBytes = 1 << 16;
+#endif
+	std::string dir;
+	bool recursive;
+	FileSelector selector;
+	bool snapshot;
+};
+
+// Single pass over files listed in a manifest: one path per line, relative
+// paths being relative to the manifest's directory. Selection by shard is
+// by line position in the manifest.
+class ManifestFrameSource: public IFrameSource {
+public:
+	ManifestFrameSource(const std::string &manifestPath,
+			const FileSelector &selector) :
+			manifest(manifestPath), selector(selector) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		auto f = fopen(manifest.c_str(), "rb");
+		if (!f) {
+			std::cerr << "Unable to open manifest " << manifest << std::endl;
+			queue.push(FrameRequest());
+			return;
+		}
+		auto pos = manifest.find_last_of("/\\");
+		std::string base = pos == std::string::npos ? "" : manifest.substr(0, pos + 1);
+		std::string line;
+		uint64_t index = 0;
+		int c = 0;
+		while (!stopRequested && c != EOF) {
+			c = fgetc(f);
+			if (c != EOF && c != '\n' && c != '\r') {
+				line += (char) c;
+				continue;
+			}
+			if (line.empty())
+				continue;
+			bool absolute = line[0] == '/' || line[0] == '\\'
+					|| (line.size() > 1 && line[1] == ':');
+			if (selector.inShard(index++) && selector.matches(baseName(line).c_str()))
+				queue.push(FrameRequest(absolute ? line : base + line));
+			line.clear();
+		}
+		fclose(f);
+		queue.push(FrameRequest());
+	}
+private:
+	std::string manifest;
+	FileSelector selector;
+};
+
+#ifdef __linux__
+// all selected files currently in a directory, followed by every selected
+// file that is subsequently written to or moved into the directory.
+// Outputs must not be written to the watched directory, or they would
+// be taken as inputs in turn.
+class WatchFrameSource: public IFrameSource {
+public:
+	explicit WatchFrameSource(const std::string &directory,
+			const FileSelector &selector = FileSelector()) :
+			dir(directory), selector(selector) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0) {
+			std::cerr << "inotify_init1 failed: " << strerror(errno) << std::endl;
+			queue.push(FrameRequest());
+			return;
+		}
+		// add watch before listing, so no file is missed
+		if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			std::cerr << "Unable to watch image directory " << dir << std::endl;
+			close(fd);
+			queue.push(FrameRequest());
+			return;
+		}
+		std::unordered_set<std::string> listed;
+		DirectoryFrameSource::listDirectory(dir, queue, stopRequested, false,
+				selector, &listed);
+		// a file closed while the directory was listed is also reported by
+		// an event queued by then; drain those events, skipping listed files
+		while (!stopRequested && readEvents(fd, queue, &listed))
+			;
+		while (!stopRequested) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			int rc = poll(&pfd, 1, pollTimeoutMs);
+			if (rc < 0 && errno != EINTR)
+				break;
+			if (rc <= 0)
+				continue;
+			readEvents(fd, queue, nullptr);
+		}
+		close(fd);
+		queue.push(FrameRequest());
+	}
+	static const int pollTimeoutMs = 200;
+private:
+	// queue selected files of one batch of pending events, other than those
+	// in skip, if given; returns false if no event was pending
+	bool readEvents(int fd, BlockingQueue<FrameRequest> &queue,
+			const std::unordered_set<std::string> *skip) {
+		alignas(struct inotify_event) char buf[4096];
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0)
+			return false;
+		for (char *p = buf; p < buf + len;) {
+			auto evt = (struct inotify_event*) p;
+			if (evt->len && !(evt->mask & IN_ISDIR) && selector.matches(evt->name)
+					&& selector.inShard(FileSelector::hash(evt->name))
+					&& !(skip && skip->count(evt->name)))
+				queue.push(FrameRequest(dir + separator() + evt->name));
+			p += sizeof(struct inotify_event) + evt->len;
+		}
+		return true;
+	}
+	std::string dir;
+	FileSelector selector;
+};
+#endif
+
+#ifndef _WIN32
+// newline separated file paths read from a file descriptor, until end of file
+class StreamFrameSource: public IFrameSource {
+public:
+	explicit StreamFrameSource(int descriptor) :
+			fd(descriptor) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		readLines(fd, queue);
+		queue.push(FrameRequest());
+	}
+	static const int pollTimeoutMs = 200;
+protected:
+	// returns false if reading was stopped before end of file
+	bool readLines(int descriptor, BlockingQueue<FrameRequest> &queue) {
+		std::string line;
+		char buf[4096];
+		while (!stopRequested) {
+			struct pollfd pfd = { descriptor, POLLIN, 0 };
+			int rc = poll(&pfd, 1, pollTimeoutMs);
+			if (rc < 0 && errno != EINTR)
+				return true;
+			if (rc <= 0)
+				continue;
+			ssize_t len = read(descriptor, buf, sizeof(buf));
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			for (ssize_t i = 0; i < len; ++i) {
+				if (buf[i] == '\n' || buf[i] == '\r') {
+					if (!line.empty())
+						queue.push(parseLine(line));
+					line.clear();
+				} else {
+					line += buf[i];
+				}
+			}
+		}
+		if (!line.empty())
+			queue.push(parseLine(line));
+		return !stopRequested;
+	}
+	// path, optionally followed by a tab and the frame's demosaic algorithm
+	static FrameRequest parseLine(const std::string &line) {
+		auto tab = line.find_last_of('\t');
+		eDemosaic demosaic = DEMOSAIC_DEFAULT;
+		if (tab == std::string::npos || !parseDemosaic(line.substr(tab + 1), demosaic))
+			return FrameRequest(line);
+		FrameRequest request(line.substr(0, tab));
+		request.demosaic = demosaic;
+		return request;
+	}
+private:
+	int fd;
+};
+
+// newline separated file paths, read from clients connecting
+// to a local (Unix domain) socket, one client at a time
+class SocketFrameSource: public StreamFrameSource {
+public:
+	explicit SocketFrameSource(const std::string &socketPath) :
+			StreamFrameSource(-1), path(socketPath) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+		if (listener < 0
+				|| bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0
+				|| listen(listener, 4) < 0) {
+			std::cerr << "Unable to listen on socket " << path << ": "
+					<< strerror(errno) << std::endl;
+			if (listener >= 0)
+				close(listener);
+			queue.push(FrameRequest());
+			return;
+		}
+		while (!stopRequested) {
+			struct pollfd pfd = { listener, POLLIN, 0 };
+			int rc = poll(&pfd, 1, pollTimeoutMs);
+			if (rc < 0 && errno != EINTR)
+				break;
+			if (rc <= 0)
+				continue;
+			int client = accept(listener, nullptr, nullptr);
+			if (client < 0)
+				continue;
+			readLines(client, queue);
+			close(client);
+		}
+		close(listener);
+		unlink(path.c_str());
+		queue.push(FrameRequest());
+	}
+private:
+	std::string path;
+};
+#endif
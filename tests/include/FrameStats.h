@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Per-frame statistics accumulated by the demosaic kernels when built with
+// FRAME_STATS, for auto exposure, auto white balance and focus.
+//
+// The device buffer holds 256 bin histograms of output R, G and B, then
+// 64 bit sums, as (low, high) 32 bit words, of R, G and B, of the squared
+// Laplacian of the levelled Bayer samples of each pixel's colour, and of
+// pixels. parse() reduces the buffer to a summary: grey-world white balance
+// gains, exposure from mean luma, median green and clipped pixels, and
+// sharpness as the mean squared Laplacian.
+struct FrameStats {
+	static const uint32_t bins = 256;
+	enum eSum {
+		SUM_R, SUM_G, SUM_B, SUM_SHARPNESS, SUM_PIXELS, NUM_SUMS
+	};
+	static const uint32_t words = 3 * bins + 2 * NUM_SUMS;
+	static size_t bufferSize() {
+		return words * sizeof(uint32_t);
+	}
+
+	FrameStats() : pixels(0), meanLuma(0), medianGreen(0), shadowClipped(0),
+			highlightClipped(0), sharpness(0) {
+		for (int i = 0; i < 3; ++i)
+			mean[i] = gain[i] = 0;
+	}
+
+	bool parse(const uint32_t *stats) {
+		auto sum = [stats](uint32_t i) {
+			const uint32_t *p = stats + 3 * bins + 2 * i;
+			return (uint64_t) p[0] | ((uint64_t) p[1] << 32);
+		};
+		pixels = sum(SUM_PIXELS);
+		if (!pixels)
+			return false;
+		for (int i = 0; i < 3; ++i)
+			mean[i] = sum(SUM_R + i) / (double) pixels;
+		// grey world: scale red and blue to the green mean
+		for (int i = 0; i < 3; ++i)
+			gain[i] = mean[i] > 0 ? mean[1] / mean[i] : 1.0;
+		meanLuma = 0.299 * mean[0] + 0.587 * mean[1] + 0.114 * mean[2];
+		const uint32_t *green = stats + bins;
+		uint64_t count = 0;
+		medianGreen = bins - 1;
+		for (uint32_t i = 0; i < bins; ++i) {
+			count += green[i];
+			if (2 * count >= pixels) {
+				medianGreen = i;
+				break;
+			}
+		}
+		uint64_t low = 0, high = 0;
+		for (int c = 0; c < 3; ++c) {
+			low += stats[c * bins];
+			high += stats[c * bins + bins - 1];
+		}
+		shadowClipped = low / (3.0 * pixels);
+		highlightClipped = high / (3.0 * pixels);
+		sharpness = sum(SUM_SHARPNESS) / (double) pixels;
+		return true;
+	}
+
+	static const char* csvHeader() {
+		return "frame,mean_r,mean_g,mean_b,gain_r,gain_b,mean_luma,median_g,"
+				"shadow_clipped,highlight_clipped,sharpness\n";
+	}
+	bool writeCsv(FILE *fp, const std::string &frame) const {
+		return fprintf(fp, "%s,%.3f,%.3f,%.3f,%.4f,%.4f,%.3f,%u,%.6f,%.6f,%.3f\n",
+				frame.c_str(), mean[0], mean[1], mean[2], gain[0], gain[2], meanLuma,
+				medianGreen, shadowClipped, highlightClipped, sharpness) > 0;
+	}
+
+	uint64_t pixels;
+	double mean[3];
+	// white balance gains, relative to green
+	double gain[3];
+	double meanLuma;
+	uint32_t medianGreen;
+	// fraction of samples at 0, and at 255
+	double shadowClipped;
+	double highlightClipped;
+	// mean squared Laplacian; larger is sharper
+	double sharpness;
+};
@@ -0,0 +1,408 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+// Single file store of output frames, memory mapped for writing and reading.
+//
+// Layout: header page, first index chunk, then frame data.
+// Each frame's data is page aligned and preceded by its source name.
+// When the index fills up, a further chunk of twice the size of the last
+// is chained on in the data area, and its offset recorded in the header.
+// Index entries are reserved in order, and committed once their frame
+// data has been written, so a reader skips frames still being written.
+//
+// The writer reserves a virtual address range for the maximum store size up
+// front, and maps the file into it as the file grows (with fallocate),
+// so pointers to frame data stay valid while other frames are appended.
+
+enum eFrameFormat {
+	FRAME_FORMAT_RAW = 0, FRAME_FORMAT_PNG = 1, FRAME_FORMAT_JPEG = 2
+};
+
+const uint32_t frameStoreMaxIndexChunks = 32;
+
+struct FrameStoreHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t pageSize;
+	// capacity of first index chunk
+	uint64_t indexCapacity;
+	uint64_t dataOffset;
+	// number of index entries reserved
+	uint64_t frameCount;
+	// end of frame data
+	uint64_t dataEnd;
+	// number of index chunks, and their offsets
+	uint64_t indexChunks;
+	uint64_t indexChunkOffset[frameStoreMaxIndexChunks];
+};
+
+struct FrameStoreEntry {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t nameOffset;
+	uint32_t nameLength;
+	uint32_t width;
+	uint32_t height;
+	uint16_t channels;
+	uint16_t format;
+	uint32_t committed;
+	uint8_t reserved[20];
+};
+static_assert(sizeof(FrameStoreEntry) == 64, "frame store entry must be 64 bytes");
+
+const char frameStoreMagic[8] = { 'L', 'T', 'K', 'F', 'R', 'M', 'S', '1' };
+const uint32_t frameStoreVersion = 2;
+
+// index chunk holding entry frameIndex, and entry's position within it.
+// Chunk k holds indexCapacity << k entries
+inline uint32_t frameStoreIndexChunk(uint64_t indexCapacity, uint64_t frameIndex,
+		uint64_t &entryInChunk) {
+	uint64_t q = frameIndex / indexCapacity + 1;
+	uint32_t chunk = 0;
+	while (q >>= 1)
+		chunk++;
+	entryInChunk = frameIndex - indexCapacity * ((1ULL << chunk) - 1);
+	return chunk;
+}
+
+// frame returned by FrameStoreReader
+struct FrameStoreFrame {
+	FrameStoreFrame() : data(nullptr), size(0), width(0), height(0), channels(0),
+						format(FRAME_FORMAT_RAW) {
+	}
+	const uint8_t *data;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+	uint16_t channels;
+	eFrameFormat format;
+	std::string name;
+};
+
+// Appends frames to a store. reserve(), commit() and append()
+// may be called concurrently from multiple threads.
+class FrameStoreWriter {
+public:
+	FrameStoreWriter() : fd(-1), base(nullptr), pageSize(0), maxSize(0), mappedSize(0),
+						 growSize(0), indexEnd(0), header(nullptr) {
+	}
+	~FrameStoreWriter() {
+		close();
+	}
+	bool create(const std::string &path, uint64_t indexCapacity = 1 << 20,
+			uint64_t maxStoreSize = 1ULL << 40, uint64_t growBy = 256 << 20) {
+		pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+		if (!indexCapacity)
+			indexCapacity = 1;
+		maxSize = roundUp(maxStoreSize);
+		growSize = roundUp(growBy ? growBy : pageSize);
+		uint64_t dataOffset = roundUp(pageSize + indexCapacity * sizeof(FrameStoreEntry));
+		if (dataOffset >= maxSize) {
+			std::cerr << "Frame store index does not fit in maximum store size" << std::endl;
+			return false;
+		}
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			std::cerr << "Unable to create frame store " << path << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		// reserve address space for whole store
+		void *addr = mmap(nullptr, maxSize, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED) {
+			std::cerr << "Unable to reserve frame store address space: " << strerror(errno) << std::endl;
+			close();
+			return false;
+		}
+		base = (uint8_t*) addr;
+		// index is sparse until used
+		if (ftruncate(fd, (off_t) dataOffset) != 0 || !grow(dataOffset + growSize)) {
+			close();
+			return false;
+		}
+		header = (FrameStoreHeader*) base;
+		memcpy(header->magic, frameStoreMagic, sizeof(frameStoreMagic));
+		header->version = frameStoreVersion;
+		header->pageSize = (uint32_t) pageSize;
+		header->indexCapacity = indexCapacity;
+		header->dataOffset = dataOffset;
+		header->frameCount = 0;
+		header->dataEnd = dataOffset;
+		header->indexChunks = 1;
+		header->indexChunkOffset[0] = pageSize;
+		indexEnd = indexCapacity;
+		return true;
+	}
+	// Reserve space for a frame, returning pointer to its data in the mapped
+	// file, or nullptr on failure. Frame becomes visible to readers on commit()
+	uint8_t* reserve(const std::string &name, uint32_t width, uint32_t height,
+			uint16_t channels, eFrameFormat format, uint64_t size, uint64_t &frameIndex) {
+		std::lock_guard<std::mutex> lk(mutex);
+		if (!header || (header->frameCount == indexEnd && !chainIndex()))
+			return nullptr;
+		uint64_t nameOffset = header->dataEnd;
+		uint64_t offset = roundUp(nameOffset + name.size());
+		uint64_t end = roundUp(offset + size);
+		if (end > mappedSize && !grow(std::max(end, mappedSize + growSize)))
+			return nullptr;
+		memcpy(base + nameOffset, name.c_str(), name.size());
+		frameIndex = header->frameCount;
+		auto entry = entryAt(frameIndex);
+		entry->offset = offset;
+		entry->size = size;
+		entry->nameOffset = nameOffset;
+		entry->nameLength = (uint32_t) name.size();
+		entry->width = width;
+		entry->height = height;
+		entry->channels = channels;
+		entry->format = (uint16_t) format;
+		__atomic_store_n(&entry->committed, 0, __ATOMIC_RELEASE);
+		header->dataEnd = end;
+		__atomic_store_n(&header->frameCount, frameIndex + 1, __ATOMIC_RELEASE);
+		return base + offset;
+	}
+	// frame data has been written
+	void commit(uint64_t frameIndex) {
+		__atomic_store_n(&entryAt(frameIndex)->committed, 1, __ATOMIC_RELEASE);
+	}
+	// copy frame into store
+	bool append(const std::string &name, uint32_t width, uint32_t height,
+			uint16_t channels, eFrameFormat format, const uint8_t *data, uint64_t size) {
+		uint64_t frameIndex = 0;
+		auto dest = reserve(name, width, height, channels, format, size, frameIndex);
+		if (!dest)
+			return false;
+		memcpy(dest, data, size);
+		commit(frameIndex);
+		return true;
+	}
+	// flush mapped pages to disk
+	bool sync() {
+		std::lock_guard<std::mutex> lk(mutex);
+		return base && msync(base, mappedSize, MS_SYNC) == 0;
+	}
+	// flush, and trim preallocated space beyond last frame
+	void close() {
+		std::lock_guard<std::mutex> lk(mutex);
+		uint64_t dataEnd = header ? header->dataEnd : 0;
+		if (base) {
+			if (mappedSize)
+				msync(base, mappedSize, MS_SYNC);
+			munmap(base, maxSize);
+			base = nullptr;
+		}
+		if (fd >= 0) {
+			if (dataEnd && ftruncate(fd, (off_t) dataEnd) != 0)
+				std::cerr << "Unable to trim frame store: " << strerror(errno) << std::endl;
+			::close(fd);
+			fd = -1;
+		}
+		header = nullptr;
+		indexEnd = 0;
+		mappedSize = 0;
+	}
+private:
+	uint64_t roundUp(uint64_t val) const {
+		return (val + pageSize - 1) / pageSize * pageSize;
+	}
+	FrameStoreEntry* entryAt(uint64_t frameIndex) const {
+		uint64_t entryInChunk = 0;
+		uint32_t chunk = frameStoreIndexChunk(header->indexCapacity, frameIndex, entryInChunk);
+		return (FrameStoreEntry*) (base + header->indexChunkOffset[chunk]) + entryInChunk;
+	}
+	// index is full: chain on a chunk of twice the size of the last
+	bool chainIndex() {
+		uint64_t chunk = header->indexChunks;
+		if (chunk == frameStoreMaxIndexChunks) {
+			std::cerr << "Frame store index is full at " << indexEnd << " frames" << std::endl;
+			return false;
+		}
+		uint64_t capacity = header->indexCapacity << chunk;
+		uint64_t offset = header->dataEnd;
+		uint64_t end = roundUp(offset + capacity * sizeof(FrameStoreEntry));
+		if (end > mappedSize && !grow(std::max(end, mappedSize + growSize))) {
+			std::cerr << "No room to extend frame store index beyond " << indexEnd
+					<< " frames: create the store with an index capacity of at least "
+					<< indexEnd + capacity << " frames, or a larger maximum size" << std::endl;
+			return false;
+		}
+		header->indexChunkOffset[chunk] = offset;
+		header->dataEnd = end;
+		__atomic_store_n(&header->indexChunks, chunk + 1, __ATOMIC_RELEASE);
+		indexEnd += capacity;
+		return true;
+	}
+	// extend file and mapping to newSize
+	bool grow(uint64_t newSize) {
+		newSize = roundUp(newSize);
+		if (newSize > maxSize) {
+			std::cerr << "Frame store is full" << std::endl;
+			return false;
+		}
+		uint64_t len = newSize - mappedSize;
+#ifdef __linux__
+		int rc = fallocate(fd, 0, (off_t) mappedSize, (off_t) len) == 0 ? 0 : errno;
+		// file system without fallocate support
+		if (rc == EOPNOTSUPP)
+			rc = ftruncate(fd, (off_t) newSize) == 0 ? 0 : errno;
+#else
+		int rc = posix_fallocate(fd, (off_t) mappedSize, (off_t) len);
+#endif
+		if (rc) {
+			std::cerr << "Unable to grow frame store: " << strerror(rc) << std::endl;
+			return false;
+		}
+		void *addr = mmap(base + mappedSize, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, (off_t) mappedSize);
+		if (addr == MAP_FAILED) {
+			std::cerr << "Unable to map frame store: " << strerror(errno) << std::endl;
+			return false;
+		}
+		mappedSize = newSize;
+		return true;
+	}
+
+	std::mutex mutex;
+	int fd;
+	uint8_t *base;
+	uint64_t pageSize;
+	uint64_t maxSize;
+	uint64_t mappedSize;
+	uint64_t growSize;
+	// number of entries that fit in current index chunks
+	uint64_t indexEnd;
+	FrameStoreHeader *header;
+};
+
+// Random access to frames in a store, through a read only mapping of the
+// store as it was when opened. refresh() maps frames appended since.
+class FrameStoreReader {
+public:
+	FrameStoreReader() : fd(-1), base(nullptr), mappedSize(0) {
+	}
+	~FrameStoreReader() {
+		close();
+	}
+	bool open(const std::string &path) {
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "Unable to open frame store " << path << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		if (!refresh() || mappedSize < sizeof(FrameStoreHeader)
+				|| memcmp(header()->magic, frameStoreMagic, sizeof(frameStoreMagic)) != 0
+				|| header()->version != frameStoreVersion) {
+			std::cerr << "Not a frame store: " << path << std::endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+	// remap, to see frames appended since open
+	bool refresh() {
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0)
+			return false;
+		if (base)
+			munmap((void*) base, mappedSize);
+		base = nullptr;
+		mappedSize = (uint64_t) st.st_size;
+		if (!mappedSize)
+			return false;
+		void *addr = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			mappedSize = 0;
+			return false;
+		}
+		base = (const uint8_t*) addr;
+		return true;
+	}
+	void close() {
+		if (base)
+			munmap((void*) base, mappedSize);
+		base = nullptr;
+		mappedSize = 0;
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+	// number of frames, including any not yet committed
+	uint64_t size() const {
+		return base ? __atomic_load_n(&header()->frameCount, __ATOMIC_ACQUIRE) : 0;
+	}
+	// Get frame. Returns false if frame does not exist, is not yet
+	// committed, or lies beyond the current mapping
+	bool getFrame(uint64_t frameIndex, FrameStoreFrame &frame) const {
+		if (frameIndex >= size() || !header()->indexCapacity)
+			return false;
+		uint64_t entryInChunk = 0;
+		uint32_t chunk = frameStoreIndexChunk(header()->indexCapacity, frameIndex, entryInChunk);
+		if (chunk >= std::min<uint64_t>(
+				__atomic_load_n(&header()->indexChunks, __ATOMIC_ACQUIRE),
+				frameStoreMaxIndexChunks))
+			return false;
+		uint64_t entryOffset = header()->indexChunkOffset[chunk];
+		if (entryOffset > mappedSize
+				|| entryInChunk >= (mappedSize - entryOffset) / sizeof(FrameStoreEntry))
+			return false;
+		auto entry = (const FrameStoreEntry*) (base + entryOffset) + entryInChunk;
+		if (!__atomic_load_n(&entry->committed, __ATOMIC_ACQUIRE))
+			return false;
+		if (!within(entry->offset, entry->size) || !within(entry->nameOffset, entry->nameLength))
+			return false;
+		frame.data = base + entry->offset;
+		frame.size = entry->size;
+		frame.width = entry->width;
+		frame.height = entry->height;
+		frame.channels = entry->channels;
+		frame.format = (eFrameFormat) entry->format;
+		frame.name.assign((const char*) base + entry->nameOffset, entry->nameLength);
+		return true;
+	}
+private:
+	const FrameStoreHeader* header() const {
+		return (const FrameStoreHeader*) base;
+	}
+	// range lies within current mapping
+	bool within(uint64_t offset, uint64_t len) const {
+		return offset <= mappedSize && len <= mappedSize - offset;
+	}
+	int fd;
+	const uint8_t *base;
+	uint64_t mappedSize;
+};
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "BlockingQueue.h"
+#include "IoEngine.h"
+#include "ReorderBuffer.h"
+
+enum eStreamFormat {
+	STREAM_FORMAT_Y4M, STREAM_FORMAT_RGB, STREAM_FORMAT_RGBA, STREAM_FORMAT_NV12
+};
+
+// Writes RGBA frames, in sequence order, as a single raw video stream:
+// YUV4MPEG2 (4:2:0), or headerless rgb24, rgba or nv12, to stdout,
+// a FIFO or a file. Frames are pushed from any thread, in any order,
+// converted into page aligned buffers, and written by a writer thread
+// once all earlier frames have been written or skipped.
+//
+// When the output is a pipe, buffers are gifted to it with vmsplice rather
+// than copied. The pipe's reader may itself splice or tee the pages on, so
+// they can stay referenced after their bytes have left the pipe. Gifted
+// buffers are therefore never reused: each spliced frame is converted into
+// freshly mapped pages, which are unmapped once gifted.
+//
+// A slow reader holds back the frames pushed for it: a frame more than
+// maxFrames sequences ahead of the next frame to be written waits in push()
+// until the stream catches up, so no more than maxFrames frames are queued.
+// The next frame to be written is never held back. maxFrames must be more
+// than how far out of order frames can arrive at push(), so that threads
+// waiting there never hold up the frame the stream needs.
+class FrameStream {
+public:
+	// Open output for streaming: "-" is stdout, whose descriptor is
+	// then taken over by the stream, with stdout redirected to stderr,
+	// so that log output does not corrupt the stream.
+	// Returns descriptor, or -1 on failure
+	static int openOutput(const std::string &path) {
+		int fd = -1;
+		if (path == "-") {
+			fflush(stdout);
+			fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+			if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+				::close(fd);
+				fd = -1;
+			}
+		} else {
+			// FIFOs are opened as is, so this blocks until a reader opens them
+			fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+			struct stat st;
+			if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+					&& ftruncate(fd, 0) != 0) {
+				::close(fd);
+				fd = -1;
+			}
+		}
+		if (fd < 0)
+			std::cerr << "Unable to open stream output " << path << ": "
+					<< strerror(errno) << std::endl;
+		// a reader going away must not kill the process
+		signal(SIGPIPE, SIG_IGN);
+		return fd;
+	}
+	static bool parseFormat(const std::string &name, eStreamFormat &format) {
+		const char *names[] = { "y4m", "rgb", "rgba", "nv12" };
+		for (int i = 0; i < 4; ++i) {
+			if (name == names[i]) {
+				format = (eStreamFormat) i;
+				return true;
+			}
+		}
+		format = STREAM_FORMAT_Y4M;
+		return false;
+	}
+	// start streaming width x height frames to fd, which the stream then owns,
+	// with up to maxFrames frames queued
+	FrameStream(int fd, eStreamFormat format, uint32_t width, uint32_t height,
+			uint32_t fps, size_t maxFrames) :
+			fd(fd), format(format), width(width), height(height),
+			maxFrames(std::max<size_t>(1, maxFrames)), frames(true), nextSequence(0),
+			splice(false), failed(false), bytesWritten(0) {
+		frameSize = planeSize();
+		if (format == STREAM_FORMAT_Y4M)
+			frameSize += frameHeaderSize;
+#ifdef __linux__
+		struct stat st;
+		splice = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+		// larger pipe lets the writer run further ahead of the reader
+		if (splice)
+			fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#endif
+		if (format == STREAM_FORMAT_Y4M) {
+			char header[128];
+			int len = snprintf(header, sizeof(header),
+					"YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height,
+					fps ? fps : 30);
+			writeAll((const uint8_t*) header, (size_t) len);
+		}
+		writer = std::thread([this] {
+			writeFrames();
+		});
+	}
+	~FrameStream() {
+		close(0);
+	}
+	// Convert RGBA frame and queue it for writing as frame sequence,
+	// waiting while the frame is too far ahead of the stream.
+	// A frame that cannot be written is skipped, and false returned
+	bool push(uint64_t sequence, const uint8_t *rgba, uint32_t frameWidth,
+			uint32_t frameHeight) {
+		if (frameWidth == width && frameHeight == height) {
+			std::unique_lock<std::mutex> lk(windowMutex);
+			windowCondition.wait(lk, [this, sequence] {
+				return failed || sequence < nextSequence + maxFrames;
+			});
+		}
+		if (frameWidth != width || frameHeight != height || failed) {
+			skip(sequence);
+			return false;
+		}
+		auto buffer = acquire();
+		uint8_t *dest = buffer->data();
+		if (format == STREAM_FORMAT_Y4M) {
+			memcpy(dest, "FRAME\n", frameHeaderSize);
+			dest += frameHeaderSize;
+		}
+		convert(rgba, dest);
+		frames.push(sequence, StreamItem(buffer));
+		return true;
+	}
+	// frame sequence will not be written
+	void skip(uint64_t sequence) {
+		frames.push(sequence, StreamItem(nullptr));
+	}
+	// wait until total frames have been written or skipped, then
+	// close output
+	void close(uint64_t total) {
+		frames.close(total);
+		if (writer.joinable())
+			writer.join();
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+		// frames left behind by an early close
+		StreamItem item;
+		while (frames.tryPop(item))
+			delete item.buffer;
+		IoBuffer *buffer = nullptr;
+		while (freeBuffers.tryPop(buffer))
+			delete buffer;
+	}
+	size_t getFrameSize() const {
+		return frameSize;
+	}
+private:
+	struct StreamItem {
+		explicit StreamItem(IoBuffer *buf = nullptr) : buffer(buf) {
+		}
+		// null for a skipped frame
+		IoBuffer *buffer;
+	};
+	static const size_t frameHeaderSize = 6;
+
+	size_t planeSize() const {
+		size_t pixels = (size_t) width * height;
+		size_t chroma = (size_t) ((width + 1) / 2) * ((height + 1) / 2);
+		switch (format) {
+		case STREAM_FORMAT_RGB:
+			return pixels * 3;
+		case STREAM_FORMAT_RGBA:
+			return pixels * 4;
+		default:
+			return pixels + 2 * chroma;
+		}
+	}
+	// buffers are allocated on demand, so a frame waiting for earlier
+	// frames never holds up their conversion. Buffers to be spliced are
+	// mapped afresh
+	IoBuffer* acquire() {
+		IoBuffer *buffer = nullptr;
+		if (!splice && freeBuffers.tryPop(buffer))
+			return buffer;
+		return new IoBuffer(frameSize, splice);
+	}
+	static uint8_t lumaOf(int r, int g, int b) {
+		return (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+	}
+	// RGBA to output format, with BT.601 limited range YUV.
+	// Chroma is averaged over each 2x2 block
+	void convert(const uint8_t *rgba, uint8_t *dest) const {
+		size_t pixels = (size_t) width * height;
+		if (format == STREAM_FORMAT_RGBA) {
+			memcpy(dest, rgba, pixels * 4);
+			return;
+		}
+		if (format == STREAM_FORMAT_RGB) {
+			for (size_t i = 0; i < pixels; ++i) {
+				dest[3 * i] = rgba[4 * i];
+				dest[3 * i + 1] = rgba[4 * i + 1];
+				dest[3 * i + 2] = rgba[4 * i + 2];
+			}
+			return;
+		}
+		for (size_t i = 0; i < pixels; ++i)
+			dest[i] = lumaOf(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2]);
+		uint32_t chromaWidth = (width + 1) / 2;
+		uint32_t chromaHeight = (height + 1) / 2;
+		uint8_t *u = dest + pixels;
+		uint8_t *v = u + (size_t) chromaWidth * chromaHeight;
+		size_t pitch = (size_t) width * 4;
+		for (uint32_t cy = 0; cy < chromaHeight; ++cy) {
+			uint32_t y0 = 2 * cy;
+			uint32_t y1 = std::min(y0 + 1, height - 1);
+			for (uint32_t cx = 0; cx < chromaWidth; ++cx) {
+				uint32_t x0 = 2 * cx;
+				uint32_t x1 = std::min(x0 + 1, width - 1);
+				const uint8_t *p[4] = { rgba + y0 * pitch + x0 * 4, rgba + y0 * pitch + x1 * 4,
+						rgba + y1 * pitch + x0 * 4, rgba + y1 * pitch + x1 * 4 };
+				int r = (p[0][0] + p[1][0] + p[2][0] + p[3][0] + 2) >> 2;
+				int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+				int b = (p[0][2] + p[1][2] + p[2][2] + p[3][2] + 2) >> 2;
+				uint8_t cb = (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+				uint8_t cr = (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+				if (format == STREAM_FORMAT_NV12) {
+					size_t i = (size_t) cy * chromaWidth * 2 + cx * 2;
+					u[i] = cb;
+					u[i + 1] = cr;
+				} else {
+					size_t i = (size_t) cy * chromaWidth + cx;
+					u[i] = cb;
+					v[i] = cr;
+				}
+			}
+		}
+	}
+	bool writeAll(const uint8_t *data, size_t len) {
+		while (len && !failed) {
+			ssize_t rc = ::write(fd, data, len);
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				fail();
+				return false;
+			}
+			data += rc;
+			len -= (size_t) rc;
+			bytesWritten += (uint64_t) rc;
+		}
+		return !failed;
+	}
+#ifdef __linux__
+	// gift buffer's pages to pipe, blocking while the pipe is full.
+	// Returns false if output is not a pipe after all, with nothing written
+	bool spliceAll(const uint8_t *data, size_t len) {
+		bool spliced = false;
+		while (len && !failed) {
+			iovec iov = { (void*) data, len };
+			ssize_t rc = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+			if (rc < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EINVAL && !spliced)
+					return false;
+				fail();
+				break;
+			}
+			spliced = true;
+			data += rc;
+			len -= (size_t) rc;
+			bytesWritten += (uint64_t) rc;
+		}
+		return true;
+	}
+#endif
+	void fail() {
+		if (!failed)
+			std::cerr << "Frame stream closed: " << strerror(errno) << std::endl;
+		std::lock_guard<std::mutex> lk(windowMutex);
+		failed = true;
+		windowCondition.notify_all();
+	}
+	void writeFrames() {
+		StreamItem item;
+		while (frames.waitAndPop(item)) {
+			if (item.buffer)
+				writeFrame(item.buffer);
+			// frames held back in push() may now proceed
+			std::lock_guard<std::mutex> lk(windowMutex);
+			nextSequence++;
+			windowCondition.notify_all();
+		}
+	}
+	void writeFrame(IoBuffer *buffer) {
+#ifdef __linux__
+		if (splice) {
+			if (spliceAll(buffer->data(), frameSize)) {
+				// gifted pages belong to the pipe now
+				delete buffer;
+				return;
+			}
+			splice = false;
+		}
+#endif
+		writeAll(buffer->data(), frameSize);
+		freeBuffers.push(buffer);
+	}
+
+	int fd;
+	eStreamFormat format;
+	uint32_t width;
+	uint32_t height;
+	size_t frameSize;
+	size_t maxFrames;
+	ReorderBuffer<StreamItem> frames;
+	// sequence of next frame to be written
+	uint64_t nextSequence;
+	std::mutex windowMutex;
+	std::condition_variable windowCondition;
+	BlockingQueue<IoBuffer*> freeBuffers;
+	// cleared by writer if vmsplice is refused
+	std::atomic<bool> splice;
+	std::atomic<bool> failed;
+	uint64_t bytesWritten;
+	std::thread writer;
+};
+
+#endif
@@ -0,0 +1,675 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BlockingQueue.h"
+
+// Page aligned buffer, suitable for O_DIRECT writes.
+// A mapped buffer has pages of its own, which are unmapped on destruction
+// rather than returned to the heap, so pages gifted to the kernel are
+// never reused by the process.
+class IoBuffer {
+public:
+	explicit IoBuffer(size_t size, bool mapped = false) :
+			buf(nullptr), capacity(roundUp(size)), mapped(mapped) {
+		if (mapped) {
+			void *pages = mmap(nullptr, capacity ? capacity : alignment,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pages == MAP_FAILED)
+				throw std::bad_alloc();
+			buf = (uint8_t*) pages;
+		} else if (posix_memalign((void**) &buf, alignment, capacity ? capacity : alignment)) {
+			throw std::bad_alloc();
+		}
+	}
+	~IoBuffer() {
+		if (mapped)
+			munmap(buf, capacity ? capacity : alignment);
+		else
+			free(buf);
+	}
+	uint8_t* data() {
+		return buf;
+	}
+	size_t getCapacity() const {
+		return capacity;
+	}
+	static size_t roundUp(size_t size) {
+		return (size + alignment - 1) / alignment * alignment;
+	}
+	static const size_t alignment = 4096;
+private:
+	uint8_t *buf;
+	size_t capacity;
+	bool mapped;
+};
+
+// Whole file read or write, completed asynchronously by an IoEngine.
+// Completion callback, if any, runs on an engine thread.
+struct IoRequest {
+	enum eType {
+		IO_READ, IO_WRITE
+	};
+	IoRequest(eType type, const std::string &filePath) :
+			type(type), path(filePath), len(0), direct(false), error(0), fd(-1), offset(
+					0), pendingOps(0), fileSize(0), done(false) {
+	}
+	// wait for completion. Returns true on success
+	bool wait() {
+		std::unique_lock<std::mutex> lk(mutex);
+		condition.wait(lk, [this] {return done;});
+		return error == 0;
+	}
+
+	eType type;
+	std::string path;
+	// read: file contents
+	std::vector<uint8_t> data;
+	// write: source buffer and length
+	std::unique_ptr<IoBuffer> buffer;
+	size_t len;
+	// write with O_DIRECT, if file system supports it
+	bool direct;
+	// errno value, or 0 on success
+	int error;
+	std::function<void(IoRequest&)> callback;
+
+	// engine state
+	int fd;
+	size_t offset;
+	uint32_t pendingOps;
+	uint64_t fileSize;
+private:
+	friend class IoEngine;
+	void complete() {
+		if (callback)
+			callback(*this);
+		std::lock_guard<std::mutex> lk(mutex);
+		done = true;
+		condition.notify_all();
+	}
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool done;
+};
+
+enum eIoBackend {
+	IO_BACKEND_AUTO, IO_BACKEND_URING, IO_BACKEND_THREADS
+};
+
+// Asynchronous whole-file I/O.
+//
+// The io_uring backend runs each request as a chain of
+// openat/statx => read(s) or openat => write(s), then close, with one engine
+// thread batching submissions and completions of all requests in flight,
+// one io_uring_enter per batch. New requests wake the engine through an
+// eventfd read kept queued on the ring.
+//
+// The thread pool backend, used when io_uring is unavailable, runs the
+// same steps with blocking system calls.
+class IoEngine {
+public:
+	IoEngine(eIoBackend backend, size_t queueDepth = 64, size_t numThreads = 4) :
+			uring(false), stopping(false), outstanding(0), numThreads(
+					numThreads ? numThreads : 1)
+#ifdef __linux__
+					, ringFd(-1), wakeFd(-1), sqRing(nullptr), cqRing(nullptr), sqes(
+					nullptr), sqRingSize(0), cqRingSize(0), sqesSize(0), sqTailLocal(
+					0), inflight(0), wakeValue(0)
+#endif
+	{
+#ifdef __linux__
+		if (backend != IO_BACKEND_THREADS)
+			uring = initUring((unsigned) queueDepth);
+#endif
+		if (backend == IO_BACKEND_URING && !uring)
+			std::cout << "io_uring unavailable. Using I/O threads." << std::endl;
+		if (uring) {
+#ifdef __linux__
+			threads.emplace_back([this] {
+				runUring();
+			});
+#endif
+		} else {
+			for (size_t i = 0; i < this->numThreads; ++i)
+				threads.emplace_back([this] {
+					runBlocking();
+				});
+		}
+	}
+	~IoEngine() {
+		drain();
+		stopping = true;
+		wake();
+		requests.deactivate();
+		for (auto &t : threads)
+			t.join();
+#ifdef __linux__
+		if (uring)
+			closeUring();
+#endif
+	}
+	bool usingUring() const {
+		return uring;
+	}
+	// read whole file
+	std::shared_ptr<IoRequest> read(const std::string &path,
+			std::function<void(IoRequest&)> callback = nullptr) {
+		auto req = std::make_shared<IoRequest>(IoRequest::IO_READ, path);
+		req->callback = callback;
+		submit(req);
+		return req;
+	}
+	// write len bytes of buffer to file, replacing any existing file
+	std::shared_ptr<IoRequest> write(const std::string &path,
+			std::unique_ptr<IoBuffer> buffer, size_t len, bool direct,
+			std::function<void(IoRequest&)> callback = nullptr) {
+		auto req = std::make_shared<IoRequest>(IoRequest::IO_WRITE, path);
+		req->buffer = std::move(buffer);
+		req->len = len;
+		req->direct = direct;
+		req->callback = callback;
+		submit(req);
+		return req;
+	}
+	// wait until all submitted requests have completed
+	void drain() {
+		std::unique_lock<std::mutex> lk(drainMutex);
+		drainCondition.wait(lk, [this] {return outstanding == 0;});
+	}
+private:
+	typedef std::shared_ptr<IoRequest> IoRequestPtr;
+
+	void submit(IoRequestPtr req) {
+		{
+			std::lock_guard<std::mutex> lk(drainMutex);
+			outstanding++;
+		}
+		requests.push(req);
+		wake();
+	}
+	void finish(IoRequestPtr req) {
+		req->complete();
+		std::lock_guard<std::mutex> lk(drainMutex);
+		if (--outstanding == 0)
+			drainCondition.notify_all();
+	}
+	int openFlags(const IoRequest &req) const {
+		if (req.type == IoRequest::IO_READ)
+			return O_RDONLY | O_CLOEXEC;
+		int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+		if (req.direct)
+			flags |= O_DIRECT;
+#endif
+		return flags;
+	}
+	// number of bytes to write: O_DIRECT writes whole pages,
+	// and the file is truncated to its length afterwards
+	size_t writeLength(const IoRequest &req) const {
+		return req.direct ? IoBuffer::roundUp(req.len) : req.len;
+	}
+
+	// thread pool backend
+	void runBlocking() {
+		IoRequestPtr req;
+		while (requests.waitAndPop(req)) {
+			if (req->type == IoRequest::IO_READ)
+				blockingRead(*req);
+			else
+				blockingWrite(*req);
+			finish(req);
+			req = nullptr;
+		}
+	}
+	void blockingRead(IoRequest &req) {
+		req.fd = open(req.path.c_str(), openFlags(req));
+		if (req.fd < 0) {
+			req.error = errno;
+			return;
+		}
+		struct stat st;
+		if (fstat(req.fd, &st) == 0) {
+			req.data.resize((size_t) st.st_size);
+			while (req.offset < req.data.size()) {
+				ssize_t rc = pread(req.fd, req.data.data() + req.offset,
+						req.data.size() - req.offset, (off_t) req.offset);
+				if (rc < 0 && errno == EINTR)
+					continue;
+				if (rc <= 0) {
+					if (rc < 0)
+						req.error = errno;
+					req.data.resize(req.offset);
+					break;
+				}
+				req.offset += (size_t) rc;
+			}
+		} else {
+			req.error = errno;
+		}
+		close(req.fd);
+		req.fd = -1;
+	}
+	void blockingWrite(IoRequest &req) {
+		req.fd = open(req.path.c_str(), openFlags(req), 0644);
+		if (req.fd < 0 && req.direct && errno == EINVAL) {
+			req.direct = false;
+			req.fd = open(req.path.c_str(), openFlags(req), 0644);
+		}
+		if (req.fd < 0) {
+			req.error = errno;
+			return;
+		}
+		size_t total = writeLength(req);
+		while (req.offset < total) {
+			ssize_t rc = pwrite(req.fd, req.buffer->data() + req.offset,
+					total - req.offset, (off_t) req.offset);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0) {
+				req.error = rc < 0 ? errno : EIO;
+				break;
+			}
+			req.offset += (size_t) rc;
+		}
+		if (!req.error && total != req.len && ftruncate(req.fd, (off_t) req.len))
+			req.error = errno;
+		if (close(req.fd) && !req.error)
+			req.error = errno;
+		req.fd = -1;
+	}
+
+	void wake() {
+#ifdef __linux__
+		if (uring) {
+			uint64_t one = 1;
+			if (::write(wakeFd, &one, sizeof(one)) < 0)
+				std::cerr << "Unable to wake I/O engine" << std::endl;
+		}
+#endif
+	}
+
+#ifdef __linux__
+	enum eUringOp {
+		URING_OP_WAKE = 0,
+		URING_OP_OPEN = 1,
+		URING_OP_STATX = 2,
+		URING_OP_READ = 3,
+		URING_OP_WRITE = 4,
+		URING_OP_CLOSE = 5,
+		URING_OP_MASK = 7
+	};
+	// request in flight on the ring, with statx result
+	struct UringRequest {
+		IoRequestPtr req;
+		struct statx stx;
+	};
+
+	bool initUring(unsigned entries) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ringFd = (int) syscall(__NR_io_uring_setup, entries, &params);
+		if (ringFd < 0)
+			return false;
+		if (!(params.features & IORING_FEAT_NODROP) || !probeUring()) {
+			close(ringFd);
+			ringFd = -1;
+			return false;
+		}
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMap)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED) {
+			sqRing = nullptr;
+			closeUring();
+			return false;
+		}
+		if (singleMap) {
+			cqRing = sqRing;
+		} else {
+			cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED) {
+				cqRing = nullptr;
+				closeUring();
+				return false;
+			}
+		}
+		sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		void *s = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (s == MAP_FAILED) {
+			closeUring();
+			return false;
+		}
+		sqes = (struct io_uring_sqe*) s;
+		auto sq = (uint8_t*) sqRing;
+		sqHead = (unsigned*) (sq + params.sq_off.head);
+		sqTail = (unsigned*) (sq + params.sq_off.tail);
+		sqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+		sqEntries = params.sq_entries;
+		sqArray = (unsigned*) (sq + params.sq_off.array);
+		auto cq = (uint8_t*) cqRing;
+		cqHead = (unsigned*) (cq + params.cq_off.head);
+		cqTail = (unsigned*) (cq + params.cq_off.tail);
+		cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+		sqTailLocal = *sqTail;
+
+		wakeFd = eventfd(0, EFD_CLOEXEC);
+		if (wakeFd < 0) {
+			closeUring();
+			return false;
+		}
+		return true;
+	}
+	// check that kernel supports all operations used
+	bool probeUring() {
+		const int numOps = 64;
+		size_t len = sizeof(struct io_uring_probe) + numOps * sizeof(struct io_uring_probe_op);
+		std::vector<uint8_t> buf(len, 0);
+		auto probe = (struct io_uring_probe*) buf.data();
+		if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, numOps) < 0)
+			return false;
+		const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+				IORING_OP_WRITE, IORING_OP_CLOSE };
+		for (int op : ops) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+		return true;
+	}
+	void closeUring() {
+		if (sqes)
+			munmap(sqes, sqesSize);
+		if (cqRing && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing)
+			munmap(sqRing, sqRingSize);
+		sqes = nullptr;
+		sqRing = cqRing = nullptr;
+		if (ringFd >= 0)
+			close(ringFd);
+		if (wakeFd >= 0)
+			close(wakeFd);
+		ringFd = wakeFd = -1;
+	}
+	// next free submission queue entry, or nullptr if queue is full
+	struct io_uring_sqe* getSqe() {
+		unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		if (sqTailLocal - head >= sqEntries)
+			return nullptr;
+		unsigned index = sqTailLocal & sqMask;
+		auto sqe = sqes + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqArray[index] = index;
+		sqTailLocal++;
+		inflight++;
+		return sqe;
+	}
+	void setUserData(struct io_uring_sqe *sqe, UringRequest *ur, eUringOp op) {
+		sqe->user_data = (uint64_t) (uintptr_t) ur | op;
+	}
+	void queueWake() {
+		auto sqe = getSqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = wakeFd;
+		sqe->addr = (uint64_t) (uintptr_t) &wakeValue;
+		sqe->len = sizeof(wakeValue);
+		sqe->user_data = URING_OP_WAKE;
+	}
+	// each step of a request needs at most two entries; requests that
+	// cannot be started wait in backlog
+	bool startRequest(UringRequest *ur) {
+		auto req = ur->req.get();
+		auto open = getSqe();
+		if (!open)
+			return false;
+		open->opcode = IORING_OP_OPENAT;
+		open->fd = AT_FDCWD;
+		open->addr = (uint64_t) (uintptr_t) req->path.c_str();
+		open->len = 0644;
+		open->open_flags = (uint32_t) openFlags(*req);
+		setUserData(open, ur, URING_OP_OPEN);
+		req->pendingOps = 1;
+		if (req->type == IoRequest::IO_READ) {
+			auto stx = getSqe();
+			stx->opcode = IORING_OP_STATX;
+			stx->fd = AT_FDCWD;
+			stx->addr = (uint64_t) (uintptr_t) req->path.c_str();
+			stx->len = STATX_SIZE;
+			stx->off = (uint64_t) (uintptr_t) &ur->stx;
+			setUserData(stx, ur, URING_OP_STATX);
+			req->pendingOps++;
+		}
+		return true;
+	}
+	void queueTransfer(UringRequest *ur) {
+		auto req = ur->req.get();
+		auto sqe = getSqe();
+		sqe->fd = req->fd;
+		sqe->off = req->offset;
+		if (req->type == IoRequest::IO_READ) {
+			sqe->opcode = IORING_OP_READ;
+			sqe->addr = (uint64_t) (uintptr_t) (req->data.data() + req->offset);
+			sqe->len = (uint32_t) std::min<size_t>(req->data.size() - req->offset, 1u << 30);
+			setUserData(sqe, ur, URING_OP_READ);
+		} else {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->addr = (uint64_t) (uintptr_t) (req->buffer->data() + req->offset);
+			sqe->len = (uint32_t) std::min<size_t>(writeLength(*req) - req->offset, 1u << 30);
+			setUserData(sqe, ur, URING_OP_WRITE);
+		}
+		req->pendingOps = 1;
+	}
+	void queueClose(UringRequest *ur) {
+		auto req = ur->req.get();
+		if (req->fd < 0) {
+			finish(ur->req);
+			delete ur;
+			return;
+		}
+		// O_DIRECT writes whole pages
+		if (req->type == IoRequest::IO_WRITE && !req->error
+				&& writeLength(*req) != req->len && ftruncate(req->fd, (off_t) req->len))
+			req->error = errno;
+		auto sqe = getSqe();
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = req->fd;
+		setUserData(sqe, ur, URING_OP_CLOSE);
+		req->pendingOps = 1;
+	}
+	// advance request state machine on completion of one of its operations
+	void complete(UringRequest *ur, eUringOp op, int res) {
+		auto req = ur->req.get();
+		req->pendingOps--;
+		switch (op) {
+		case URING_OP_OPEN:
+			if (res >= 0) {
+				req->fd = res;
+			} else if (res == -EINVAL && req->direct) {
+				// file system does not support O_DIRECT
+				req->direct = false;
+				req->pendingOps = 0;
+				startRequest(ur);
+				return;
+			} else if (!req->error) {
+				req->error = -res;
+			}
+			break;
+		case URING_OP_STATX:
+			if (res < 0 && !req->error)
+				req->error = -res;
+			else if (res >= 0)
+				req->fileSize = ur->stx.stx_size;
+			break;
+		case URING_OP_READ:
+		case URING_OP_WRITE:
+			if (res < 0) {
+				req->error = -res;
+			} else if (res == 0) {
+				if (op == URING_OP_READ)
+					req->data.resize(req->offset);
+				else
+					req->error = EIO;
+			} else {
+				req->offset += (size_t) res;
+			}
+			break;
+		case URING_OP_CLOSE:
+			if (res < 0 && !req->error)
+				req->error = -res;
+			req->fd = -1;
+			finish(ur->req);
+			delete ur;
+			return;
+		default:
+			break;
+		}
+		if (req->pendingOps)
+			return;
+		if (req->error || (op == URING_OP_READ && res == 0)) {
+			queueClose(ur);
+			return;
+		}
+		if (op == URING_OP_OPEN || op == URING_OP_STATX) {
+			if (req->type == IoRequest::IO_READ)
+				req->data.resize(req->fileSize);
+		}
+		size_t total = req->type == IoRequest::IO_READ ? req->data.size() : writeLength(*req);
+		if (req->offset < total)
+			queueTransfer(ur);
+		else
+			queueClose(ur);
+	}
+	void runUring() {
+		std::vector<UringRequest*> backlog;
+		queueWake();
+		while (true) {
+			// start new requests while there is room for their first step
+			// and for the steps of requests already in flight
+			IoRequestPtr req;
+			while (backlog.size() < sqEntries && requests.tryPop(req))
+				backlog.push_back(new UringRequest { req, { } });
+			size_t started = 0;
+			while (started < backlog.size() && inflight + 2 <= sqEntries / 2
+					&& startRequest(backlog[started]))
+				started++;
+			backlog.erase(backlog.begin(), backlog.begin() + started);
+			if (stopping && inflight == 1 && backlog.empty())
+				break;
+
+			unsigned toSubmit = sqTailLocal - *sqTail;
+			__atomic_store_n(sqTail, sqTailLocal, __ATOMIC_RELEASE);
+			int rc = (int) syscall(__NR_io_uring_enter, ringFd, toSubmit, 1,
+					IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+				break;
+			}
+
+			// reap completions
+			unsigned head = *cqHead;
+			unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				auto cqe = cqes + (head & cqMask);
+				uint64_t data = cqe->user_data;
+				int res = cqe->res;
+				inflight--;
+				if (data == URING_OP_WAKE) {
+					queueWake();
+					continue;
+				}
+				complete((UringRequest*) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK),
+						(eUringOp) (data & URING_OP_MASK), res);
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+		// fail any requests that never started
+		for (auto ur : backlog) {
+			ur->req->error = ECANCELED;
+			finish(ur->req);
+			delete ur;
+		}
+	}
+#endif
+
+	bool uring;
+	std::atomic<bool> stopping;
+	BlockingQueue<IoRequestPtr> requests;
+	std::vector<std::thread> threads;
+	std::mutex drainMutex;
+	std::condition_variable drainCondition;
+	size_t outstanding;
+	size_t numThreads;
+#ifdef __linux__
+	int ringFd;
+	int wakeFd;
+	void *sqRing;
+	void *cqRing;
+	struct io_uring_sqe *sqes;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned sqTailLocal;
+	// submitted entries without completion
+	unsigned inflight;
+	uint64_t wakeValue;
+#endif
+};
+
+#endif
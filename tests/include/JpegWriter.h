@@ -0,0 +1,258 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Annex K tables: luminance, then chrominance
+static const uint8_t jpegBaseQuant[2][64] = {
+	{ 16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+	  14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+	  18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+	  49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99 },
+	{ 17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+	  24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+	  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+	  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99 } };
+static const uint8_t jpegNaturalOrder[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+static const uint8_t jpegDcBits[2][16] = {
+	{ 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 } };
+static const uint8_t jpegDcValues[2][12] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 } };
+static const uint8_t jpegAcBits[2][16] = {
+	{ 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+	{ 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 } };
+static const uint8_t jpegAcValues[2][162] = {
+	{ 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	  0xf9, 0xfa },
+	{ 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	  0xf9, 0xfa } };
+
+// Baseline JPEG (4:2:0, standard Huffman tables) for frames that are
+// transformed and entropy coded on the device by the kernels in jpegEncode.cl.
+//
+// The device needs quantization tables and Huffman codes, which are built
+// here from the quality setting, and passed to the kernels in one buffer.
+// Frames come back packed: a header of packHeaderSize bytes, holding the size
+// of the entropy coded data and an overflow flag, followed by the data, with
+// restart markers every restartMcus MCUs. The writer adds the JPEG headers
+// and end of image marker.
+class JpegWriter {
+public:
+	static const uint32_t restartMcus = 8;
+	static const uint32_t packHeaderSize = 16;
+	// bytes per MCU of a restart interval's device segment, and
+	// of the packed bitstream read back to the host
+	static const uint32_t segmentBytesPerMcu = 1024;
+	static const uint32_t packedBytesPerMcu = 384;
+
+	explicit JpegWriter(int quality) {
+		quality = std::min(std::max(quality, 1), 100);
+		int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+		tables.resize(tableSize);
+		for (int t = 0; t < 2; ++t) {
+			for (int i = 0; i < 64; ++i) {
+				int q = (jpegBaseQuant[t][i] * scale + 50) / 100;
+				quant[t][i] = (uint8_t) std::min(std::max(q, 1), 255);
+				tables[t * 64 + i] = quant[t][i];
+			}
+			buildCodes(jpegDcBits[t], jpegDcValues[t], tables.data() + tableDc + t * 16);
+			buildCodes(jpegAcBits[t], jpegAcValues[t], tables.data() + tableAc + t * 256);
+		}
+	}
+
+	// quantization tables and Huffman codes, for the device
+	const std::vector<uint32_t>& getDeviceTables() const {
+		return tables;
+	}
+
+	static uint32_t mcuCount(uint32_t width, uint32_t height) {
+		return ((width + 15) >> 4) * ((height + 15) >> 4);
+	}
+	static uint32_t segmentCount(uint32_t width, uint32_t height) {
+		return (mcuCount(width, height) + restartMcus - 1) / restartMcus;
+	}
+	// device buffer of quantized coefficients
+	static size_t coefficientSize(uint32_t width, uint32_t height) {
+		return (size_t) mcuCount(width, height) * 6 * 64 * sizeof(int16_t);
+	}
+	// device buffer of segment sizes, then segments
+	static uint32_t segmentCapacity() {
+		return restartMcus * segmentBytesPerMcu;
+	}
+	static size_t segmentBufferSize(uint32_t width, uint32_t height) {
+		uint32_t n = segmentCount(width, height);
+		return (size_t) (((n * 4 + 63) >> 6) << 6) + (size_t) n * segmentCapacity();
+	}
+	// packed frame read back from device
+	static size_t packedCapacity(uint32_t width, uint32_t height) {
+		return packHeaderSize + (size_t) mcuCount(width, height) * packedBytesPerMcu
+				+ (size_t) segmentCount(width, height) * 2;
+	}
+	// size of a packed frame, header included, or 0 if the
+	// bitstream did not fit the device buffers
+	static size_t packedSize(const uint8_t *packed, size_t capacity) {
+		uint32_t header[2];
+		memcpy(header, packed, sizeof(header));
+		if (header[1] || !header[0] || header[0] > capacity - packHeaderSize)
+			return 0;
+		return packHeaderSize + header[0];
+	}
+
+	static size_t maxHeaderSize() {
+		return 1024;
+	}
+
+	// JPEG file from packed frame, into caller's buffer.
+	// Returns number of bytes written, or 0 on failure,
+	// including when buffer is too small
+	size_t write(const uint8_t *packed, size_t packedLen, uint32_t width, uint32_t height,
+			uint8_t *out, size_t outSize) const {
+		size_t dataLen = packedLen - packHeaderSize;
+		if (packedLen <= packHeaderSize || width > 0xFFFF || height > 0xFFFF
+				|| outSize < maxHeaderSize() + dataLen)
+			return 0;
+		uint8_t *p = out;
+		p = marker(p, 0xD8);
+		// JFIF
+		static const uint8_t jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+		p = segment(p, 0xE0, sizeof(jfif));
+		p = put(p, jfif, sizeof(jfif));
+		// quantization tables, in zig-zag order
+		p = segment(p, 0xDB, 2 * 65);
+		for (int t = 0; t < 2; ++t) {
+			*p++ = (uint8_t) t;
+			for (int k = 0; k < 64; ++k)
+				*p++ = quant[t][jpegNaturalOrder[k]];
+		}
+		// frame: Y sampled 2x2, Cb and Cr 1x1
+		p = segment(p, 0xC0, 15);
+		*p++ = 8;
+		p = put16(p, (uint16_t) height);
+		p = put16(p, (uint16_t) width);
+		*p++ = 3;
+		static const uint8_t components[] = { 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1 };
+		p = put(p, components, sizeof(components));
+		// Huffman tables
+		for (int t = 0; t < 2; ++t) {
+			p = huffmanTable(p, (uint8_t) t, jpegDcBits[t], jpegDcValues[t]);
+			p = huffmanTable(p, (uint8_t) (0x10 | t), jpegAcBits[t], jpegAcValues[t]);
+		}
+		// restart interval
+		p = segment(p, 0xDD, 2);
+		p = put16(p, (uint16_t) restartMcus);
+		// scan
+		p = segment(p, 0xDA, 10);
+		static const uint8_t scan[] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+		p = put(p, scan, sizeof(scan));
+		p = put(p, packed + packHeaderSize, dataLen);
+		p = marker(p, 0xD9);
+		return (size_t) (p - out);
+	}
+
+	// JPEG file from packed frame
+	bool write(const std::string &fileName, const uint8_t *packed, size_t packedLen,
+			uint32_t width, uint32_t height, std::vector<uint8_t> &scratch) const {
+		scratch.resize(maxHeaderSize() + packedLen);
+		size_t len = write(packed, packedLen, width, height, scratch.data(), scratch.size());
+		if (!len)
+			return false;
+		auto fp = fopen(fileName.c_str(), "wb");
+		if (!fp)
+			return false;
+		bool rc = fwrite(scratch.data(), 1, len, fp) == len;
+		return (fclose(fp) == 0) && rc;
+	}
+private:
+	static const uint32_t tableDc = 128;
+	static const uint32_t tableAc = 160;
+	static const uint32_t tableSize = tableAc + 2 * 256;
+
+	// code of each symbol, as length << 16 | code (Annex C)
+	static void buildCodes(const uint8_t *bits, const uint8_t *values, uint32_t *codes) {
+		uint32_t code = 0;
+		size_t k = 0;
+		for (uint32_t len = 1; len <= 16; ++len) {
+			for (uint32_t i = 0; i < bits[len - 1]; ++i)
+				codes[values[k++]] = (len << 16) | code++;
+			code <<= 1;
+		}
+	}
+	static uint8_t* marker(uint8_t *p, uint8_t m) {
+		*p++ = 0xFF;
+		*p++ = m;
+		return p;
+	}
+	static uint8_t* put16(uint8_t *p, uint16_t v) {
+		*p++ = (uint8_t) (v >> 8);
+		*p++ = (uint8_t) v;
+		return p;
+	}
+	static uint8_t* put(uint8_t *p, const uint8_t *data, size_t len) {
+		memcpy(p, data, len);
+		return p + len;
+	}
+	// marker and length of segment with payload of len bytes
+	static uint8_t* segment(uint8_t *p, uint8_t m, size_t len) {
+		return put16(marker(p, m), (uint16_t) (len + 2));
+	}
+	static uint8_t* huffmanTable(uint8_t *p, uint8_t id, const uint8_t *bits,
+			const uint8_t *values) {
+		size_t count = 0;
+		for (int i = 0; i < 16; ++i)
+			count += bits[i];
+		p = segment(p, 0xC4, 17 + count);
+		*p++ = id;
+		p = put(p, bits, 16);
+		return put(p, values, count);
+	}
+
+	std::vector<uint32_t> tables;
+	uint8_t quant[2][64];
+};
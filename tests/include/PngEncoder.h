@@ -0,0 +1,430 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include "latke_config.h"
+
+#ifdef ZLIB_FOUND
+
+#include <zlib.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <vector>
+#include "ThreadPool.h"
+
+// PNG row filter. Adaptive chooses, for each row, the filter
+// with the minimum sum of absolute differences
+enum ePngFilter {
+	PNG_FILTER_NONE = 0,
+	PNG_FILTER_SUB = 1,
+	PNG_FILTER_UP = 2,
+	PNG_FILTER_AVERAGE = 3,
+	PNG_FILTER_PAETH = 4,
+	PNG_FILTER_ADAPTIVE = 5
+};
+
+struct PngEncodeParams {
+	PngEncodeParams() : filter(PNG_FILTER_ADAPTIVE), level(2), stripeRows(0) {
+	}
+	ePngFilter filter;
+	// zlib compression level, 0 to 9
+	int level;
+	// rows per independently compressed stripe (0 for automatic)
+	uint32_t stripeRows;
+};
+
+// Parallel PNG encoder for 8 bit images.
+//
+// Rows are split into stripes, which are filtered and deflated
+// independently on a thread pool, pigz-style: each stripe's compressor is
+// primed with the preceding 32K of filtered data, and all but the last
+// stripe end with a sync flush, so that the raw deflate streams concatenate
+// into a single zlib stream. Each stripe is stored in its own IDAT chunk.
+// The caller's thread compresses the first stripe.
+//
+// Rows may also be filtered elsewhere, for example on the device, and passed
+// to encodeFiltered() as scanlines, each prefixed by its filter type.
+//
+// encode() may be called concurrently from multiple threads.
+class PngEncoder {
+public:
+	explicit PngEncoder(size_t numThreads) :
+			pool(numThreads ? numThreads : 1), numThreads(numThreads ? numThreads : 1) {
+	}
+
+	// parse filter name {none,sub,up,average,paeth,adaptive}
+	static bool parseFilter(const std::string &name, ePngFilter &filter) {
+		static const char *names[] = { "none", "sub", "up", "average", "paeth",
+				"adaptive" };
+		for (int i = PNG_FILTER_NONE; i <= PNG_FILTER_ADAPTIVE; ++i) {
+			if (name == names[i]) {
+				filter = (ePngFilter) i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// upper bound on size of an encoded image
+	size_t maxEncodedSize(uint32_t width, uint32_t height, uint32_t channels,
+			const PngEncodeParams &params) const {
+		size_t rowLen = (size_t) width * channels + 1;
+		uint32_t rows = getStripeRows(width, height, channels, params);
+		uint32_t numStripes = (height + rows - 1) / rows;
+		size_t stripeLen = rowLen * rows;
+		size_t perStripe = compressBound((uLong) stripeLen) + 16 + chunkOverhead;
+		return signatureLen + (chunkOverhead + 13) + chunkOverhead
+				+ zlibHeaderLen + adlerLen + numStripes * perStripe;
+	}
+
+	// Encode image into caller's buffer.
+	// Returns number of bytes written, or 0 on failure, including
+	// when buffer is too small.
+	size_t encode(const uint8_t *pixels, uint32_t width, uint32_t height,
+			uint32_t channels, size_t stride, const PngEncodeParams &params,
+			uint8_t *out, size_t outSize) {
+		return encodeRows(pixels, stride, false, width, height, channels,
+				params, out, outSize);
+	}
+
+	// Encode filtered scanlines: height rows of 1 + width * channels bytes,
+	// each starting with its filter type. Filter in params is ignored.
+	size_t encodeFiltered(const uint8_t *scanlines, uint32_t width,
+			uint32_t height, uint32_t channels, const PngEncodeParams &params,
+			uint8_t *out, size_t outSize) {
+		return encodeRows(scanlines, (size_t) width * channels + 1, true, width,
+				height, channels, params, out, outSize);
+	}
+
+	// encode image to file
+	bool write(const std::string &fileName, const uint8_t *pixels,
+			uint32_t width, uint32_t height, uint32_t channels, size_t stride,
+			const PngEncodeParams &params, std::vector<uint8_t> &scratch) {
+		scratch.resize(maxEncodedSize(width, height, channels, params));
+		size_t len = encode(pixels, width, height, channels, stride, params,
+				scratch.data(), scratch.size());
+		return len && writeFile(fileName, scratch.data(), len);
+	}
+
+	// encode filtered scanlines to file
+	bool writeFiltered(const std::string &fileName, const uint8_t *scanlines,
+			uint32_t width, uint32_t height, uint32_t channels,
+			const PngEncodeParams &params, std::vector<uint8_t> &scratch) {
+		scratch.resize(maxEncodedSize(width, height, channels, params));
+		size_t len = encodeFiltered(scanlines, width, height, channels, params,
+				scratch.data(), scratch.size());
+		return len && writeFile(fileName, scratch.data(), len);
+	}
+
+	// filter image into scanlines, as passed to encodeFiltered()
+	static void filter(const uint8_t *pixels, uint32_t width, uint32_t height,
+			uint32_t channels, size_t stride, ePngFilter filter, uint8_t *scanlines) {
+		std::vector<uint8_t> candidate;
+		filterRows(pixels, width, channels, stride, filter, 0, height, scanlines,
+				candidate);
+	}
+private:
+	static bool writeFile(const std::string &fileName, const uint8_t *data,
+			size_t len) {
+		auto fp = fopen(fileName.c_str(), "wb");
+		if (!fp)
+			return false;
+		bool rc = fwrite(data, 1, len, fp) == len;
+		return (fclose(fp) == 0) && rc;
+	}
+	struct Stripe {
+		Stripe() : adler(1), crc(0), uncompressedLen(0) {
+		}
+		std::vector<uint8_t> data;
+		uLong adler;
+		uLong crc;
+		size_t uncompressedLen;
+	};
+
+	uint32_t getStripeRows(uint32_t width, uint32_t height, uint32_t channels,
+			const PngEncodeParams &params) const {
+		if (params.stripeRows)
+			return std::min(params.stripeRows, height);
+		size_t rowLen = (size_t) width * channels + 1;
+		// at least 256K per stripe, and at least four stripes per thread
+		size_t rows = (height + 4 * numThreads - 1) / (4 * numThreads);
+		rows = std::max(rows, (minStripeBytes + rowLen - 1) / rowLen);
+		return (uint32_t) std::max<size_t>(1, std::min<size_t>(rows, height));
+	}
+
+	// encode rows of pixels, or of scanlines already filtered
+	size_t encodeRows(const uint8_t *pixels, size_t stride, bool prefiltered,
+			uint32_t width, uint32_t height, uint32_t channels,
+			const PngEncodeParams &params, uint8_t *out, size_t outSize) {
+		if (!pixels || !out || !width || !height || channels < 1 || channels > 4)
+			return 0;
+		uint32_t rows = getStripeRows(width, height, channels, params);
+		uint32_t numStripes = (height + rows - 1) / rows;
+		std::vector<Stripe> stripes(numStripes);
+		std::vector<std::future<bool>> results;
+		for (uint32_t i = 1; i < numStripes; ++i) {
+			results.push_back(pool.enqueue([this, &stripes, i, pixels, stride,
+					prefiltered, width, height, channels, &params, rows] {
+				return compressStripe(stripes[i], pixels, stride, prefiltered,
+						width, height, channels, params, i * rows, rows);
+			}));
+		}
+		bool success = compressStripe(stripes[0], pixels, stride, prefiltered,
+				width, height, channels, params, 0, rows);
+		for (auto &r : results)
+			success = r.get() && success;
+		if (!success)
+			return 0;
+
+		// combine stripe checksums
+		uLong adler = stripes[0].adler;
+		for (uint32_t i = 1; i < numStripes; ++i)
+			adler = adler32_combine(adler, stripes[i].adler, (z_off_t) stripes[i].uncompressedLen);
+
+		size_t total = signatureLen + (chunkOverhead + 13) + chunkOverhead
+				+ zlibHeaderLen + adlerLen;
+		for (auto &s : stripes)
+			total += chunkOverhead + s.data.size();
+		if (total > outSize)
+			return 0;
+
+		static const uint8_t signature[signatureLen] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		uint8_t *p = out;
+		memcpy(p, signature, signatureLen);
+		p += signatureLen;
+
+		uint8_t ihdr[13];
+		put32(ihdr, width);
+		put32(ihdr + 4, height);
+		ihdr[8] = 8;
+		ihdr[9] = colourType(channels);
+		ihdr[10] = 0;
+		ihdr[11] = 0;
+		ihdr[12] = 0;
+		p = writeChunk(p, "IHDR", ihdr, sizeof(ihdr));
+
+		uint8_t zlibHeader[zlibHeaderLen] = { 0x78, zlibLevelFlags(params.level) };
+		uint8_t adlerBytes[adlerLen];
+		put32(adlerBytes, (uint32_t) adler);
+		for (uint32_t i = 0; i < numStripes; ++i) {
+			auto &s = stripes[i];
+			bool first = i == 0;
+			bool last = i == numStripes - 1;
+			uint32_t len = (uint32_t) (s.data.size() + (first ? zlibHeaderLen : 0)
+					+ (last ? adlerLen : 0));
+			put32(p, len);
+			p += 4;
+			uint8_t *type = p;
+			memcpy(p, "IDAT", 4);
+			p += 4;
+			if (first) {
+				memcpy(p, zlibHeader, zlibHeaderLen);
+				p += zlibHeaderLen;
+			}
+			memcpy(p, s.data.data(), s.data.size());
+			p += s.data.size();
+			if (last) {
+				memcpy(p, adlerBytes, adlerLen);
+				p += adlerLen;
+			}
+			// checksum of header and trailer is cheap, stripe data was
+			// checksummed in parallel
+			uLong crc = crc32(0, type, 4 + (first ? zlibHeaderLen : 0));
+			crc = crc32_combine(crc, s.crc, (z_off_t) s.data.size());
+			if (last)
+				crc = crc32(crc, adlerBytes, adlerLen);
+			put32(p, (uint32_t) crc);
+			p += 4;
+		}
+		p = writeChunk(p, "IEND", nullptr, 0);
+
+		return (size_t) (p - out);
+	}
+
+	// filter rows [begin, end) into out, each prefixed by its filter type
+	static void filterRows(const uint8_t *pixels, uint32_t width, uint32_t channels,
+			size_t stride, ePngFilter filter, uint32_t begin, uint32_t end,
+			uint8_t *out, std::vector<uint8_t> &candidate) {
+		size_t len = (size_t) width * channels;
+		for (uint32_t y = begin; y < end; ++y) {
+			const uint8_t *row = pixels + y * stride;
+			const uint8_t *prev = y ? row - stride : nullptr;
+			if (filter != PNG_FILTER_ADAPTIVE) {
+				*out = (uint8_t) filter;
+				filterRow(filter, row, prev, len, channels, out + 1);
+			} else {
+				candidate.resize(len);
+				uint64_t best = UINT64_MAX;
+				for (int f = PNG_FILTER_NONE; f <= PNG_FILTER_PAETH; ++f) {
+					filterRow((ePngFilter) f, row, prev, len, channels, candidate.data());
+					uint64_t cost = 0;
+					for (size_t i = 0; i < len; ++i)
+						cost += (uint64_t) std::abs((int) (int8_t) candidate[i]);
+					if (cost < best) {
+						best = cost;
+						*out = (uint8_t) f;
+						memcpy(out + 1, candidate.data(), len);
+					}
+				}
+			}
+			out += len + 1;
+		}
+	}
+	static void filterRow(ePngFilter filter, const uint8_t *row, const uint8_t *prev,
+			size_t len, uint32_t bpp, uint8_t *out) {
+		switch (filter) {
+		case PNG_FILTER_SUB:
+			for (size_t i = 0; i < len; ++i)
+				out[i] = (uint8_t) (row[i] - (i >= bpp ? row[i - bpp] : 0));
+			break;
+		case PNG_FILTER_UP:
+			for (size_t i = 0; i < len; ++i)
+				out[i] = (uint8_t) (row[i] - (prev ? prev[i] : 0));
+			break;
+		case PNG_FILTER_AVERAGE:
+			for (size_t i = 0; i < len; ++i) {
+				int a = i >= bpp ? row[i - bpp] : 0;
+				int b = prev ? prev[i] : 0;
+				out[i] = (uint8_t) (row[i] - ((a + b) >> 1));
+			}
+			break;
+		case PNG_FILTER_PAETH:
+			for (size_t i = 0; i < len; ++i) {
+				int a = i >= bpp ? row[i - bpp] : 0;
+				int b = prev ? prev[i] : 0;
+				int c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+				out[i] = (uint8_t) (row[i] - paeth(a, b, c));
+			}
+			break;
+		default:
+			memcpy(out, row, len);
+			break;
+		}
+	}
+	static int paeth(int a, int b, int c) {
+		int p = a + b - c;
+		int pa = std::abs(p - a);
+		int pb = std::abs(p - b);
+		int pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		return pb <= pc ? b : c;
+	}
+
+	// filter (unless prefiltered) and deflate one stripe of rows
+	bool compressStripe(Stripe &stripe, const uint8_t *pixels, size_t stride,
+			bool prefiltered, uint32_t width, uint32_t height, uint32_t channels,
+			const PngEncodeParams &params, uint32_t firstRow, uint32_t rows) const {
+		size_t rowLen = (size_t) width * channels + 1;
+		uint32_t lastRow = std::min(firstRow + rows, height);
+		bool last = lastRow == height;
+
+		// filtered rows preceding this stripe prime the compressor,
+		// filling the deflate window
+		uint32_t dictRows = (uint32_t) std::min<size_t>(firstRow,
+				(windowSize + rowLen - 1) / rowLen);
+		std::vector<uint8_t> filtered;
+		const uint8_t *input = pixels + firstRow * stride;
+		if (!prefiltered) {
+			filtered.resize((dictRows + lastRow - firstRow) * rowLen);
+			std::vector<uint8_t> candidate;
+			filterRows(pixels, width, channels, stride, params.filter,
+					firstRow - dictRows, lastRow, filtered.data(), candidate);
+			input = filtered.data() + dictRows * rowLen;
+		}
+		stripe.uncompressedLen = (lastRow - firstRow) * rowLen;
+		stripe.adler = adler32(1, input, (uInt) stripe.uncompressedLen);
+
+		z_stream strm;
+		memset(&strm, 0, sizeof(strm));
+		int level = std::max(0, std::min(9, params.level));
+		if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		if (dictRows) {
+			size_t dictLen = std::min<size_t>(dictRows * rowLen, windowSize);
+			if (deflateSetDictionary(&strm, input - dictLen, (uInt) dictLen) != Z_OK) {
+				deflateEnd(&strm);
+				return false;
+			}
+		}
+		stripe.data.resize(deflateBound(&strm, (uLong) stripe.uncompressedLen) + 16);
+		strm.next_in = const_cast<uint8_t*>(input);
+		strm.avail_in = (uInt) stripe.uncompressedLen;
+		strm.next_out = stripe.data.data();
+		strm.avail_out = (uInt) stripe.data.size();
+		int rc = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+		bool success = last ? rc == Z_STREAM_END : (rc == Z_OK && strm.avail_in == 0);
+		stripe.data.resize(stripe.data.size() - strm.avail_out);
+		deflateEnd(&strm);
+		if (success)
+			stripe.crc = crc32(0, stripe.data.data(), (uInt) stripe.data.size());
+
+		return success;
+	}
+
+	static uint8_t colourType(uint32_t channels) {
+		// grey, grey + alpha, RGB, RGBA
+		static const uint8_t types[] = { 0, 4, 2, 6 };
+		return types[channels - 1];
+	}
+	static uint8_t zlibLevelFlags(int level) {
+		// FLEVEL bits, with FCHECK making header a multiple of 31
+		if (level <= 1)
+			return 0x01;
+		if (level <= 5)
+			return 0x5E;
+		if (level == 6)
+			return 0x9C;
+		return 0xDA;
+	}
+	static void put32(uint8_t *p, uint32_t val) {
+		p[0] = (uint8_t) (val >> 24);
+		p[1] = (uint8_t) (val >> 16);
+		p[2] = (uint8_t) (val >> 8);
+		p[3] = (uint8_t) val;
+	}
+	static uint8_t* writeChunk(uint8_t *p, const char *type, const uint8_t *data,
+			uint32_t len) {
+		put32(p, len);
+		memcpy(p + 4, type, 4);
+		if (len)
+			memcpy(p + 8, data, len);
+		put32(p + 8 + len, (uint32_t) crc32(0, p + 4, len + 4));
+		return p + 12 + len;
+	}
+
+	enum {
+		signatureLen = 8,
+		chunkOverhead = 12,
+		zlibHeaderLen = 2,
+		adlerLen = 4,
+		windowSize = 32768,
+		minStripeBytes = 256 * 1024
+	};
+
+	ltk::ThreadPool pool;
+	size_t numThreads;
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+// Hands off items produced out of order by several threads.
+// When ordered, items are popped in sequence order, starting at zero;
+// otherwise, items are popped as soon as they are pushed.
+// Once close() is called with the total number of items, waitAndPop()
+// returns false after the last item has been popped.
+template<typename Data> class ReorderBuffer {
+public:
+	explicit ReorderBuffer(bool ordered) :
+			_ordered(ordered), _next(0), _popped(0), _total(UINT64_MAX), _active(
+					true) {
+	}
+	void push(uint64_t sequence, Data const &data) {
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (!_active)
+			return;
+		_items.emplace(sequence, data);
+		_condition.notify_all();
+	}
+	bool waitAndPop(Data &value) {
+		std::unique_lock<std::mutex> lk(_mutex);
+		_condition.wait(lk, [this] {return !_active || ready() || _popped >= _total;});
+		if (!ready())
+			return false;
+		auto it = _ordered ? _items.find(_next) : _items.begin();
+		value = it->second;
+		_items.erase(it);
+		_next++;
+		_popped++;
+		return true;
+	}
+	// pop any item, regardless of order
+	bool tryPop(Data &value) {
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (_items.empty())
+			return false;
+		auto it = _items.begin();
+		value = it->second;
+		_items.erase(it);
+		_popped++;
+		return true;
+	}
+	// no more than total items will be pushed
+	void close(uint64_t total) {
+		std::lock_guard<std::mutex> lk(_mutex);
+		_total = total;
+		_condition.notify_all();
+	}
+	// release all waiting threads, discarding remaining items
+	void deactivate() {
+		std::lock_guard<std::mutex> lk(_mutex);
+		_active = false;
+		_items.clear();
+		_condition.notify_all();
+	}
+	size_t size() {
+		std::lock_guard<std::mutex> lk(_mutex);
+		return _items.size();
+	}
+private:
+	bool ready() {
+		if (_items.empty())
+			return false;
+		return !_ordered || _items.begin()->first == _next;
+	}
+	std::map<uint64_t, Data> _items;
+	bool _ordered;
+	uint64_t _next;
+	uint64_t _popped;
+	uint64_t _total;
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	bool _active;
+};
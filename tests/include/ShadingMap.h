@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Lens shading gain map for Bayer correction on the device (BAYER_CORRECT).
+//
+// The map is a coarse grid of gains for red, green in red rows, green in
+// blue rows and blue sites, four floats per node, stretched over the frame
+// and bilinearly interpolated by the device's sampler. A map is read from
+// a text file holding the grid's width and height, then one line of four
+// gains per node, row by row; or generated from a radial falloff model,
+// given as "radial:K", with gain 1 + K * d^2 at distance d from the
+// frame's centre, d being 1 at the corners. The default map is a single unity node.
+struct ShadingMap {
+	static const uint32_t radialNodes = 17;
+
+	ShadingMap() : width(1), height(1), gains(4, 1.0f) {
+	}
+
+	bool load(const std::string &spec) {
+		if (spec.compare(0, 7, "radial:") == 0) {
+			char *end = nullptr;
+			float strength = strtof(spec.c_str() + 7, &end);
+			if (end == spec.c_str() + 7)
+				return false;
+			radial(strength);
+			return true;
+		}
+		auto f = fopen(spec.c_str(), "r");
+		if (!f)
+			return false;
+		unsigned int w = 0, h = 0;
+		bool rc = fscanf(f, "%u %u", &w, &h) == 2 && w && h && w <= 4096 && h <= 4096;
+		std::vector<float> values;
+		if (rc) {
+			values.resize((size_t) w * h * 4);
+			for (size_t i = 0; i < values.size() && rc; ++i)
+				rc = fscanf(f, "%f", &values[i]) == 1 && values[i] > 0;
+		}
+		fclose(f);
+		if (!rc)
+			return false;
+		width = w;
+		height = h;
+		gains.swap(values);
+		return true;
+	}
+
+	void radial(float strength) {
+		width = height = radialNodes;
+		gains.resize((size_t) width * height * 4);
+		for (uint32_t y = 0; y < height; ++y) {
+			for (uint32_t x = 0; x < width; ++x) {
+				float dx = 2.0f * x / (width - 1) - 1.0f;
+				float dy = 2.0f * y / (height - 1) - 1.0f;
+				float gain = 1.0f + strength * (dx * dx + dy * dy) / 2.0f;
+				for (uint32_t c = 0; c < 4; ++c)
+					gains[((size_t) y * width + x) * 4 + c] = gain;
+			}
+		}
+	}
+
+	uint32_t width;
+	uint32_t height;
+	std::vector<float> gains;
+};
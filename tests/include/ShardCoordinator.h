@@ -0,0 +1,604 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameSource.h"
+
+// Dynamic sharding of a work list over local worker processes.
+//
+// The coordinator packs frame requests into shards of a fixed number of
+// files, and hands them out to workers over a local socket, one shard per
+// request, so faster workers take more shards. Shards held by a worker
+// that goes away are re-queued for the others.
+//
+// Protocol: newline terminated text lines.
+//   worker:      HELLO <pid>
+//   worker:      NEXT
+//   coordinator: SHARD <id> <count>, followed by <count> lines <path>\t<name>
+//                or END, once every shard is done
+//   worker:      DONE <id> <frames written> <frames failed> <latency sum ms> <latency max ms>
+// NEXT is answered as soon as a shard is available; while the last shards
+// are out with other workers, the answer waits, in case they are re-queued.
+
+// lines over a connected socket
+class LineChannel {
+public:
+	explicit LineChannel(int descriptor = -1) : fd(descriptor) {
+	}
+	bool send(const std::string &line) {
+		std::string msg = line + "\n";
+		const char *p = msg.data();
+		size_t len = msg.size();
+		while (len) {
+			ssize_t rc = ::send(fd, p, len, MSG_NOSIGNAL);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				return false;
+			p += rc;
+			len -= (size_t) rc;
+		}
+		return true;
+	}
+	// take a complete line from data received so far
+	bool takeLine(std::string &line) {
+		auto pos = input.find('\n');
+		if (pos == std::string::npos)
+			return false;
+		line = input.substr(0, pos);
+		input.erase(0, pos + 1);
+		return true;
+	}
+	// receive available data. Returns false once peer has gone
+	bool receive() {
+		char buf[4096];
+		ssize_t rc = recv(fd, buf, sizeof(buf), 0);
+		if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+			return true;
+		if (rc <= 0)
+			return false;
+		input.append(buf, (size_t) rc);
+		return true;
+	}
+	int fd;
+private:
+	std::string input;
+};
+
+class ShardCoordinator {
+public:
+	ShardCoordinator(const std::string &socketPath, uint32_t shardSize) :
+			path(socketPath), shardSize(shardSize ? shardSize : 1), listener(-1), nextShardId(
+					1), enumerated(false), shardsDone(0), shardsFailed(0) {
+	}
+	~ShardCoordinator() {
+		if (listener >= 0) {
+			close(listener);
+			unlink(path.c_str());
+		}
+	}
+	// Hand out shards of requests until all are done. If spawn is non-zero,
+	// launch that many workers, running workerArgs with worker index i
+	// appended as "--device i", bound to NUMA node i if numa is set.
+	// Returns false if shards could not be completed
+	bool run(BlockingQueue<FrameRequest> &requests, const std::vector<std::string> &workerArgs,
+			uint32_t spawn, bool numa) {
+		if (!listen())
+			return false;
+		start = clock::now();
+		std::thread packer([this, &requests] {
+			pack(requests);
+		});
+		for (uint32_t i = 0; i < spawn; ++i)
+			spawnWorker(workerArgs, i, numa);
+		bool rc = serve(spawn > 0);
+		// unblock packer, if it is still enumerating
+		requests.push(FrameRequest());
+		packer.join();
+		for (auto &client : clients)
+			close(client.channel.fd);
+		clients.clear();
+		for (auto pid : children) {
+			int status = 0;
+			waitpid(pid, &status, 0);
+		}
+		printStats();
+		return rc;
+	}
+private:
+	typedef std::chrono::steady_clock clock;
+	struct Shard {
+		Shard() : id(0), attempts(0) {
+		}
+		uint64_t id;
+		std::vector<FrameRequest> requests;
+		uint32_t attempts;
+	};
+	struct WorkerStats {
+		WorkerStats() : pid(0), shards(0), frames(0), failed(0), latencySum(0), latencyMax(
+				0), lost(false) {
+		}
+		long pid;
+		uint64_t shards;
+		uint64_t frames;
+		uint64_t failed;
+		double latencySum;
+		double latencyMax;
+		clock::time_point first;
+		clock::time_point last;
+		bool lost;
+	};
+	struct Client {
+		LineChannel channel;
+		// NEXT received and not yet answered
+		bool waiting;
+		std::set<uint64_t> outstanding;
+		size_t stats;
+	};
+	static const int pollTimeoutMs = 100;
+	static const uint32_t maxAttempts = 3;
+
+	bool listen() {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+		listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listener < 0 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) < 0
+				|| ::listen(listener, 64) < 0) {
+			std::cerr << "Unable to listen on socket " << path << ": " << strerror(errno)
+					<< std::endl;
+			return false;
+		}
+		return true;
+	}
+	// pack requests into shards, as they are enumerated
+	void pack(BlockingQueue<FrameRequest> &requests) {
+		Shard shard;
+		FrameRequest request;
+		while (requests.waitAndPop(request) && !request.endOfStream()) {
+			shard.requests.push_back(request);
+			if (shard.requests.size() == shardSize)
+				queueShard(shard);
+		}
+		if (!shard.requests.empty())
+			queueShard(shard);
+		std::lock_guard<std::mutex> lk(mutex);
+		enumerated = true;
+	}
+	void queueShard(Shard &shard) {
+		std::lock_guard<std::mutex> lk(mutex);
+		shard.id = nextShardId++;
+		pending.push_back(shard.id);
+		shards[shard.id] = std::move(shard);
+		shard = Shard();
+	}
+	void spawnWorker(const std::vector<std::string> &workerArgs, uint32_t index, bool numa) {
+		std::vector<std::string> args = workerArgs;
+		args.push_back("--device");
+		args.push_back(std::to_string(index));
+		std::vector<char*> argv;
+		for (auto &arg : args)
+			argv.push_back(&arg[0]);
+		argv.push_back(nullptr);
+#ifdef __linux__
+		cpu_set_t cpus;
+		bool bind = numa && numaCpus(index, cpus);
+		const char *exe = "/proc/self/exe";
+#else
+		(void) numa;
+		const char *exe = argv[0];
+#endif
+		pid_t pid = fork();
+		if (pid == 0) {
+#ifdef __linux__
+			if (bind)
+				sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+			execv(exe, argv.data());
+			_exit(127);
+		}
+		if (pid < 0) {
+			std::cerr << "Unable to spawn worker: " << strerror(errno) << std::endl;
+			return;
+		}
+		children.push_back(pid);
+	}
+#ifdef __linux__
+	// CPUs of NUMA node, from its cpulist, e.g. "0-7,16-23"
+	static bool numaCpus(uint32_t node, cpu_set_t &cpus) {
+		std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string ranges;
+		if (!std::getline(list, ranges))
+			return false;
+		CPU_ZERO(&cpus);
+		std::stringstream ss(ranges);
+		std::string range;
+		bool any = false;
+		while (std::getline(ss, range, ',')) {
+			unsigned first = 0, last = 0;
+			int n = sscanf(range.c_str(), "%u-%u", &first, &last);
+			if (n < 1)
+				continue;
+			if (n == 1)
+				last = first;
+			for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+				CPU_SET(cpu, &cpus);
+				any = true;
+			}
+		}
+		return any;
+	}
+#endif
+	bool childrenAlive() {
+		for (auto it = children.begin(); it != children.end();) {
+			int status = 0;
+			if (waitpid(*it, &status, WNOHANG) == *it) {
+				it = children.erase(it);
+			} else {
+				++it;
+			}
+		}
+		return !children.empty();
+	}
+	bool allDone() {
+		std::lock_guard<std::mutex> lk(mutex);
+		return enumerated && shards.empty();
+	}
+	// answer waiting workers: a shard each, or END once all are done
+	void dispatch() {
+		bool done = allDone();
+		for (auto &client : clients) {
+			if (!client.waiting)
+				continue;
+			if (done) {
+				client.channel.send("END");
+				client.waiting = false;
+				continue;
+			}
+			Shard *shard = nullptr;
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				if (pending.empty())
+					return;
+				shard = &shards[pending.front()];
+				pending.pop_front();
+			}
+			// shards map is only modified by packer, which adds shards
+			std::ostringstream msg;
+			msg << "SHARD " << shard->id << " " << shard->requests.size();
+			for (auto &request : shard->requests)
+				msg << "\n" << request.path << "\t" << request.name;
+			shard->attempts++;
+			client.outstanding.insert(shard->id);
+			client.waiting = false;
+			auto &stats = workers[client.stats];
+			if (!stats.shards && stats.first == clock::time_point())
+				stats.first = clock::now();
+			if (!client.channel.send(msg.str())) {
+				// shard never reached the worker: give it to the next one, and
+				// shut down the connection so the worker is reaped by serve()
+				client.outstanding.erase(shard->id);
+				shard->attempts--;
+				{
+					std::lock_guard<std::mutex> lk(mutex);
+					pending.push_front(shard->id);
+				}
+				shutdown(client.channel.fd, SHUT_RDWR);
+			}
+		}
+	}
+	void handleLine(Client &client, const std::string &line) {
+		std::istringstream in(line);
+		std::string cmd;
+		in >> cmd;
+		if (cmd == "HELLO") {
+			in >> workers[client.stats].pid;
+		} else if (cmd == "NEXT") {
+			client.waiting = true;
+		} else if (cmd == "DONE") {
+			uint64_t id = 0, ok = 0, failed = 0;
+			double latencySum = 0, latencyMax = 0;
+			in >> id >> ok >> failed >> latencySum >> latencyMax;
+			if (!client.outstanding.erase(id))
+				return;
+			auto &stats = workers[client.stats];
+			stats.shards++;
+			stats.frames += ok;
+			stats.failed += failed;
+			stats.latencySum += latencySum;
+			stats.latencyMax = std::max(stats.latencyMax, latencyMax);
+			stats.last = clock::now();
+			std::lock_guard<std::mutex> lk(mutex);
+			shards.erase(id);
+			shardsDone++;
+		}
+	}
+	// worker has gone: re-queue its shards, unless they keep failing
+	void lose(Client &client) {
+		close(client.channel.fd);
+		if (client.outstanding.empty())
+			return;
+		auto &stats = workers[client.stats];
+		stats.lost = true;
+		std::lock_guard<std::mutex> lk(mutex);
+		size_t requeued = 0;
+		for (auto id : client.outstanding) {
+			auto &shard = shards[id];
+			if (shard.attempts >= maxAttempts) {
+				std::cerr << "Dropping shard " << id << " after " << shard.attempts
+						<< " attempts" << std::endl;
+				shards.erase(id);
+				shardsFailed++;
+				continue;
+			}
+			pending.push_front(id);
+			requeued++;
+		}
+		std::cerr << "Worker " << stats.pid << " lost: re-queued " << requeued << " shards"
+				<< std::endl;
+	}
+	bool serve(bool spawned) {
+		while (true) {
+			dispatch();
+			if (allDone()) {
+				bool anyWaiting = false;
+				for (auto &client : clients)
+					anyWaiting |= !client.outstanding.empty();
+				if (!anyWaiting)
+					return shardsFailed == 0;
+			}
+			if (spawned && !childrenAlive() && clients.empty()) {
+				std::cerr << "All workers have exited with work remaining" << std::endl;
+				return false;
+			}
+			std::vector<struct pollfd> fds;
+			fds.push_back( { listener, POLLIN, 0 });
+			for (auto &client : clients)
+				fds.push_back( { client.channel.fd, POLLIN, 0 });
+			int rc = poll(fds.data(), fds.size(), pollTimeoutMs);
+			if (rc < 0 && errno != EINTR)
+				return false;
+			if (rc <= 0)
+				continue;
+			for (size_t i = clients.size(); i > 0; --i) {
+				if (!fds[i].revents)
+					continue;
+				auto &client = clients[i - 1];
+				bool alive = client.channel.receive();
+				std::string line;
+				while (client.channel.takeLine(line))
+					handleLine(client, line);
+				if (!alive) {
+					lose(client);
+					clients.erase(clients.begin() + (ptrdiff_t) (i - 1));
+				}
+			}
+			if (fds[0].revents & POLLIN) {
+				int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+				if (fd >= 0) {
+					Client client;
+					client.channel.fd = fd;
+					client.waiting = false;
+					client.stats = workers.size();
+					workers.push_back(WorkerStats());
+					clients.push_back(client);
+				}
+			}
+		}
+	}
+	void printStats() {
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		uint64_t frames = 0;
+		for (auto &stats : workers) {
+			frames += stats.frames;
+			double active = std::chrono::duration<double>(stats.last - stats.first).count();
+			fprintf(stdout,
+					"worker %ld: shards = %llu, frames = %llu, failed = %llu, fps = %f, latency (ms): mean = %f, max = %f%s\n",
+					stats.pid, (unsigned long long) stats.shards,
+					(unsigned long long) stats.frames, (unsigned long long) stats.failed,
+					active > 0 ? stats.frames / active : 0.0,
+					stats.frames ? stats.latencySum / stats.frames : 0.0, stats.latencyMax,
+					stats.lost ? " (lost)" : "");
+		}
+		fprintf(stdout, "coordinator: shards = %llu, dropped = %llu, frames = %llu, fps = %f\n",
+				(unsigned long long) shardsDone, (unsigned long long) shardsFailed,
+				(unsigned long long) frames, elapsed > 0 ? frames / elapsed : 0.0);
+	}
+
+	std::string path;
+	uint32_t shardSize;
+	int listener;
+	clock::time_point start;
+	std::mutex mutex;
+	std::map<uint64_t, Shard> shards;
+	std::deque<uint64_t> pending;
+	uint64_t nextShardId;
+	bool enumerated;
+	uint64_t shardsDone;
+	uint64_t shardsFailed;
+	std::vector<Client> clients;
+	std::vector<WorkerStats> workers;
+	std::vector<pid_t> children;
+};
+
+// Frame source of a worker process: takes shards from a coordinator,
+// keeping up to two shards in hand so the pipeline does not drain
+// between shards, and reports each shard once all its frames are done.
+class CoordinatedFrameSource: public IFrameSource {
+public:
+	explicit CoordinatedFrameSource(const std::string &socketPath) :
+			path(socketPath), ended(false) {
+	}
+	~CoordinatedFrameSource() {
+		if (channel.fd >= 0)
+			close(channel.fd);
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		// local copy, as milliseconds binds its count by reference
+		const int timeoutMs = pollTimeoutMs;
+		if (connect()) {
+			while (!stopRequested && !ended) {
+				{
+					std::unique_lock<std::mutex> lk(mutex);
+					condition.wait_for(lk, std::chrono::milliseconds(timeoutMs),
+							[this] {return stopRequested || held.size() < maxHeld;});
+					if (held.size() >= maxHeld)
+						continue;
+				}
+				if (!takeShard(queue))
+					break;
+			}
+		}
+		queue.push(FrameRequest());
+	}
+	void completed(uint64_t tag, bool success, double latencyMs) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = held.find(tag);
+		if (it == held.end())
+			return;
+		auto &shard = it->second;
+		if (success) {
+			shard.written++;
+			shard.latencySum += latencyMs;
+			shard.latencyMax = std::max(shard.latencyMax, latencyMs);
+		} else {
+			shard.failed++;
+		}
+		if (shard.written + shard.failed < shard.count)
+			return;
+		std::ostringstream msg;
+		msg << "DONE " << tag << " " << shard.written << " " << shard.failed << " "
+				<< shard.latencySum << " " << shard.latencyMax;
+		channel.send(msg.str());
+		held.erase(it);
+		condition.notify_all();
+	}
+private:
+	struct HeldShard {
+		HeldShard() : count(0), written(0), failed(0), latencySum(0), latencyMax(0) {
+		}
+		uint64_t count;
+		uint64_t written;
+		uint64_t failed;
+		double latencySum;
+		double latencyMax;
+	};
+	static const int pollTimeoutMs = 200;
+	static const size_t maxHeld = 2;
+
+	bool connect() {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		channel.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (channel.fd < 0 || ::connect(channel.fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+				|| !channel.send("HELLO " + std::to_string((long) getpid()))) {
+			std::cerr << "Unable to connect to coordinator " << path << ": "
+					<< strerror(errno) << std::endl;
+			return false;
+		}
+		return true;
+	}
+	// wait for a line from coordinator. Returns false if it has gone
+	bool readLine(std::string &line) {
+		while (!channel.takeLine(line)) {
+			if (stopRequested)
+				return false;
+			struct pollfd pfd = { channel.fd, POLLIN, 0 };
+			int rc = poll(&pfd, 1, pollTimeoutMs);
+			if (rc < 0 && errno != EINTR)
+				return false;
+			if (rc > 0 && !channel.receive())
+				return false;
+		}
+		return true;
+	}
+	// request next shard, and queue its frames. Returns false at end
+	bool takeShard(BlockingQueue<FrameRequest> &queue) {
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			if (!channel.send("NEXT"))
+				return false;
+		}
+		std::string line;
+		if (!readLine(line))
+			return false;
+		std::istringstream in(line);
+		std::string cmd;
+		uint64_t id = 0, count = 0;
+		in >> cmd >> id >> count;
+		if (cmd != "SHARD" || !id) {
+			ended = true;
+			return false;
+		}
+		std::vector<FrameRequest> requests;
+		for (uint64_t i = 0; i < count; ++i) {
+			if (!readLine(line))
+				return false;
+			auto tab = line.find('\t');
+			FrameRequest request(line.substr(0, tab),
+					tab == std::string::npos ? std::string() : line.substr(tab + 1));
+			request.tag = id;
+			requests.push_back(request);
+		}
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			held[id].count = count;
+		}
+		for (auto &request : requests)
+			queue.push(request);
+		return true;
+	}
+
+	std::string path;
+	LineChannel channel;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::map<uint64_t, HeldShard> held;
+	bool ended;
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "FrameSource.h"
+
+// Synthetic frames: requests for generated Bayer mosaics, which the decode
+// stage fills from memory, so that the pipeline can be measured without
+// file I/O or image decoding in the loop.
+
+const char syntheticScheme[] = "synthetic:";
+
+// parse "<width>x<height>"
+inline bool parseDimensions(const std::string &str, uint32_t &width, uint32_t &height) {
+	unsigned w = 0, h = 0;
+	char trailing = 0;
+	if (sscanf(str.c_str(), "%ux%u%c", &w, &h, &trailing) != 2 || !w || !h)
+		return false;
+	width = w;
+	height = h;
+	return true;
+}
+inline std::string syntheticPath(uint32_t width, uint32_t height) {
+	return std::string(syntheticScheme) + std::to_string(width) + "x" + std::to_string(height);
+}
+// dimensions of frames requested by a synthetic path
+inline bool parseSyntheticPath(const std::string &path, uint32_t &width, uint32_t &height) {
+	size_t len = sizeof(syntheticScheme) - 1;
+	return path.compare(0, len, syntheticScheme) == 0
+			&& parseDimensions(path.substr(len), width, height);
+}
+
+// RGB test scene: colour gradients under a sharp edged grid and rings.
+// Generated once per size, and shared
+inline std::shared_ptr<const std::vector<uint8_t>> syntheticScene(uint32_t width,
+		uint32_t height) {
+	static std::mutex mutex;
+	static std::map<std::pair<uint32_t, uint32_t>, std::shared_ptr<const std::vector<uint8_t>>> cache;
+	std::lock_guard<std::mutex> lk(mutex);
+	auto &entry = cache[std::make_pair(width, height)];
+	if (entry)
+		return entry;
+	auto scene = std::make_shared<std::vector<uint8_t>>((size_t) width * height * 3);
+	for (uint32_t y = 0; y < height; ++y) {
+		for (uint32_t x = 0; x < width; ++x) {
+			// darkened grid lines and rings, so that edges are shared
+			// by all channels, as in natural images
+			uint32_t rgb[3] = { 64 + x * 191 / width, 64 + y * 191 / height,
+					64 + (x + y) * 191 / (width + height) };
+			bool line = (x % 64) < 2 || (y % 64) < 2;
+			double dx = (double) (x % 256) - 128, dy = (double) (y % 256) - 128;
+			bool ring = ((uint32_t) std::sqrt(dx * dx + dy * dy) / 6) & 1;
+			uint32_t shade = line ? 1 : ring ? 3 : 4;
+			for (uint32_t c = 0; c < 3; ++c)
+				(*scene)[((size_t) y * width + x) * 3 + c] = (uint8_t) (rgb[c] * shade / 4);
+		}
+	}
+	entry = scene;
+	return entry;
+}
+
+// RGGB mosaic of the test scene, with a little noise so that frames
+// do not compress trivially. Generated once per size, and shared
+inline std::shared_ptr<const std::vector<uint8_t>> syntheticMosaic(uint32_t width,
+		uint32_t height) {
+	static std::mutex mutex;
+	static std::map<std::pair<uint32_t, uint32_t>, std::shared_ptr<const std::vector<uint8_t>>> cache;
+	std::lock_guard<std::mutex> lk(mutex);
+	auto &entry = cache[std::make_pair(width, height)];
+	if (entry)
+		return entry;
+	auto scene = syntheticScene(width, height);
+	auto mosaic = std::make_shared<std::vector<uint8_t>>((size_t) width * height);
+	uint32_t noise = 0x12345678;
+	for (uint32_t y = 0; y < height; ++y) {
+		for (uint32_t x = 0; x < width; ++x) {
+			uint32_t channel = (y & 1) + (x & 1);
+			noise = noise * 1664525 + 1013904223;
+			uint32_t v = (*scene)[((size_t) y * width + x) * 3 + channel];
+			(*mosaic)[(size_t) y * width + x] = (uint8_t) std::min<uint32_t>(255,
+					v + (noise >> 29));
+		}
+	}
+	entry = mosaic;
+	return entry;
+}
+
+// PSNR, in dB, of a demosaiced frame with three or more channels
+// against the test scene. Frame rows are unpadded
+inline double syntheticPsnr(const uint8_t *frame, uint32_t width, uint32_t height,
+		uint32_t channels) {
+	auto scene = syntheticScene(width, height);
+	double squaredError = 0;
+	for (size_t i = 0; i < (size_t) width * height; ++i) {
+		for (uint32_t c = 0; c < 3; ++c) {
+			double e = (double) frame[i * channels + c] - (*scene)[i * 3 + c];
+			squaredError += e * e;
+		}
+	}
+	double mse = squaredError / ((double) width * height * 3);
+	return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+// requests count synthetic frames of one size
+class SyntheticFrameSource: public IFrameSource {
+public:
+	SyntheticFrameSource(uint32_t width, uint32_t height, uint64_t count) :
+			path(syntheticPath(width, height)), count(count) {
+	}
+	void run(BlockingQueue<FrameRequest> &queue) {
+		char name[32];
+		for (uint64_t i = 0; i < count && !stopRequested; ++i) {
+			snprintf(name, sizeof(name), "synthetic_%08llu", (unsigned long long) i);
+			queue.push(FrameRequest(path, name));
+		}
+		queue.push(FrameRequest());
+	}
+private:
+	std::string path;
+	uint64_t count;
+};
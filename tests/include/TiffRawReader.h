@@ -0,0 +1,600 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Bayer pattern of a CFA image, in the order of debayer's pattern_t
+enum eCfaPattern {
+	CFA_UNKNOWN = -1, CFA_RGGB = 0, CFA_GRBG = 1, CFA_GBRG = 2, CFA_BGGR = 3
+};
+
+// Reader for raw Bayer frames stored as uncompressed DNG or TIFF:
+// the CFA image of a DNG (in IFD0 or a SubIFD), or a single channel
+// TIFF holding a mosaic. Samples of 8 to 16 bits, packed or not, in strips
+// or tiles, are supported.
+//
+// The file is memory mapped (or its contents adopted, when it has already
+// been read), and only its tags are parsed on open; samples are unpacked
+// to 8 bits straight from the file's strips or tiles into the caller's
+// buffer, cropped to the DNG default crop. The Bayer pattern of the cropped
+// image, and black and white levels scaled to 8 bits, are reported so that
+// they can be applied on the device.
+class TiffRawReader {
+public:
+	TiffRawReader() :
+			base(nullptr), length(0), mapped(false), bigEndian(false), width(0), height(
+					0), bitsPerSample(0), rowBits(0), alignedRows(true), segmentWidth(
+					0), segmentHeight(0), tiled(false), cropX(0), cropY(0), cropWidth(
+					0), cropHeight(0), pattern(CFA_UNKNOWN), shift(0), blackLevel(
+					0), whiteLevel(255) {
+	}
+	~TiffRawReader() {
+		close();
+	}
+	// files handled by this reader, by extension
+	static bool hasRawExtension(const std::string &path) {
+		auto pos = path.find_last_of('.');
+		if (pos == std::string::npos)
+			return false;
+		std::string ext = path.substr(pos + 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(),
+				[](unsigned char c) {return (char) std::tolower(c);});
+		return ext == "dng" || ext == "tif" || ext == "tiff";
+	}
+	static bool isTiff(const uint8_t *data, size_t len) {
+		return len >= 8 && ((data[0] == 'I' && data[1] == 'I' && data[2] == 42 && data[3] == 0)
+					|| (data[0] == 'M' && data[1] == 'M' && data[2] == 0 && data[3] == 42));
+	}
+	// map file and parse its raw image. Returns false, with reason in
+	// getError(), if file is not an uncompressed raw TIFF/DNG
+	bool open(const std::string &path) {
+		close();
+#ifdef _WIN32
+		auto f = fopen(path.c_str(), "rb");
+		if (!f)
+			return fail("unable to open file");
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		contents.resize(size > 0 ? (size_t) size : 0);
+		size_t rc = contents.empty() ? 0 : fread(contents.data(), 1, contents.size(), f);
+		fclose(f);
+		if (rc != contents.size())
+			return fail("unable to read file");
+		base = contents.data();
+		length = contents.size();
+#else
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return fail("unable to open file");
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < 8) {
+			::close(fd);
+			return fail("not a TIFF file");
+		}
+		void *addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED)
+			return fail("unable to map file");
+		base = (const uint8_t*) addr;
+		length = (size_t) st.st_size;
+		mapped = true;
+#endif
+		return parse();
+	}
+	// parse file contents that have already been read
+	bool open(std::vector<uint8_t> &&fileContents) {
+		close();
+		contents = std::move(fileContents);
+		base = contents.data();
+		length = contents.size();
+		return parse();
+	}
+	void close() {
+#ifndef _WIN32
+		if (mapped)
+			munmap((void*) base, length);
+#endif
+		mapped = false;
+		base = nullptr;
+		length = 0;
+		contents.clear();
+		segments.clear();
+	}
+	// dimensions of cropped image
+	uint32_t getWidth() const {
+		return cropWidth;
+	}
+	uint32_t getHeight() const {
+		return cropHeight;
+	}
+	// pattern of cropped image, or CFA_UNKNOWN for a TIFF without CFA tags
+	eCfaPattern getPattern() const {
+		return pattern;
+	}
+	// levels, scaled to 8 bits
+	uint32_t getBlackLevel() const {
+		return blackLevel;
+	}
+	uint32_t getWhiteLevel() const {
+		return whiteLevel;
+	}
+	const std::string& getError() const {
+		return error;
+	}
+	// Unpack cropped image to 8 bits per sample, keeping the most
+	// significant bits below the white level. Rows are pitch bytes apart.
+	bool read(uint8_t *dest, size_t pitch) const {
+		if (!base || segments.empty())
+			return false;
+		uint32_t segmentsAcross = tiled ? (width + segmentWidth - 1) / segmentWidth : 1;
+		uint32_t firstRow = cropY / segmentHeight;
+		uint32_t lastRow = (cropY + cropHeight - 1) / segmentHeight;
+		uint32_t firstCol = cropX / segmentWidth;
+		uint32_t lastCol = (cropX + cropWidth - 1) / segmentWidth;
+		for (uint32_t sr = firstRow; sr <= lastRow; ++sr) {
+			for (uint32_t sc = firstCol; sc <= lastCol; ++sc) {
+				auto &seg = segments[sr * segmentsAcross + sc];
+				uint32_t x0 = sc * segmentWidth;
+				uint32_t y0 = sr * segmentHeight;
+				// intersection of segment and crop, in image coordinates
+				uint32_t xBegin = std::max(x0, cropX);
+				uint32_t xEnd = std::min(x0 + segmentWidth, cropX + cropWidth);
+				uint32_t yBegin = std::max(y0, cropY);
+				uint32_t yEnd = std::min(y0 + segmentHeight, cropY + cropHeight);
+				for (uint32_t y = yBegin; y < yEnd; ++y) {
+					uint64_t rowStart = (uint64_t) (y - y0) * rowStrideBits();
+					uint64_t bit = rowStart + (uint64_t) (xBegin - x0) * bitsPerSample;
+					uint64_t lastBit = rowStart + (uint64_t) (xEnd - x0) * bitsPerSample;
+					if ((lastBit + 7) / 8 > seg.size)
+						return false;
+					unpackRow(base + seg.offset, bit, xEnd - xBegin,
+							dest + (size_t) (y - cropY) * pitch + (xBegin - cropX));
+				}
+			}
+		}
+		return true;
+	}
+private:
+	struct Segment {
+		uint64_t offset;
+		uint64_t size;
+	};
+	enum eTag {
+		TAG_NEW_SUBFILE_TYPE = 254,
+		TAG_IMAGE_WIDTH = 256,
+		TAG_IMAGE_LENGTH = 257,
+		TAG_BITS_PER_SAMPLE = 258,
+		TAG_COMPRESSION = 259,
+		TAG_PHOTOMETRIC = 262,
+		TAG_STRIP_OFFSETS = 273,
+		TAG_SAMPLES_PER_PIXEL = 277,
+		TAG_ROWS_PER_STRIP = 278,
+		TAG_STRIP_BYTE_COUNTS = 279,
+		TAG_PLANAR_CONFIG = 284,
+		TAG_TILE_WIDTH = 322,
+		TAG_TILE_LENGTH = 323,
+		TAG_TILE_OFFSETS = 324,
+		TAG_TILE_BYTE_COUNTS = 325,
+		TAG_SUB_IFDS = 330,
+		TAG_CFA_REPEAT_PATTERN_DIM = 33421,
+		TAG_CFA_PATTERN = 33422,
+		TAG_BLACK_LEVEL = 50714,
+		TAG_WHITE_LEVEL = 50717,
+		TAG_DEFAULT_CROP_ORIGIN = 50719,
+		TAG_DEFAULT_CROP_SIZE = 50720,
+		TAG_ACTIVE_AREA = 50829
+	};
+	enum eType {
+		TYPE_BYTE = 1,
+		TYPE_SHORT = 3,
+		TYPE_LONG = 4,
+		TYPE_RATIONAL = 5,
+		TYPE_SRATIONAL = 10,
+		TYPE_FLOAT = 11,
+		TYPE_IFD = 13
+	};
+	enum {
+		PHOTOMETRIC_MIN_IS_BLACK = 1,
+		PHOTOMETRIC_CFA = 32803,
+		COMPRESSION_NONE = 1,
+		maxIfds = 64
+	};
+	struct Entry {
+		Entry() : tag(0), type(0), count(0), valueOffset(0) {
+		}
+		uint16_t tag;
+		uint16_t type;
+		uint32_t count;
+		// offset of value, which is inline if it fits in four bytes
+		uint64_t valueOffset;
+	};
+	typedef std::vector<Entry> Ifd;
+
+	bool fail(const char *reason) {
+		error = reason;
+		return false;
+	}
+	uint16_t get16(uint64_t off) const {
+		if (off + 2 > length)
+			return 0;
+		auto p = base + off;
+		return bigEndian ? (uint16_t) ((p[0] << 8) | p[1]) : (uint16_t) ((p[1] << 8) | p[0]);
+	}
+	uint32_t get32(uint64_t off) const {
+		if (off + 4 > length)
+			return 0;
+		auto p = base + off;
+		return bigEndian ?
+				((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3] :
+				((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+	}
+	static uint32_t typeSize(uint16_t type) {
+		switch (type) {
+		case TYPE_BYTE:
+			return 1;
+		case TYPE_SHORT:
+			return 2;
+		case TYPE_LONG:
+		case TYPE_FLOAT:
+		case TYPE_IFD:
+			return 4;
+		case TYPE_RATIONAL:
+		case TYPE_SRATIONAL:
+			return 8;
+		default:
+			return 1;
+		}
+	}
+	bool readIfd(uint64_t off, Ifd &ifd, uint64_t &next) const {
+		uint16_t count = get16(off);
+		if (!count || off + 2 + (uint64_t) count * 12 + 4 > length)
+			return false;
+		for (uint16_t i = 0; i < count; ++i) {
+			uint64_t e = off + 2 + (uint64_t) i * 12;
+			Entry entry;
+			entry.tag = get16(e);
+			entry.type = get16(e + 2);
+			entry.count = get32(e + 4);
+			uint64_t bytes = (uint64_t) entry.count * typeSize(entry.type);
+			entry.valueOffset = bytes <= 4 ? e + 8 : get32(e + 8);
+			if (entry.valueOffset + bytes > length)
+				continue;
+			ifd.push_back(entry);
+		}
+		next = get32(off + 2 + (uint64_t) count * 12);
+		return true;
+	}
+	static const Entry* find(const Ifd &ifd, uint16_t tag) {
+		for (auto &e : ifd) {
+			if (e.tag == tag)
+				return &e;
+		}
+		return nullptr;
+	}
+	// value i of entry, as a double
+	double value(const Entry &e, uint32_t i) const {
+		uint64_t off = e.valueOffset + (uint64_t) i * typeSize(e.type);
+		switch (e.type) {
+		case TYPE_BYTE:
+			return base[off];
+		case TYPE_SHORT:
+			return get16(off);
+		case TYPE_LONG:
+		case TYPE_IFD:
+			return get32(off);
+		case TYPE_RATIONAL: {
+			uint32_t den = get32(off + 4);
+			return den ? (double) get32(off) / den : 0;
+		}
+		case TYPE_SRATIONAL: {
+			int32_t den = (int32_t) get32(off + 4);
+			return den ? (double) (int32_t) get32(off) / den : 0;
+		}
+		case TYPE_FLOAT: {
+			uint32_t bits = get32(off);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return f;
+		}
+		default:
+			return 0;
+		}
+	}
+	double value(const Ifd &ifd, uint16_t tag, double defaultValue) const {
+		auto e = find(ifd, tag);
+		return e && e->count ? value(*e, 0) : defaultValue;
+	}
+	// collect IFD chain starting at off, with SubIFDs
+	void collectIfds(uint64_t off, std::vector<Ifd> &ifds) const {
+		while (off && ifds.size() < maxIfds) {
+			Ifd ifd;
+			uint64_t next = 0;
+			if (!readIfd(off, ifd, next))
+				return;
+			ifds.push_back(ifd);
+			auto sub = find(ifd, TAG_SUB_IFDS);
+			if (sub) {
+				for (uint32_t i = 0; i < sub->count && ifds.size() < maxIfds; ++i)
+					collectIfds((uint64_t) value(*sub, i), ifds);
+			}
+			if (next == off)
+				return;
+			off = next;
+		}
+	}
+	// full resolution raw image: CFA, or single channel, main image
+	const Ifd* selectIfd(const std::vector<Ifd> &ifds) const {
+		const Ifd *best = nullptr;
+		double bestArea = 0;
+		for (auto &ifd : ifds) {
+			uint32_t photometric = (uint32_t) value(ifd, TAG_PHOTOMETRIC, 0);
+			if (photometric != PHOTOMETRIC_CFA && photometric != PHOTOMETRIC_MIN_IS_BLACK)
+				continue;
+			if (value(ifd, TAG_SAMPLES_PER_PIXEL, 1) != 1
+					|| ((uint32_t) value(ifd, TAG_NEW_SUBFILE_TYPE, 0) & 1))
+				continue;
+			double area = value(ifd, TAG_IMAGE_WIDTH, 0) * value(ifd, TAG_IMAGE_LENGTH, 0);
+			// prefer CFA image over a grey preview of same size
+			if (photometric == PHOTOMETRIC_CFA)
+				area *= 2;
+			if (area > bestArea) {
+				best = &ifd;
+				bestArea = area;
+			}
+		}
+		return best;
+	}
+	bool parse() {
+		if (!isTiff(base, length))
+			return fail("not a TIFF file");
+		bigEndian = base[0] == 'M';
+		std::vector<Ifd> ifds;
+		collectIfds(get32(4), ifds);
+		auto ifdp = selectIfd(ifds);
+		if (!ifdp)
+			return fail("no raw image");
+		auto &ifd = *ifdp;
+		if (value(ifd, TAG_COMPRESSION, COMPRESSION_NONE) != COMPRESSION_NONE)
+			return fail("compressed raw images are not supported");
+		if (value(ifd, TAG_PLANAR_CONFIG, 1) != 1)
+			return fail("planar raw images are not supported");
+		width = (uint32_t) value(ifd, TAG_IMAGE_WIDTH, 0);
+		height = (uint32_t) value(ifd, TAG_IMAGE_LENGTH, 0);
+		bitsPerSample = (uint32_t) value(ifd, TAG_BITS_PER_SAMPLE, 1);
+		if (!width || !height)
+			return fail("invalid dimensions");
+		if (bitsPerSample < 8 || bitsPerSample > 16)
+			return fail("unsupported bits per sample");
+
+		// strips or tiles
+		auto offsets = find(ifd, TAG_TILE_OFFSETS);
+		auto counts = find(ifd, TAG_TILE_BYTE_COUNTS);
+		tiled = offsets && counts;
+		uint32_t expected = 0;
+		if (tiled) {
+			segmentWidth = (uint32_t) value(ifd, TAG_TILE_WIDTH, 0);
+			segmentHeight = (uint32_t) value(ifd, TAG_TILE_LENGTH, 0);
+			if (!segmentWidth || !segmentHeight)
+				return fail("invalid tiles");
+			expected = ((width + segmentWidth - 1) / segmentWidth)
+					* ((height + segmentHeight - 1) / segmentHeight);
+		} else {
+			offsets = find(ifd, TAG_STRIP_OFFSETS);
+			counts = find(ifd, TAG_STRIP_BYTE_COUNTS);
+			if (!offsets || !counts)
+				return fail("missing strips");
+			segmentWidth = width;
+			segmentHeight = std::min<uint32_t>(height,
+					(uint32_t) value(ifd, TAG_ROWS_PER_STRIP, height));
+			if (!segmentHeight)
+				return fail("invalid strips");
+			expected = (height + segmentHeight - 1) / segmentHeight;
+		}
+		if (offsets->count < expected || counts->count < expected)
+			return fail("missing strips");
+		segments.resize(expected);
+		for (uint32_t i = 0; i < expected; ++i) {
+			segments[i].offset = (uint64_t) value(*offsets, i);
+			segments[i].size = (uint64_t) value(*counts, i);
+			if (segments[i].offset > length || segments[i].size > length - segments[i].offset)
+				return fail("strip beyond end of file");
+		}
+		// rows of samples of fewer than 8 or 16 bits are packed, most
+		// significant bit first, and start on a byte boundary, unless
+		// the first segment's size shows that they are not
+		rowBits = (uint64_t) segmentWidth * bitsPerSample;
+		uint64_t firstRows = std::min(segmentHeight, height);
+		alignedRows = bitsPerSample == 8 || bitsPerSample == 16
+				|| segments[0].size >= firstRows * ((rowBits + 7) / 8);
+
+		// crop: active area, then default crop within active area
+		uint32_t top = 0, left = 0, bottom = height, right = width;
+		auto active = find(ifd, TAG_ACTIVE_AREA);
+		if (active && active->count == 4) {
+			top = (uint32_t) value(*active, 0);
+			left = (uint32_t) value(*active, 1);
+			bottom = (uint32_t) value(*active, 2);
+			right = (uint32_t) value(*active, 3);
+			if (top >= bottom || left >= right || bottom > height || right > width)
+				return fail("invalid active area");
+		}
+		cropX = left;
+		cropY = top;
+		cropWidth = right - left;
+		cropHeight = bottom - top;
+		auto cropOrigin = find(ifd, TAG_DEFAULT_CROP_ORIGIN);
+		auto cropSize = find(ifd, TAG_DEFAULT_CROP_SIZE);
+		if (cropOrigin && cropSize && cropOrigin->count == 2 && cropSize->count == 2) {
+			uint32_t x = (uint32_t) value(*cropOrigin, 0);
+			uint32_t y = (uint32_t) value(*cropOrigin, 1);
+			uint32_t w = (uint32_t) value(*cropSize, 0);
+			uint32_t h = (uint32_t) value(*cropSize, 1);
+			if (w && h && x + w <= cropWidth && y + h <= cropHeight) {
+				cropX += x;
+				cropY += y;
+				cropWidth = w;
+				cropHeight = h;
+			}
+		}
+
+		// pattern is defined relative to the top left of the active area
+		pattern = CFA_UNKNOWN;
+		if ((uint32_t) value(ifd, TAG_PHOTOMETRIC, 0) == PHOTOMETRIC_CFA) {
+			auto dim = find(ifd, TAG_CFA_REPEAT_PATTERN_DIM);
+			auto cfa = find(ifd, TAG_CFA_PATTERN);
+			if (!cfa || cfa->count != 4 || (dim && (dim->count != 2
+					|| value(*dim, 0) != 2 || value(*dim, 1) != 2)))
+				return fail("unsupported CFA pattern");
+			uint32_t dx = (cropX - left) & 1;
+			uint32_t dy = (cropY - top) & 1;
+			int colors[4];
+			for (uint32_t r = 0; r < 2; ++r)
+				for (uint32_t c = 0; c < 2; ++c)
+					colors[r * 2 + c] = (int) value(*cfa, ((r + dy) & 1) * 2 + ((c + dx) & 1));
+			pattern = patternOf(colors);
+			if (pattern == CFA_UNKNOWN)
+				return fail("unsupported CFA pattern");
+		}
+
+		// levels: samples are reduced to 8 bits below the white level
+		uint32_t maxValue = (1u << bitsPerSample) - 1;
+		uint32_t white = std::min<uint32_t>(maxValue,
+				(uint32_t) value(ifd, TAG_WHITE_LEVEL, maxValue));
+		double black = 0;
+		auto blackEntry = find(ifd, TAG_BLACK_LEVEL);
+		if (blackEntry && blackEntry->count) {
+			for (uint32_t i = 0; i < blackEntry->count; ++i)
+				black += value(*blackEntry, i);
+			black /= blackEntry->count;
+		}
+		uint32_t significantBits = 0;
+		while (significantBits < 16 && (white >> significantBits))
+			significantBits++;
+		shift = significantBits > 8 ? significantBits - 8 : 0;
+		whiteLevel = std::min<uint32_t>(255, white >> shift);
+		blackLevel = std::min<uint32_t>(whiteLevel ? whiteLevel - 1 : 0,
+				(uint32_t) (black / (1u << shift) + 0.5));
+		error.clear();
+		return true;
+	}
+	static eCfaPattern patternOf(const int *colors) {
+		enum {
+			R = 0, G = 1, B = 2
+		};
+		const int patterns[4][4] = { { R, G, G, B }, { G, R, B, G }, { G, B, R, G }, { B, G, G, R } };
+		for (int p = 0; p < 4; ++p) {
+			if (std::equal(colors, colors + 4, patterns[p]))
+				return (eCfaPattern) p;
+		}
+		return CFA_UNKNOWN;
+	}
+	// bits from one row of a segment to the next
+	uint64_t rowStrideBits() const {
+		return alignedRows ? (rowBits + 7) / 8 * 8 : rowBits;
+	}
+	// unpack count samples starting at bit offset of src to 8 bits
+	void unpackRow(const uint8_t *src, uint64_t bit, uint32_t count, uint8_t *dest) const {
+		if (bitsPerSample == 8) {
+			memcpy(dest, src + bit / 8, count);
+			return;
+		}
+		if (bitsPerSample == 16) {
+			auto p = src + bit / 8;
+			// most significant byte of each sample
+			size_t msb = bigEndian ? 0 : 1;
+			if (shift == 8) {
+				for (uint32_t i = 0; i < count; ++i)
+					dest[i] = p[2 * i + msb];
+			} else {
+				for (uint32_t i = 0; i < count; ++i) {
+					uint32_t v = bigEndian ? (p[2 * i] << 8) | p[2 * i + 1] :
+							(p[2 * i + 1] << 8) | p[2 * i];
+					dest[i] = (uint8_t) std::min<uint32_t>(255, v >> shift);
+				}
+			}
+			return;
+		}
+		// packed samples, most significant bit first
+		if (bitsPerSample == 12 && !(bit & 7)) {
+			auto p = src + bit / 8;
+			uint32_t i = 0;
+			for (; i + 1 < count; i += 2, p += 3) {
+				dest[i] = (uint8_t) std::min<uint32_t>(255,
+						((p[0] << 4) | (p[1] >> 4)) >> shift);
+				dest[i + 1] = (uint8_t) std::min<uint32_t>(255,
+						(((p[1] & 0xF) << 8) | p[2]) >> shift);
+			}
+			if (i < count)
+				dest[i] = (uint8_t) std::min<uint32_t>(255,
+						((p[0] << 4) | (p[1] >> 4)) >> shift);
+			return;
+		}
+		for (uint32_t i = 0; i < count; ++i, bit += bitsPerSample) {
+			auto p = src + bit / 8;
+			// sample spans at most three bytes
+			uint32_t window = (uint32_t) p[0] << 16;
+			uint32_t bitsNeeded = (uint32_t) (bit & 7) + bitsPerSample;
+			if (bitsNeeded > 8)
+				window |= (uint32_t) p[1] << 8;
+			if (bitsNeeded > 16)
+				window |= p[2];
+			uint32_t v = (window >> (24 - bitsNeeded)) & ((1u << bitsPerSample) - 1);
+			dest[i] = (uint8_t) std::min<uint32_t>(255, v >> shift);
+		}
+	}
+
+	const uint8_t *base;
+	size_t length;
+	bool mapped;
+	std::vector<uint8_t> contents;
+	std::string error;
+	bool bigEndian;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bitsPerSample;
+	uint64_t rowBits;
+	bool alignedRows;
+	std::vector<Segment> segments;
+	uint32_t segmentWidth;
+	uint32_t segmentHeight;
+	bool tiled;
+	uint32_t cropX;
+	uint32_t cropY;
+	uint32_t cropWidth;
+	uint32_t cropHeight;
+	eCfaPattern pattern;
+	uint32_t shift;
+	uint32_t blackLevel;
+	uint32_t whiteLevel;
+};
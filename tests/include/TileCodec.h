@@ -0,0 +1,177 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <vector>
+#include "ThreadPool.h"
+
+// Decoder for frames compressed losslessly on the device by tileCodec.cl.
+//
+// A packed frame holds a header of headerSize bytes (data size, tile count
+// and overflow flag), tile offsets, then tile data. Each tile of
+// tileSize x tileSize pixels is coded on its own, so rows of tiles are
+// decoded in parallel on a thread pool, the caller's thread decoding the
+// first row. Each channel of a tile holds tileSize 4 bit widths, then
+// each tile row's residuals, bit-packed LSB first; samples are rebuilt
+// from MED prediction over their left, upper and upper left neighbours
+// in the tile.
+//
+// decode() may be called concurrently from multiple threads.
+class TileDecoder {
+public:
+	static const uint32_t tileSize = 16;
+	static const uint32_t headerSize = 16;
+
+	explicit TileDecoder(size_t numThreads) :
+			pool(numThreads ? numThreads : 1) {
+	}
+
+	static uint32_t tileCount(uint32_t width, uint32_t height) {
+		return ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+	}
+	// device buffer of tile sizes, tile offsets and tile slots
+	static size_t tileBufferSize(uint32_t width, uint32_t height, uint32_t channels) {
+		uint32_t n = tileCount(width, height);
+		return 2 * align(((size_t) n + 1) * 4, 64)
+				+ (size_t) n * channels * (tileSize / 2 + tileSize * tileSize);
+	}
+	static size_t dataOffset(uint32_t numTiles) {
+		return align(headerSize + ((size_t) numTiles + 1) * 4, 16);
+	}
+	// packed frame read back from device: table, and budget percent
+	// of the uncompressed frame
+	static size_t packedCapacity(uint32_t width, uint32_t height, uint32_t channels,
+			uint32_t budget) {
+		return dataOffset(tileCount(width, height))
+				+ (size_t) width * height * channels * budget / 100;
+	}
+	// size of a packed frame, table included, or 0 if
+	// it did not fit the device-to-host buffer
+	static size_t packedSize(const uint8_t *packed, size_t capacity) {
+		uint32_t header[3];
+		memcpy(header, packed, sizeof(header));
+		size_t len = dataOffset(header[1]) + header[0];
+		if (header[2] || len > capacity)
+			return 0;
+		return len;
+	}
+
+	// Decode packed frame into caller's buffer.
+	// Returns false if the frame is malformed
+	bool decode(const uint8_t *packed, size_t len, uint32_t width, uint32_t height,
+			uint32_t channels, uint8_t *out, size_t pitch) {
+		uint32_t numTiles = tileCount(width, height);
+		uint32_t header[3];
+		if (len < headerSize)
+			return false;
+		memcpy(header, packed, sizeof(header));
+		if (header[1] != numTiles || header[2] || dataOffset(numTiles) + header[0] > len)
+			return false;
+		std::vector<uint32_t> offsets(numTiles + 1);
+		memcpy(offsets.data(), packed + headerSize, offsets.size() * sizeof(uint32_t));
+		const uint8_t *data = packed + dataOffset(numTiles);
+		uint32_t tilesX = (width + tileSize - 1) / tileSize;
+		uint32_t tilesY = (height + tileSize - 1) / tileSize;
+		auto decodeRow = [&](uint32_t ty) {
+			for (uint32_t tx = 0; tx < tilesX; ++tx) {
+				uint32_t tile = ty * tilesX + tx;
+				if (offsets[tile] > offsets[tile + 1] || offsets[tile + 1] > header[0])
+					return false;
+				uint32_t x0 = tx * tileSize;
+				uint32_t y0 = ty * tileSize;
+				if (!decodeTile(data + offsets[tile], offsets[tile + 1] - offsets[tile],
+						std::min<uint32_t>(+tileSize, width - x0),
+						std::min<uint32_t>(+tileSize, height - y0),
+						channels, out + y0 * pitch + x0 * channels, pitch))
+					return false;
+			}
+			return true;
+		};
+		std::vector<std::future<bool>> results;
+		for (uint32_t ty = 1; ty < tilesY; ++ty)
+			results.push_back(pool.enqueue(decodeRow, ty));
+		bool success = decodeRow(0);
+		for (auto &r : results)
+			success = r.get() && success;
+		return success;
+	}
+private:
+	static size_t align(size_t len, size_t alignment) {
+		return (len + alignment - 1) / alignment * alignment;
+	}
+	static int predict(int a, int b, int c) {
+		if (c >= std::max(a, b))
+			return std::min(a, b);
+		if (c <= std::min(a, b))
+			return std::max(a, b);
+		return a + b - c;
+	}
+	static bool decodeTile(const uint8_t *in, size_t len, uint32_t tw, uint32_t th,
+			uint32_t channels, uint8_t *out, size_t pitch) {
+		size_t pos = 0;
+		uint8_t residuals[tileSize];
+		for (uint32_t ch = 0; ch < channels; ++ch) {
+			if (pos + tileSize / 2 > len)
+				return false;
+			const uint8_t *widths = in + pos;
+			pos += tileSize / 2;
+			for (uint32_t y = 0; y < th; ++y) {
+				uint32_t width = (widths[y >> 1] >> ((y & 1) << 2)) & 0xF;
+				if (width > 8 || pos + 2 * width > len)
+					return false;
+				// unpack row of residuals
+				uint32_t bits = 0, count = 0;
+				uint32_t mask = (1u << width) - 1;
+				for (uint32_t x = 0; x < tileSize; ++x) {
+					if (count < width) {
+						bits |= (uint32_t) in[pos++] << count;
+						count += 8;
+					}
+					residuals[x] = (uint8_t) (bits & mask);
+					bits >>= width;
+					count -= width;
+				}
+				// rebuild samples
+				uint8_t *row = out + y * pitch + ch;
+				const uint8_t *up = row - pitch;
+				for (uint32_t x = 0; x < tw; ++x) {
+					int z = residuals[x];
+					int r = (z >> 1) ^ -(z & 1);
+					int pred = 0;
+					if (x && y)
+						pred = predict(row[(x - 1) * channels], up[x * channels],
+								up[(x - 1) * channels]);
+					else if (x)
+						pred = row[(x - 1) * channels];
+					else if (y)
+						pred = up[0];
+					row[x * channels] = (uint8_t) (pred + r);
+				}
+			}
+		}
+		return pos == len;
+	}
+
+	ltk::ThreadPool pool;
+};
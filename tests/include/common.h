@@ -49,7 +49,9 @@
 #include "stb_image.h"
 #include "stb_image_write.h"
 #include <string>
+#include <vector>
 #include "ThreadPool.h"
+#include "FrameSource.h"
 #define TCLAP_NAMESTARTSTRING "-"
 #include "tclap/CmdLine.h"
 using namespace TCLAP;
@@ -58,21 +60,58 @@ using namespace ltk;
 
 template<typename M> struct JobInfo {
 	JobInfo(DeviceOCL *dev, std::shared_ptr<M> hostToDev,
-			std::shared_ptr<M> devToHost, JobInfo *previous) :
+			std::shared_ptr<M> devToHost, JobInfo *previous, uint32_t slotIndex) :
 			hostToDevice(new MemMapEvents<M>(dev, hostToDev)), kernelCompleted(
-					0), deviceToHost(new MemMapEvents<M>(dev, devToHost)), prev(
-					previous) {
+					0), deviceToHost(new MemMapEvents<M>(dev, devToHost)), width(0), height(
+					0), outputWidth(0), outputHeight(0), pattern(0), blackLevel(0), whiteLevel(255), demosaic(0), sequence(UINT64_MAX), tag(0), slot(
+					slotIndex), valid(
+					false), last(false), demosaiced(0), statsRead(0), prev(previous) {
 	}
 	~JobInfo() {
 		delete hostToDevice;
 		Util::ReleaseEvent(kernelCompleted);
 		delete deviceToHost;
+		if (demosaiced)
+			clReleaseMemObject(demosaiced);
+		Util::ReleaseEvent(statsRead);
 	}
 
 	MemMapEvents<M> *hostToDevice;
 	cl_event kernelCompleted;
 	MemMapEvents<M> *deviceToHost;
 	std::string fileName;
+	std::chrono::high_resolution_clock::time_point arrival;
+	// frame geometry: hostToDevice holds width x height grey pixels,
+	// and deviceToHost receives the frame's outputWidth x outputHeight
+	// demosaiced rows, unpadded; output is smaller than input for
+	// binned preview frames
+	uint32_t width;
+	uint32_t height;
+	uint32_t outputWidth;
+	uint32_t outputHeight;
+	// Bayer pattern and 8 bit black and white levels of frame
+	int32_t pattern;
+	uint32_t blackLevel;
+	uint32_t whiteLevel;
+	// demosaic algorithm (eDemosaic) of frame
+	int32_t demosaic;
+	// position of frame in output order, or UINT64_MAX for a job without a frame
+	uint64_t sequence;
+	// frame request's tag
+	uint64_t tag;
+	uint32_t slot;
+	// hostToDevice buffer was filled with a frame
+	bool valid;
+	// no further jobs will be queued on this slot
+	bool last;
+	// intermediate buffer holding the frame's demosaiced rows, retained
+	// when deviceToHost receives a compressed frame, so that a frame which
+	// does not compress into deviceToHost can be read back uncompressed
+	cl_mem demosaiced;
+	// frame statistics accumulated during demosaic, read back
+	// asynchronously into stats once statsRead completes
+	std::vector<uint32_t> stats;
+	cl_event statsRead;
 
 	JobInfo *prev;
 };
@@ -83,41 +122,38 @@ typedef void (CL_CALLBACK *pfn_event_notify)(cl_event event,
 class BufferAllocater {
 public:
 	BufferAllocater(DeviceOCL *dev, size_t dimX, size_t dimY, size_t bps,
-			uint32_t data_type, cl_command_queue_properties queue_props) :
+			uint32_t data_type) :
 			m_dev(dev),
 			m_dimX(dimX),
 			m_dimY(dimY),
-			m_bps(bps),
-			m_queue_props(queue_props)
+			m_bps(bps)
   {
 		(void) data_type;
 	}
 	std::unique_ptr<DualBufferOCL> allocate(bool hostToDevice) {
 		return std::make_unique<DualBufferOCL>(m_dev, m_dimX * m_dimY * m_bps,
-				hostToDevice ? HostToDeviceBuffer : DeviceToHostBuffer, m_queue_props);
+				hostToDevice ? HostToDeviceBuffer : DeviceToHostBuffer);
 	}
 private:
 	DeviceOCL *m_dev;
 	size_t m_dimX;
 	size_t m_dimY;
 	size_t m_bps;
-	cl_command_queue_properties m_queue_props;
 };
 
 class ImageAllocater {
 public:
 	ImageAllocater(DeviceOCL *dev, size_t dimX, size_t dimY, size_t bps,
-			uint32_t data_type, cl_command_queue_properties queue_props) :
+			uint32_t data_type) :
 			m_dev(dev),
 			m_dimX(dimX),
 			m_dimY(dimY),
 			m_bps(bps),
-			m_data_type(data_type),
-			m_queue_props(queue_props) {
+			m_data_type(data_type) {
 	}
 	std::unique_ptr<DualImageOCL> allocate(bool hostToDevice) {
 		return std::make_unique<DualImageOCL>(m_dev, m_dimX, m_dimY,
-				(m_bps == 1 ? CL_R : CL_RGBA), m_data_type, hostToDevice, m_queue_props);
+				(m_bps == 1 ? CL_R : CL_RGBA), m_data_type, hostToDevice);
 	}
 private:
 	DeviceOCL *m_dev;
@@ -125,6 +161,5 @@ private:
 	size_t m_dimY;
 	size_t m_bps;
 	uint32_t m_data_type;
-	cl_command_queue_properties m_queue_props;
 };
 
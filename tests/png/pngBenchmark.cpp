@@ -0,0 +1,181 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image.h"
+#include "stb_image_write.h"
+#include "BlockingQueue.h"
+#include "FrameSource.h"
+#include "PngEncoder.h"
+#define TCLAP_NAMESTARTSTRING "-"
+#include "tclap/CmdLine.h"
+using namespace TCLAP;
+
+typedef std::chrono::high_resolution_clock hrclock;
+
+// Compare parallel PNG encoder with stbi_write_png, encoding each
+// image in a directory to memory, and verifying that encoded images
+// decode to the original pixels
+int main(int argc, char *argv[]) {
+	CmdLine cmd("png encoder benchmark", ' ', "v1.0");
+
+	ValueArg<std::string> inputDirArg("i", "input-dir", "Input Image Directory", true,
+			"", "string", cmd);
+
+	ValueArg<uint32_t> channelsArg("c", "channels", "Channels To Encode", false,
+			4, "unsigned integer", cmd);
+
+	ValueArg<uint32_t> threadsArg("t", "threads", "Encoder Threads (0 for hardware threads)", false,
+			0, "unsigned integer", cmd);
+
+	ValueArg<int> levelArg("l", "level", "Compression Level (0-9)", false,
+			PngEncodeParams().level, "integer", cmd);
+
+	ValueArg<std::string> filterArg("f", "filter", "Row Filter {none,sub,up,average,paeth,adaptive}", false,
+			"adaptive", "string", cmd);
+
+	ValueArg<uint32_t> stripeRowsArg("s", "stripe-rows", "Rows Per Stripe (0 for automatic)", false,
+			0, "unsigned integer", cmd);
+
+	ValueArg<uint32_t> repeatArg("r", "repeat", "Encodes Per Image", false,
+			3, "unsigned integer", cmd);
+
+	cmd.parse(argc, argv);
+
+	PngEncodeParams params;
+	params.level = levelArg.getValue();
+	params.stripeRows = stripeRowsArg.getValue();
+	if (!PngEncoder::parseFilter(filterArg.getValue(), params.filter)) {
+		std::cerr << "Unrecognized filter " << filterArg.getValue() << std::endl;
+		return -1;
+	}
+	uint32_t channels = channelsArg.getValue();
+	if (channels < 1 || channels > 4) {
+		std::cerr << "Channels must be between 1 and 4" << std::endl;
+		return -1;
+	}
+	size_t threads = threadsArg.getValue();
+	if (!threads)
+		threads = std::max<unsigned>(1, std::thread::hardware_concurrency());
+	uint32_t repeat = std::max<uint32_t>(1, repeatArg.getValue());
+
+	BlockingQueue<FrameRequest> files;
+	std::atomic<bool> stop(false);
+	DirectoryFrameSource::listDirectory(inputDirArg.getValue(), files, stop);
+
+	PngEncoder encoder(threads);
+	std::vector<uint8_t> encoded;
+	std::vector<uint8_t> scanlines;
+	double stbMs = 0, encoderMs = 0, deflateMs = 0;
+	uint64_t stbBytes = 0, encoderBytes = 0, rawBytes = 0;
+	uint32_t numImages = 0;
+	FrameRequest request;
+	while (files.tryPop(request)) {
+		int width = 0, height = 0, comp = 0;
+		auto pixels = stbi_load(request.path.c_str(), &width, &height, &comp, (int) channels);
+		if (!pixels) {
+			std::cerr << "Skipping image file " << request.path << std::endl;
+			continue;
+		}
+		size_t stride = (size_t) width * channels;
+
+		int stbLen = 0;
+		unsigned char *stbPng = nullptr;
+		auto start = hrclock::now();
+		for (uint32_t i = 0; i < repeat; ++i) {
+			STBIW_FREE(stbPng);
+			stbPng = stbi_write_png_to_mem(pixels, (int) stride, width, height,
+					(int) channels, &stbLen);
+		}
+		std::chrono::duration<double, std::milli> stbElapsed = hrclock::now() - start;
+		STBIW_FREE(stbPng);
+
+		encoded.resize(encoder.maxEncodedSize(width, height, channels, params));
+		size_t len = 0;
+		start = hrclock::now();
+		for (uint32_t i = 0; i < repeat; ++i)
+			len = encoder.encode(pixels, width, height, channels, stride, params,
+					encoded.data(), encoded.size());
+		std::chrono::duration<double, std::milli> encoderElapsed = hrclock::now() - start;
+		if (!len) {
+			std::cerr << "Failed to encode " << request.path << std::endl;
+			stbi_image_free(pixels);
+			return -1;
+		}
+
+		// deflate only, as when rows are filtered on the device
+		scanlines.resize(((size_t) width * channels + 1) * height);
+		auto filterType = params.filter;
+		PngEncoder::filter(pixels, width, height, channels, stride, filterType,
+				scanlines.data());
+		size_t filteredLen = 0;
+		start = hrclock::now();
+		for (uint32_t i = 0; i < repeat; ++i)
+			filteredLen = encoder.encodeFiltered(scanlines.data(), width, height,
+					channels, params, encoded.data(), encoded.size());
+		std::chrono::duration<double, std::milli> deflateElapsed = hrclock::now() - start;
+		if (filteredLen != len) {
+			std::cerr << "Prefiltered encode differs: " << request.path << std::endl;
+			stbi_image_free(pixels);
+			return -1;
+		}
+
+		// verify round trip
+		int w = 0, h = 0;
+		auto decoded = stbi_load_from_memory(encoded.data(), (int) len, &w, &h,
+				&comp, (int) channels);
+		bool match = decoded && w == width && h == height
+				&& memcmp(decoded, pixels, stride * height) == 0;
+		stbi_image_free(decoded);
+		stbi_image_free(pixels);
+		if (!match) {
+			std::cerr << "Encoded image does not match original: " << request.path << std::endl;
+			return -1;
+		}
+
+		stbMs += stbElapsed.count() / repeat;
+		encoderMs += encoderElapsed.count() / repeat;
+		deflateMs += deflateElapsed.count() / repeat;
+		stbBytes += stbLen;
+		encoderBytes += len;
+		rawBytes += stride * height;
+		numImages++;
+	}
+	if (!numImages) {
+		std::cout << "No images to encode" << std::endl;
+		return 0;
+	}
+	fprintf(stdout, "%u images, %zu threads, level %d, filter %s\n", numImages,
+			threads, params.level, filterArg.getValue().c_str());
+	fprintf(stdout, "stbi_write_png : %f ms per image, ratio %f\n",
+			stbMs / numImages, (double) rawBytes / stbBytes);
+	fprintf(stdout, "PngEncoder     : %f ms per image, ratio %f, speedup %f\n",
+			encoderMs / numImages, (double) rawBytes / encoderBytes, stbMs / encoderMs);
+	fprintf(stdout, "  deflate only : %f ms per image\n", deflateMs / numImages);
+
+	return 0;
+}
@@ -0,0 +1,616 @@
+/*
+ * Copyright 2016-2020 Grok Image Compression Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "latke_config.h"
+#include "FrameRing.h"
+#include "FrameStore.h"
+#include "JpegWriter.h"
+#include "PngEncoder.h"
+#include "ReorderBuffer.h"
+#include "TiffRawReader.h"
+#include "TileCodec.h"
+
+// Round trip checks of the host side of the debayer pipeline, with no
+// device: each encoder or container is fed a known frame, and its output
+// is decoded independently and compared with the original.
+
+static uint32_t failures = 0;
+
+static void check(bool condition, const std::string &what) {
+	if (!condition) {
+		std::cerr << "FAILED: " << what << std::endl;
+		failures++;
+	}
+}
+
+// pseudo random test pattern, with smooth areas and noise
+static std::vector<uint8_t> pattern(uint32_t width, uint32_t height, uint32_t channels,
+		uint32_t seed) {
+	std::vector<uint8_t> pixels((size_t) width * height * channels);
+	uint32_t state = seed * 2654435761u + 1;
+	for (uint32_t y = 0; y < height; ++y) {
+		for (uint32_t x = 0; x < width; ++x) {
+			for (uint32_t c = 0; c < channels; ++c) {
+				state = state * 1664525u + 1013904223u;
+				uint32_t noise = (state >> 24) & ((y & 8) ? 0xFF : 0x7);
+				pixels[((size_t) y * width + x) * channels + c] =
+						(uint8_t) (x * (c + 1) + y * 3 + noise);
+			}
+		}
+	}
+	return pixels;
+}
+
+static uint32_t get32be(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Decode PNG with zlib: check chunk CRCs and header, inflate the
+// concatenated IDAT chunks as one zlib stream, and undo row filters
+static bool decodePng(const std::vector<uint8_t> &png, uint32_t &width, uint32_t &height,
+		uint32_t &channels, std::vector<uint8_t> &pixels, uint32_t &idatCount) {
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if (png.size() < 8 || memcmp(png.data(), signature, 8) != 0)
+		return false;
+	std::vector<uint8_t> compressed;
+	idatCount = 0;
+	channels = 0;
+	bool ended = false;
+	size_t pos = 8;
+	while (!ended && pos + 12 <= png.size()) {
+		uint32_t len = get32be(png.data() + pos);
+		if (pos + 12 + len > png.size())
+			return false;
+		const uint8_t *type = png.data() + pos + 4;
+		const uint8_t *data = type + 4;
+		uLong crc = crc32(0, type, 4 + len);
+		if (crc != get32be(data + len))
+			return false;
+		if (!memcmp(type, "IHDR", 4)) {
+			static const uint32_t channelsOf[7] = { 1, 0, 3, 0, 2, 0, 4 };
+			width = get32be(data);
+			height = get32be(data + 4);
+			if (data[8] != 8 || data[9] > 6)
+				return false;
+			channels = channelsOf[data[9]];
+		} else if (!memcmp(type, "IDAT", 4)) {
+			compressed.insert(compressed.end(), data, data + len);
+			idatCount++;
+		} else if (!memcmp(type, "IEND", 4)) {
+			ended = true;
+		}
+		pos += 12 + len;
+	}
+	if (!ended || !channels || pos != png.size())
+		return false;
+	size_t rowLen = (size_t) width * channels;
+	std::vector<uint8_t> scanlines((rowLen + 1) * height);
+	uLongf scanlinesLen = (uLongf) scanlines.size();
+	if (uncompress(scanlines.data(), &scanlinesLen, compressed.data(),
+			(uLong) compressed.size()) != Z_OK || scanlinesLen != scanlines.size())
+		return false;
+	pixels.assign(rowLen * height, 0);
+	for (uint32_t y = 0; y < height; ++y) {
+		const uint8_t *in = scanlines.data() + y * (rowLen + 1);
+		uint8_t *row = pixels.data() + y * rowLen;
+		const uint8_t *up = y ? row - rowLen : nullptr;
+		for (size_t i = 0; i < rowLen; ++i) {
+			int a = i >= channels ? row[i - channels] : 0;
+			int b = up ? up[i] : 0;
+			int c = up && i >= channels ? up[i - channels] : 0;
+			int pred = 0;
+			switch (in[0]) {
+			case PNG_FILTER_NONE:
+				break;
+			case PNG_FILTER_SUB:
+				pred = a;
+				break;
+			case PNG_FILTER_UP:
+				pred = b;
+				break;
+			case PNG_FILTER_AVERAGE:
+				pred = (a + b) / 2;
+				break;
+			case PNG_FILTER_PAETH:
+				pred = paeth(a, b, c);
+				break;
+			default:
+				return false;
+			}
+			row[i] = (uint8_t) (in[1 + i] + pred);
+		}
+	}
+	return true;
+}
+
+static void checkPngEncoder() {
+	PngEncoder encoder(4);
+	const uint32_t width = 61, height = 47;
+	for (uint32_t channels = 1; channels <= 4; ++channels) {
+		auto pixels = pattern(width, height, channels, channels);
+		size_t stride = (size_t) width * channels;
+		for (int f = PNG_FILTER_NONE; f <= PNG_FILTER_ADAPTIVE; ++f) {
+			std::string what = "PNG " + std::to_string(channels) + " channels, filter "
+					+ std::to_string(f);
+			PngEncodeParams params;
+			params.filter = (ePngFilter) f;
+			params.stripeRows = 5;
+			std::vector<uint8_t> png(encoder.maxEncodedSize(width, height, channels, params));
+			size_t len = encoder.encode(pixels.data(), width, height, channels, stride,
+					params, png.data(), png.size());
+			check(len > 0, what + ": encode");
+			png.resize(len);
+			uint32_t w = 0, h = 0, c = 0, idatCount = 0;
+			std::vector<uint8_t> decoded;
+			check(decodePng(png, w, h, c, decoded, idatCount), what + ": decode");
+			check(w == width && h == height && c == channels, what + ": header");
+			check(idatCount == (height + params.stripeRows - 1) / params.stripeRows,
+					what + ": one IDAT per stripe");
+			check(decoded == pixels, what + ": pixels");
+
+			// rows filtered elsewhere encode to the same file
+			std::vector<uint8_t> scanlines((stride + 1) * height);
+			PngEncoder::filter(pixels.data(), width, height, channels, stride,
+					params.filter, scanlines.data());
+			std::vector<uint8_t> filtered(png.size() + 1024);
+			size_t filteredLen = encoder.encodeFiltered(scanlines.data(), width, height,
+					channels, params, filtered.data(), filtered.size());
+			filtered.resize(filteredLen);
+			check(filtered == png, what + ": prefiltered encode");
+		}
+	}
+	// buffer too small
+	PngEncodeParams params;
+	auto pixels = pattern(16, 16, 3, 9);
+	std::vector<uint8_t> small(32);
+	check(!encoder.encode(pixels.data(), 16, 16, 3, 48, params, small.data(), small.size()),
+			"PNG encode into short buffer");
+}
+
+// Pack frame in tileCodec.cl's format: per tile and channel, a 4 bit
+// residual width per row, then each row's zig-zag MED residuals,
+// bit-packed LSB first
+static std::vector<uint8_t> packTiles(const std::vector<uint8_t> &pixels, uint32_t width,
+		uint32_t height, uint32_t channels) {
+	const uint32_t ts = TileDecoder::tileSize;
+	uint32_t tilesX = (width + ts - 1) / ts;
+	uint32_t tilesY = (height + ts - 1) / ts;
+	uint32_t numTiles = tilesX * tilesY;
+	std::vector<uint8_t> data;
+	std::vector<uint32_t> offsets;
+	auto at = [&](uint32_t x, uint32_t y, uint32_t c) {
+		return (int) pixels[((size_t) y * width + x) * channels + c];
+	};
+	for (uint32_t ty = 0; ty < tilesY; ++ty) {
+		for (uint32_t tx = 0; tx < tilesX; ++tx) {
+			offsets.push_back((uint32_t) data.size());
+			uint32_t x0 = tx * ts, y0 = ty * ts;
+			uint32_t tw = std::min(ts, width - x0), th = std::min(ts, height - y0);
+			for (uint32_t c = 0; c < channels; ++c) {
+				uint8_t residuals[TileDecoder::tileSize][TileDecoder::tileSize] = { };
+				uint8_t widths[TileDecoder::tileSize / 2] = { };
+				for (uint32_t y = 0; y < th; ++y) {
+					uint32_t bits = 0;
+					for (uint32_t x = 0; x < tw; ++x) {
+						int a = x ? at(x0 + x - 1, y0 + y, c) : 0;
+						int b = y ? at(x0 + x, y0 + y - 1, c) : 0;
+						int cc = x && y ? at(x0 + x - 1, y0 + y - 1, c) : 0;
+						int pred = 0;
+						if (x && y)
+							pred = cc >= std::max(a, b) ? std::min(a, b) :
+									(cc <= std::min(a, b) ? std::max(a, b) : a + b - cc);
+						else if (x)
+							pred = a;
+						else if (y)
+							pred = b;
+						int r = (int8_t) (uint8_t) (at(x0 + x, y0 + y, c) - pred);
+						uint8_t z = (uint8_t) ((r << 1) ^ (r >> 7));
+						residuals[y][x] = z;
+						while (bits < 8 && (z >> bits))
+							bits++;
+					}
+					widths[y >> 1] |= (uint8_t) (bits << ((y & 1) << 2));
+				}
+				data.insert(data.end(), widths, widths + ts / 2);
+				for (uint32_t y = 0; y < th; ++y) {
+					uint32_t bits = (widths[y >> 1] >> ((y & 1) << 2)) & 0xF;
+					uint32_t acc = 0, count = 0;
+					for (uint32_t x = 0; x < ts; ++x) {
+						acc |= (uint32_t) residuals[y][x] << count;
+						count += bits;
+						while (count >= 8) {
+							data.push_back((uint8_t) acc);
+							acc >>= 8;
+							count -= 8;
+						}
+					}
+				}
+			}
+		}
+	}
+	offsets.push_back((uint32_t) data.size());
+	std::vector<uint8_t> packed(TileDecoder::dataOffset(numTiles) + data.size());
+	uint32_t header[4] = { (uint32_t) data.size(), numTiles, 0, 0 };
+	memcpy(packed.data(), header, sizeof(header));
+	memcpy(packed.data() + TileDecoder::headerSize, offsets.data(),
+			offsets.size() * sizeof(uint32_t));
+	memcpy(packed.data() + TileDecoder::dataOffset(numTiles), data.data(), data.size());
+	return packed;
+}
+
+static void checkTileDecoder() {
+	TileDecoder decoder(3);
+	const uint32_t width = 53, height = 37;
+	for (uint32_t channels = 1; channels <= 4; ++channels) {
+		std::string what = "tile codec " + std::to_string(channels) + " channels";
+		auto pixels = pattern(width, height, channels, 10 + channels);
+		auto packed = packTiles(pixels, width, height, channels);
+		check(TileDecoder::packedSize(packed.data(), packed.size()) == packed.size(),
+				what + ": packed size");
+		// decode into a wider buffer, to exercise pitch
+		size_t pitch = (size_t) width * channels + 5;
+		std::vector<uint8_t> decoded(pitch * height);
+		check(decoder.decode(packed.data(), packed.size(), width, height, channels,
+				decoded.data(), pitch), what + ": decode");
+		bool match = true;
+		for (uint32_t y = 0; y < height; ++y)
+			match = match && !memcmp(decoded.data() + y * pitch,
+					pixels.data() + (size_t) y * width * channels, (size_t) width * channels);
+		check(match, what + ": pixels");
+
+		auto truncated = packed;
+		truncated.resize(packed.size() - 1);
+		check(!decoder.decode(truncated.data(), truncated.size(), width, height, channels,
+				decoded.data(), pitch), what + ": truncated frame rejected");
+		auto overflowed = packed;
+		overflowed[8] = 1;
+		check(!TileDecoder::packedSize(overflowed.data(), overflowed.size()),
+				what + ": overflow flag");
+	}
+}
+
+static void checkJpegWriter() {
+	JpegWriter writer(75);
+	const uint32_t width = 100, height = 60;
+	check(writer.getDeviceTables().size() == 128 + 32 + 512, "JPEG device tables");
+	std::vector<uint8_t> packed(JpegWriter::packHeaderSize + 40);
+	uint32_t header[2] = { 40, 0 };
+	memcpy(packed.data(), header, sizeof(header));
+	for (size_t i = JpegWriter::packHeaderSize; i < packed.size(); ++i)
+		packed[i] = (uint8_t) i;
+	size_t packedLen = JpegWriter::packedSize(packed.data(), packed.size());
+	check(packedLen == packed.size(), "JPEG packed size");
+
+	std::vector<uint8_t> jpeg(JpegWriter::maxHeaderSize() + packed.size());
+	size_t len = writer.write(packed.data(), packedLen, width, height, jpeg.data(), jpeg.size());
+	check(len > 0, "JPEG write");
+	jpeg.resize(len);
+	// walk marker segments up to the scan
+	std::vector<uint8_t> markers;
+	size_t pos = 2;
+	bool scan = false;
+	check(len > 4 && jpeg[0] == 0xFF && jpeg[1] == 0xD8, "JPEG SOI");
+	while (!scan && pos + 4 <= len) {
+		check(jpeg[pos] == 0xFF, "JPEG marker");
+		uint8_t m = jpeg[pos + 1];
+		size_t segLen = ((size_t) jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		const uint8_t *payload = jpeg.data() + pos + 4;
+		markers.push_back(m);
+		switch (m) {
+		case 0xE0:
+			check(!memcmp(payload, "JFIF", 5), "JPEG JFIF");
+			break;
+		case 0xDB:
+			check(segLen == 2 + 2 * 65 && payload[0] == 0 && payload[65] == 1,
+					"JPEG quantization tables");
+			break;
+		case 0xC0:
+			check(payload[0] == 8 && ((payload[1] << 8) | payload[2]) == (int) height
+					&& ((payload[3] << 8) | payload[4]) == (int) width && payload[5] == 3
+					&& payload[7] == 0x22, "JPEG frame header");
+			break;
+		case 0xDD:
+			check(((payload[0] << 8) | payload[1]) == (int) JpegWriter::restartMcus,
+					"JPEG restart interval");
+			break;
+		case 0xDA:
+			scan = true;
+			break;
+		}
+		pos += 2 + segLen;
+	}
+	std::vector<uint8_t> expected = { 0xE0, 0xDB, 0xC0, 0xC4, 0xC4, 0xC4, 0xC4, 0xDD, 0xDA };
+	check(markers == expected, "JPEG segment order");
+	check(pos + 40 + 2 == len
+			&& !memcmp(jpeg.data() + pos, packed.data() + JpegWriter::packHeaderSize, 40),
+			"JPEG entropy coded data");
+	check(jpeg[len - 2] == 0xFF && jpeg[len - 1] == 0xD9, "JPEG EOI");
+
+	header[1] = 1;
+	memcpy(packed.data(), header, sizeof(header));
+	check(!JpegWriter::packedSize(packed.data(), packed.size()), "JPEG overflow flag");
+}
+
+// single strip, little or big endian CFA TIFF
+static std::vector<uint8_t> makeTiff(bool bigEndian, uint32_t width, uint32_t height,
+		uint16_t bits, const std::vector<uint8_t> &strip) {
+	struct Tag {
+		uint16_t tag;
+		uint16_t type;
+		uint32_t count;
+		uint32_t value;
+	};
+	const Tag tags[] = { { 256, 4, 1, width }, { 257, 4, 1, height }, { 258, 3, 1, bits },
+			{ 259, 3, 1, 1 }, { 262, 3, 1, 32803 }, { 273, 4, 1, 0 }, { 277, 3, 1, 1 },
+			{ 278, 4, 1, height }, { 279, 4, 1, (uint32_t) strip.size() },
+			{ 33421, 3, 2, 0 }, { 33422, 1, 4, 0 } };
+	const uint16_t numTags = sizeof(tags) / sizeof(tags[0]);
+	uint32_t stripOffset = 8 + 2 + numTags * 12 + 4;
+	std::vector<uint8_t> tiff;
+	auto put16 = [&](uint16_t v) {
+		if (bigEndian) {
+			tiff.push_back((uint8_t) (v >> 8));
+			tiff.push_back((uint8_t) v);
+		} else {
+			tiff.push_back((uint8_t) v);
+			tiff.push_back((uint8_t) (v >> 8));
+		}
+	};
+	auto put32 = [&](uint32_t v) {
+		if (bigEndian) {
+			put16((uint16_t) (v >> 16));
+			put16((uint16_t) v);
+		} else {
+			put16((uint16_t) v);
+			put16((uint16_t) (v >> 16));
+		}
+	};
+	tiff.push_back(bigEndian ? 'M' : 'I');
+	tiff.push_back(bigEndian ? 'M' : 'I');
+	put16(42);
+	put32(8);
+	put16(numTags);
+	for (auto &t : tags) {
+		put16(t.tag);
+		put16(t.type);
+		put32(t.count);
+		if (t.tag == 273) {
+			put32(stripOffset);
+		} else if (t.tag == 33421) {
+			// 2x2 repeat
+			put16(2);
+			put16(2);
+		} else if (t.tag == 33422) {
+			// RGGB
+			const uint8_t cfa[4] = { 0, 1, 1, 2 };
+			tiff.insert(tiff.end(), cfa, cfa + 4);
+		} else if (t.type == 3) {
+			put16((uint16_t) t.value);
+			put16(0);
+		} else {
+			put32(t.value);
+		}
+	}
+	put32(0);
+	tiff.insert(tiff.end(), strip.begin(), strip.end());
+	return tiff;
+}
+
+static void checkTiffRawReader() {
+	const uint32_t width = 7, height = 5;
+	std::vector<uint16_t> samples((size_t) width * height);
+	for (size_t i = 0; i < samples.size(); ++i)
+		samples[i] = (uint16_t) (i * 977 + 13);
+
+	// 12 bit, packed most significant bit first, rows byte aligned
+	std::vector<uint8_t> strip;
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t acc = 0, count = 0;
+		for (uint32_t x = 0; x < width; ++x) {
+			acc = (acc << 12) | (samples[y * width + x] & 0xFFF);
+			count += 12;
+			while (count >= 8) {
+				strip.push_back((uint8_t) (acc >> (count - 8)));
+				count -= 8;
+			}
+		}
+		if (count)
+			strip.push_back((uint8_t) (acc << (8 - count)));
+	}
+	TiffRawReader reader;
+	check(reader.open(makeTiff(false, width, height, 12, strip)),
+			"TIFF 12 bit open: " + reader.getError());
+	check(reader.getWidth() == width && reader.getHeight() == height
+			&& reader.getPattern() == CFA_RGGB, "TIFF 12 bit dimensions and pattern");
+	std::vector<uint8_t> out((size_t) width * height);
+	check(reader.read(out.data(), width), "TIFF 12 bit read");
+	bool match = true;
+	for (size_t i = 0; i < samples.size(); ++i)
+		match = match && out[i] == ((samples[i] & 0xFFF) >> 4);
+	check(match, "TIFF 12 bit unpack");
+
+	// 16 bit, both byte orders
+	for (int bigEndian = 0; bigEndian < 2; ++bigEndian) {
+		std::string what = bigEndian ? "TIFF 16 bit big endian" : "TIFF 16 bit little endian";
+		strip.clear();
+		for (auto s : samples) {
+			uint8_t hi = (uint8_t) (s >> 8), lo = (uint8_t) s;
+			strip.push_back(bigEndian ? hi : lo);
+			strip.push_back(bigEndian ? lo : hi);
+		}
+		check(reader.open(makeTiff(bigEndian != 0, width, height, 16, strip)),
+				what + " open: " + reader.getError());
+		std::fill(out.begin(), out.end(), 0);
+		check(reader.read(out.data(), width), what + " read");
+		match = true;
+		for (size_t i = 0; i < samples.size(); ++i)
+			match = match && out[i] == (samples[i] >> 8);
+		check(match, what + " unpack");
+	}
+
+	// strip shorter than the image
+	strip.resize(strip.size() / 2);
+	check(!reader.open(makeTiff(false, width, height, 16, strip)) || !reader.read(out.data(), width),
+			"TIFF truncated strip rejected");
+}
+
+#ifndef _WIN32
+static void checkFrameStore() {
+	std::string path = "roundtrip_" + std::to_string(getpid()) + ".store";
+	const uint32_t numFrames = 40;
+	{
+		FrameStoreWriter writer;
+		// small index, so that it is chained
+		check(writer.create(path, 4, 1 << 26, 1 << 16), "frame store create");
+		for (uint32_t i = 0; i < numFrames; ++i) {
+			auto frame = pattern(8 + i, 4, 3, i);
+			check(writer.append("frame" + std::to_string(i), 8 + i, 4, 3, FRAME_FORMAT_RAW,
+					frame.data(), frame.size()), "frame store append");
+		}
+		// reserved, never committed
+		uint64_t frameIndex = 0;
+		check(writer.reserve("pending", 1, 1, 1, FRAME_FORMAT_PNG, 1, frameIndex) != nullptr,
+				"frame store reserve");
+	}
+	FrameStoreReader reader;
+	check(reader.open(path), "frame store open");
+	check(reader.size() == numFrames + 1, "frame store size");
+	for (uint32_t i = 0; i < numFrames; ++i) {
+		FrameStoreFrame frame;
+		auto expected = pattern(8 + i, 4, 3, i);
+		bool found = reader.getFrame(i, frame);
+		check(found && frame.name == "frame" + std::to_string(i) && frame.width == 8 + i
+				&& frame.height == 4 && frame.channels == 3 && frame.format == FRAME_FORMAT_RAW
+				&& frame.size == expected.size()
+				&& !memcmp(frame.data, expected.data(), expected.size()),
+				"frame store frame " + std::to_string(i));
+	}
+	FrameStoreFrame frame;
+	check(!reader.getFrame(numFrames, frame), "frame store skips uncommitted frame");
+	check(!reader.getFrame(numFrames + 1, frame), "frame store index out of range");
+	reader.close();
+	unlink(path.c_str());
+}
+#endif
+
+#ifdef __linux__
+static void checkFrameRing() {
+	std::string path = "roundtrip_" + std::to_string(getpid()) + ".ring";
+	FrameRingWriter writer;
+	if (!writer.create(path, 4, 4096, false)) {
+		check(false, "frame ring create");
+		return;
+	}
+	FrameRingReader reader;
+	check(reader.connect(path), "frame ring connect");
+	const uint32_t numFrames = 3;
+	for (uint32_t i = 0; i < numFrames; ++i) {
+		auto frame = pattern(16, 8, 4, 20 + i);
+		check(writer.publish("ring" + std::to_string(i), 16, 8, 4, FRAME_FORMAT_RAW,
+				frame.data(), frame.size()), "frame ring publish");
+	}
+	auto tooLarge = pattern(64, 64, 4, 0);
+	check(!writer.publish("large", 64, 64, 4, FRAME_FORMAT_RAW, tooLarge.data(),
+			tooLarge.size()), "frame ring rejects frame larger than slot");
+	for (uint32_t i = 0; i < numFrames; ++i) {
+		FrameRingFrame frame;
+		auto expected = pattern(16, 8, 4, 20 + i);
+		bool found = reader.next(frame, 1000);
+		check(found && frame.sequence == i && frame.name == "ring" + std::to_string(i)
+				&& frame.width == 16 && frame.height == 8 && frame.channels == 4
+				&& frame.size == expected.size()
+				&& !memcmp(frame.data, expected.data(), expected.size())
+				&& reader.valid(frame), "frame ring frame " + std::to_string(i));
+		reader.release(frame);
+	}
+	writer.close();
+	FrameRingFrame frame;
+	check(!reader.next(frame, 1000), "frame ring closed");
+	check(reader.getDropped() == 0, "frame ring dropped frames");
+}
+#endif
+
+static void checkReorderBuffer() {
+	const uint64_t total = 1000;
+	const uint32_t numThreads = 4;
+	ReorderBuffer<uint64_t> buffer(true);
+	std::vector<std::thread> producers;
+	// each producer pushes its share in reverse
+	for (uint32_t t = 0; t < numThreads; ++t) {
+		producers.push_back(std::thread([&buffer, t, total, numThreads] {
+			for (uint64_t i = total; i-- > 0;) {
+				if (i % numThreads == t)
+					buffer.push(i, i * 7);
+			}
+		}));
+	}
+	buffer.close(total);
+	uint64_t next = 0, value = 0;
+	bool ordered = true;
+	while (buffer.waitAndPop(value))
+		ordered = ordered && value == 7 * next++;
+	for (auto &p : producers)
+		p.join();
+	check(ordered && next == total, "reorder buffer pops in sequence");
+	check(buffer.size() == 0, "reorder buffer drained");
+
+	ReorderBuffer<uint64_t> unordered(false);
+	unordered.push(5, 5);
+	unordered.close(1);
+	check(unordered.waitAndPop(value) && value == 5 && !unordered.waitAndPop(value),
+			"unordered buffer pops as pushed");
+}
+
+int main(void) {
+	checkPngEncoder();
+	checkTileDecoder();
+	checkJpegWriter();
+	checkTiffRawReader();
+#ifndef _WIN32
+	checkFrameStore();
+#endif
+#ifdef __linux__
+	checkFrameRing();
+#endif
+	checkReorderBuffer();
+	if (failures) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return -1;
+	}
+	std::cout << "All round trip checks passed" << std::endl;
+	return 0;
+}